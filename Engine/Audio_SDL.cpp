@@ -57,33 +57,11 @@ namespace Audio_SDL
 		SDL_QuitSubSystem(SDL_INIT_AUDIO);
 	}
 
-	// Load a WAV into memory
-	bool LoadWAV(char* szAudioPath, BYTE** ppWavOutput, DWORD& dwSizeBytes)
+	// Map a WAV into memory. The result needs to be given back with FS::Unmap.
+	bool LoadWAV(char* szAudioPath, const BYTE** ppWavOutput, size_t& dwSizeBytes)
 	{
-		// Find the file and determine how big it should be
-		fs_handle f;
-		dwSizeBytes = FS::Open(szAudioPath, &f, FS_READ, true);
-		if (f == INVALID_HANDLE)
-		{
-			return false;
-		}
-
-		if (dwSizeBytes == 0)
-		{
-			FS::CloseFile(f);
-		}
-
-		// allocate memory for it
-		*ppWavOutput = (BYTE*)malloc(dwSizeBytes);
-		if (!(*ppWavOutput))
-		{
-			return false;
-		}
-
-		FS::Read(f, *ppWavOutput, dwSizeBytes);
-		FS::CloseFile(f);
-
-		return true;
+		*ppWavOutput = (const BYTE*)FS::Map(szAudioPath, &dwSizeBytes);
+		return *ppWavOutput != nullptr;
 	}
 
 	// Register a sound effect for playing
@@ -102,18 +80,20 @@ namespace Audio_SDL
 			return ourHandle;
 		}
 
-		BYTE* pWavData = nullptr;
-		DWORD dwWavSize = 0;
+		const BYTE* pWavData = nullptr;
+		size_t dwWavSize = 0;
 		if (!LoadWAV(szAudioPath, &pWavData, dwWavSize))
 		{
 			Log::Print(OpenD2LogFlags::PRIORITY_MESSAGE, "Failed to load %s", szAudioPath);
 			return INVALID_HANDLE;
 		}
 
-		SDL_RWops* sdlFile = SDL_RWFromMem(pWavData, dwWavSize);
+		// Chunks are decoded up front, so the file isn't needed afterwards
+		SDL_RWops* sdlFile = SDL_RWFromConstMem(pWavData, dwWavSize);
 		Log_WarnAssert(sdlFile);
 		gpSoundCache[ourHandle].bIsMusic = false;
 		gpSoundCache[ourHandle].data.pChunk = Mix_LoadWAV_RW(sdlFile, true);
+		FS::Unmap(pWavData);
 		return ourHandle;
 	}
 
@@ -134,15 +114,16 @@ namespace Audio_SDL
 			return ourHandle;
 		}
 
-		BYTE* pWavData = nullptr;
-		DWORD dwWavSize = 0;
+		const BYTE* pWavData = nullptr;
+		size_t dwWavSize = 0;
 		if (!LoadWAV(szAudioPath, &pWavData, dwWavSize))
 		{
 			Log::Print(OpenD2LogFlags::PRIORITY_MESSAGE, "Failed to load %s", szAudioPath);
 			return INVALID_HANDLE;
 		}
 
-		SDL_RWops* sdlFile = SDL_RWFromMem(pWavData, dwWavSize);
+		// Music gets streamed out of the file as it plays, so it stays mapped
+		SDL_RWops* sdlFile = SDL_RWFromConstMem(pWavData, dwWavSize);
 		Log_WarnAssert(sdlFile);
 		gpSoundCache[ourHandle].bIsMusic = true;
 		gpSoundCache[ourHandle].data.pMusic = Mix_LoadMUS_RW(sdlFile, true);
@@ -13,6 +13,9 @@ Bitstream::Bitstream()
 	bExternalStorage = false;
 	dwStreamStartByte = 0;
 	dwStreamStartBit = 0;
+	qwBitBuffer = 0;
+	nBitsBuffered = 0;
+	dwNextByte = 0;
 }
 
 /*
@@ -50,10 +53,8 @@ void Bitstream::LoadStream(BYTE* pNewStream, size_t dwNewSizeBytes)
 	dwTotalStreamSizeBytes = dwNewSizeBytes;
 	dwStreamStartByte = 0;
 	dwStreamStartBit = 0;
-	
-#ifndef D2_BIG_ENDIAN
-	dwReadBit = dwCurrentByte = 0;
-#endif
+
+	SetBitPosition(0);
 }
 
 /*
@@ -64,41 +65,119 @@ void Bitstream::SplitFrom(Bitstream* pSplitStream, size_t dwSplitStreamSizeBits)
 {
 	DWORD dwBitsHanging = (dwSplitStreamSizeBits % 8);
 	DWORD dwBytes = (dwSplitStreamSizeBits - dwBitsHanging) / 8;
+	size_t dwSplitByte, dwSplitBit;
 	FreeInternalStreamSource();
+
+	pSplitStream->GetCurrentPosition(dwSplitByte, dwSplitBit);
 	
 	// Copy from the other bitstream
 	bExternalStorage = true;
-	dwReadBit = pSplitStream->dwReadBit;
-	dwCurrentByte = pSplitStream->dwCurrentByte;
-	if (dwReadBit == 0)
+	dwStreamStartBit = dwSplitBit;
+	dwStreamStartByte = dwSplitByte;
+	if (dwStreamStartBit == 0)
 	{	// Send the bitstream back by one byte so we don't encounter errors
-		dwCurrentByte--;
+		dwStreamStartByte--;
 	}
 	dwTotalStreamSizeBits = pSplitStream->dwTotalStreamSizeBits;
 	dwTotalStreamSizeBytes = pSplitStream->dwTotalStreamSizeBytes;
 	pStream = pSplitStream->pStream;
+	Rewind();
 
 	// Advance the other bitstream
-	pSplitStream->dwCurrentByte += dwBytes;
-	pSplitStream->dwReadBit += dwBitsHanging;
-	while (pSplitStream->dwReadBit >= 8)
+	dwSplitByte += dwBytes;
+	dwSplitBit += dwBitsHanging;
+	while (dwSplitBit >= 8)
 	{
-		pSplitStream->dwCurrentByte++;
-		pSplitStream->dwReadBit -= 8;
+		dwSplitByte++;
+		dwSplitBit -= 8;
 	}
-
-	dwStreamStartBit = dwReadBit;
-	dwStreamStartByte = dwCurrentByte;
+	pSplitStream->SetCurrentPosition(dwSplitByte, dwSplitBit);
 }
 
 /*
  *	Set the current stream position.
+ *	When there's a bit offset, the position is one past the byte that's being read (the way it's always been kept).
  *	@author	eezstreet
  */
 void Bitstream::SetCurrentPosition(DWORD dwPosition, DWORD dwBitOffset)
 {
-	dwCurrentByte = dwPosition;
-	dwReadBit = dwBitOffset;
+	if (dwBitOffset == 0)
+	{
+		SetBitPosition((size_t)dwPosition * 8);
+	}
+	else
+	{
+		SetBitPosition(((size_t)dwPosition - 1) * 8 + dwBitOffset);
+	}
+}
+
+/*
+ *	Get the current stream position, in the same form that SetCurrentPosition takes.
+ *	@author	eezstreet
+ */
+void Bitstream::GetCurrentPosition(size_t& dwPosition, size_t& dwBitOffset)
+{
+	size_t dwBitPosition = (dwNextByte * 8) - nBitsBuffered;
+
+	dwBitOffset = dwBitPosition & 7;
+	dwPosition = dwBitPosition >> 3;
+	if (dwBitOffset != 0)
+	{
+		dwPosition++;
+	}
+}
+
+/*
+ *	Moves the stream to an exact bit, and throws out whatever was buffered.
+ *	@author	eezstreet
+ */
+void Bitstream::SetBitPosition(size_t dwBitPosition)
+{
+	qwBitBuffer = 0;
+	nBitsBuffered = 0;
+	dwNextByte = dwBitPosition >> 3;
+
+	if (dwBitPosition & 7)
+	{
+		Refill();
+		if (nBitsBuffered > 0)
+		{
+			ConsumeBits((int)(dwBitPosition & 7));
+		}
+	}
+}
+
+/*
+ *	Tops up the bit buffer, so that it holds at least 56 bits (unless the stream is about to run out).
+ *	Whole words get loaded when there's enough stream left for it. Whatever bits of the word don't fit get
+ *	loaded again on the next refill, which is harmless since they're or'd into the same spots.
+ *	@author	eezstreet
+ */
+void Bitstream::Refill()
+{
+	if (pStream == nullptr)
+	{
+		return;
+	}
+
+#ifndef D2_BIG_ENDIAN
+	if (dwNextByte + sizeof(QWORD) <= dwTotalStreamSizeBytes)
+	{
+		QWORD qwWord;
+
+		memcpy(&qwWord, pStream + dwNextByte, sizeof(QWORD));
+		qwBitBuffer |= qwWord << nBitsBuffered;
+		dwNextByte += (63 - nBitsBuffered) >> 3;
+		nBitsBuffered |= 56;
+		return;
+	}
+#endif
+
+	while (nBitsBuffered <= 56 && dwNextByte < dwTotalStreamSizeBytes)
+	{
+		qwBitBuffer |= (QWORD)pStream[dwNextByte++] << nBitsBuffered;
+		nBitsBuffered += 8;
+	}
 }
 
 /*
@@ -109,8 +188,7 @@ void Bitstream::SetCurrentPosition(DWORD dwPosition, DWORD dwBitOffset)
  */
 void Bitstream::Rewind()
 {
-	dwReadBit = dwStreamStartBit;
-	dwCurrentByte = dwStreamStartByte;
+	SetCurrentPosition(dwStreamStartByte, dwStreamStartBit);
 }
 
 /*
@@ -120,7 +198,7 @@ void Bitstream::Rewind()
 // Overload 1
 void Bitstream::ReadByte(BYTE& outByte)
 {
-	DWORD bits = ReadBits(8);
+	DWORD bits = ReadUnsigned(8);
 	
 	outByte = (BYTE)bits;
 }
@@ -128,7 +206,7 @@ void Bitstream::ReadByte(BYTE& outByte)
 // Overload 2
 void Bitstream::ReadByte(BYTE* outByte)
 {
-	DWORD bits = ReadBits(8);
+	DWORD bits = ReadUnsigned(8);
 
 	*outByte = (BYTE)bits;
 }
@@ -140,7 +218,7 @@ void Bitstream::ReadByte(BYTE* outByte)
 // Overload 1
 void Bitstream::ReadWord(WORD& outWord)
 {
-	DWORD bits = ReadBits(16);
+	DWORD bits = ReadUnsigned(16);
 
 	outWord = (WORD)bits;
 }
@@ -148,7 +226,7 @@ void Bitstream::ReadWord(WORD& outWord)
 // Overload 2
 void Bitstream::ReadWord(WORD* outWord)
 {
-	DWORD bits = ReadBits(16);
+	DWORD bits = ReadUnsigned(16);
 
 	*outWord = (WORD)bits;
 }
@@ -160,7 +238,7 @@ void Bitstream::ReadWord(WORD* outWord)
 // Overload 1
 void Bitstream::ReadDWord(DWORD& outDWord)
 {
-	DWORD bits = ReadBits(32);
+	DWORD bits = ReadUnsigned(32);
 
 	outDWord = bits;
 }
@@ -168,7 +246,7 @@ void Bitstream::ReadDWord(DWORD& outDWord)
 // Overload 2
 void Bitstream::ReadDWord(DWORD* outDWord)
 {
-	DWORD bits = ReadBits(32);
+	DWORD bits = ReadUnsigned(32);
 
 	*outDWord = bits;
 }
@@ -180,7 +258,7 @@ void Bitstream::ReadDWord(DWORD* outDWord)
 // Overload 1
 void Bitstream::ReadBits(BYTE& outBits, int bitCount)
 {
-	BYTE bits = ReadBits(bitCount);
+	BYTE bits = ReadUnsigned(bitCount);
 
 	outBits = bits;
 }
@@ -188,7 +266,7 @@ void Bitstream::ReadBits(BYTE& outBits, int bitCount)
 // Overload 2
 void Bitstream::ReadBits(WORD& outBits, int bitCount)
 {
-	WORD bits = ReadBits(bitCount);
+	WORD bits = ReadUnsigned(bitCount);
 
 	outBits = bits;
 }
@@ -196,7 +274,7 @@ void Bitstream::ReadBits(WORD& outBits, int bitCount)
 // Overload 3
 void Bitstream::ReadBits(DWORD& outBits, int bitCount)
 {
-	DWORD bits = ReadBits(bitCount);
+	DWORD bits = ReadUnsigned(bitCount);
 
 	outBits = bits;
 }
@@ -204,7 +282,7 @@ void Bitstream::ReadBits(DWORD& outBits, int bitCount)
 // Overload 4
 void Bitstream::ReadBits(BYTE* outBits, int bitCount)
 {
-	BYTE bits = ReadBits(bitCount);
+	BYTE bits = ReadUnsigned(bitCount);
 
 	*outBits = bits;
 }
@@ -212,7 +290,7 @@ void Bitstream::ReadBits(BYTE* outBits, int bitCount)
 // Overload 5
 void Bitstream::ReadBits(WORD* outBits, int bitCount)
 {
-	WORD bits = ReadBits(bitCount);
+	WORD bits = ReadUnsigned(bitCount);
 
 	*outBits = bits;
 }
@@ -220,7 +298,7 @@ void Bitstream::ReadBits(WORD* outBits, int bitCount)
 // Overload 6
 void Bitstream::ReadBits(DWORD* outBits, int bitCount)
 {
-	DWORD bits = ReadBits(bitCount);
+	DWORD bits = ReadUnsigned(bitCount);
 
 	*outBits = bits;
 }
@@ -232,31 +310,73 @@ void Bitstream::ReadBits(void* outBits, size_t outBitsSize, int bitCount)
 	{
 		case 1:
 			{
-				BYTE nBits = ReadBits(bitCount);
+				BYTE nBits = ReadUnsigned(bitCount);
 				*(BYTE*)outBits = nBits;
 			}
 			break;
 		case 2:
 			{
-				WORD wBits = ReadBits(bitCount);
+				WORD wBits = ReadUnsigned(bitCount);
 				*(WORD*)outBits = wBits;
 			}
 			break;
 		case 4:
 			{
-				DWORD dwBits = ReadBits(bitCount);
+				DWORD dwBits = ReadUnsigned(bitCount);
 				*(DWORD*)outBits = dwBits;
 			}
 			break;
 		case 8:
 			{
-				QWORD qwBits = ReadBits(bitCount);
+				QWORD qwBits = ReadUnsigned(bitCount);
 				*(QWORD*)outBits = qwBits;
 			}
 			break;
 	}
 }
 
+/*
+ *	Reads a whole bunch of numbers that are all the same size (up to 32 bits each).
+ *	The buffer only gets checked once per refill instead of once per number.
+ *	If the stream runs out, the rest of the numbers are filled in with -1, the same as ReadBits does.
+ *	@author	eezstreet
+ */
+void Bitstream::ReadBitsN(DWORD* outBits, size_t dwCount, int bitCount)
+{
+	Log_ErrorAssertVoidReturn(bitCount >= 0 && bitCount <= 32);
+
+	if (bitCount == 0)
+	{
+		memset(outBits, 0, sizeof(DWORD) * dwCount);
+		return;
+	}
+
+	while (dwCount > 0)
+	{
+		size_t dwAvailable;
+
+		Refill();
+		dwAvailable = nBitsBuffered / bitCount;
+		if (dwAvailable == 0)
+		{	// ran out of stream
+			memset(outBits, 0xFF, sizeof(DWORD) * dwCount);
+			return;
+		}
+
+		if (dwAvailable > dwCount)
+		{
+			dwAvailable = dwCount;
+		}
+		dwCount -= dwAvailable;
+
+		while (dwAvailable--)
+		{
+			*outBits++ = PeekBits(bitCount);
+			ConsumeBits(bitCount);
+		}
+	}
+}
+
 /*
  *	Helper function: converts from an unsigned number to a twos complement number.
  *	@author	eezstreet/SVR
@@ -284,7 +404,7 @@ void Bitstream::ConvertFormat(long* dwOutBits, int bitCount)
  */
 size_t Bitstream::GetRemainingReadBits()
 {
-	return dwTotalStreamSizeBits - ((dwCurrentByte * 8) + dwReadBit);
+	return dwTotalStreamSizeBits - ((dwNextByte * 8) - nBitsBuffered);
 }
 
 /*
@@ -294,9 +414,6 @@ size_t Bitstream::GetRemainingReadBits()
 int Bitstream::ReadBits(int numBits) 
 {
 	int		value;
-	int		valueBits;
-	int		get;
-	int		fraction;
 	bool	sgn;
 
 	if (numBits == 0)
@@ -307,9 +424,6 @@ int Bitstream::ReadBits(int numBits)
 	Log_ErrorAssertReturn(pStream != nullptr, 0);
 	Log_ErrorAssertReturn(numBits >= -31 && numBits <= 32, 0);
 
-	value = 0;
-	valueBits = 0;
-
 	if (numBits < 0) {
 		numBits = -numBits;
 		sgn = true;
@@ -318,27 +432,17 @@ int Bitstream::ReadBits(int numBits)
 		sgn = false;
 	}
 
+	if (nBitsBuffered < numBits) {
+		Refill();
+	}
+
 	// check for overflow
-	if (numBits > GetRemainingReadBits()) {
+	if (nBitsBuffered < numBits) {
 		return -1;
 	}
 
-	while (valueBits < numBits) {
-		if (dwReadBit == 0) {
-			dwCurrentByte++;
-		}
-		get = 8 - dwReadBit;
-		if (get >(numBits - valueBits)) {
-			get = numBits - valueBits;
-		}
-		fraction = pStream[dwCurrentByte - 1];
-		fraction >>= dwReadBit;
-		fraction &= (1 << get) - 1;
-		value |= fraction << valueBits;
-
-		valueBits += get;
-		dwReadBit = (dwReadBit + get) & 7;
-	}
+	value = PeekBits(numBits);
+	ConsumeBits(numBits);
 
 	if (sgn) {
 		if (value & (1 << (numBits - 1))) {
@@ -346,8 +450,6 @@ int Bitstream::ReadBits(int numBits)
 		}
 	}
 
-	Log_ErrorAssertReturn(dwCurrentByte <= dwTotalStreamSizeBytes, 0);
-
 	return value;
 }
 
@@ -4,6 +4,7 @@
 /*
  *	Bitstreams are used for both DCCs and networking.
  *	Based partially on id Tech 4's bitstreams.
+ *	Bits are read out of a 64-bit buffer that gets refilled a word at a time, so most reads are just a mask and a shift.
  *	@author	eezstreet
  */
 class Bitstream
@@ -30,6 +31,7 @@ public:
 	void ReadBits(WORD* outBits, int bitCount);
 	void ReadBits(DWORD* outBits, int bitCount);
 	void ReadBits(void* outBits, size_t outSize, int bitCount);
+	void ReadBitsN(DWORD* outBits, size_t dwCount, int bitCount);
 	void ReadData(void* data, size_t outSize);
 
 	// Helper function - convert from unsigned to 2C
@@ -45,12 +47,46 @@ private:
 	int ReadBits(int bitsCount);
 	void FreeInternalStreamSource();
 
+	void Refill();
+	void GetCurrentPosition(size_t& dwPosition, size_t& dwBitOffset);
+	void SetBitPosition(size_t dwBitPosition);
+
+	// Looks at the next few bits in the buffer without reading them (bitCount can't be more than nBitsBuffered)
+	DWORD PeekBits(int bitCount)
+	{
+		return (DWORD)(qwBitBuffer & ((1ULL << bitCount) - 1));
+	}
+
+	void ConsumeBits(int bitCount)
+	{
+		qwBitBuffer >>= bitCount;
+		nBitsBuffered -= bitCount;
+	}
+
+	// Reads an unsigned number, going through ReadBits(int) only when the buffer needs to be refilled
+	// (or for signed reads, which have a negative bitCount)
+	DWORD ReadUnsigned(int bitCount)
+	{
+		DWORD dwValue;
+
+		if ((unsigned int)bitCount > (unsigned int)nBitsBuffered)
+		{
+			return (DWORD)ReadBits(bitCount);
+		}
+
+		dwValue = PeekBits(bitCount);
+		ConsumeBits(bitCount);
+		return dwValue;
+	}
+
 	bool bExternalStorage;
 	BYTE* pStream;
 	size_t dwStreamStartByte;
 	size_t dwStreamStartBit;
 	size_t dwTotalStreamSizeBytes;
 	size_t dwTotalStreamSizeBits;
-	size_t dwCurrentByte;
-	size_t dwReadBit;
+
+	QWORD qwBitBuffer;		// Bits that have been loaded out of the stream, but not read yet. The next bit is bit 0.
+	int nBitsBuffered;		// How many of the bits in qwBitBuffer are real
+	size_t dwNextByte;		// The next byte that gets loaded into qwBitBuffer
 };
\ No newline at end of file
@@ -18,7 +18,7 @@ namespace COF
 		char szCOFName[MAX_COFFILE_NAMELEN];
 		char szCOFType[MAX_COF_TYPELEN];
 		COFFile*	pFile;
-		BYTE*		pCOFContents;
+		const BYTE*	pCOFContents;		// Mapped with FS::Map
 	};
 
 	static COFHash COFHashTable[MAX_COF_HASHLEN]{ 0 };
@@ -35,7 +35,7 @@ namespace COF
 		char cof[MAX_COFFILE_NAMELEN]{ 0 };
 		COFHash* pHash;
 		cof_handle outHandle;
-		fs_handle file;
+		const BYTE* pContents;
 		size_t dwFileSize;
 		int i;
 
@@ -46,17 +46,17 @@ namespace COF
 		snprintf(path, MAX_D2PATH, "data\\global\\%s\\%s\\COF\\%s", type, token, cof);
 
 		// Try and load the COF first because it's possible we could be wasting time with the below code
-		dwFileSize = FS::Open(path, &file, FS_READ, true);
-		if (file == INVALID_HANDLE)
+		pContents = (const BYTE*)FS::Map(path, &dwFileSize);
+		if (pContents == nullptr)
 		{
 			Log::Print(PRIORITY_MESSAGE, "Couldn't load %s\n", cof);
 			return INVALID_HANDLE;
 		}
 
-		if (dwFileSize == 0)
+		if (dwFileSize < sizeof(COFHeader))
 		{
 			Log::Print(PRIORITY_MESSAGE, "Bad COF file: %s\n", cof);
-			FS::CloseFile(file);
+			FS::Unmap(pContents);
 			return INVALID_HANDLE;
 		}
 
@@ -70,17 +70,19 @@ namespace COF
 			pHash = &COFHashTable[outHandle];
 		}
 
+		if (pHash->pFile != nullptr)
+		{	// already registered
+			FS::Unmap(pContents);
+			return outHandle;
+		}
+
 		// Allocate the file.
 		pHash->pFile = (COFFile*)malloc(sizeof(COFFile));
 
 		D2Lib::strncpyz(pHash->szCOFName, cof, MAX_COFFILE_NAMELEN);
 		D2Lib::strncpyz(pHash->szCOFType, type, MAX_COF_TYPELEN);
 
-		pHash->pCOFContents = (BYTE*)malloc(dwFileSize);
-		Log_ErrorAssertReturn(pHash->pCOFContents != nullptr, INVALID_HANDLE);
-
-		FS::Read(file, pHash->pCOFContents, dwFileSize);
-		FS::CloseFile(file);
+		pHash->pCOFContents = pContents;
 
 		// Copy the header over
 		memcpy(&pHash->pFile->header, pHash->pCOFContents, sizeof(COFHeader));
@@ -115,7 +117,7 @@ namespace COF
 		}
 
 		free(pHash->pFile);
-		free(pHash->pCOFContents);
+		FS::Unmap(pHash->pCOFContents);
 		pHash->pFile = nullptr;
 		pHash->pCOFContents = nullptr;
 		pHash->szCOFName[0] = '\0';
@@ -1,17 +1,18 @@
 #include "DC6.hpp"
 #include "Logging.hpp"
 #include "FileSystem.hpp"
+#include "Threadpool.hpp"
 
-#define DC6_HEADER_VERSION	6
 #define DECODE_BUFFER_SIZE	2048 * 2048
 
 namespace DC6
 {
-	static BYTE gpDecodeBuffer[DECODE_BUFFER_SIZE];
 	static BYTE gpReadBuffer[DECODE_BUFFER_SIZE];
 
 	/*
 	*	Decode a DC6 frame in place
+	*	Some of the shipped DC6s write outside of their frame; those pixels get dropped, since the frames next to
+	*	this one are being decoded on other threads.
 	*	@author	Necrolis/eezstreet
 	*	TODO: optimize this a lot
 	*/
@@ -51,12 +52,42 @@ namespace DC6
 			{
 				while (pixel--)
 				{
-					pOutPixels[(y * pFrame->fh.dwWidth) + x++] = pPixels[++i];
+					BYTE color = pPixels[++i];
+
+					if (x < pFrame->fh.dwWidth && y < pFrame->fh.dwHeight)
+					{	// (y wraps around when it goes off of the top, so this catches both sides)
+						pOutPixels[(y * pFrame->fh.dwWidth) + x] = color;
+					}
+					x++;
 				}
 			}
 		}
 	}
 
+	/*
+	*	Decodes a range of frames, for the threadpool
+	*/
+	static void DecodeFrames(int nStart, int nEnd, void* pData)
+	{
+		DC6Image* pImage = (DC6Image*)pData;
+		DWORD* pFramePointers = (DWORD*)(gpReadBuffer + sizeof(pImage->header));
+
+		for (int i = nStart; i < nEnd; i++)
+		{
+			DC6Frame* pFrame = &pImage->pFrames[i];
+			BYTE* pFrameData = gpReadBuffer + pFramePointers[i] + sizeof(DC6Frame::DC6FrameHeader);
+
+			if (pImage->header.dwVersion != DC6_DECODED_VERSION)
+			{
+				DecodeFrame(pFrameData, pImage->pPixels + pFrame->fh.dwNextBlock, pFrame);
+			}
+			else if (pFrame->fh.dwLength == pFrame->fh.dwWidth * pFrame->fh.dwHeight)
+			{	// Already decoded when the pak got made
+				memcpy(pImage->pPixels + pFrame->fh.dwNextBlock, pFrameData, pFrame->fh.dwLength);
+			}
+		}
+	}
+
 	/*
 	*	Loads a DC6 from an MPQ
 	*	@author	eezstreet
@@ -71,12 +102,16 @@ namespace DC6
 		DWORD dwOffset = 0, dwTotalPixels = 0, dwWidth = 0, dwHeight = 0, dwDirectionWidth = 0, dwDirectionHeight = 0;
 
 		memset(pImage, 0, sizeof(DC6Image));
-		memset(gpDecodeBuffer, 0, sizeof(BYTE) * DECODE_BUFFER_SIZE);
 
 		dwFileSize = FS::Open(szPath, &pImage->f, FS_READ, true);
 		
-		Log_WarnAssert(pImage->f != INVALID_HANDLE);
-		Log_WarnAssert(dwFileSize < DECODE_BUFFER_SIZE);
+		Log_WarnAssertVoidReturn(pImage->f != INVALID_HANDLE);
+		if (dwFileSize >= DECODE_BUFFER_SIZE)
+		{	// only part of it would get read, and the frames would get copied out of whatever is past the end
+			FS::CloseFile(pImage->f);
+			pImage->f = INVALID_HANDLE;
+			Log_WarnAssertVoidReturn(dwFileSize < DECODE_BUFFER_SIZE);
+		}
 
 		// Now comes the fun part: reading and decoding the actual thing
 		FS::Read(pImage->f, gpReadBuffer, DECODE_BUFFER_SIZE);
@@ -87,7 +122,7 @@ namespace DC6
 		pByteReadHead += sizeof(pImage->header);
 
 		// Validate the header
-		Log_WarnAssert(pImage->header.dwVersion == DC6_HEADER_VERSION);
+		Log_WarnAssert(pImage->header.dwVersion == DC6_HEADER_VERSION || pImage->header.dwVersion == DC6_DECODED_VERSION);
 
 		// Table of pointers
 		pFramePointers = (DWORD*)pByteReadHead;
@@ -97,7 +132,7 @@ namespace DC6
 		pImage->pFrames = (DC6Frame*)malloc(sizeof(DC6Frame) * dwNumFrames);
 		Log_ErrorAssert(pImage->pFrames != nullptr);
 
-		// Read each frame's header, and then decode the blocks
+		// Read each frame's header, to figure out where its pixels go
 		for (i = 0; i < pImage->header.dwDirections; i++)
 		{
 			for (j = 0; j < pImage->header.dwFrames; j++)
@@ -119,9 +154,6 @@ namespace DC6
 					pFrame->dwDeltaY = 0;
 				}
 
-				pByteReadHead = gpReadBuffer + pFramePointers[dwFramePos] + sizeof(DC6Frame::DC6FrameHeader);
-				DecodeFrame(pByteReadHead, gpDecodeBuffer + dwOffset, pFrame);
-
 				dwTotalPixels += pFrame->fh.dwWidth * pFrame->fh.dwHeight;
 				dwOffset += pFrame->fh.dwWidth * pFrame->fh.dwHeight;
 
@@ -148,11 +180,12 @@ namespace DC6
 		pImage->dwTotalWidth = dwWidth;
 		pImage->dwTotalHeight = dwHeight;
 
-		// Allocate the pixels that we need
-		pImage->pPixels = (BYTE*)malloc(dwTotalPixels);
+		// Allocate the pixels that we need (zeroed, since decoding skips over the transparent ones),
+		// and then decode all of the frames straight into them
+		pImage->pPixels = (BYTE*)calloc(dwTotalPixels, 1);
 		Log_ErrorAssert(pImage->pPixels != nullptr);
 
-		memcpy(pImage->pPixels, gpDecodeBuffer, dwTotalPixels);
+		Threadpool::ParallelFor(0, dwNumFrames, 1, DecodeFrames, pImage);
 		pImage->bPixelsFreed = false;
 	}
 
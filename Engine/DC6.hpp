@@ -8,6 +8,11 @@
  */
 #define MAX_DC6_CELL_SIZE	256
 
+#define DC6_HEADER_VERSION	6
+#define DC6_DECODED_VERSION	0x80000006	// Made by od2pak -predecode. Each frame's pixels are stored as they get
+										// decoded (dwWidth * dwHeight bytes, top row first), so dwLength is the
+										// number of pixels instead of the number of blocks.
+
 #pragma pack(push,enter_include)
 #pragma pack(1)
 struct DC6Frame
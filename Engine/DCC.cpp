@@ -1,20 +1,27 @@
 #include "DCC.hpp"
+#include "DCC_Cache.hpp"
 #include "Logging.hpp"
 #include "FileSystem.hpp"
+#include <new>
 
-#define MAX_DCC_HASH		32768
-#define MAX_DCC_NAMELEN		32
+#define MAX_DCC_HASH			32768
+#define DCC_ARENA_BLOCK_SIZE	4096
 
-namespace DCC
+/*
+ *	A chunk of a DCC file's arena. Things get carved off of the front of it, and they never get freed on their own;
+ *	the whole arena goes away when the file does.
+ */
+struct DCCArenaBlock
 {
-	struct DCCHash
-	{
-		DCCFile*	pFile;
-		char		name[MAX_DCC_NAMELEN];
-		int			useCount;
-	};
+	DCCArenaBlock*	pNext;
+	size_t			dwSize;
+	size_t			dwUsed;
+};
 
-	static DCCHash DCCHashTable[MAX_DCC_HASH]{ 0 };
+namespace DCC
+{
+	// Only the files themselves go in the table; their names and use counts are kept inside of them
+	static DCCFile* gpDCCFiles[MAX_DCC_HASH]{ 0 };
 	static int gnNumHashesUsed = 0;
 
 	static const BYTE gdwDCCBitTable[] = {
@@ -25,9 +32,9 @@ namespace DCC
 	*	Inits the DCC code globally. We should call this before doing any DCC calls.
 	*	@author	eezstreet
 	*/
-	void GlobalInit()
+	void GlobalInit(bool bUseCache)
 	{
-		// do nothing atm
+		DCCCache::Init(bUseCache);
 	}
 
 	/*
@@ -37,24 +44,92 @@ namespace DCC
 	void GlobalShutdown()
 	{
 		FreeAll();
+		DCCCache::Shutdown();
+	}
+
+	//////////////////////////////////////////////////
+	//
+	//	Arenas
+
+	/*
+	*	Makes a new arena block, with room for at least dwSize bytes
+	*/
+	static DCCArenaBlock* NewArenaBlock(size_t dwSize)
+	{
+		DCCArenaBlock* pBlock;
+
+		dwSize = D2Lib::max<size_t>(dwSize, DCC_ARENA_BLOCK_SIZE);
+		pBlock = (DCCArenaBlock*)malloc(sizeof(DCCArenaBlock) + dwSize);
+		Log_ErrorAssertReturn(pBlock != nullptr, nullptr);
+
+		pBlock->pNext = nullptr;
+		pBlock->dwSize = dwSize;
+		pBlock->dwUsed = 0;
+		return pBlock;
+	}
+
+	/*
+	*	Allocates (zeroed) memory out of a file's arena
+	*/
+	static void* ArenaAlloc(DCCFile* pFile, size_t dwSize)
+	{
+		DCCArenaBlock* pBlock = pFile->pArena;
+		BYTE* pMemory;
+
+		// Keep everything pointer-aligned
+		dwSize = (dwSize + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+		if (pBlock->dwUsed + dwSize > pBlock->dwSize)
+		{	// The newest block always goes at the front
+			DCCArenaBlock* pNewBlock = NewArenaBlock(dwSize);
+			if (pNewBlock == nullptr)
+			{
+				return nullptr;
+			}
+
+			pNewBlock->pNext = pBlock;
+			pFile->pArena = pBlock = pNewBlock;
+		}
+
+		pMemory = (BYTE*)(pBlock + 1) + pBlock->dwUsed;
+		pBlock->dwUsed += dwSize;
+		memset(pMemory, 0, dwSize);
+		return pMemory;
+	}
+
+	/*
+	*	Frees every block in an arena
+	*/
+	static void FreeArena(DCCArenaBlock* pBlock)
+	{
+		while (pBlock != nullptr)
+		{
+			DCCArenaBlock* pNext = pBlock->pNext;
+			free(pBlock);
+			pBlock = pNext;
+		}
 	}
 
+	//////////////////////////////////////////////////
+	//
+	//	Reading
+
 	/*
 	*	Is responsible for reading the header of the DCC file.
 	*	@author	eezstreet
 	*/
-	static void ReadHeader(DCCHash& dcc, Bitstream* pBits)
+	static void ReadHeader(DCCHeader& header, Bitstream* pBits)
 	{
-		pBits->ReadByte(dcc.pFile->header.nSignature);
-		pBits->ReadByte(dcc.pFile->header.nVersion);
-		pBits->ReadByte(dcc.pFile->header.nNumberDirections);
-		pBits->ReadDWord(dcc.pFile->header.dwFramesPerDirection);
-		pBits->ReadDWord(dcc.pFile->header.dwTag);
-		pBits->ReadDWord(dcc.pFile->header.dwFinalDC6Size);
-
-		for (int i = 0; i < dcc.pFile->header.nNumberDirections; i++)
+		pBits->ReadByte(header.nSignature);
+		pBits->ReadByte(header.nVersion);
+		pBits->ReadByte(header.nNumberDirections);
+		pBits->ReadDWord(header.dwFramesPerDirection);
+		pBits->ReadDWord(header.dwTag);
+		pBits->ReadDWord(header.dwFinalDC6Size);
+
+		for (int i = 0; i < header.nNumberDirections && i < MAX_DIRECTIONS; i++)
 		{
-			pBits->ReadDWord(dcc.pFile->header.dwDirectionOffset[i]);
+			pBits->ReadDWord(header.dwDirectionOffset[i]);
 		}
 	}
 
@@ -62,7 +137,7 @@ namespace DCC
 	*	Is reponsible for reading the header that starts each direction of the DCC.
 	*	@author	eezstreet
 	*/
-	static void ReadDirectionHeader(DCCHeader& fileHeader, DCCDirection& dir, int dirNum, Bitstream* pBits)
+	static void ReadDirectionHeader(DCCDirection& dir, Bitstream* pBits)
 	{
 		pBits->ReadBits(&dir.dwOutsizeCoded, 32);
 		pBits->ReadBits(dir.nCompressionFlag, 2);
@@ -89,15 +164,17 @@ namespace DCC
 	*/
 	static void ReadFrameHeader(DCCFrame& frame, DCCDirection& direction, Bitstream* pBits)
 	{
+		DWORD dwValue;
+
 		memset(&frame, 0, sizeof(DCCFrame));
 
-#define ReadHeaderBits(x, y)	if(y != 0) pBits->ReadBits((DWORD*)&x, y);
+#define ReadHeaderBits(x, y)	if(y != 0) { pBits->ReadBits(&dwValue, y); x = dwValue; }
 		ReadHeaderBits(frame.dwVariable0, direction.nVar0Bits);
 		ReadHeaderBits(frame.dwWidth, direction.nWidthBits);
 		ReadHeaderBits(frame.dwHeight, direction.nHeightBits);
 		ReadHeaderBits(frame.nXOffset, direction.nXOffsetBits);
 		ReadHeaderBits(frame.nYOffset, direction.nYOffsetBits);
-		ReadHeaderBits(*frame.pOptionalByteData, frame.dwOptionalBytes);
+		ReadHeaderBits(frame.dwOptionalBytes, direction.nOptionalBytesBits);
 		ReadHeaderBits(frame.dwCodedBytes, direction.nCodedBytesBits);
 		ReadHeaderBits(frame.dwFlipped, 1);
 #undef ReadHeaderBits
@@ -141,137 +218,220 @@ namespace DCC
 		}
 	}
 
+	/*
+	*	Makes one of a direction's bitstreams, in the file's arena
+	*/
+	static Bitstream* NewStream(DCCFile* pFile, Bitstream* pBits, size_t dwSizeBits)
+	{
+		void* pMemory = ArenaAlloc(pFile, sizeof(Bitstream));
+		Bitstream* pStream;
+
+		if (pMemory == nullptr)
+		{
+			return nullptr;
+		}
+
+		pStream = new (pMemory) Bitstream();
+		pStream->SplitFrom(pBits, dwSizeBits);
+		return pStream;
+	}
+
 	/*
 	*	Is responsible for creating the DCC bitstreams
 	*	@author	eezstreet
 	*/
-	static void CreateDirectionBitstreams(DCCDirection& dir, Bitstream* pBits)
+	static void CreateDirectionBitstreams(DCCFile* pFile, DCCDirection& dir, Bitstream* pBits)
 	{
-		// Initialize everything to nullptr to begin with
-		dir.EqualCellStream = nullptr;
-		dir.PixelMaskStream = nullptr;
-		dir.EncodingTypeStream = nullptr;
-		dir.RawPixelStream = nullptr;
-		dir.PixelCodeDisplacementStream = nullptr;
-
 		if (dir.nCompressionFlag & 0x02)
 		{
-			dir.EqualCellStream = new Bitstream();
-			dir.EqualCellStream->SplitFrom(pBits, dir.dwEqualCellStreamSize);
+			dir.EqualCellStream = NewStream(pFile, pBits, dir.dwEqualCellStreamSize);
 		}
 
 		// Corresponds to `ColorMask` in SVR's code
-		dir.PixelMaskStream = new Bitstream();
-		dir.PixelMaskStream->SplitFrom(pBits, dir.dwPixelMaskStreamSize);
+		dir.PixelMaskStream = NewStream(pFile, pBits, dir.dwPixelMaskStreamSize);
 
 		if (dir.nCompressionFlag & 0x01)
 		{
-			dir.EncodingTypeStream = new Bitstream();
-			dir.RawPixelStream = new Bitstream();	// Corresponds to `RawColors` in SVR's code
-			dir.EncodingTypeStream->SplitFrom(pBits, dir.dwEncodingStreamSize);
-			dir.RawPixelStream->SplitFrom(pBits, dir.dwRawPixelStreamSize);
+			dir.EncodingTypeStream = NewStream(pFile, pBits, dir.dwEncodingStreamSize);
+			dir.RawPixelStream = NewStream(pFile, pBits, dir.dwRawPixelStreamSize);	// Corresponds to `RawColors` in SVR's code
 		}
 
 		// Read the remainder into the pixel code displacement
 		// Corresponds to `PixelData` in SVR's code
-		dir.PixelCodeDisplacementStream = new Bitstream();
-		dir.PixelCodeDisplacementStream->SplitFrom(pBits, pBits->GetRemainingReadBits());
+		dir.PixelCodeDisplacementStream = NewStream(pFile, pBits, pBits->GetRemainingReadBits());
 	}
 
 	/*
-	*	Is responsible for the actual reading of the DCC, from an fs_handle and a hash entry pointer.
+	*	Reads one direction of a DCC into its arena. The file's lock needs to be held.
 	*	@author	eezstreet
 	*/
-	void Read(DCCHash& dcc, fs_handle fileHandle, DWORD fileSize)
+	static DCCDirection* ReadDirection(DCCFile* pFile, int nDirection)
 	{
-		Bitstream* pBits;
-		int i, j;
+		DCCDirection* pDir;
+		Bitstream bits;
+		size_t optionalSize = 0;
+		DWORD j;
 
-		// Allocate memory for everything
-		dcc.pFile = (DCCFile*)malloc(sizeof(DCCFile));
-		Log_ErrorAssert(dcc.pFile);
+		pDir = (DCCDirection*)ArenaAlloc(pFile, sizeof(DCCDirection));
+		if (pDir == nullptr)
+		{
+			return nullptr;
+		}
 
-		dcc.pFile->dwFileSize = fileSize;
-		dcc.pFile->pFileBytes = (BYTE*)malloc(dcc.pFile->dwFileSize);
-		Log_ErrorAssert(dcc.pFile->pFileBytes);
+		pDir->frames = (DCCFrame*)ArenaAlloc(pFile, sizeof(DCCFrame) * pFile->header.dwFramesPerDirection);
+		if (pDir->frames == nullptr)
+		{
+			return nullptr;
+		}
 
-		// Read into filebytes.
-		FS::Read(fileHandle, dcc.pFile->pFileBytes, dcc.pFile->dwFileSize);
+		// (This only ever reads from the file bytes.)
+		bits.LoadStream((BYTE*)pFile->pFileBytes, pFile->dwFileSize);
+		bits.SetCurrentPosition(pFile->header.dwDirectionOffset[nDirection]);
 
-		// Create the bitstream.
-		pBits = new Bitstream();
-		pBits->LoadStream(dcc.pFile->pFileBytes, dcc.pFile->dwFileSize);
+		pDir->nMinX = INT_MAX;
+		pDir->nMinY = INT_MAX;
+		pDir->nMaxX = INT_MIN;
+		pDir->nMaxY = INT_MIN;
 
-		// Read the header.
-		ReadHeader(dcc, pBits);
+		// Direction header
+		ReadDirectionHeader(*pDir, &bits);
 
-		// Read the direction bitstream
-		for (i = 0; i < dcc.pFile->header.nNumberDirections; i++)
+		// Read frames
+		for (j = 0; j < pFile->header.dwFramesPerDirection; j++)
 		{
-			DCCDirection& dir = dcc.pFile->directions[i];
-			size_t optionalSize = 0;
-
-			pBits->SetCurrentPosition(dcc.pFile->header.dwDirectionOffset[i]);
+			// Read header
+			ReadFrameHeader(pDir->frames[j], *pDir, &bits);
 
-			dir.nMinX = INT_MAX;
-			dir.nMinY = INT_MAX;
-			dir.nMaxX = INT_MIN;
-			dir.nMaxY = INT_MIN;
+			// Recalculate box frame
+			pDir->nMinX = D2Lib::min<long>(pDir->nMinX, pDir->frames[j].nMinX);
+			pDir->nMaxX = D2Lib::max<long>(pDir->nMaxX, pDir->frames[j].nMaxX);
+			pDir->nMinY = D2Lib::min<long>(pDir->nMinY, pDir->frames[j].nMinY);
+			pDir->nMaxY = D2Lib::max<long>(pDir->nMaxY, pDir->frames[j].nMaxY);
 
-			// Direction header
-			ReadDirectionHeader(dcc.pFile->header, dir, i, pBits);
+			// Add to the optional bytes size
+			optionalSize += pDir->frames[j].dwOptionalBytes;
+		}
 
-			// Read frames
-			for (j = 0; j < dcc.pFile->header.dwFramesPerDirection; j++)
+		// Read direction optional data
+		if (optionalSize > 0)
+		{
+			for (j = 0; j < pFile->header.dwFramesPerDirection; j++)
 			{
-				// Read header
-				ReadFrameHeader(dir.frames[j], dir, pBits);
-
-				// Recalculate box frame
-				dir.nMinX = D2Lib::min<long>(dir.nMinX, dir.frames[j].nMinX);
-				dir.nMaxX = D2Lib::max<long>(dir.nMaxX, dir.frames[j].nMaxX);
-				dir.nMinY = D2Lib::min<long>(dir.nMinY, dir.frames[j].nMinY);
-				dir.nMaxY = D2Lib::max<long>(dir.nMaxY, dir.frames[j].nMaxY);
-
-				// Add to the optional bytes size
-				optionalSize += dir.frames[j].dwOptionalBytes;
-			}
+				if (pDir->frames[j].dwOptionalBytes == 0)
+				{
+					continue;
+				}
 
-			// Read direction optional data
-			if (optionalSize > 0)
-			{
-				for (j = 0; j < dcc.pFile->header.dwFramesPerDirection; j++)
+				pDir->frames[j].pOptionalByteData = (BYTE*)ArenaAlloc(pFile, pDir->frames[j].dwOptionalBytes);
+				if (pDir->frames[j].pOptionalByteData == nullptr)
 				{
-					// Allocate memory and read
-					dir.frames[j].pOptionalByteData = (BYTE*)malloc(dir.frames[j].dwOptionalBytes);
-					pBits->ReadData(dir.frames[j].pOptionalByteData, dir.frames[j].dwOptionalBytes);
+					return nullptr;
 				}
+				bits.ReadData(pDir->frames[j].pOptionalByteData, pDir->frames[j].dwOptionalBytes);
 			}
+		}
 
-			// Read size for the pixel bitstreams
-			if (dir.nCompressionFlag & 0x02)
-			{
-				pBits->ReadBits(dir.dwEqualCellStreamSize, 20);
-			}
-			pBits->ReadBits(dir.dwPixelMaskStreamSize, 20);
-			if (dir.nCompressionFlag & 0x01)
-			{
-				pBits->ReadBits(dir.dwEncodingStreamSize, 20);
-				pBits->ReadBits(dir.dwRawPixelStreamSize, 20);
-			}
+		// Read size for the pixel bitstreams
+		if (pDir->nCompressionFlag & 0x02)
+		{
+			bits.ReadBits(pDir->dwEqualCellStreamSize, 20);
+		}
+		bits.ReadBits(pDir->dwPixelMaskStreamSize, 20);
+		if (pDir->nCompressionFlag & 0x01)
+		{
+			bits.ReadBits(pDir->dwEncodingStreamSize, 20);
+			bits.ReadBits(pDir->dwRawPixelStreamSize, 20);
+		}
+
+		// Read pixel mapping
+		ReadDirectionPixelMapping(*pDir, &bits);
+
+		// Initiate the bitstreams
+		CreateDirectionBitstreams(pFile, *pDir, &bits);
+		if (pDir->PixelMaskStream == nullptr || pDir->PixelCodeDisplacementStream == nullptr)
+		{
+			return nullptr;
+		}
 
-			// Read pixel mapping
-			ReadDirectionPixelMapping(dir, pBits);
+		// That's all we need to do for now. 
+		// The LRU on the renderer will be responsible for decoding the DCCs as we need them.
+		return pDir;
+	}
 
-			// Initiate the bitstreams
-			CreateDirectionBitstreams(dir, pBits);
+	/*
+	*	Is responsible for the actual reading of the DCC, from a mapped file.
+	*	Only the header gets read here. The DCC keeps the mapped file around until it gets freed.
+	*	@author	eezstreet
+	*/
+	static DCCFile* Read(const BYTE* pFileBytes, DWORD fileSize, const char* szName)
+	{
+		DCCHeader header;
+		DCCArenaBlock* pArena;
+		DCCFile* pFile;
+		Bitstream bits;
+
+		// Read the header.
+		memset(&header, 0, sizeof(header));
+		bits.LoadStream((BYTE*)pFileBytes, fileSize);
+		ReadHeader(header, &bits);
+
+		if (header.nNumberDirections > MAX_DIRECTIONS || header.dwFramesPerDirection > MAX_FRAMES)
+		{
+			Log::Print(PRIORITY_MESSAGE, "DCC file %s has too many directions or frames\n", szName);
+			return nullptr;
+		}
+
+		// The file itself is the first thing in its arena
+		pArena = NewArenaBlock(sizeof(DCCFile) + (sizeof(DCCDirection*) * header.nNumberDirections));
+		if (pArena == nullptr)
+		{
+			return nullptr;
+		}
+
+		pFile = (DCCFile*)(pArena + 1);
+		pArena->dwUsed = sizeof(DCCFile);
+		memset(pFile, 0, sizeof(DCCFile));
+		pFile->pArena = pArena;
+
+		pFile->header = header;
+		pFile->dwFileSize = fileSize;
+		pFile->pFileBytes = pFileBytes;
+		D2Lib::strncpyz(pFile->szName, szName, MAX_DCC_NAMELEN);
+		pFile->ppDirections = (DCCDirection**)ArenaAlloc(pFile, sizeof(DCCDirection*) * header.nNumberDirections);
+
+		return pFile;
+	}
+
+	/*
+	*	Gets a direction of a DCC, reading it if this is the first time that it has been asked for.
+	*	Safe to call from any thread.
+	*	@author	eezstreet
+	*/
+	DCCDirection* GetDirection(DCCFile* pFile, int nDirection)
+	{
+		DCCDirection* pDir;
+
+		if (pFile == nullptr || nDirection < 0 || nDirection >= pFile->header.nNumberDirections)
+		{
+			return nullptr;
+		}
+
+		pDir = (DCCDirection*)SDL_AtomicGetPtr((void**)&pFile->ppDirections[nDirection]);
+		if (pDir != nullptr)
+		{
+			return pDir;
+		}
 
-			// That's all we need to do for now. 
-			// The LRU on the renderer will be responsible for decoding the DCCs as we need them.
+		SDL_AtomicLock(&pFile->nLock);
+		pDir = pFile->ppDirections[nDirection];
+		if (pDir == nullptr)
+		{
+			pDir = ReadDirection(pFile, nDirection);
+			SDL_AtomicSetPtr((void**)&pFile->ppDirections[nDirection], pDir);
 		}
+		SDL_AtomicUnlock(&pFile->nLock);
 
-		// Clear out the bitstream
-		delete pBits;
+		return pDir;
 	}
 
 	/*
@@ -282,7 +442,8 @@ namespace DCC
 	anim_handle Load(char* szPath, char* szName)
 	{
 		anim_handle outHandle;
-		fs_handle fileHandle;
+		const BYTE* pFileBytes;
+		size_t fileSize;
 		DWORD dwNameHash;
 
 		if (!szPath || !szName)
@@ -297,26 +458,21 @@ namespace DCC
 
 		// Make sure that the file actually exists first before we start poking the hash table.
 		// That way, we can root out issues of not finding DCCs immediately
-		DWORD fileSize = FS::Open(szPath, &fileHandle, FS_READ, true);
-		if (fileHandle == INVALID_HANDLE)
+		pFileBytes = (const BYTE*)FS::Map(szPath, &fileSize);
+		if (pFileBytes == nullptr)
 		{
 			Log::Print(PRIORITY_DEBUG, "Couldn't load DCC file: %s (%s)\n", szPath, szName);
 			return INVALID_HANDLE;
 		}
-		if (fileSize == 0)
-		{
-			Log::Print(PRIORITY_DEBUG, "Blank DCC file: %s (%s)\n", szPath, szName);
-			FS::CloseFile(fileHandle);
-			return INVALID_HANDLE;
-		}
 
 		// Find a free slot in the hash table
 		dwNameHash = D2Lib::strhash(szName, 0, MAX_DCC_HASH);
 		outHandle = (anim_handle)dwNameHash;
-		while (DCCHashTable[outHandle].pFile != nullptr)
+		while (gpDCCFiles[outHandle] != nullptr)
 		{
-			if (!D2Lib::stricmp(szName, DCCHashTable[outHandle].name))
+			if (!D2Lib::stricmp(szName, gpDCCFiles[outHandle]->szName))
 			{
+				FS::Unmap(pFileBytes);
 				return outHandle;
 			}
 			outHandle++;
@@ -324,11 +480,15 @@ namespace DCC
 		}
 
 		// Now that we've got a free slot and a file handle, let's go ahead and load the DCC itself
-		Read(DCCHashTable[outHandle], fileHandle, fileSize);
-		D2Lib::strncpyz(DCCHashTable[outHandle].name, szName, MAX_DCC_NAMELEN);
-		DCCHashTable[outHandle].useCount = 0;
-		FS::CloseFile(fileHandle);
+		gpDCCFiles[outHandle] = Read(pFileBytes, fileSize, szName);
+		if (gpDCCFiles[outHandle] == nullptr)
+		{
+			FS::Unmap(pFileBytes);
+			return INVALID_HANDLE;
+		}
+		DCCCache::IdentifyFile(gpDCCFiles[outHandle], szPath);
 
+		gnNumHashesUsed++;
 		return outHandle;
 	}
 
@@ -338,12 +498,12 @@ namespace DCC
 	*/
 	void IncrementUseCount(anim_handle dccHandle, int amount)
 	{
-		if (dccHandle == INVALID_HANDLE)
+		if (dccHandle == INVALID_HANDLE || gpDCCFiles[dccHandle] == nullptr)
 		{
 			return;
 		}
 
-		DCCHashTable[dccHandle].useCount += amount;
+		gpDCCFiles[dccHandle]->nUseCount += amount;
 	}
 
 	/*
@@ -357,25 +517,7 @@ namespace DCC
 			return nullptr;
 		}
 
-		return DCCHashTable[dccHandle].pFile;
-	}
-
-	/*
-	*	Free any DCC misc data (optional bytes, etc) that got allocated
-	*	@author	eezstreet
-	*/
-	static void FreeMiscData(DCCFile* pFile)
-	{
-		for (int i = 0; i < pFile->header.nNumberDirections; i++)
-		{
-			for (int j = 0; j < pFile->header.dwFramesPerDirection; j++)
-			{
-				if (pFile->directions[i].frames[j].pOptionalByteData)
-				{
-					free(pFile->directions[i].frames[j].pOptionalByteData);
-				}
-			}
-		}
+		return gpDCCFiles[dccHandle];
 	}
 
 	/*
@@ -389,13 +531,15 @@ namespace DCC
 			return;
 		}
 
-		if (DCCHashTable[dcc].pFile != nullptr)
+		if (gpDCCFiles[dcc] != nullptr)
 		{
-			DCCHashTable[dcc].name[0] = '\0';
-			FreeMiscData(DCCHashTable[dcc].pFile);
-			free(DCCHashTable[dcc].pFile->pFileBytes);
-			free(DCCHashTable[dcc].pFile);
-			DCCHashTable[dcc].pFile = nullptr;
+			DCCFile* pFile = gpDCCFiles[dcc];
+
+			// (the file is in its own arena, so nothing can be touched after the arena is gone)
+			gpDCCFiles[dcc] = nullptr;
+			gnNumHashesUsed--;
+			FS::Unmap(pFile->pFileBytes);
+			FreeArena(pFile->pArena);
 		}
 	}
 
@@ -405,7 +549,7 @@ namespace DCC
 	*/
 	void FreeIfInactive(anim_handle handle)
 	{
-		if (DCCHashTable[handle].useCount <= 0)
+		if (gpDCCFiles[handle] != nullptr && gpDCCFiles[handle]->nUseCount <= 0)
 		{
 			FreeHandle(handle);
 		}
@@ -437,15 +581,17 @@ namespace DCC
 			return;
 		}
 
+		// Files can get freed out of the middle of a run of slots, so this can't stop at the first empty one
 		dwHash = D2Lib::strhash(name, 0, MAX_DCC_HASH);
-		while (dwHashesTried < gnNumHashesUsed && D2Lib::stricmp(DCCHashTable[dwHash].name, name))
+		while (dwHashesTried < MAX_DCC_HASH &&
+			(gpDCCFiles[dwHash] == nullptr || D2Lib::stricmp(gpDCCFiles[dwHash]->szName, name)))
 		{
 			dwHash++;
 			dwHash %= MAX_DCC_HASH;
-			dwHashesTried++; // Increment number of hashes tried. If we go over the amount of hashes used, its wrong
+			dwHashesTried++;
 		}
 
-		if (dwHashesTried >= gnNumHashesUsed)
+		if (dwHashesTried >= MAX_DCC_HASH)
 		{
 			// Not found
 			Log::Print(PRIORITY_DEBUG, "DCC not freed: %s\n", name);
@@ -495,4 +641,424 @@ namespace DCC
 		nCells++;		// last cell width = sz
 		return nCells;
 	}
-}
\ No newline at end of file
+
+	//////////////////////////////////////////////////
+	//
+	//	Direction decoding
+
+	/*
+	*	How the arena gets carved up when decoding a direction
+	*/
+	struct DCCArenaLayout
+	{
+		int			nWidth, nHeight;				// Size of the direction
+		int			nCellBufferW, nCellBufferH;		// Size of the grid that tracks the last cell drawn at each spot
+		size_t		dwBitmapOffset;					// The frames come first, then the direction's bitmap...
+		size_t		dwCellBufferOffset;				// ...then the grid...
+		size_t		dwCellsOffset;					// ...and then every cell of every frame
+		size_t		dwTotalSize;
+	};
+
+	static bool GetArenaLayout(DCCFile* pFile, int nDirection, DCCArenaLayout& layout)
+	{
+		DCCDirection* pDir;
+		size_t dwNumCells = 0;
+
+		pDir = GetDirection(pFile, nDirection);
+		if (pDir == nullptr)
+		{
+			return false;
+		}
+
+		layout.nWidth = pDir->nMaxX - pDir->nMinX + 1;
+		layout.nHeight = pDir->nMaxY - pDir->nMinY + 1;
+		if (layout.nWidth <= 0 || layout.nHeight <= 0)
+		{
+			return false;
+		}
+		layout.nCellBufferW = (layout.nWidth >> 2) + 10;
+		layout.nCellBufferH = (layout.nHeight >> 2) + 10;
+
+		for (DWORD f = 0; f < pFile->header.dwFramesPerDirection; f++)
+		{
+			DCCFrame* pFrame = &pDir->frames[f];
+			int nFrameW = pFrame->dwWidth;
+			int nFrameH = pFrame->dwHeight;
+			int nFrameX = pFrame->nXOffset - pDir->nMinX;
+			int nFrameY = pFrame->nYOffset - pDir->nMinY - nFrameH + 1;
+
+			if (nFrameX < 0 || nFrameY < 0 || nFrameX + nFrameW > layout.nWidth || nFrameY + nFrameH > layout.nHeight)
+			{	// the frame doesn't fit inside of the direction (flipped frames end up like this)
+				return false;
+			}
+
+			dwNumCells += GetCellCount(nFrameX, nFrameW) * GetCellCount(nFrameY, nFrameH);
+		}
+
+		layout.dwBitmapOffset = (size_t)layout.nWidth * layout.nHeight * pFile->header.dwFramesPerDirection;
+		layout.dwCellBufferOffset = layout.dwBitmapOffset + ((size_t)layout.nWidth * layout.nHeight);
+		layout.dwCellBufferOffset = (layout.dwCellBufferOffset + sizeof(DCCCell*) - 1) & ~(sizeof(DCCCell*) - 1);
+		layout.dwCellsOffset = layout.dwCellBufferOffset +
+			(sizeof(DCCCell*) * layout.nCellBufferW * layout.nCellBufferH);
+		layout.dwTotalSize = layout.dwCellsOffset + (sizeof(DCCCell) * dwNumCells);
+		return true;
+	}
+
+	/*
+	*	Gets how big of an arena DecodeDirection needs for a direction (or 0 if it can't be decoded)
+	*	@author	eezstreet
+	*/
+	size_t GetDirectionArenaSize(DCCFile* pFile, int nDirection)
+	{
+		DCCArenaLayout layout;
+
+		if (!GetArenaLayout(pFile, nDirection, layout))
+		{
+			return 0;
+		}
+		return layout.dwTotalSize;
+	}
+
+	/*
+	*	Copies one of a direction's streams, so that it can be read without touching the direction.
+	*	The streams are all split off of the file's stream, so the copies don't own anything.
+	*/
+	static Bitstream* CopyStream(Bitstream* pSource, Bitstream& copy)
+	{
+		if (pSource == nullptr)
+		{
+			return nullptr;
+		}
+
+		copy = *pSource;
+		copy.Rewind();
+		return &copy;
+	}
+
+	/*
+	*	Decodes every frame of a direction into an arena (see GetDirectionArenaSize for how big it needs to be).
+	*	Nothing gets allocated, and the direction is only read from, so any number of threads can decode
+	*	directions (even the same one) at once.
+	*	Special thanks to SVR, Paul Siramy, Bilian Belchev and Necrolis
+	*	@author	eezstreet
+	*/
+	bool DecodeDirection(DCCFile* pFile, int nDirection, BYTE* pArena, size_t dwArenaSize, DCCDecodedDirection* pOut)
+	{
+		DCCArenaLayout layout;
+		DCCDirection* pDir;
+		DCCCell* pFrameCells[MAX_FRAMES];
+		DCCCell** ppCellBuffer;
+		DCCCell* pNextCell;
+		BYTE* pBitmap;
+		int nDirectionW, nDirectionH, nDirCellW;
+		size_t dwFrameSize;
+		int n;
+
+		Bitstream equalCellStream, pixelMaskStream, encodingTypeStream, rawPixelStream, pixelCodeStream;
+		Bitstream* pEqualCellStream;
+		Bitstream* pPixelMaskStream;
+		Bitstream* pEncodingTypeStream;
+		Bitstream* pRawPixelStream;
+		Bitstream* pPixelCodeStream;
+
+		if (pArena == nullptr || pOut == nullptr || !GetArenaLayout(pFile, nDirection, layout) ||
+			dwArenaSize < layout.dwTotalSize)
+		{
+			return false;
+		}
+
+		pDir = GetDirection(pFile, nDirection);
+		nDirectionW = layout.nWidth;
+		nDirectionH = layout.nHeight;
+		nDirCellW = layout.nCellBufferW;
+		dwFrameSize = (size_t)nDirectionW * nDirectionH;
+
+		pBitmap = pArena + layout.dwBitmapOffset;
+		ppCellBuffer = (DCCCell**)(pArena + layout.dwCellBufferOffset);
+		pNextCell = (DCCCell*)(pArena + layout.dwCellsOffset);
+
+		pEqualCellStream = CopyStream(pDir->EqualCellStream, equalCellStream);
+		pPixelMaskStream = CopyStream(pDir->PixelMaskStream, pixelMaskStream);
+		pEncodingTypeStream = CopyStream(pDir->EncodingTypeStream, encodingTypeStream);
+		pRawPixelStream = CopyStream(pDir->RawPixelStream, rawPixelStream);
+		pPixelCodeStream = CopyStream(pDir->PixelCodeDisplacementStream, pixelCodeStream);
+
+		memset(ppCellBuffer, 0, sizeof(DCCCell*) * layout.nCellBufferW * layout.nCellBufferH);
+
+		// First part: iterate through the frames and get the colors
+		for (DWORD f = 0; f < pFile->header.dwFramesPerDirection; f++)
+		{
+			DCCFrame* pFrame = &pDir->frames[f];
+
+			// Calculate the frame size, and number of cells in this frame
+			int nFrameW = pFrame->dwWidth;
+			int nFrameH = pFrame->dwHeight;
+			int nFrameX = pFrame->nXOffset - pDir->nMinX;
+			int nFrameY = pFrame->nYOffset - pDir->nMinY - nFrameH + 1;
+
+			int nNumCellsW = GetCellCount(nFrameX, nFrameW);
+			int nNumCellsH = GetCellCount(nFrameY, nFrameH);
+
+			// The cells come out of the arena, in order
+			DCCCell* pCell = pFrameCells[f] = pNextCell;
+			pNextCell += nNumCellsW * nNumCellsH;
+
+			// Process cells left -> right / top -> bottom --SVR
+			int nStartX = nFrameX >> 2;
+			int nStartY = nFrameY >> 2;
+
+			// Grab the four pixels (clrcode) color for each cell
+			for (int y = nStartY; y < (nStartY + nNumCellsH); y++)
+			{
+				for (int x = nStartX; x < (nStartX + nNumCellsW); x++)
+				{
+					DCCCell* pCurCell = pCell++;
+					DCCCell* pPrevCell = ppCellBuffer[(y * nDirCellW) + x];
+					DWORD dwCLRMask = 0xF;
+
+					*(DWORD*)(pCurCell->clrmap) = 0;
+
+					// If we have a previous cell, read the contents of the EqualCellBitstream and ColorMask
+					if (pPrevCell)
+					{
+						if (pEqualCellStream != nullptr)
+						{
+							BYTE bit = 0;
+							pEqualCellStream->ReadBits(bit, 1);
+							if (bit)
+							{	// Skip if we read a '1' bit from EqualCells
+								continue;
+							}
+						}
+						if (pPixelMaskStream != nullptr)
+						{	// read the color mask
+							pPixelMaskStream->ReadBits(&dwCLRMask, 4);
+						}
+					}
+
+					DWORD dwEncodingType = 0;
+					DWORD dwCLRCode = 0;
+					DWORD dwUnencoded = 0;
+					DWORD dwLastColor = 0;
+					DWORD dwTemp = 0;
+
+					// Mask off the appropriate colors
+					if (dwCLRMask != 0)
+					{
+						if (pEncodingTypeStream != nullptr)
+						{	// check the encoding type
+							pEncodingTypeStream->ReadBits(&dwEncodingType, 1);
+						}
+
+						for (n = 0; n < 4; n++)
+						{	// read the colors in the mask
+							if (dwCLRMask & (0x1 << n))
+							{
+								if (dwEncodingType != 0)
+								{	// if encoding is 1, read it from the raw pixel stream
+									pRawPixelStream->ReadBits(&dwCLRCode, 8);
+								}
+								else
+								{
+									// read the difference from the pixel data and add it to the color
+									do
+									{
+										pPixelCodeStream->ReadBits(&dwUnencoded, 4);
+										dwCLRCode += dwUnencoded;
+									} while (dwUnencoded == 15);
+								}
+
+								// Check to see if the same color was fetched.
+								// If so, stop decoding (it's probably transparent)
+								if (dwLastColor == dwCLRCode)
+								{
+									break;
+								}
+
+								dwTemp <<= 8;
+								dwTemp |= dwCLRCode;
+								dwLastColor = dwCLRCode;
+							}
+						}
+					}
+
+					// Merge previous colors
+					for (n = 0; n < 4; n++)
+					{
+						if (dwCLRMask & (0x1 << n))
+						{	// pop the current color bit
+							pCurCell->clrmap[n] = (BYTE)(dwTemp & 0xFF);
+							dwTemp >>= 8;
+						}
+						else
+						{	// copy the previous color
+							pCurCell->clrmap[n] = pPrevCell->clrmap[n];
+						}
+					}
+
+					ppCellBuffer[(y * nDirCellW) + x] = pCurCell;
+				}
+			}
+		}
+
+		// Second part: draw the cells onto the direction's bitmap, and copy each frame out of it.
+		// The bitmap carries over from one frame to the next, since equal cells keep whatever was there before.
+		memset(ppCellBuffer, 0, sizeof(DCCCell*) * layout.nCellBufferW * layout.nCellBufferH);
+		memset(pBitmap, 0, dwFrameSize);
+		memset(pArena, 0, dwFrameSize * pFile->header.dwFramesPerDirection);
+
+		// Rewind the equal cell stream
+		if (pEqualCellStream != nullptr)
+		{
+			pEqualCellStream->Rewind();
+		}
+
+		for (DWORD f = 0; f < pFile->header.dwFramesPerDirection; f++)
+		{
+			DCCFrame* pFrame = &pDir->frames[f];
+			BYTE* pFramePixels = pArena + (dwFrameSize * f);
+
+			// Calculate the frame size, and number of cells in this frame
+			int nFrameW = pFrame->dwWidth;
+			int nFrameH = pFrame->dwHeight;
+			int nFrameX = pFrame->nXOffset - pDir->nMinX;
+			int nFrameY = pFrame->nYOffset - pDir->nMinY - nFrameH + 1;
+
+			int nNumCellsW = GetCellCount(nFrameX, nFrameW);
+			int nNumCellsH = GetCellCount(nFrameY, nFrameH);
+
+			int nStartX = nFrameX >> 2;
+			int nStartY = nFrameY >> 2;
+
+			int nFirstColumnW = 4 - (nFrameX & 3);
+			int nFirstRowH = 4 - (nFrameY & 3);
+
+			int nCountI = nFirstRowH;	// height counter
+			int nCountJ;
+			int nYPos = 0;
+			int nXPos;
+
+			DCCCell* pCells = pFrameCells[f];
+			for (int y = nStartY; y < (nStartY + nNumCellsH); y++)
+			{
+				nXPos = 0;
+				nCountJ = nFirstColumnW;
+
+				if (y == ((nStartY + nNumCellsH) - 1))
+				{	// If it's the last row, use the last height
+					nCountI = nFrameH;
+				}
+
+				for (int x = nStartX; x < (nStartX + nNumCellsW); x++)
+				{
+					bool bTransparent = false;
+					DCCCell* pCurCell = pCells++;
+					DCCCell* pPrevCell = ppCellBuffer[(y * nDirCellW) + x];
+
+					if (x == ((nStartX + nNumCellsW) - 1))
+					{	// If it's the last column, use the last width
+						nCountJ = nFrameW;
+					}
+
+					pCurCell->nH = nCountI;
+					pCurCell->nW = nCountJ;
+					pCurCell->nX = nFrameX + nXPos;
+					pCurCell->nY = nFrameY + nYPos;
+
+					// Check for equal cell
+					if (pPrevCell && pEqualCellStream != nullptr)
+					{
+						DWORD dwEqualCell = 0;
+						pEqualCellStream->ReadBits(&dwEqualCell, 1);
+
+						if (dwEqualCell)
+						{
+							if (pPrevCell->nH == pCurCell->nH && pPrevCell->nW == pCurCell->nW)
+							{	// same sized cell = it's definitely the same
+								// check x/y - if they are not the same then we copy it
+								if (pPrevCell->nX != pCurCell->nX || pPrevCell->nY != pCurCell->nY)
+								{
+									// source and destination rectangles
+									int dY = pCurCell->nY;
+
+									for (int i = pPrevCell->nY; i < pPrevCell->nY + pPrevCell->nH; i++)
+									{
+										int dX = pCurCell->nX;
+										for (int j = pPrevCell->nX; j < pPrevCell->nX + pPrevCell->nW; j++)
+										{
+											pBitmap[(dY * nDirectionW) + dX] = pBitmap[(i * nDirectionW) + j];
+											dX++;
+										}
+										dY++;
+									}
+								}
+
+								ppCellBuffer[(y * nDirCellW) + x] = pCurCell;
+								nXPos += nCountJ;
+								nCountJ = 4;
+								continue;
+							}
+							else
+							{	// incongruent cell = it's definitely transparent
+								bTransparent = true;
+							}
+						}
+					}
+
+					for (n = 0; n < 2; n++)
+					{	// try to find a zero
+						if (!pCurCell->clrmap[n])
+						{
+							break;
+						}
+					}
+
+					// fill the cell
+					if (bTransparent || !n)
+					{	// if all of them are transparent, fill with 0s
+						for (int i = nFrameY + nYPos; i < nFrameY + nYPos + nCountI; i++)
+						{
+							memset(pBitmap + (i * nDirectionW) + nFrameX + nXPos, 0, nCountJ);
+						}
+					}
+					else
+					{
+						// Write the color pixels, a row at a time (cells are never more than 5 pixels across)
+						DWORD dwPixelCodes[5];
+
+						for (int i = 0; i < nCountI; i++)
+						{
+							BYTE* pRow = pBitmap + ((nFrameY + nYPos + i) * nDirectionW) + nFrameX + nXPos;
+
+							pPixelCodeStream->ReadBitsN(dwPixelCodes, nCountJ, n);
+							for (int j = 0; j < nCountJ; j++)
+							{
+								pRow[j] = pDir->nPixelValues[pCurCell->clrmap[dwPixelCodes[j] & 3]];
+							}
+						}
+					}
+
+					ppCellBuffer[(y * nDirCellW) + x] = pCurCell;
+					nXPos += nCountJ;
+					nCountJ = 4;
+				}
+
+				nYPos += nCountI;
+				nCountI = 4;
+			}
+
+			// Copy the frame out of the bitmap
+			for (int i = nFrameY; i < nFrameY + (int)pFrame->dwHeight; i++)
+			{
+				size_t dwRowStart = (i * nDirectionW) + nFrameX;
+				memcpy(pFramePixels + dwRowStart, pBitmap + dwRowStart, pFrame->dwWidth);
+			}
+		}
+
+		pOut->dwWidth = nDirectionW;
+		pOut->dwHeight = nDirectionH;
+		pOut->dwNumFrames = pFile->header.dwFramesPerDirection;
+		pOut->pPixels = pArena;
+		return true;
+	}
+}
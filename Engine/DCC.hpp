@@ -1,10 +1,14 @@
 #pragma once
 #include "../Shared/D2Shared.hpp"
 #include "Bitstream.hpp"
+#include "../Libraries/sdl/SDL_atomic.h"
 
 /*
  *	DCC Files
  *	Pieced together with code from Necrolis, SVR, and Paul Siramy
+ *
+ *	Only the file header gets read when a DCC is loaded. Each direction gets read the first time that it's asked for
+ *	(with DCC::GetDirection), and everything that gets read goes into an arena that belongs to the file.
  */
 #pragma pack(push,enter_include)
 #pragma pack(1)
@@ -41,6 +45,7 @@ struct DCCFrame
 };
 
 #define MAX_DCC_PIXEL_BUFFER	300000
+#define MAX_DCC_NAMELEN			32
 #define MAX_DCC_FRAMES			200
 struct DCCPixelBuffer
 {
@@ -61,7 +66,7 @@ struct DCCDirection
 	BYTE			nOptionalBytesBits;
 	BYTE			nCodedBytesBits;
 
-	DCCFrame		frames[MAX_FRAMES];
+	DCCFrame*		frames;					// dwFramesPerDirection of them
 
 	//////////////////////////////////
 	// Not actually in the file, these are calculated
@@ -76,7 +81,7 @@ struct DCCDirection
 	BYTE			nPixelValues[256];
 
 	//////////////////////////////////
-	//	Allocated when the DCC direction is created
+	//	Allocated when the DCC direction is read
 	Bitstream*		EqualCellStream;
 	Bitstream*		PixelMaskStream;
 	Bitstream*		EncodingTypeStream;
@@ -95,32 +100,56 @@ struct DCCDirection
 	}
 };
 
+// Each frame in the DCC is composed of cells.
+// Cells are (roughly) 4x4 blocks of pixels.
+// The size is flexible; sometimes you can have a 5x4, etc.
+struct DCCCell
+{
+	int nX, nY, nW, nH;
+	BYTE clrmap[4];
+};
+
+#pragma pack(pop, enter_include)
+
+// Not packed, since the direction table and the lock get used atomically
 struct DCCFile
 {
 	// Part of the file structure
 	DCCHeader		header;
-	DCCDirection	directions[MAX_DIRECTIONS];
+	DCCDirection**	ppDirections;		// nNumberDirections of them, each one nullptr until it gets read
 
 	// Other stuff used by OpenD2
 	DWORD			dwFileSize;
-	BYTE*			pFileBytes;
+	const BYTE*		pFileBytes;			// Mapped with FS::Map
+	char			szName[MAX_DCC_NAMELEN];
+	int				nUseCount;
+	SDL_SpinLock	nLock;				// Held while a direction is being read
+	struct DCCArenaBlock*	pArena;		// Everything above (including this) lives in here
+
+	// Where the file came from, so that its decoded directions can be found in the DCC cache (see DCC_Cache.cpp)
+	bool			bCacheKeyValid;
+	DWORD			dwSourceArchive;	// Hash of the archive's path, or 0 for a loose file
+	DWORD			dwSourceBlock;		// Block in the archive, or a hash of the path for a loose file
+	QWORD			qwContentHash;
 };
 
-// Each frame in the DCC is composed of cells.
-// Cells are (roughly) 4x4 blocks of pixels.
-// The size is flexible; sometimes you can have a 5x4, etc.
-struct DCCCell
+/*
+ *	The decoded, palette-indexed frames of one DCC direction.
+ *	Every frame is as big as the whole direction, with the frame itself drawn at its offset and zeros around it.
+ *	@author	eezstreet
+ */
+struct DCCDecodedDirection
 {
-	int nX, nY, nW, nH;
-	BYTE clrmap[4];
+	DWORD			dwWidth;
+	DWORD			dwHeight;
+	DWORD			dwNumFrames;
+	BYTE*			pPixels;			// dwNumFrames * dwWidth * dwHeight, inside of the arena
 };
 
-#pragma pack(pop, enter_include)
-
 // DCC.cpp
 namespace DCC
 {
-	void GlobalInit();
+	void GlobalInit(bool bUseCache);
 	void GlobalShutdown();
 	anim_handle Load(char* szPath, char* szName);
 	void IncrementUseCount(anim_handle dccHandle, int amount);
@@ -130,5 +159,8 @@ namespace DCC
 	void FreeInactive();
 	void FreeByName(char* name);
 	void FreeAll();
+	DCCDirection* GetDirection(DCCFile* pFile, int nDirection);
 	DWORD GetCellCount(int pos, int& sz);
+	size_t GetDirectionArenaSize(DCCFile* pFile, int nDirection);
+	bool DecodeDirection(DCCFile* pFile, int nDirection, BYTE* pArena, size_t dwArenaSize, DCCDecodedDirection* pOut);
 };
\ No newline at end of file
@@ -0,0 +1,858 @@
+#include "DCC_Cache.hpp"
+#include "DCC.hpp"
+#include "FileSystem.hpp"
+#include "FileSystem_MPQ.hpp"
+#include "Logging.hpp"
+#include "Platform.hpp"
+#include "Threadpool.hpp"
+#include "../Libraries/sdl/SDL_atomic.h"
+#include "../Libraries/sdl/SDL_mutex.h"
+
+/*
+ *	Decoding a DCC direction always comes out the same for the same file, but it's slow, and it used to happen again
+ *	every time that the game started and every time that a direction fell out of the renderer's LRU.
+ *	The DCC cache keeps decoded directions in the homepath instead, so they only ever have to be decoded once:
+ *	each frame is cropped down to its own size and kept as palette indices, one frame after another.
+ *
+ *	dcccache.dat holds the directions, each one on its own aligned record, so the file can be read a record at a time
+ *	or mapped as a whole. dcccache.idx says where each record is. Both files only ever get appended to.
+ *	Directions are found by where their DCC came from (archive path and block) and a hash of the DCC's contents, so
+ *	a changed or replaced archive just means decoding them again.
+ *
+ *	Run with +dcccache to turn it on, and with +dccwarm (or +dccwarm=<listfile>) to fill it up ahead of time.
+ */
+
+#define DCCCACHE_INDEX_FILE			"dcccache.idx"
+#define DCCCACHE_DATA_FILE			"dcccache.dat"
+#define DCCCACHE_INDEX_MAGIC		0x4943444F	// "ODCI"
+#define DCCCACHE_DATA_MAGIC			0x4443444F	// "ODCD"
+#define DCCCACHE_RECORD_MAGIC		0x5243444F	// "ODCR"
+#define DCCCACHE_VERSION			2			// Needs to go up whenever the decoder's output (or the key) changes
+#define DCCCACHE_ALIGNMENT			16
+#define DCCCACHE_MAX_DATA_SIZE		0x7FFFFFFF	// Offsets have to fit in a long for ftell
+#define DCCCACHE_HASH_SIZE			16384
+#define DCCCACHE_NO_ENTRY			0xFFFFFFFF
+#define DCCCACHE_PREWARM_BATCH		64
+#define DCCCACHE_DEFAULT_LISTFILE	"(listfile)"
+
+namespace DCCCache
+{
+#pragma pack(push,enter_include)
+#pragma pack(1)
+	struct FileHeader
+	{
+		DWORD	dwMagic;
+		DWORD	dwVersion;
+		DWORD	dwReserved[2];
+	};
+
+	struct CacheKey
+	{
+		DWORD	dwArchive;
+		DWORD	dwBlock;
+		DWORD	dwFileSize;
+		DWORD	dwDirection;
+		QWORD	qwContentHash;
+	};
+
+	struct IndexEntry
+	{
+		CacheKey	key;
+		DWORD		dwOffset;			// Into the data file
+		DWORD		dwSize;
+	};
+
+	// Followed by a DCCCachedFrame for each frame, and then all of the pixels
+	struct RecordHeader
+	{
+		DWORD	dwMagic;
+		DWORD	dwNumFrames;
+		DWORD	dwPixelBytes;
+		DWORD	dwReserved;
+	};
+#pragma pack(pop,enter_include)
+
+	struct CacheEntry
+	{
+		IndexEntry	entry;
+		DWORD		dwHashNext;
+	};
+
+	/*
+	 *	A batch of directions for the prewarm to decode
+	 */
+	struct PrewarmWork
+	{
+		anim_handle*	pHandles;
+		int*			pDirections;
+		SDL_atomic_t	nDecoded;
+		SDL_atomic_t	nSkipped;
+	};
+
+	static bool gbEnabled = false;
+	static SDL_mutex* gpCacheMutex = nullptr;
+	static FILE* gpIndexFile = nullptr;			// Appended to
+	static FILE* gpDataFile = nullptr;			// Appended to
+	static FILE* gpDataReadFile = nullptr;		// Read with Sys::ReadAt
+	static DWORD gdwDataSize = 0;
+
+	static CacheEntry* gpEntries = nullptr;
+	static DWORD gdwNumEntries = 0;
+	static DWORD gdwMaxEntries = 0;
+	static DWORD gdwHashTable[DCCCACHE_HASH_SIZE];
+
+	static SDL_atomic_t gnHits{ 0 };
+	static SDL_atomic_t gnMisses{ 0 };
+	static SDL_atomic_t gnStores{ 0 };
+
+	/*
+	 *	Hashes the contents of a file, a word at a time. This only needs to tell versions of the same file apart.
+	 */
+	static QWORD HashContents(const BYTE* pData, size_t dwSize)
+	{
+		QWORD qwHash = 0xCBF29CE484222325ULL ^ dwSize;
+		size_t i;
+
+		for (i = 0; i + sizeof(QWORD) <= dwSize; i += sizeof(QWORD))
+		{
+			QWORD qwWord;
+
+			memcpy(&qwWord, pData + i, sizeof(QWORD));
+			qwHash = (qwHash ^ qwWord) * 0x100000001B3ULL;
+			qwHash ^= qwHash >> 29;
+		}
+
+		for (; i < dwSize; i++)
+		{
+			qwHash = (qwHash ^ pData[i]) * 0x100000001B3ULL;
+		}
+
+		return qwHash;
+	}
+
+	/*
+	 *	Hash a key into the table
+	 */
+	static DWORD HashKey(const CacheKey* pKey)
+	{
+		DWORD dwHash = (pKey->dwArchive * 31) + pKey->dwBlock;
+
+		dwHash = (dwHash * 31) + pKey->dwDirection;
+		dwHash ^= (DWORD)pKey->qwContentHash;
+		return dwHash % DCCCACHE_HASH_SIZE;
+	}
+
+	/*
+	 *	Builds the key for one direction of a file
+	 */
+	static bool MakeKey(DCCFile* pFile, int nDirection, CacheKey* pKey)
+	{
+		if (!gbEnabled || pFile == nullptr || !pFile->bCacheKeyValid)
+		{
+			return false;
+		}
+
+		memset(pKey, 0, sizeof(CacheKey));
+		pKey->dwArchive = pFile->dwSourceArchive;
+		pKey->dwBlock = pFile->dwSourceBlock;
+		pKey->dwFileSize = pFile->dwFileSize;
+		pKey->dwDirection = nDirection;
+		pKey->qwContentHash = pFile->qwContentHash;
+		return true;
+	}
+
+	/*
+	 *	Find an entry in the table. The cache mutex must be held.
+	 */
+	static CacheEntry* FindEntry(const CacheKey* pKey)
+	{
+		DWORD dwEntry = gdwHashTable[HashKey(pKey)];
+
+		while (dwEntry != DCCCACHE_NO_ENTRY)
+		{
+			if (!memcmp(&gpEntries[dwEntry].entry.key, pKey, sizeof(CacheKey)))
+			{
+				return &gpEntries[dwEntry];
+			}
+			dwEntry = gpEntries[dwEntry].dwHashNext;
+		}
+		return nullptr;
+	}
+
+	/*
+	 *	Adds an entry to the table, or points an existing one somewhere new. The cache mutex must be held.
+	 */
+	static void AddEntry(const IndexEntry* pIndexEntry)
+	{
+		CacheEntry* pEntry = FindEntry(&pIndexEntry->key);
+		DWORD dwHash;
+
+		if (pEntry != nullptr)
+		{	// newer records win
+			pEntry->entry = *pIndexEntry;
+			return;
+		}
+
+		if (gdwNumEntries >= gdwMaxEntries)
+		{
+			DWORD dwNewMax = gdwMaxEntries ? gdwMaxEntries * 2 : 1024;
+			CacheEntry* pNewEntries = (CacheEntry*)realloc(gpEntries, sizeof(CacheEntry) * dwNewMax);
+
+			if (pNewEntries == nullptr)
+			{
+				return;
+			}
+
+			gpEntries = pNewEntries;
+			gdwMaxEntries = dwNewMax;
+		}
+
+		dwHash = HashKey(&pIndexEntry->key);
+		pEntry = &gpEntries[gdwNumEntries];
+		pEntry->entry = *pIndexEntry;
+		pEntry->dwHashNext = gdwHashTable[dwHash];
+		gdwHashTable[dwHash] = gdwNumEntries;
+		gdwNumEntries++;
+	}
+
+	/*
+	 *	Finds one of the cache files, making an empty one in the homepath if it isn't anywhere yet.
+	 *	@return	true if the file is there, and it's the right kind of file for this version of the cache
+	 */
+	static bool FindCacheFile(const char* szFileName, DWORD dwMagic, char* szPath)
+	{
+		char szName[MAX_D2PATH]{ 0 };
+		FileHeader header;
+		FILE* pFile;
+		bool bValid;
+
+		D2Lib::strncpyz(szName, szFileName, MAX_D2PATH);
+		if (!FS::Find(szName, szPath, MAX_D2PATH_ABSOLUTE))
+		{
+			fs_handle f;
+
+			FS::Open(szFileName, &f, FS_WRITE, true);
+			if (f == INVALID_HANDLE)
+			{
+				return false;
+			}
+			FS::CloseFile(f);
+
+			D2Lib::strncpyz(szName, szFileName, MAX_D2PATH);
+			if (!FS::Find(szName, szPath, MAX_D2PATH_ABSOLUTE))
+			{
+				return false;
+			}
+		}
+
+		pFile = fopen(szPath, "rb");
+		if (pFile == nullptr)
+		{
+			return false;
+		}
+
+		bValid = fread(&header, sizeof(header), 1, pFile) == 1 &&
+			header.dwMagic == dwMagic && header.dwVersion == DCCCACHE_VERSION;
+		fclose(pFile);
+		return bValid;
+	}
+
+	/*
+	 *	Throws out whatever is in a cache file, and starts it over
+	 */
+	static bool ResetCacheFile(const char* szPath, DWORD dwMagic)
+	{
+		FileHeader header;
+		FILE* pFile = fopen(szPath, "wb");
+		bool bWritten;
+
+		if (pFile == nullptr)
+		{
+			return false;
+		}
+
+		memset(&header, 0, sizeof(header));
+		header.dwMagic = dwMagic;
+		header.dwVersion = DCCCACHE_VERSION;
+		bWritten = fwrite(&header, sizeof(header), 1, pFile) == 1;
+		fclose(pFile);
+		return bWritten;
+	}
+
+	/*
+	 *	Reads every entry out of the index file, skipping over any that point past the end of the data
+	 */
+	static void LoadIndex(const char* szIndexPath)
+	{
+		size_t dwSize = 0;
+		const BYTE* pData = (const BYTE*)Sys::MapFile(szIndexPath, &dwSize);
+		const IndexEntry* pEntries;
+		DWORD dwNumEntries;
+
+		if (pData == nullptr || dwSize < sizeof(FileHeader))
+		{
+			Sys::UnmapFile((void*)pData, dwSize);
+			return;
+		}
+
+		pEntries = (const IndexEntry*)(pData + sizeof(FileHeader));
+		dwNumEntries = (DWORD)((dwSize - sizeof(FileHeader)) / sizeof(IndexEntry));
+		for (DWORD i = 0; i < dwNumEntries; i++)
+		{
+			if (pEntries[i].dwSize < sizeof(RecordHeader) || pEntries[i].dwOffset < sizeof(FileHeader) ||
+				pEntries[i].dwOffset > gdwDataSize || pEntries[i].dwSize > gdwDataSize - pEntries[i].dwOffset)
+			{	// the data never made it to the disk
+				continue;
+			}
+			AddEntry(&pEntries[i]);
+		}
+
+		Sys::UnmapFile((void*)pData, dwSize);
+	}
+
+	/*
+	 *	Opens the cache, if it's turned on.
+	 *	Needs to happen after the filesystem is up.
+	 *	@author	eezstreet
+	 */
+	void Init(bool bEnabled)
+	{
+		char szIndexPath[MAX_D2PATH_ABSOLUTE]{ 0 };
+		char szDataPath[MAX_D2PATH_ABSOLUTE]{ 0 };
+		bool bIndexValid, bDataValid;
+		long lDataSize;
+
+		if (!bEnabled || gbEnabled)
+		{
+			return;
+		}
+
+		for (int i = 0; i < DCCCACHE_HASH_SIZE; i++)
+		{
+			gdwHashTable[i] = DCCCACHE_NO_ENTRY;
+		}
+
+		bIndexValid = FindCacheFile(DCCCACHE_INDEX_FILE, DCCCACHE_INDEX_MAGIC, szIndexPath);
+		bDataValid = FindCacheFile(DCCCACHE_DATA_FILE, DCCCACHE_DATA_MAGIC, szDataPath);
+		if (szIndexPath[0] == '\0' || szDataPath[0] == '\0')
+		{
+			Log::Print(PRIORITY_MESSAGE, "Couldn't make the DCC cache in the homepath; it won't be used");
+			return;
+		}
+
+		if (!bIndexValid || !bDataValid)
+		{	// Out of date (or broken), so the two files can't be trusted to agree with each other
+			if (!ResetCacheFile(szIndexPath, DCCCACHE_INDEX_MAGIC) || !ResetCacheFile(szDataPath, DCCCACHE_DATA_MAGIC))
+			{
+				return;
+			}
+		}
+
+		gpDataFile = fopen(szDataPath, "ab");
+		gpDataReadFile = fopen(szDataPath, "rb");
+		if (gpDataFile == nullptr || gpDataReadFile == nullptr)
+		{
+			Shutdown();
+			return;
+		}
+
+		fseek(gpDataFile, 0, SEEK_END);
+		lDataSize = ftell(gpDataFile);
+		gdwDataSize = lDataSize > 0 ? (DWORD)lDataSize : 0;
+
+		LoadIndex(szIndexPath);
+
+		gpIndexFile = fopen(szIndexPath, "ab");
+		if (gpIndexFile == nullptr)
+		{
+			Shutdown();
+			return;
+		}
+
+		gpCacheMutex = SDL_CreateMutex();
+		SDL_AtomicSet(&gnHits, 0);
+		SDL_AtomicSet(&gnMisses, 0);
+		SDL_AtomicSet(&gnStores, 0);
+		gbEnabled = true;
+		Log::Print(PRIORITY_MESSAGE, "DCC cache has %u directions (%u KB)", gdwNumEntries, gdwDataSize / 1024);
+	}
+
+	/*
+	 *	Closes the cache.
+	 *	Nothing can be decoding DCCs while this happens.
+	 *	@author	eezstreet
+	 */
+	void Shutdown()
+	{
+		if (gbEnabled)
+		{
+			Log::Print(PRIORITY_MESSAGE, "DCC cache: %i hits, %i misses, %i directions stored",
+				SDL_AtomicGet(&gnHits), SDL_AtomicGet(&gnMisses), SDL_AtomicGet(&gnStores));
+		}
+
+		gbEnabled = false;
+
+		if (gpIndexFile != nullptr)
+		{
+			fclose(gpIndexFile);
+			gpIndexFile = nullptr;
+		}
+
+		if (gpDataFile != nullptr)
+		{
+			fclose(gpDataFile);
+			gpDataFile = nullptr;
+		}
+
+		if (gpDataReadFile != nullptr)
+		{
+			fclose(gpDataReadFile);
+			gpDataReadFile = nullptr;
+		}
+
+		if (gpCacheMutex != nullptr)
+		{
+			SDL_DestroyMutex(gpCacheMutex);
+			gpCacheMutex = nullptr;
+		}
+
+		free(gpEntries);
+		gpEntries = nullptr;
+		gdwNumEntries = gdwMaxEntries = 0;
+		gdwDataSize = 0;
+	}
+
+	/*
+	 *	Whether or not the cache is being used
+	 *	@author	eezstreet
+	 */
+	bool IsEnabled()
+	{
+		return gbEnabled;
+	}
+
+	/*
+	 *	Works out where a freshly loaded DCC came from, so that its directions can be looked up later.
+	 *	@author	eezstreet
+	 */
+	void IdentifyFile(DCCFile* pFile, const char* szPath)
+	{
+		D2MPQArchive* pArchive;
+		fs_handle fBlock;
+
+		if (!gbEnabled || pFile == nullptr)
+		{
+			return;
+		}
+
+		if (FS::Locate(szPath, &pArchive, &fBlock))
+		{
+			// (by path, since several archives can share a name)
+			const char* szArchivePath = FSMPQ::GetArchivePath(pArchive);
+
+			pFile->dwSourceArchive = szArchivePath != nullptr ? D2Lib::strhash(szArchivePath, 0, 0xFFFFFFFF) + 1 : 0;
+			pFile->dwSourceBlock = fBlock;
+		}
+		else
+		{
+			pFile->dwSourceArchive = 0;
+			pFile->dwSourceBlock = D2Lib::strhash(szPath, 0, 0xFFFFFFFF);
+		}
+
+		pFile->qwContentHash = HashContents(pFile->pFileBytes, pFile->dwFileSize);
+		pFile->bCacheKeyValid = true;
+	}
+
+	/*
+	 *	Reads a direction out of the cache, with a single read.
+	 *	The frames are checked against the DCC's own frame headers before any of them get handed out.
+	 *	@return	false if the direction isn't in the cache
+	 *	@author	eezstreet
+	 */
+	bool LoadDirection(DCCFile* pFile, int nDirection, DCCCachedDirection* pOut)
+	{
+		DCCDirection* pDir;
+		CacheKey key;
+		CacheEntry* pEntry;
+		IndexEntry entry;
+		RecordHeader* pHeader;
+		BYTE* pRecord;
+		size_t dwFramesEnd;
+
+		memset(pOut, 0, sizeof(DCCCachedDirection));
+
+		if (!MakeKey(pFile, nDirection, &key))
+		{
+			return false;
+		}
+
+		SDL_LockMutex(gpCacheMutex);
+		pEntry = FindEntry(&key);
+		if (pEntry != nullptr)
+		{
+			entry = pEntry->entry;
+		}
+		SDL_UnlockMutex(gpCacheMutex);
+
+		pDir = DCC::GetDirection(pFile, nDirection);
+		if (pEntry == nullptr || pDir == nullptr)
+		{
+			SDL_AtomicAdd(&gnMisses, 1);
+			return false;
+		}
+
+		pRecord = (BYTE*)malloc(entry.dwSize);
+		if (pRecord == nullptr)
+		{
+			return false;
+		}
+
+		if (Sys::ReadAt(gpDataReadFile, entry.dwOffset, pRecord, entry.dwSize) != entry.dwSize)
+		{
+			free(pRecord);
+			SDL_AtomicAdd(&gnMisses, 1);
+			return false;
+		}
+
+		pHeader = (RecordHeader*)pRecord;
+		dwFramesEnd = sizeof(RecordHeader) + (sizeof(DCCCachedFrame) * pFile->header.dwFramesPerDirection);
+		if (pHeader->dwMagic != DCCCACHE_RECORD_MAGIC || pHeader->dwNumFrames != pFile->header.dwFramesPerDirection ||
+			dwFramesEnd > entry.dwSize || pHeader->dwPixelBytes > entry.dwSize - dwFramesEnd)
+		{
+			free(pRecord);
+			SDL_AtomicAdd(&gnMisses, 1);
+			return false;
+		}
+
+		pOut->dwNumFrames = pHeader->dwNumFrames;
+		pOut->pFrames = (DCCCachedFrame*)(pRecord + sizeof(RecordHeader));
+		pOut->pPixels = pRecord + dwFramesEnd;
+		pOut->pRecord = pRecord;
+
+		for (DWORD f = 0; f < pOut->dwNumFrames; f++)
+		{
+			DCCCachedFrame* pFrame = &pOut->pFrames[f];
+
+			if (pFrame->dwWidth != pDir->frames[f].dwWidth || pFrame->dwHeight != pDir->frames[f].dwHeight ||
+				pFrame->dwPixelOffset > pHeader->dwPixelBytes ||
+				(size_t)pFrame->dwWidth * pFrame->dwHeight > pHeader->dwPixelBytes - pFrame->dwPixelOffset)
+			{	// not the file that we think it is
+				FreeDirection(pOut);
+				SDL_AtomicAdd(&gnMisses, 1);
+				return false;
+			}
+		}
+
+		SDL_AtomicAdd(&gnHits, 1);
+		return true;
+	}
+
+	/*
+	 *	Frees a direction that came out of LoadDirection
+	 *	@author	eezstreet
+	 */
+	void FreeDirection(DCCCachedDirection* pCached)
+	{
+		free(pCached->pRecord);
+		memset(pCached, 0, sizeof(DCCCachedDirection));
+	}
+
+	/*
+	 *	Crops the frames out of a decoded direction, and adds them to the end of the cache.
+	 *	Does nothing if the cache is off, or if the direction is in there already.
+	 *	@author	eezstreet
+	 */
+	void StoreDirection(DCCFile* pFile, int nDirection, DCCDecodedDirection* pDecoded)
+	{
+		static const BYTE padding[DCCCACHE_ALIGNMENT]{ 0 };
+		DCCDirection* pDir;
+		CacheKey key;
+		RecordHeader* pHeader;
+		DCCCachedFrame* pFrames;
+		IndexEntry entry;
+		BYTE* pRecord;
+		BYTE* pPixels;
+		size_t dwPixelBytes = 0;
+		size_t dwRecordSize, dwPadding;
+		bool bWritten;
+
+		pDir = DCC::GetDirection(pFile, nDirection);
+		if (!MakeKey(pFile, nDirection, &key) || pDir == nullptr || pDecoded->dwNumFrames != pFile->header.dwFramesPerDirection)
+		{
+			return;
+		}
+
+		for (DWORD f = 0; f < pDecoded->dwNumFrames; f++)
+		{
+			dwPixelBytes += (size_t)pDir->frames[f].dwWidth * pDir->frames[f].dwHeight;
+		}
+
+		dwRecordSize = sizeof(RecordHeader) + (sizeof(DCCCachedFrame) * pDecoded->dwNumFrames) + dwPixelBytes;
+		pRecord = (BYTE*)malloc(dwRecordSize);
+		if (pRecord == nullptr)
+		{
+			return;
+		}
+
+		pHeader = (RecordHeader*)pRecord;
+		pHeader->dwMagic = DCCCACHE_RECORD_MAGIC;
+		pHeader->dwNumFrames = pDecoded->dwNumFrames;
+		pHeader->dwPixelBytes = (DWORD)dwPixelBytes;
+		pHeader->dwReserved = 0;
+		pFrames = (DCCCachedFrame*)(pRecord + sizeof(RecordHeader));
+		pPixels = (BYTE*)(pFrames + pDecoded->dwNumFrames);
+
+		// Crop each frame out of the direction's bounding box (the same way that the decoder placed it there)
+		dwPixelBytes = 0;
+		for (DWORD f = 0; f < pDecoded->dwNumFrames; f++)
+		{
+			DCCFrame* pFrame = &pDir->frames[f];
+			int nFrameX = pFrame->nXOffset - pDir->nMinX;
+			int nFrameY = pFrame->nYOffset - pDir->nMinY - (int)pFrame->dwHeight + 1;
+			BYTE* pSrc = pDecoded->pPixels + ((size_t)pDecoded->dwWidth * pDecoded->dwHeight * f) +
+				((size_t)nFrameY * pDecoded->dwWidth) + nFrameX;
+
+			pFrames[f].dwWidth = pFrame->dwWidth;
+			pFrames[f].dwHeight = pFrame->dwHeight;
+			pFrames[f].dwPixelOffset = (DWORD)dwPixelBytes;
+
+			for (DWORD y = 0; y < pFrame->dwHeight; y++)
+			{
+				memcpy(pPixels + dwPixelBytes, pSrc, pFrame->dwWidth);
+				dwPixelBytes += pFrame->dwWidth;
+				pSrc += pDecoded->dwWidth;
+			}
+		}
+
+		SDL_LockMutex(gpCacheMutex);
+		dwPadding = (DCCCACHE_ALIGNMENT - (gdwDataSize % DCCCACHE_ALIGNMENT)) % DCCCACHE_ALIGNMENT;
+		if (FindEntry(&key) != nullptr || (size_t)gdwDataSize + dwPadding + dwRecordSize > DCCCACHE_MAX_DATA_SIZE)
+		{	// somebody beat us to it, or the cache is full
+			SDL_UnlockMutex(gpCacheMutex);
+			free(pRecord);
+			return;
+		}
+
+		// The record has to be on the disk before the index points at it
+		bWritten = fwrite(padding, 1, dwPadding, gpDataFile) == dwPadding &&
+			fwrite(pRecord, dwRecordSize, 1, gpDataFile) == 1 && fflush(gpDataFile) == 0;
+		if (!bWritten)
+		{	// don't know how much made it out, so stop writing
+			gdwDataSize = DCCCACHE_MAX_DATA_SIZE;
+			SDL_UnlockMutex(gpCacheMutex);
+			free(pRecord);
+			Log::Print(PRIORITY_MESSAGE, "Couldn't write to the DCC cache; no more directions will be stored");
+			return;
+		}
+
+		entry.key = key;
+		entry.dwOffset = gdwDataSize + (DWORD)dwPadding;
+		entry.dwSize = (DWORD)dwRecordSize;
+		gdwDataSize = entry.dwOffset + entry.dwSize;
+
+		fwrite(&entry, sizeof(entry), 1, gpIndexFile);
+		fflush(gpIndexFile);
+		AddEntry(&entry);
+		SDL_UnlockMutex(gpCacheMutex);
+
+		free(pRecord);
+		SDL_AtomicAdd(&gnStores, 1);
+	}
+
+	/*
+	 *	Decodes and stores some of the directions in a prewarm batch
+	 */
+	static void PrewarmDirections(int nStart, int nEnd, void* pData)
+	{
+		PrewarmWork* pWork = (PrewarmWork*)pData;
+
+		for (int i = nStart; i < nEnd; i++)
+		{
+			DCCFile* pFile = DCC::GetContents(pWork->pHandles[i]);
+			int nDirection = pWork->pDirections[i];
+			DCCDecodedDirection decoded;
+			CacheKey key;
+			bool bCached;
+			size_t dwArenaSize;
+			BYTE* pArena;
+
+			if (!MakeKey(pFile, nDirection, &key))
+			{
+				continue;
+			}
+
+			SDL_LockMutex(gpCacheMutex);
+			bCached = FindEntry(&key) != nullptr;
+			SDL_UnlockMutex(gpCacheMutex);
+
+			if (bCached)
+			{
+				SDL_AtomicAdd(&pWork->nSkipped, 1);
+				continue;
+			}
+
+			dwArenaSize = DCC::GetDirectionArenaSize(pFile, nDirection);
+			if (dwArenaSize == 0)
+			{
+				continue;
+			}
+
+			pArena = (BYTE*)malloc(dwArenaSize);
+			if (pArena != nullptr && DCC::DecodeDirection(pFile, nDirection, pArena, dwArenaSize, &decoded))
+			{
+				StoreDirection(pFile, nDirection, &decoded);
+				SDL_AtomicAdd(&pWork->nDecoded, 1);
+			}
+			free(pArena);
+		}
+	}
+
+	/*
+	 *	Whether or not a listfile entry is a DCC that should be prewarmed
+	 */
+	static bool IsPrewarmPath(const char* szPath)
+	{
+		static const char* szPrefixes[] = {
+			"data\\global\\chars\\",
+			"data\\global\\monsters\\",
+		};
+		size_t dwLen = strlen(szPath);
+
+		if (dwLen < 4 || D2Lib::stricmp(szPath + dwLen - 4, ".dcc"))
+		{
+			return false;
+		}
+
+		for (size_t i = 0; i < sizeof(szPrefixes) / sizeof(szPrefixes[0]); i++)
+		{
+			if (!D2Lib::stricmpn(szPath, szPrefixes[i], strlen(szPrefixes[i])))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/*
+	 *	Decodes every direction of every character and monster DCC into the cache, ahead of time.
+	 *	The DCCs come from a listfile (one path per line) - either a loose one, or the (listfile) in the MPQs.
+	 *	DCCs get loaded on this thread in batches, and their directions get decoded on the threadpool.
+	 *	@author	eezstreet
+	 */
+	void Prewarm(const char* szListFile)
+	{
+		const char* pListView;
+		char* pList;
+		char* pLine;
+		size_t dwListSize = 0;
+		anim_handle handles[DCCCACHE_PREWARM_BATCH];
+		anim_handle workHandles[DCCCACHE_PREWARM_BATCH * MAX_DIRECTIONS];
+		int workDirections[DCCCACHE_PREWARM_BATCH * MAX_DIRECTIONS];
+		PrewarmWork work;
+		int nNumHandles = 0;
+		DWORD dwNumFiles = 0;
+		DWORD dwStartTicks = SDL_GetTicks();
+
+		if (!gbEnabled)
+		{
+			Log::Print(PRIORITY_MESSAGE, "The DCC cache couldn't be opened, so there's nothing to prewarm");
+			return;
+		}
+
+		if (szListFile == nullptr || szListFile[0] == '\0')
+		{
+			szListFile = DCCCACHE_DEFAULT_LISTFILE;
+		}
+
+		pListView = (const char*)FS::Map(szListFile, &dwListSize);
+		if (pListView == nullptr)
+		{
+			Log::Print(PRIORITY_MESSAGE, "Couldn't find the listfile %s to prewarm the DCC cache with", szListFile);
+			return;
+		}
+
+		// Make our own copy of the list to chop up into lines
+		pList = (char*)malloc(dwListSize + 1);
+		Log_ErrorAssertVoidReturn(pList != nullptr);
+		memcpy(pList, pListView, dwListSize);
+		pList[dwListSize] = '\0';
+		FS::Unmap(pListView);
+
+		work.pHandles = workHandles;
+		work.pDirections = workDirections;
+		SDL_AtomicSet(&work.nDecoded, 0);
+		SDL_AtomicSet(&work.nSkipped, 0);
+
+		pLine = pList;
+		while (pLine != nullptr)
+		{
+			char* pNextLine = strpbrk(pLine, "\r\n;");
+			char szName[MAX_DCC_NAMELEN]{ 0 };
+			char* pBaseName;
+			char* pExtension;
+			anim_handle handle;
+
+			if (pNextLine != nullptr)
+			{
+				*pNextLine++ = '\0';
+			}
+
+			for (char* p = pLine; *p != '\0'; p++)
+			{
+				if (*p == '/')
+				{
+					*p = '\\';
+				}
+			}
+
+			if (IsPrewarmPath(pLine))
+			{
+				pBaseName = strrchr(pLine, '\\') + 1;
+				pExtension = strrchr(pBaseName, '.');
+				D2Lib::strncpyz(szName, pBaseName, D2Lib::min<size_t>(pExtension - pBaseName + 1, MAX_DCC_NAMELEN));
+
+				handle = DCC::Load(pLine, szName);
+				if (handle != INVALID_HANDLE)
+				{
+					handles[nNumHandles++] = handle;
+					dwNumFiles++;
+				}
+			}
+
+			if (nNumHandles > 0 && (nNumHandles == DCCCACHE_PREWARM_BATCH || pNextLine == nullptr))
+			{	// Decode this batch, and then let go of it
+				int nNumWork = 0;
+
+				for (int i = 0; i < nNumHandles; i++)
+				{
+					DCCFile* pFile = DCC::GetContents(handles[i]);
+
+					for (int d = 0; pFile != nullptr && d < pFile->header.nNumberDirections; d++)
+					{
+						workHandles[nNumWork] = handles[i];
+						workDirections[nNumWork] = d;
+						nNumWork++;
+					}
+				}
+
+				Threadpool::ParallelFor(0, nNumWork, 1, PrewarmDirections, &work);
+
+				for (int i = 0; i < nNumHandles; i++)
+				{
+					DCC::FreeHandle(handles[i]);
+				}
+				nNumHandles = 0;
+
+				Log::Print(PRIORITY_MESSAGE, "DCC cache prewarm: %u files, %i directions decoded, %i already cached",
+					dwNumFiles, SDL_AtomicGet(&work.nDecoded), SDL_AtomicGet(&work.nSkipped));
+			}
+
+			pLine = pNextLine;
+		}
+
+		free(pList);
+
+		Log::Print(PRIORITY_MESSAGE, "DCC cache prewarm finished in %u ms: %u files, %i directions decoded, %i already cached",
+			SDL_GetTicks() - dwStartTicks, dwNumFiles, SDL_AtomicGet(&work.nDecoded), SDL_AtomicGet(&work.nSkipped));
+	}
+}
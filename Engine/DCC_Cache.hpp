@@ -0,0 +1,41 @@
+#pragma once
+#include "../Shared/D2Shared.hpp"
+
+struct DCCFile;
+struct DCCDecodedDirection;
+
+/*
+ *	Where a frame's pixels are in a cached direction.
+ *	Frames are cropped down to their own size (the one in their frame header), and are stored one after another.
+ */
+struct DCCCachedFrame
+{
+	DWORD			dwWidth;
+	DWORD			dwHeight;
+	DWORD			dwPixelOffset;		// From pPixels
+};
+
+/*
+ *	A direction that came out of the DCC cache. Free it with DCCCache::FreeDirection.
+ *	@author	eezstreet
+ */
+struct DCCCachedDirection
+{
+	DWORD			dwNumFrames;
+	DCCCachedFrame*	pFrames;
+	BYTE*			pPixels;
+	BYTE*			pRecord;			// Everything above points into this
+};
+
+// DCC_Cache.cpp
+namespace DCCCache
+{
+	void Init(bool bEnabled);
+	void Shutdown();
+	bool IsEnabled();
+	void IdentifyFile(DCCFile* pFile, const char* szPath);
+	bool LoadDirection(DCCFile* pFile, int nDirection, DCCCachedDirection* pOut);
+	void FreeDirection(DCCCachedDirection* pCached);
+	void StoreDirection(DCCFile* pFile, int nDirection, DCCDecodedDirection* pDecoded);
+	void Prewarm(const char* szListFile);
+}
@@ -1,6 +1,9 @@
 #include "DT1.hpp"
 #include "FileSystem.hpp"
 #include "Logging.hpp"
+#include "Threadpool.hpp"
+
+#define DT1_DECODE_BATCH	32		// Tiles that get decoded at once
 
 namespace DT1
 {
@@ -28,19 +31,21 @@ namespace DT1
 			return;
 		}
 
-		fs_handle f;
-		DWORD fileSize = FS::Open(fileName, &f, FS_READ, true);
-		file->fileBytes = (BYTE*)malloc(fileSize);
+		size_t fileSize;
+		file->fileBytes = (const BYTE*)FS::Map(fileName, &fileSize);
+		Log_WarnAssertVoidReturn(file->fileBytes != nullptr);
 
-		FS::Read(f, file->fileBytes, fileSize);
 		memcpy(&file->header, file->fileBytes, sizeof(file->header));
 
-		FS::CloseFile(f);
-
-		file->tileHeaders = (DT1TileHeader*)(file->fileBytes + file->header.dwTileHeaderOffset);
+		// The tile headers get block numbers written into them, so those need their own copy;
+		// everything else is read straight out of the mapped file.
+		file->tileHeaders = (DT1TileHeader*)malloc(sizeof(DT1TileHeader) * file->header.dwNumTiles);
+		Log_ErrorAssertVoidReturn(file->tileHeaders != nullptr);
+		memcpy(file->tileHeaders, file->fileBytes + file->header.dwTileHeaderOffset,
+			sizeof(DT1TileHeader) * file->header.dwNumTiles);
 		DWORD numBlocks = 0;
 
-		file->blockHeaders = (DT1BlockHeader*)(file->fileBytes + (file->header.dwTileHeaderOffset * sizeof(DT1TileHeader)));
+		file->blockHeaders = (const DT1BlockHeader*)(file->fileBytes + (file->header.dwTileHeaderOffset * sizeof(DT1TileHeader)));
 		for (int i = 0; i < file->header.dwNumTiles; i++)
 		{
 			file->tileHeaders[i].dwBlockNumber = numBlocks;
@@ -55,9 +60,108 @@ namespace DT1
 			return;
 		}
 
-		free(file->fileBytes);
+		free(file->tileHeaders);
+		FS::Unmap(file->fileBytes);
+		file->tileHeaders = nullptr;
+		file->fileBytes = nullptr;
+	}
+
+	/*
+	 *	Decodes the blocks of a single tile into a buffer that's gGlobalDecodeBufferWidth pixels wide
+	 */
+	static void DecodeTile(DT1File* file, DT1TileHeader* tileHeader, BYTE* pBuffer)
+	{
+		memset(pBuffer, 0, gGlobalDecodeBufferWidth * gGlobalDecodeBufferHeight);
+
+		for (uint32_t j = 0; j < tileHeader->dwNumBlocks; j++)
+		{	// iterate through all blocks
+			uint32_t blockIndex = j + tileHeader->dwBlockNumber;
+			const DT1BlockHeader* block = &file->blockHeaders[blockIndex];
+			const BYTE* inputBuffer = file->fileBytes + tileHeader->dwBlockHeaderOffset + block->fileOffset;
+			DWORD length = block->encodingLength;
+			int x = 0, y = 0;
+
+			if (block->encodingFormat == 1)
+			{
+				// 3D-isometric floor block (RAW format, no transparency) -- Paul Siramy
+				Log_WarnAssertVoidReturn(length == 256);
+
+				int n;
+				int xjump[15] = { 14, 12, 10,  8,  6,  4,  2,  0,  2,  4,  6,  8, 10, 12, 14 };
+				int nbpix[15] = {  4,  8, 12, 16, 20, 24, 28, 32, 28, 24, 20, 16, 12,  8,  4 };
+				
+
+				while (length > 0)
+				{
+					x = xjump[y];
+					n = nbpix[y];
+					length -= n;
+					while (n)
+					{
+						pBuffer[x + (y * gGlobalDecodeBufferWidth)] = *inputBuffer;
+						inputBuffer++;
+						x++;
+						n--;
+					}
+					y++;
+				}
+			}
+			else
+			{
+				// RLE format, 32x32 pixels -- Paul Siramy
+				while (length > 0)
+				{
+					BYTE b1, b2;
+					b1 = *inputBuffer;
+					b2 = *(inputBuffer + 1);
+					inputBuffer += 2;
+					length -= 2;
+					if (b1 || b2)
+					{
+						x += b1;
+						length -= b2;
+						while (b2)
+						{
+							pBuffer[x + (y * gGlobalDecodeBufferWidth)] = *inputBuffer;
+							inputBuffer++;
+							x++;
+							b2--;
+						}
+					}
+					else
+					{
+						x = 0;
+						y++;
+					}
+				}
+			}
+		}
+	}
+
+	/*
+	 *	Shared state for decoding a batch of tiles on the threadpool
+	 */
+	struct DT1DecodeBatch
+	{
+		DT1File*	file;
+		int32_t		firstTile;
+	};
+
+	static void DecodeTiles(int nStart, int nEnd, void* pData)
+	{
+		DT1DecodeBatch* batch = (DT1DecodeBatch*)pData;
+		DWORD dwTileSize = gGlobalDecodeBufferWidth * gGlobalDecodeBufferHeight;
+
+		for (int i = nStart; i < nEnd; i++)
+		{
+			DecodeTile(batch->file, &batch->file->tileHeaders[batch->firstTile + i], gGlobalDecodeBuffer + (i * dwTileSize));
+		}
 	}
 
+	/*
+	 *	Decodes a range of tiles, and hands each one to the callback in order.
+	 *	The tiles get decoded in batches on the threadpool; the callback always gets called on this thread.
+	 */
 	void DecodeDT1(DT1File* file, int32_t startTile, int32_t endTile, TileDecodeCallback callback)
 	{
 		if (!file)
@@ -77,7 +181,6 @@ namespace DT1
 			startTile = swap;
 		}
 
-		BYTE* allocatedPixels;
 		uint32_t largestWidth = 0, largestHeight = 0;
 		for (int32_t i = startTile; i <= endTile; i++)
 		{
@@ -100,84 +203,27 @@ namespace DT1
 				free(gGlobalDecodeBuffer);
 			}
 			
-			gGlobalDecodeBuffer = (BYTE*)malloc(gGlobalDecodeBufferWidth * gGlobalDecodeBufferHeight);
+			// one tile's worth of space for every tile in a batch
+			gGlobalDecodeBuffer = (BYTE*)malloc(gGlobalDecodeBufferWidth * gGlobalDecodeBufferHeight * DT1_DECODE_BATCH);
 		}
 
 		// decode the actual DT1 blocks
-		for (int32_t i = startTile; i <= endTile; i++)
-		{	// iterate through all tiles
-			DT1TileHeader* tileHeader = &file->tileHeaders[i];
-			memset(gGlobalDecodeBuffer, 0, gGlobalDecodeBufferWidth * gGlobalDecodeBufferHeight);
-
-			for (uint32_t j = 0; j < tileHeader->dwNumBlocks; j++)
-			{	// iterate through all blocks
-				uint32_t blockIndex = j + tileHeader->dwBlockNumber;
-				DT1BlockHeader* block = &file->blockHeaders[blockIndex];
-				BYTE* inputBuffer = file->fileBytes + tileHeader->dwBlockHeaderOffset + block->fileOffset;
-				DWORD length = block->encodingLength;
-				int x = 0, y = 0;
-
-				if (block->encodingFormat == 1)
-				{
-					// 3D-isometric floor block (RAW format, no transparency) -- Paul Siramy
-					Log_WarnAssertVoidReturn(length == 256);
-
-					int n;
-					int xjump[15] = { 14, 12, 10,  8,  6,  4,  2,  0,  2,  4,  6,  8, 10, 12, 14 };
-					int nbpix[15] = {  4,  8, 12, 16, 20, 24, 28, 32, 28, 24, 20, 16, 12,  8,  4 };
-					
+		for (int32_t i = startTile; i <= endTile; i += DT1_DECODE_BATCH)
+		{
+			DT1DecodeBatch batch = { file, i };
+			int32_t numTiles = D2Lib::min(endTile - i + 1, DT1_DECODE_BATCH);
 
-					while (length > 0)
-					{
-						x = xjump[y];
-						n = nbpix[y];
-						length -= n;
-						while (n)
-						{
-							gGlobalDecodeBuffer[x + (y * gGlobalDecodeBufferWidth)] = *inputBuffer;
-							inputBuffer++;
-							x++;
-							n--;
-						}
-						y++;
-					}
-				}
-				else
-				{
-					// RLE format, 32x32 pixels -- Paul Siramy
-					while (length > 0)
-					{
-						BYTE b1, b2;
-						b1 = *inputBuffer;
-						b2 = *(inputBuffer + 1);
-						inputBuffer += 2;
-						length -= 2;
-						if (b1 || b2)
-						{
-							x += b1;
-							length -= b2;
-							while (b2)
-							{
-								gGlobalDecodeBuffer[x + (y * gGlobalDecodeBufferWidth)] = *inputBuffer;
-								inputBuffer++;
-								x++;
-								b2--;
-							}
-						}
-						else
-						{
-							x = 0;
-							y++;
-						}
-					}
-				}
-			}
+			Threadpool::ParallelFor(0, numTiles, 1, DecodeTiles, &batch);
 
 			if (callback)
 			{	// what use is there in calling this if there's no callback?
-				callback(gGlobalDecodeBuffer, tileHeader->width, tileHeader->height, 
-					gGlobalDecodeBufferWidth, gGlobalDecodeBufferHeight, i, tileHeader);
+				for (int32_t j = 0; j < numTiles; j++)
+				{
+					callback(gGlobalDecodeBuffer + (j * gGlobalDecodeBufferWidth * gGlobalDecodeBufferHeight),
+						file->tileHeaders[i + j].width, file->tileHeaders[i + j].height,
+						gGlobalDecodeBufferWidth, gGlobalDecodeBufferHeight, i + j, &file->tileHeaders[i + j]);
+				}
 			}
 		}
 	}
-}
\ No newline at end of file
+}
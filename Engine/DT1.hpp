@@ -83,8 +83,8 @@ struct DT1File
 {
 	DT1Header header;
 	DT1TileHeader* tileHeaders;
-	DT1BlockHeader* blockHeaders;
-	BYTE* fileBytes;
+	const DT1BlockHeader* blockHeaders;
+	const BYTE* fileBytes;		// Mapped with FS::Map
 };
 
 typedef void(*TileDecodeCallback)(BYTE* bitmap, uint32_t width, uint32_t height, uint32_t bufferWidth, uint32_t bufferHeight, int32_t tileNumber, DT1TileHeader* tileHeader);
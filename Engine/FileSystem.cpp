@@ -1,10 +1,15 @@
 #include "FileSystem.hpp"
 #include "Logging.hpp"
 #include "FileSystem_MPQ.hpp"
+#include "FileSystem_Cache.hpp"
+#include "FileSystem_Async.hpp"
+#include "FileSystem_Prefetch.hpp"
 #include "MPQ.hpp"
 #include "Platform.hpp"
 #include "../Libraries/sdl/SDL_thread.h"
+#include "../Libraries/sdl/SDL_atomic.h"
 #include <assert.h>
+#include <ctype.h>
 
 /*
  *	The OpenD2 filesystem varies greatly from the one in retail Diablo 2.
@@ -24,7 +29,16 @@
  *	Whenever we reference a file directly (ie, "d2char.mpq"), it's always assumed to be a path relative to a directory.
  */
 
-#define MAX_CONCURRENT_FILES_OPEN	32
+#define FS_HANDLES_PER_PAGE			64
+#define FS_MAX_HANDLE_PAGES			512		// Handle indices have to fit in the bottom 16 bits of an fs_handle
+#define FS_HANDLE_INDEX_MASK		0xFFFF
+#define FS_HANDLE_GENERATION_SHIFT	16
+#define FS_HANDLE_GENERATION_MASK	0xFFFF
+#define FS_NO_SLOT					0xFFFFFFFF
+#define FS_NAME_HASH_SIZE			1024
+#define FS_RESOLVE_HASH_SIZE		4096
+#define FS_RESOLVE_MAX_ENTRIES		16384	// The whole path cache gets flushed if it grows past this
+#define FS_MAP_HASH_SIZE			256
 
 namespace FS
 {
@@ -42,26 +56,164 @@ namespace FS
 		gszModPath,
 	};
 
+	/*
+	 *	An open file.
+	 *	fs_handles are made out of the index of one of these (bottom 16 bits) and its generation (top 16 bits).
+	 *	The generation is odd while the slot is open and even while it's free, and goes up every time it changes,
+	 *	so a handle that has been closed (or was never valid) can't be used to get at whoever has the slot now.
+	 *	Everything other than the refcount and the name chain is only written while the slot is free,
+	 *	so it can be read without any locking once a handle has been checked.
+	 */
 	struct FSHandleStore
 	{
 		char szFileName[MAX_D2PATH];
 		FILE* handle;
 		OpenD2FileModes mode;
-		SDL_mutex* mut;
-		bool bActive;
 		bool bLoadedFromMPQ;
 		D2MPQArchive* mpq;
 		fs_handle mpqFileHandle;
+		size_t dwFileSize;
+		SDL_atomic_t nGeneration;
+		int nRefCount;				// Files read out of MPQs are shared by everyone who opens them
+		DWORD dwNameHash;
+		bool bInNameMap;
+		DWORD dwNext;				// Next slot with the same name hash if open, next free slot if not
 
 		bool Invalid()
 		{
-			return !bActive || (handle == nullptr && mpq == nullptr);
+			return handle == nullptr && mpq == nullptr;
 		}
 	};
 
-	static FSHandleStore glFileHandles[MAX_CONCURRENT_FILES_OPEN]{ 0 };
+	// Pages never move or get freed until shutdown, so a slot's address stays good no matter how many files get opened
+	static FSHandleStore* gpHandlePages[FS_MAX_HANDLE_PAGES]{ 0 };
+	static SDL_atomic_t gnNumSlots{ 0 };
+	static DWORD gdwFreeSlot = FS_NO_SLOT;
+	static DWORD gdwNameMap[FS_NAME_HASH_SIZE];
+	static SDL_mutex* gpHandleMutex = nullptr;
 	static int gnNumFilesOpened = 0;
 
+	/*
+	 *	Where a path ended up resolving to the last time something tried to read it.
+	 *	This saves walking every search path (and the MPQ chain) for files that get opened over and over,
+	 *	and especially for files that don't exist at all.
+	 */
+	enum FSResolveType
+	{
+		FSRESOLVE_MISSING,
+		FSRESOLVE_LOOSE,
+		FSRESOLVE_MPQ,
+	};
+
+	struct FSResolution
+	{
+		FSResolveType	type;
+		int				nSearchPath;	// Which search path a loose file is in
+		D2MPQArchive*	pArchive;
+		fs_handle		fFile;
+	};
+
+	struct FSResolveEntry
+	{
+		char			szFileName[MAX_D2PATH];
+		FSResolution	resolution;
+		FSResolveEntry*	pHashNext;
+	};
+
+	static FSResolveEntry* gpResolveTable[FS_RESOLVE_HASH_SIZE]{ 0 };
+	static DWORD gdwNumResolveEntries = 0;
+	static SDL_mutex* gpResolveMutex = nullptr;
+
+	/*
+	 *	Where the memory behind a mapped file came from, which decides how it gets let go of
+	 */
+	enum FSMapType
+	{
+		FSMAP_ARCHIVEVIEW,		// Stored file, pointing straight into the mapped MPQ
+		FSMAP_CACHED,			// Compressed file, shared out of the file cache
+		FSMAP_HEAP,				// Compressed file that was too big for the cache
+		FSMAP_LOOSE,			// Loose file, mapped by the OS
+	};
+
+	struct FSMapRecord
+	{
+		const BYTE*		pData;
+		size_t			dwSize;
+		FSMapType		type;
+		FSCacheEntry*	pCached;
+		int				nRefCount;
+		FSMapRecord*	pHashNext;
+	};
+
+	static FSMapRecord* gpMapTable[FS_MAP_HASH_SIZE]{ 0 };
+	static SDL_mutex* gpMapMutex = nullptr;
+
+	/*
+	 *	Hash the address of a mapped file
+	 */
+	static DWORD HashMapPointer(const void* pData)
+	{
+		return (DWORD)(((size_t)pData >> 4) % FS_MAP_HASH_SIZE);
+	}
+
+	/*
+	 *	Gives back the memory behind a map record once nobody is using it anymore
+	 */
+	static void FreeMapRecord(FSMapRecord* pRecord)
+	{
+		switch (pRecord->type)
+		{
+			case FSMAP_HEAP:
+				free((void*)pRecord->pData);
+				break;
+			case FSMAP_LOOSE:
+				Sys::UnmapFile((void*)pRecord->pData, pRecord->dwSize);
+				break;
+			default:
+				break;
+		}
+		free(pRecord);
+	}
+
+	/*
+	 *	Drops every map that's still around
+	 */
+	static void UnmapAll()
+	{
+		int nLeaked = 0;
+
+		if (gpMapMutex == nullptr)
+		{
+			return;
+		}
+
+		SDL_LockMutex(gpMapMutex);
+		for (int i = 0; i < FS_MAP_HASH_SIZE; i++)
+		{
+			while (gpMapTable[i] != nullptr)
+			{
+				FSMapRecord* pRecord = gpMapTable[i];
+
+				gpMapTable[i] = pRecord->pHashNext;
+				for (int j = 0; j < pRecord->nRefCount; j++)
+				{
+					FSCache::Release(pRecord->pCached);
+				}
+				FreeMapRecord(pRecord);
+				nLeaked++;
+			}
+		}
+		SDL_UnlockMutex(gpMapMutex);
+
+		if (nLeaked > 0)
+		{
+			Log::Print(PRIORITY_DEBUG, "%i mapped files were never unmapped", nLeaked);
+		}
+
+		SDL_DestroyMutex(gpMapMutex);
+		gpMapMutex = nullptr;
+	}
+
 	/*
 	 *	Log the searchpaths
 	 */
@@ -156,10 +308,12 @@ namespace FS
 		D2Lib::strncpyz(gszBasePath, pOpenConfig->szBasePath, MAX_D2PATH_ABSOLUTE);
 		D2Lib::strncpyz(gszModPath, pOpenConfig->szModPath, MAX_D2PATH_ABSOLUTE);
 
-		// Create mutexes for each openable file
-		for (int i = 0; i < MAX_CONCURRENT_FILES_OPEN; i++)
+		// Set up the handle table. Slots get allocated as files get opened.
+		gpHandleMutex = SDL_CreateMutex();
+		gpResolveMutex = SDL_CreateMutex();
+		for (int i = 0; i < FS_NAME_HASH_SIZE; i++)
 		{
-			glFileHandles[i].mut = SDL_CreateMutex();
+			gdwNameMap[i] = FS_NO_SLOT;
 		}
 
 		// Make sure there's no garbage in the strings
@@ -170,8 +324,13 @@ namespace FS
 		// Copy over bDirect.
 		bDirect = pConfig->bDirect;
 
+		gpMapMutex = SDL_CreateMutex();
+
 		// Init extensions
 		FSMPQ::Init();
+		FSCache::Init((size_t)pOpenConfig->dwFileCacheKB * 1024);
+		FSAsync::Init();
+		FSPrefetch::Init(!pConfig->bNoPreload);
 	}
 
 	/*
@@ -180,21 +339,40 @@ namespace FS
 	 */
 	void Shutdown()
 	{
+		// Anything still loading in the background needs to finish before the rest of this can go
+		FSPrefetch::Shutdown();
+		FSAsync::Shutdown();
+
+		// Anything still mapped at this point is leaked, but the cache and MPQs can't go away underneath it
+		UnmapAll();
+
 		// Shut down any extensions that need closing
+		// (the cache refers to the MPQs, so it has to go first)
+		FSCache::Shutdown();
+		FlushPathCache();
 		FSMPQ::Shutdown();
 
-		for (int i = 0; i < MAX_CONCURRENT_FILES_OPEN; i++)
+		for (int i = 0; i < FS_MAX_HANDLE_PAGES && gpHandlePages[i] != nullptr; i++)
 		{
-			FSHandleStore* pRecord = &glFileHandles[i];
-			if (pRecord->bActive)
+			for (int j = 0; j < FS_HANDLES_PER_PAGE; j++)
 			{
-				if (!pRecord->bLoadedFromMPQ)
+				FSHandleStore* pRecord = &gpHandlePages[i][j];
+				if ((SDL_AtomicGet(&pRecord->nGeneration) & 1) && !pRecord->bLoadedFromMPQ)
 				{
 					fclose(pRecord->handle);
 				}
 			}
-			SDL_DestroyMutex(pRecord->mut);
+			free(gpHandlePages[i]);
+			gpHandlePages[i] = nullptr;
 		}
+		SDL_AtomicSet(&gnNumSlots, 0);
+		gdwFreeSlot = FS_NO_SLOT;
+		gnNumFilesOpened = 0;
+
+		SDL_DestroyMutex(gpHandleMutex);
+		gpHandleMutex = nullptr;
+		SDL_DestroyMutex(gpResolveMutex);
+		gpResolveMutex = nullptr;
 	}
 
 	/*
@@ -274,6 +452,314 @@ namespace FS
 		return "";
 	}
 
+	/*
+	 *	Hashes a (sanitized) file name. Case doesn't matter, same as when the names get compared.
+	 */
+	static DWORD HashFileName(const char* szFileName, DWORD dwHashSize)
+	{
+		DWORD dwHash = 0;
+
+		while (*szFileName)
+		{
+			dwHash = tolower(*szFileName) + (dwHash << 6) + (dwHash << 16) - dwHash;
+			szFileName++;
+		}
+		return dwHash % dwHashSize;
+	}
+
+	/*
+	 *	Looks for a loose file in the search paths that we read from
+	 *	@return	true if it was found, with the search path it was found in
+	 */
+	static bool FindLooseFile(const char* szFileName, int* pnSearchPath)
+	{
+		char path[MAX_D2PATH_ABSOLUTE]{ 0 };
+		FILE* f;
+
+		for (int i = FS_MAXPATH - 1; i != 0; i--)
+		{
+			D2Lib::strncpyz(path, pszPaths[i], MAX_D2PATH_ABSOLUTE);
+			strcat(path, szFileName);
+
+			f = fopen(path, "rb");
+			if (f != nullptr)
+			{
+				fclose(f);
+				*pnSearchPath = i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/*
+	 *	Works out where a file should be read from, the slow way.
+	 *	-direct prefers loose files, otherwise the MPQs go first.
+	 */
+	static void ResolveUncached(const char* szFileName, const char* szSanitized, FSResolution* pResolution)
+	{
+		memset(pResolution, 0, sizeof(FSResolution));
+		pResolution->type = FSRESOLVE_MISSING;
+		pResolution->fFile = INVALID_HANDLE;
+
+		if (bDirect && FindLooseFile(szSanitized, &pResolution->nSearchPath))
+		{
+			pResolution->type = FSRESOLVE_LOOSE;
+			return;
+		}
+
+		pResolution->fFile = FSMPQ::FindFile(szFileName, nullptr, &pResolution->pArchive);
+		if (pResolution->fFile != INVALID_HANDLE)
+		{
+			pResolution->type = FSRESOLVE_MPQ;
+			return;
+		}
+
+		if (!bDirect && FindLooseFile(szSanitized, &pResolution->nSearchPath))
+		{
+			pResolution->type = FSRESOLVE_LOOSE;
+		}
+	}
+
+	/*
+	 *	Frees the whole path cache. The resolve mutex must be held.
+	 */
+	static void FreeResolveEntries()
+	{
+		for (int i = 0; i < FS_RESOLVE_HASH_SIZE; i++)
+		{
+			while (gpResolveTable[i] != nullptr)
+			{
+				FSResolveEntry* pNext = gpResolveTable[i]->pHashNext;
+				free(gpResolveTable[i]);
+				gpResolveTable[i] = pNext;
+			}
+		}
+		gdwNumResolveEntries = 0;
+	}
+
+	/*
+	 *	Works out where a file should be read from, remembering it for next time
+	 */
+	static void Resolve(const char* szFileName, const char* szSanitized, FSResolution* pResolution)
+	{
+		DWORD dwHash = HashFileName(szSanitized, FS_RESOLVE_HASH_SIZE);
+		FSResolveEntry* pEntry;
+
+		SDL_LockMutex(gpResolveMutex);
+		for (pEntry = gpResolveTable[dwHash]; pEntry != nullptr; pEntry = pEntry->pHashNext)
+		{
+			if (!D2Lib::stricmp(pEntry->szFileName, szSanitized))
+			{
+				memcpy(pResolution, &pEntry->resolution, sizeof(FSResolution));
+				SDL_UnlockMutex(gpResolveMutex);
+				return;
+			}
+		}
+		SDL_UnlockMutex(gpResolveMutex);
+
+		ResolveUncached(szFileName, szSanitized, pResolution);
+
+		if (strlen(szSanitized) >= MAX_D2PATH)
+		{	// wouldn't fit
+			return;
+		}
+
+		pEntry = (FSResolveEntry*)malloc(sizeof(FSResolveEntry));
+		if (pEntry == nullptr)
+		{
+			return;
+		}
+
+		D2Lib::strncpyz(pEntry->szFileName, szSanitized, MAX_D2PATH);
+		memcpy(&pEntry->resolution, pResolution, sizeof(FSResolution));
+
+		SDL_LockMutex(gpResolveMutex);
+		if (gdwNumResolveEntries >= FS_RESOLVE_MAX_ENTRIES)
+		{
+			FreeResolveEntries();
+		}
+		// If another thread resolved the same file in the meantime, they'll both agree, so a duplicate is harmless
+		pEntry->pHashNext = gpResolveTable[dwHash];
+		gpResolveTable[dwHash] = pEntry;
+		gdwNumResolveEntries++;
+		SDL_UnlockMutex(gpResolveMutex);
+	}
+
+	/*
+	 *	Forgets where a single file resolved to, for when it gets written to or disappears
+	 */
+	static void ForgetResolution(const char* szSanitized)
+	{
+		FSResolveEntry** ppLink = &gpResolveTable[HashFileName(szSanitized, FS_RESOLVE_HASH_SIZE)];
+
+		SDL_LockMutex(gpResolveMutex);
+		while (*ppLink != nullptr)
+		{
+			FSResolveEntry* pEntry = *ppLink;
+
+			if (!D2Lib::stricmp(pEntry->szFileName, szSanitized))
+			{
+				*ppLink = pEntry->pHashNext;
+				free(pEntry);
+				gdwNumResolveEntries--;
+			}
+			else
+			{
+				ppLink = &pEntry->pHashNext;
+			}
+		}
+		SDL_UnlockMutex(gpResolveMutex);
+	}
+
+	/*
+	 *	Forgets where every file resolved to.
+	 *	Needs to happen whenever something gets added to the search paths, since files can move around.
+	 *	@author	eezstreet
+	 */
+	void FlushPathCache()
+	{
+		if (gpResolveMutex == nullptr)
+		{
+			return;
+		}
+
+		SDL_LockMutex(gpResolveMutex);
+		FreeResolveEntries();
+		SDL_UnlockMutex(gpResolveMutex);
+	}
+
+	/*
+	 *	Gets a slot from its index
+	 */
+	static FSHandleStore* GetSlot(DWORD dwIndex)
+	{
+		return &gpHandlePages[dwIndex / FS_HANDLES_PER_PAGE][dwIndex % FS_HANDLES_PER_PAGE];
+	}
+
+	/*
+	 *	Builds a handle out of a slot index and the slot's current generation
+	 */
+	static fs_handle MakeHandle(DWORD dwIndex)
+	{
+		DWORD dwGeneration = (DWORD)SDL_AtomicGet(&GetSlot(dwIndex)->nGeneration) & FS_HANDLE_GENERATION_MASK;
+
+		return (dwGeneration << FS_HANDLE_GENERATION_SHIFT) | dwIndex;
+	}
+
+	/*
+	 *	Finds a file record from a handle. Returns nullptr if the handle isn't open (anymore).
+	 *	This doesn't need to take any locks.
+	 */
+	static FSHandleStore* GetFileRecord(fs_handle f)
+	{
+		DWORD dwIndex = f & FS_HANDLE_INDEX_MASK;
+		DWORD dwGeneration = (f >> FS_HANDLE_GENERATION_SHIFT) & FS_HANDLE_GENERATION_MASK;
+		FSHandleStore* pRecord;
+
+		if (f == INVALID_HANDLE || (dwGeneration & 1) == 0 || dwIndex >= (DWORD)SDL_AtomicGet(&gnNumSlots))
+		{
+			return nullptr;
+		}
+
+		pRecord = GetSlot(dwIndex);
+		if (((DWORD)SDL_AtomicGet(&pRecord->nGeneration) & FS_HANDLE_GENERATION_MASK) != dwGeneration)
+		{
+			return nullptr;
+		}
+		return pRecord;
+	}
+
+	/*
+	 *	Finds a file that's already open (and shareable). The handle mutex must be held.
+	 *	@return	The index of the slot, or FS_NO_SLOT if it isn't open
+	 */
+	static DWORD FindOpenFile(const char* szFileName, DWORD dwNameHash)
+	{
+		DWORD dwIndex = gdwNameMap[dwNameHash];
+
+		while (dwIndex != FS_NO_SLOT)
+		{
+			FSHandleStore* pRecord = GetSlot(dwIndex);
+
+			if (!D2Lib::stricmp(pRecord->szFileName, szFileName))
+			{
+				return dwIndex;
+			}
+			dwIndex = pRecord->dwNext;
+		}
+		return FS_NO_SLOT;
+	}
+
+	/*
+	 *	Takes a free slot, adding another page of them if we've run out. The handle mutex must be held.
+	 *	@return	The index of the slot, or FS_NO_SLOT if the table is completely full
+	 */
+	static DWORD AllocateSlot()
+	{
+		DWORD dwIndex;
+		DWORD dwNumSlots = (DWORD)SDL_AtomicGet(&gnNumSlots);
+
+		if (gdwFreeSlot == FS_NO_SLOT)
+		{
+			DWORD dwPage = dwNumSlots / FS_HANDLES_PER_PAGE;
+			FSHandleStore* pPage;
+
+			Log_ErrorAssertReturn(dwPage < FS_MAX_HANDLE_PAGES, FS_NO_SLOT);
+
+			pPage = (FSHandleStore*)calloc(FS_HANDLES_PER_PAGE, sizeof(FSHandleStore));
+			Log_ErrorAssertReturn(pPage != nullptr, FS_NO_SLOT);
+
+			for (int i = FS_HANDLES_PER_PAGE - 1; i >= 0; i--)
+			{
+				pPage[i].dwNext = gdwFreeSlot;
+				gdwFreeSlot = dwNumSlots + i;
+			}
+
+			// The page has to be in place before anyone can see an index that lands in it
+			gpHandlePages[dwPage] = pPage;
+			SDL_AtomicSet(&gnNumSlots, dwNumSlots + FS_HANDLES_PER_PAGE);
+		}
+
+		dwIndex = gdwFreeSlot;
+		gdwFreeSlot = GetSlot(dwIndex)->dwNext;
+		return dwIndex;
+	}
+
+	/*
+	 *	Closes a slot and puts it back on the free list. The handle mutex must be held.
+	 */
+	static void FreeSlot(DWORD dwIndex)
+	{
+		FSHandleStore* pRecord = GetSlot(dwIndex);
+
+		// Invalidate every handle to this slot before anything about it changes
+		SDL_AtomicAdd(&pRecord->nGeneration, 1);
+
+		if (pRecord->bInNameMap)
+		{
+			DWORD* pdwLink = &gdwNameMap[pRecord->dwNameHash];
+
+			while (*pdwLink != dwIndex)
+			{
+				pdwLink = &GetSlot(*pdwLink)->dwNext;
+			}
+			*pdwLink = pRecord->dwNext;
+			pRecord->bInNameMap = false;
+		}
+
+		if (!pRecord->bLoadedFromMPQ && pRecord->handle != nullptr)
+		{
+			fclose(pRecord->handle);
+		}
+		pRecord->handle = nullptr;
+		pRecord->mpq = nullptr;
+
+		pRecord->dwNext = gdwFreeSlot;
+		gdwFreeSlot = dwIndex;
+		gnNumFilesOpened--;
+	}
+
 	/*
 	 *	Open a file with the select mode.
 	 *	@return	The size of the file
@@ -284,36 +770,39 @@ namespace FS
 		char folder[MAX_D2PATH]{ 0 };
 		char filepathBuffer[MAX_D2PATH_ABSOLUTE]{ 0 };
 		const char* szModeStr = ModeStr(mode, bBinary);
-		fs_handle outHandle = 0;
 		size_t dwLen = 0;
 		FILE* fileHandle = nullptr;
 		bool bUsedMPQ = false;
 		D2MPQArchive* mpq = nullptr;
 		fs_handle mpqFileHandle = INVALID_HANDLE;
-
-		// FIXME: warn if the handle is already open?
-
-		Log_ErrorAssertReturn(gnNumFilesOpened < MAX_CONCURRENT_FILES_OPEN, 0);
+		DWORD dwNameHash;
+		DWORD dwIndex;
+		FSHandleStore* pRecord;
+		FSResolution resolution;
 
 		D2Lib::strncpyz(filepathBuffer, filename, MAX_D2PATH_ABSOLUTE);
 		SanitizeFilePath(filepathBuffer);
+		dwNameHash = HashFileName(filepathBuffer, FS_NAME_HASH_SIZE);
 
-		if (mode != FS_READ || bDirect)
-		{
-			// attempt to use the local filesystem first
-			int start = FS_MAXPATH - 1;
-			int terminal = 0;
-			int add = -1;
-
-			if (mode != FS_READ)
-			{	// flip the terminal and the start
-				int swap = terminal;
-				terminal = start;
-				start = swap;
-				add = 1;
+		if (mode == FS_READ)
+		{	// If someone already has this open out of an MPQ, share their handle
+			SDL_LockMutex(gpHandleMutex);
+			dwIndex = FindOpenFile(filepathBuffer, dwNameHash);
+			if (dwIndex != FS_NO_SLOT)
+			{
+				pRecord = GetSlot(dwIndex);
+				pRecord->nRefCount++;
+				*f = MakeHandle(dwIndex);
+				SDL_UnlockMutex(gpHandleMutex);
+				return pRecord->dwFileSize;
 			}
+			SDL_UnlockMutex(gpHandleMutex);
+		}
 
-			for (int i = start; i != terminal; i += add)
+		if (mode != FS_READ)
+		{
+			// writes always go to the local filesystem, homepath first
+			for (int i = 0; i != FS_MAXPATH - 1; i++)
 			{
 				D2Lib::strncpyz(path, pszPaths[i], MAX_D2PATH_ABSOLUTE);
 				strcat(path, filepathBuffer);
@@ -323,28 +812,39 @@ namespace FS
 					break;
 				}
 			}
-		}
 
-		if (mode == FS_READ && fileHandle == nullptr)
-		{	// try to read it from an MPQ
-			mpqFileHandle = FSMPQ::FindFile(filename, nullptr, &mpq);
-			if (mpqFileHandle != INVALID_HANDLE)
-			{
-				bUsedMPQ = true; 
+			if (fileHandle != nullptr)
+			{	// this might have just created the file
+				ForgetResolution(filepathBuffer);
 			}
 		}
-
-		if (mode == FS_READ && mpqFileHandle == INVALID_HANDLE)
-		{	// try one more time to find it
-			for (int i = FS_MAXPATH - 1; i != 0; i--)
+		else
+		{
+			// If a loose file went away since the last time we looked, look again
+			for (int nAttempt = 0; nAttempt < 2 && fileHandle == nullptr && !bUsedMPQ; nAttempt++)
 			{
-				D2Lib::strncpyz(path, pszPaths[i], MAX_D2PATH_ABSOLUTE);
-				strcat(path, filepathBuffer);
-
-				if (fileHandle = fopen(path, szModeStr))
+				Resolve(filename, filepathBuffer, &resolution);
+				if (resolution.type == FSRESOLVE_MISSING)
 				{
 					break;
 				}
+				else if (resolution.type == FSRESOLVE_MPQ)
+				{
+					mpq = resolution.pArchive;
+					mpqFileHandle = resolution.fFile;
+					bUsedMPQ = true;
+				}
+				else
+				{
+					D2Lib::strncpyz(path, pszPaths[resolution.nSearchPath], MAX_D2PATH_ABSOLUTE);
+					strcat(path, filepathBuffer);
+
+					fileHandle = fopen(path, szModeStr);
+					if (fileHandle == nullptr)
+					{
+						ForgetResolution(filepathBuffer);
+					}
+				}
 			}
 		}
 
@@ -354,29 +854,7 @@ namespace FS
 			return 0;
 		}
 
-		// Push this file handle
-		while (glFileHandles[outHandle].bActive)
-		{
-			if (!D2Lib::stricmp(glFileHandles[outHandle].szFileName, filepathBuffer))
-			{
-				return outHandle;
-			}
-			outHandle++;
-		}
-
-		// Not active, store it!
-		*f = outHandle;
-		glFileHandles[outHandle].handle = fileHandle;
-		SDL_UnlockMutex(glFileHandles[outHandle].mut);
-		glFileHandles[outHandle].mode = mode;
-		glFileHandles[outHandle].bActive = true;
-		glFileHandles[outHandle].bLoadedFromMPQ = bUsedMPQ;
-		glFileHandles[outHandle].mpq = mpq;
-		glFileHandles[outHandle].mpqFileHandle = mpqFileHandle;
-		D2Lib::strncpyz(glFileHandles[outHandle].szFileName, filepathBuffer, MAX_D2PATH);
-		gnNumFilesOpened++;
-
-		// Get the length of the file and return it
+		// Get the length of the file
 		if (bUsedMPQ)
 		{
 			dwLen = MPQ::FileSize(mpq, mpqFileHandle);
@@ -388,20 +866,49 @@ namespace FS
 			rewind(fileHandle);
 		}
 
-		return dwLen;
-	}
+		// Push this file handle
+		SDL_LockMutex(gpHandleMutex);
+		dwIndex = AllocateSlot();
+		if (dwIndex == FS_NO_SLOT)
+		{
+			SDL_UnlockMutex(gpHandleMutex);
+			if (fileHandle != nullptr)
+			{
+				fclose(fileHandle);
+			}
+			*f = INVALID_HANDLE;
+			return 0;
+		}
 
-	/*
-	 *	Finds a file record (from the linked list). Returns nullptr if it isn't found.
-	 */
-	static FSHandleStore* GetFileRecord(fs_handle f)
-	{
-		if (f == INVALID_HANDLE)
+		pRecord = GetSlot(dwIndex);
+		pRecord->handle = fileHandle;
+		pRecord->mode = mode;
+		pRecord->bLoadedFromMPQ = bUsedMPQ;
+		pRecord->mpq = mpq;
+		pRecord->mpqFileHandle = mpqFileHandle;
+		pRecord->dwFileSize = dwLen;
+		pRecord->nRefCount = 1;
+		pRecord->dwNameHash = dwNameHash;
+		pRecord->bInNameMap = false;
+		pRecord->dwNext = FS_NO_SLOT;
+		D2Lib::strncpyz(pRecord->szFileName, filepathBuffer, MAX_D2PATH);
+
+		// Files in MPQs don't have a file position, so they can be shared by everyone who reads them.
+		// Only the first reader goes in the map; if somebody beat us to it, this handle just isn't shared.
+		if (bUsedMPQ && FindOpenFile(filepathBuffer, dwNameHash) == FS_NO_SLOT)
 		{
-			return nullptr;
+			pRecord->dwNext = gdwNameMap[dwNameHash];
+			gdwNameMap[dwNameHash] = dwIndex;
+			pRecord->bInNameMap = true;
 		}
 
-		return &glFileHandles[f];
+		// Everything is filled in, so the handle can go live
+		SDL_AtomicAdd(&pRecord->nGeneration, 1);
+		gnNumFilesOpened++;
+		*f = MakeHandle(dwIndex);
+		SDL_UnlockMutex(gpHandleMutex);
+
+		return dwLen;
 	}
 
 	/*
@@ -413,25 +920,287 @@ namespace FS
 		size_t result;
 		FSHandleStore* pSource = GetFileRecord(f);
 
-		if (pSource == nullptr || !pSource->bActive || pSource->Invalid())
+		if (pSource == nullptr || pSource->Invalid())
 		{	// invalid file of some kind
 			return 0;
 		}
 
-		SDL_LockMutex(pSource->mut);
+		// MPQ reads don't share any state and stdio locks the FILE itself, so there's nothing to lock here
 		if (pSource->bLoadedFromMPQ)
 		{
-			result = MPQ::ReadFile(pSource->mpq, pSource->mpqFileHandle, (BYTE*)buffer, dwBufferLen);
+			FSCacheEntry* pCached = nullptr;
+
+			FSPrefetch::Record(pSource->mpq, pSource->mpqFileHandle);
+
+			// Files that get opened over and over are served out of the cache instead of being decompressed again.
+			// Stored files in mapped archives are already in memory, so caching them would only use up the budget.
+			if (MPQ::GetFileView(pSource->mpq, pSource->mpqFileHandle) == nullptr)
+			{
+				pCached = FSCache::Acquire(pSource->mpq, pSource->mpqFileHandle);
+			}
+
+			if (pCached != nullptr)
+			{	// same as MPQ::ReadFile: either the whole file fits in the buffer, or nothing gets read
+				result = 0;
+				if (pCached->dwSize <= dwBufferLen)
+				{
+					memcpy(buffer, pCached->pData, pCached->dwSize);
+					result = pCached->dwSize;
+				}
+				FSCache::Release(pCached);
+			}
+			else
+			{
+				result = MPQ::ReadFile(pSource->mpq, pSource->mpqFileHandle, (BYTE*)buffer, dwBufferLen);
+			}
 		}
 		else
 		{
 			result = fread(buffer, dwBufferLen, dwCount, pSource->handle);
 		}
-		SDL_UnlockMutex(pSource->mut);
 
 		return result;
 	}
 
+	/*
+	 *	Read from a specific offset in a (loose) file, without using or moving the file position.
+	 *	Several threads can read the same file at once this way.
+	 *	On Windows this still moves the file pointer underneath, so don't mix it with Read/Seek on the same file.
+	 *	@return	The number of bytes read from the file
+	 */
+	size_t ReadAt(fs_handle f, size_t dwOffset, void* buffer, size_t dwBufferLen)
+	{
+		FSHandleStore* pSource = GetFileRecord(f);
+
+		if (pSource == nullptr || pSource->Invalid())
+		{	// invalid file of some kind
+			return 0;
+		}
+
+		// Files inside of MPQs don't have a position to read from
+		Log_WarnAssertReturn(!pSource->bLoadedFromMPQ, 0);
+
+		return Sys::ReadAt(pSource->handle, dwOffset, buffer, dwBufferLen);
+	}
+
+	/*
+	 *	Gets the contents of a file inside of an MPQ, touching as little memory as possible
+	 */
+	static const BYTE* MapArchiveFile(D2MPQArchive* pArchive, fs_handle fFile, size_t* pdwSize,
+		FSMapType* pType, FSCacheEntry** ppCached)
+	{
+		const BYTE* pView;
+		BYTE* pBuffer;
+		size_t dwSize = MPQ::FileSize(pArchive, fFile);
+
+		if (dwSize == 0)
+		{
+			return nullptr;
+		}
+
+		FSPrefetch::Record(pArchive, fFile);
+
+		// Stored files can be handed out as-is
+		pView = MPQ::GetFileView(pArchive, fFile);
+		if (pView != nullptr)
+		{
+			*pType = FSMAP_ARCHIVEVIEW;
+			*pdwSize = dwSize;
+			return pView;
+		}
+
+		// Compressed files get decompressed once and shared through the cache
+		*ppCached = FSCache::Acquire(pArchive, fFile);
+		if (*ppCached != nullptr)
+		{
+			*pType = FSMAP_CACHED;
+			*pdwSize = (*ppCached)->dwSize;
+			return (*ppCached)->pData;
+		}
+
+		// Too big for the cache (or the cache is off), so this one gets its own copy
+		pBuffer = (BYTE*)malloc(dwSize);
+		Log_ErrorAssertReturn(pBuffer != nullptr, nullptr);
+
+		dwSize = MPQ::ReadFile(pArchive, fFile, pBuffer, dwSize);
+		if (dwSize == 0)
+		{
+			free(pBuffer);
+			return nullptr;
+		}
+
+		*pType = FSMAP_HEAP;
+		*pdwSize = dwSize;
+		return pBuffer;
+	}
+
+	/*
+	 *	Gets a read-only view of the entire contents of a file, without reading it into a buffer of our own.
+	 *	Stored files in MPQs point straight into the archive, compressed files are shared with the file cache and
+	 *	loose files get mapped by the OS. Mapping the same data twice hands out the same view.
+	 *	Every view that gets returned must be given back with Unmap.
+	 *	@return	The contents of the file, or nullptr if it couldn't be found
+	 *	@author	eezstreet
+	 */
+	const void* Map(const char* filename, size_t* pdwSize)
+	{
+		char filepathBuffer[MAX_D2PATH_ABSOLUTE]{ 0 };
+		const BYTE* pData = nullptr;
+		size_t dwSize = 0;
+		FSMapType type = FSMAP_LOOSE;
+		FSCacheEntry* pCached = nullptr;
+		char path[MAX_D2PATH_ABSOLUTE]{ 0 };
+		FSResolution resolution;
+		FSMapRecord* pRecord;
+		DWORD dwHash;
+
+		Log_ErrorAssertReturn(pdwSize != nullptr, nullptr);
+		Log_ErrorAssertReturn(gpMapMutex != nullptr, nullptr);
+		*pdwSize = 0;
+
+		D2Lib::strncpyz(filepathBuffer, filename, MAX_D2PATH_ABSOLUTE);
+		SanitizeFilePath(filepathBuffer);
+
+		// Same search as Open, including looking again if a loose file went away
+		for (int nAttempt = 0; nAttempt < 2 && pData == nullptr; nAttempt++)
+		{
+			Resolve(filename, filepathBuffer, &resolution);
+			if (resolution.type == FSRESOLVE_MISSING)
+			{
+				break;
+			}
+			else if (resolution.type == FSRESOLVE_MPQ)
+			{
+				pData = MapArchiveFile(resolution.pArchive, resolution.fFile, &dwSize, &type, &pCached);
+				break;
+			}
+
+			D2Lib::strncpyz(path, pszPaths[resolution.nSearchPath], MAX_D2PATH_ABSOLUTE);
+			strcat(path, filepathBuffer);
+
+			pData = (const BYTE*)Sys::MapFile(path, &dwSize);
+			if (pData == nullptr)
+			{
+				ForgetResolution(filepathBuffer);
+			}
+		}
+
+		if (pData == nullptr)
+		{
+			return nullptr;
+		}
+
+		dwHash = HashMapPointer(pData);
+
+		SDL_LockMutex(gpMapMutex);
+		pRecord = gpMapTable[dwHash];
+		while (pRecord != nullptr && pRecord->pData != pData)
+		{
+			pRecord = pRecord->pHashNext;
+		}
+
+		if (pRecord != nullptr)
+		{	// Somebody has this mapped already. Any cache reference we took gets released alongside theirs.
+			pRecord->nRefCount++;
+		}
+		else
+		{
+			pRecord = (FSMapRecord*)malloc(sizeof(FSMapRecord));
+			if (pRecord == nullptr)
+			{
+				SDL_UnlockMutex(gpMapMutex);
+				FSCache::Release(pCached);
+				if (type == FSMAP_HEAP)
+				{
+					free((void*)pData);
+				}
+				else if (type == FSMAP_LOOSE)
+				{
+					Sys::UnmapFile((void*)pData, dwSize);
+				}
+				return nullptr;
+			}
+
+			pRecord->pData = pData;
+			pRecord->dwSize = dwSize;
+			pRecord->type = type;
+			pRecord->pCached = pCached;
+			pRecord->nRefCount = 1;
+			pRecord->pHashNext = gpMapTable[dwHash];
+			gpMapTable[dwHash] = pRecord;
+		}
+		SDL_UnlockMutex(gpMapMutex);
+
+		*pdwSize = dwSize;
+		return pData;
+	}
+
+	/*
+	 *	Gives back a view that was returned by Map.
+	 *	@author	eezstreet
+	 */
+	void Unmap(const void* pView)
+	{
+		FSMapRecord** ppLink;
+		FSMapRecord* pRecord;
+		FSCacheEntry* pCached;
+
+		if (pView == nullptr || gpMapMutex == nullptr)
+		{
+			return;
+		}
+
+		SDL_LockMutex(gpMapMutex);
+		ppLink = &gpMapTable[HashMapPointer(pView)];
+		while (*ppLink != nullptr && (*ppLink)->pData != pView)
+		{
+			ppLink = &(*ppLink)->pHashNext;
+		}
+
+		pRecord = *ppLink;
+		if (pRecord == nullptr)
+		{
+			SDL_UnlockMutex(gpMapMutex);
+			Log::Warning(__FILE__, __LINE__, "Unmap on a view that didn't come from Map");
+			return;
+		}
+
+		pCached = pRecord->pCached;
+		pRecord->nRefCount--;
+		if (pRecord->nRefCount <= 0)
+		{
+			*ppLink = pRecord->pHashNext;
+			FreeMapRecord(pRecord);
+		}
+		SDL_UnlockMutex(gpMapMutex);
+
+		FSCache::Release(pCached);
+	}
+
+	/*
+	 *	Works out which archive a file would be read out of, and which block of the archive it's in.
+	 *	@return	false if the file would be read off of the disk instead, or if it can't be found at all
+	 *	@author	eezstreet
+	 */
+	bool Locate(const char* filename, D2MPQArchive** ppArchive, fs_handle* pfFile)
+	{
+		char filepathBuffer[MAX_D2PATH_ABSOLUTE]{ 0 };
+		FSResolution resolution;
+
+		D2Lib::strncpyz(filepathBuffer, filename, MAX_D2PATH_ABSOLUTE);
+		SanitizeFilePath(filepathBuffer);
+
+		Resolve(filename, filepathBuffer, &resolution);
+		if (resolution.type != FSRESOLVE_MPQ)
+		{
+			return false;
+		}
+
+		*ppArchive = resolution.pArchive;
+		*pfFile = resolution.fFile;
+		return true;
+	}
+
 	/*
 	 *	Write to a file
 	 *	@return	The number of bytes written to the file
@@ -452,9 +1221,6 @@ namespace FS
 			return 0;
 		}
 
-		// Lock the mutex until we are done writing
-		SDL_LockMutex(pRecord->mut);
-
 		if (dwBufferLen == 0)
 		{
 			dwBufferLen = strlen((const char*)buffer);
@@ -462,9 +1228,6 @@ namespace FS
 
 		result = fwrite(buffer, dwCount, dwBufferLen, pRecord->handle);
 
-		// Unlock the mutex so other stuff can use this
-		SDL_UnlockMutex(pRecord->mut);
-
 		return result;
 	}
 
@@ -490,17 +1253,12 @@ namespace FS
 			return;
 		}
 
-		// Lock, write, unlock
-		SDL_LockMutex(pRecord->mut);
-		if (!pRecord->bLoadedFromMPQ)
-		{
-			fclose(pRecord->handle);
+		SDL_LockMutex(gpHandleMutex);
+		if (GetFileRecord(f) == pRecord && --pRecord->nRefCount <= 0)
+		{	// checked again under the lock, in case someone else closed it first
+			FreeSlot(f & FS_HANDLE_INDEX_MASK);
 		}
-		pRecord->handle = 0;
-		pRecord->mpq = nullptr;
-		pRecord->bActive = false;
-		gnNumFilesOpened--;
-		SDL_UnlockMutex(pRecord->mut);
+		SDL_UnlockMutex(gpHandleMutex);
 	}
 
 	/*
@@ -518,11 +1276,9 @@ namespace FS
 		}
 
 		// Not allowed to Seek() on files from MPQs.
-		Log_WarnAssertReturn(!pRecord->bLoadedFromMPQ);
+		Log_WarnAssertVoidReturn(!pRecord->bLoadedFromMPQ);
 
-		SDL_LockMutex(pRecord->mut);
 		fseek(pRecord->handle, offset, nSeekType);
-		SDL_UnlockMutex(pRecord->mut);
 	}
 
 	/*
@@ -541,9 +1297,7 @@ namespace FS
 		// Not allowed to Tell() on files from MPQs
 		Log_WarnAssertReturn(!pFile->bLoadedFromMPQ, 0);
 
-		SDL_LockMutex(pFile->mut);
 		result = ftell(pFile->handle);
-		SDL_UnlockMutex(pFile->mut);
 		return result;
 	}
 
@@ -9,6 +9,10 @@ namespace FS
 	void LogSearchPaths();
 	size_t Open(const char* filename, fs_handle* f, OpenD2FileModes mode, bool bBinary = false);
 	size_t Read(fs_handle f, void* buffer, size_t dwBufferLen = 4, size_t dwCount = 1);
+	size_t ReadAt(fs_handle f, size_t dwOffset, void* buffer, size_t dwBufferLen);
+	const void* Map(const char* filename, size_t* pdwSize);
+	bool Locate(const char* filename, D2MPQArchive** ppArchive, fs_handle* pfFile);
+	void Unmap(const void* pView);
 	size_t Write(fs_handle f, void* buffer, size_t dwBufferLen = 1, size_t dwCount = 1);
 	size_t WritePlaintext(fs_handle f, const char* text);
 	void CloseFile(fs_handle f);
@@ -18,4 +22,5 @@ namespace FS
 	char** ListFilesInDirectory(char* szDirectory, char* szExtensionFilter, int *nFiles);
 	void FreeFileList(char** pszFileList, int nNumFiles);
 	void CreateSubdirectory(char* szSubdirectory);
+	void FlushPathCache();
 };
\ No newline at end of file
@@ -0,0 +1,220 @@
+#include "FileSystem_Async.hpp"
+#include "FileSystem.hpp"
+#include "Logging.hpp"
+#include "Threadpool.hpp"
+#include "../Libraries/sdl/SDL_atomic.h"
+#include "../Libraries/sdl/SDL_mutex.h"
+
+/*
+ *	Async file loading lets the game ask for a whole batch of files at once (for instance, every DCC that a token needs)
+ *	without stalling the main thread while they get found and decompressed.
+ *	Each file in a batch is mapped on the threadpool. Once every file in a batch is ready, the batch gets handed back
+ *	on the main thread by Deliver, which runs at the start of every frame, before the module does.
+ *	Batches are always delivered in the order that they were submitted, and the files within a batch are delivered
+ *	in the order that they were requested.
+ */
+
+namespace FSAsync
+{
+	struct FSAsyncBatch;
+
+	struct FSAsyncFile
+	{
+		D2AsyncLoadRequest	request;
+		const void*			pData;
+		size_t				dwSize;
+		FSAsyncBatch*		pBatch;
+	};
+
+	struct FSAsyncBatch
+	{
+		SDL_atomic_t		nRemaining;		// Files that haven't been loaded yet
+		D2JobCounter		counter;		// The jobs loading the files (which are still running for a moment after nRemaining hits 0)
+		int					nNumFiles;
+		FSAsyncFile*		pFiles;
+		FSAsyncBatch*		pNext;
+	};
+
+	static FSAsyncBatch* gpBatchHead = nullptr;
+	static FSAsyncBatch* gpBatchTail = nullptr;
+	static SDL_mutex* gpBatchMutex = nullptr;
+	static DWORD gdwNumPending = 0;
+
+	/*
+	 *	Loads a single file. Runs on a worker thread (or inline, if there aren't any).
+	 */
+	static void T_LoadFile(void* pData)
+	{
+		FSAsyncFile* pFile = (FSAsyncFile*)pData;
+
+		pFile->pData = FS::Map(pFile->request.szFileName, &pFile->dwSize);
+		SDL_AtomicAdd(&pFile->pBatch->nRemaining, -1);
+	}
+
+	/*
+	 *	Initializes async loading
+	 *	@author	eezstreet
+	 */
+	void Init()
+	{
+		gpBatchMutex = SDL_CreateMutex();
+	}
+
+	/*
+	 *	Waits for anything that's still loading, and throws away everything that hasn't been delivered.
+	 *	Has to happen before the rest of the filesystem shuts down.
+	 *	@author	eezstreet
+	 */
+	void Shutdown()
+	{
+		if (gpBatchMutex == nullptr)
+		{
+			return;
+		}
+
+		SDL_LockMutex(gpBatchMutex);
+		while (gpBatchHead != nullptr)
+		{
+			FSAsyncBatch* pBatch = gpBatchHead;
+
+			Threadpool::WaitForCounter(&pBatch->counter);
+
+			for (int i = 0; i < pBatch->nNumFiles; i++)
+			{
+				FS::Unmap(pBatch->pFiles[i].pData);
+			}
+
+			gpBatchHead = pBatch->pNext;
+			free(pBatch);
+		}
+		gpBatchTail = nullptr;
+		gdwNumPending = 0;
+		SDL_UnlockMutex(gpBatchMutex);
+
+		SDL_DestroyMutex(gpBatchMutex);
+		gpBatchMutex = nullptr;
+	}
+
+	/*
+	 *	Starts loading a batch of files in the background.
+	 *	The requests are copied, so they don't need to stick around after this returns.
+	 *	@author	eezstreet
+	 */
+	void LoadBatch(D2AsyncLoadRequest* pRequests, int nNumRequests)
+	{
+		FSAsyncBatch* pBatch;
+		bool bThreaded = Threadpool::GetNumWorkers() > 0;
+
+		Log_WarnAssertVoidReturn(pRequests != nullptr && nNumRequests > 0);
+		Log_ErrorAssertVoidReturn(gpBatchMutex != nullptr);
+
+		// The batch and all of its files live in one allocation
+		pBatch = (FSAsyncBatch*)malloc(sizeof(FSAsyncBatch) + (sizeof(FSAsyncFile) * nNumRequests));
+		Log_ErrorAssertVoidReturn(pBatch != nullptr);
+
+		pBatch->nNumFiles = nNumRequests;
+		pBatch->pFiles = (FSAsyncFile*)(pBatch + 1);
+		pBatch->pNext = nullptr;
+		SDL_AtomicSet(&pBatch->nRemaining, nNumRequests);
+		memset(&pBatch->counter, 0, sizeof(pBatch->counter));
+
+		for (int i = 0; i < nNumRequests; i++)
+		{
+			FSAsyncFile* pFile = &pBatch->pFiles[i];
+
+			memcpy(&pFile->request, &pRequests[i], sizeof(D2AsyncLoadRequest));
+			pFile->pData = nullptr;
+			pFile->dwSize = 0;
+			pFile->pBatch = pBatch;
+		}
+
+		// Queue the batch up for delivery before any of it can finish
+		SDL_LockMutex(gpBatchMutex);
+		if (gpBatchTail == nullptr)
+		{
+			gpBatchHead = gpBatchTail = pBatch;
+		}
+		else
+		{
+			gpBatchTail->pNext = pBatch;
+			gpBatchTail = pBatch;
+		}
+		gdwNumPending += nNumRequests;
+		SDL_UnlockMutex(gpBatchMutex);
+
+		for (int i = 0; i < nNumRequests; i++)
+		{
+			if (bThreaded)
+			{
+				Threadpool::SpawnJob(T_LoadFile, &pBatch->pFiles[i], &pBatch->counter);
+			}
+			else
+			{	// No threadpool; load it now, but still deliver it at the usual time
+				T_LoadFile(&pBatch->pFiles[i]);
+			}
+		}
+	}
+
+	/*
+	 *	Hands every batch that has finished loading back to whoever asked for it.
+	 *	Runs on the main thread, once per frame.
+	 *	@author	eezstreet
+	 */
+	void Deliver()
+	{
+		FSAsyncBatch* pBatch;
+
+		if (gpBatchMutex == nullptr)
+		{
+			return;
+		}
+
+		while (true)
+		{
+			SDL_LockMutex(gpBatchMutex);
+			pBatch = gpBatchHead;
+			if (pBatch == nullptr || SDL_AtomicGet(&pBatch->nRemaining) > 0)
+			{	// Later batches have to wait their turn, even if they're already done
+				SDL_UnlockMutex(gpBatchMutex);
+				return;
+			}
+
+			gpBatchHead = pBatch->pNext;
+			if (gpBatchHead == nullptr)
+			{
+				gpBatchTail = nullptr;
+			}
+			gdwNumPending -= pBatch->nNumFiles;
+			SDL_UnlockMutex(gpBatchMutex);
+
+			// The last job might not be completely done with the batch yet
+			Threadpool::WaitForCounter(&pBatch->counter);
+
+			// Callbacks run without the lock held, so that they can queue up more loads
+			for (int i = 0; i < pBatch->nNumFiles; i++)
+			{
+				FSAsyncFile* pFile = &pBatch->pFiles[i];
+
+				if (pFile->request.pCallback != nullptr)
+				{
+					pFile->request.pCallback(pFile->request.szFileName, pFile->pData, pFile->dwSize, pFile->request.pUserData);
+				}
+				else
+				{	// Nobody wants it, so don't let it leak
+					FS::Unmap(pFile->pData);
+				}
+			}
+
+			free(pBatch);
+		}
+	}
+
+	/*
+	 *	Gets the number of files that have been requested but not delivered yet
+	 *	@author	eezstreet
+	 */
+	DWORD GetNumPending()
+	{
+		return gdwNumPending;
+	}
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include "../Shared/D2Shared.hpp"
+
+// FileSystem_Async.cpp
+namespace FSAsync
+{
+	void Init();
+	void Shutdown();
+	void LoadBatch(D2AsyncLoadRequest* pRequests, int nNumRequests);
+	void Deliver();
+	DWORD GetNumPending();
+}
@@ -0,0 +1,348 @@
+#include "FileSystem_Cache.hpp"
+#include "Logging.hpp"
+#include "MPQ.hpp"
+#include "../Libraries/sdl/SDL_mutex.h"
+
+/*
+ *	The file cache keeps decompressed MPQ files around, so that files which get opened over and over
+ *	(palettes, COFs, fonts, UI DC6s...) only have to be decompressed once.
+ *	Entries are keyed by the (archive, block) pair that a path resolved to, and are evicted in least-recently-used
+ *	order once the cache goes over its memory budget. Entries that are still acquired by someone (for instance a file
+ *	that's kept mapped for as long as the game runs) are pinned: they sit outside of the LRU list and their bytes don't
+ *	count against the budget, so that they never get walked over or crowd out everything else.
+ */
+
+#define FSCACHE_HASH_SIZE			1024
+#define FSCACHE_MAX_ENTRY_FRACTION	8		// Files bigger than (budget / this) are never cached
+
+namespace FSCache
+{
+	static FSCacheEntry* gpHashTable[FSCACHE_HASH_SIZE]{ 0 };
+	static FSCacheEntry* gpLRUHead = nullptr;
+	static FSCacheEntry* gpLRUTail = nullptr;
+	static FSCacheStats gStats{ 0 };
+	static SDL_mutex* gpCacheMutex = nullptr;
+
+	/*
+	 *	Hash an (archive, block) pair
+	 */
+	static DWORD HashKey(D2MPQArchive* pArchive, fs_handle fBlock)
+	{
+		size_t dwArchive = (size_t)pArchive;
+
+		return (DWORD)(((dwArchive >> 4) * 31) + fBlock) % FSCACHE_HASH_SIZE;
+	}
+
+	/*
+	 *	Take an entry out of the LRU list
+	 */
+	static void UnlinkEntry(FSCacheEntry* pEntry)
+	{
+		if (pEntry->pPrev != nullptr)
+		{
+			pEntry->pPrev->pNext = pEntry->pNext;
+		}
+		else
+		{
+			gpLRUHead = pEntry->pNext;
+		}
+
+		if (pEntry->pNext != nullptr)
+		{
+			pEntry->pNext->pPrev = pEntry->pPrev;
+		}
+		else
+		{
+			gpLRUTail = pEntry->pPrev;
+		}
+
+		pEntry->pPrev = pEntry->pNext = nullptr;
+	}
+
+	/*
+	 *	Put an entry at the front of the LRU list
+	 */
+	static void LinkEntryToFront(FSCacheEntry* pEntry)
+	{
+		pEntry->pPrev = nullptr;
+		pEntry->pNext = gpLRUHead;
+		if (gpLRUHead != nullptr)
+		{
+			gpLRUHead->pPrev = pEntry;
+		}
+		gpLRUHead = pEntry;
+
+		if (gpLRUTail == nullptr)
+		{
+			gpLRUTail = pEntry;
+		}
+	}
+
+	/*
+	 *	Find an entry in the hash table. The cache mutex must be held.
+	 */
+	static FSCacheEntry* FindEntry(D2MPQArchive* pArchive, fs_handle fBlock)
+	{
+		FSCacheEntry* pEntry = gpHashTable[HashKey(pArchive, fBlock)];
+
+		while (pEntry != nullptr)
+		{
+			if (pEntry->pArchive == pArchive && pEntry->fBlock == fBlock)
+			{
+				return pEntry;
+			}
+			pEntry = pEntry->pHashNext;
+		}
+		return nullptr;
+	}
+
+	/*
+	 *	Gets the number of bytes that count against the budget. The cache mutex must be held.
+	 */
+	static size_t UnpinnedBytes()
+	{
+		return gStats.dwBytesUsed - gStats.dwBytesPinned;
+	}
+
+	/*
+	 *	Adds a reference to an entry, pinning it if it wasn't already. The cache mutex must be held.
+	 */
+	static void PinEntry(FSCacheEntry* pEntry)
+	{
+		if (pEntry->nRefCount++ == 0)
+		{
+			UnlinkEntry(pEntry);
+			gStats.dwBytesPinned += pEntry->dwSize;
+		}
+	}
+
+	/*
+	 *	Remove an entry from the cache entirely and free it. The cache mutex must be held.
+	 */
+	static void FreeEntry(FSCacheEntry* pEntry)
+	{
+		FSCacheEntry** ppLink = &gpHashTable[HashKey(pEntry->pArchive, pEntry->fBlock)];
+
+		while (*ppLink != nullptr && *ppLink != pEntry)
+		{
+			ppLink = &(*ppLink)->pHashNext;
+		}
+
+		if (*ppLink == pEntry)
+		{
+			*ppLink = pEntry->pHashNext;
+		}
+
+		if (pEntry->nRefCount > 0)
+		{	// only happens on shutdown
+			gStats.dwBytesPinned -= pEntry->dwSize;
+		}
+		else
+		{
+			UnlinkEntry(pEntry);
+		}
+
+		gStats.dwBytesUsed -= pEntry->dwSize;
+		gStats.dwNumEntries--;
+
+		free(pEntry->pData);
+		free(pEntry);
+	}
+
+	/*
+	 *	Evict unpinned entries, oldest first, until dwIncoming more bytes fit into the budget.
+	 *	Everything in the LRU list is unpinned, so every step frees something.
+	 *	The cache mutex must be held.
+	 */
+	static void EvictToBudget(size_t dwIncoming)
+	{
+		while (gpLRUTail != nullptr && UnpinnedBytes() + dwIncoming > gStats.dwBytesBudget)
+		{
+			FreeEntry(gpLRUTail);
+			gStats.dwEvictions++;
+		}
+	}
+
+	/*
+	 *	Initializes the file cache with a budget (in bytes). A budget of zero disables the cache.
+	 *	@author	eezstreet
+	 */
+	void Init(size_t dwBudget)
+	{
+		memset(&gStats, 0, sizeof(gStats));
+		gStats.dwBytesBudget = dwBudget;
+
+		if (dwBudget > 0)
+		{
+			gpCacheMutex = SDL_CreateMutex();
+		}
+	}
+
+	/*
+	 *	Frees everything in the file cache.
+	 *	Has to happen before the MPQs get closed, since the cache is keyed on them.
+	 *	@author	eezstreet
+	 */
+	void Shutdown()
+	{
+		if (gpCacheMutex == nullptr)
+		{
+			return;
+		}
+
+		SDL_LockMutex(gpCacheMutex);
+		for (int i = 0; i < FSCACHE_HASH_SIZE; i++)
+		{	// pinned entries aren't in the LRU list, so go through the hash table instead
+			while (gpHashTable[i] != nullptr)
+			{
+				FreeEntry(gpHashTable[i]);
+			}
+		}
+		SDL_UnlockMutex(gpCacheMutex);
+
+		SDL_DestroyMutex(gpCacheMutex);
+		gpCacheMutex = nullptr;
+	}
+
+	/*
+	 *	Gets the decompressed contents of a file from the cache, decompressing it if it's not there yet.
+	 *	Every successful Acquire must be paired with a Release.
+	 *	@return	The cache entry, or nullptr if the file can't be (or shouldn't be) cached
+	 *	@author	eezstreet
+	 */
+	FSCacheEntry* Acquire(D2MPQArchive* pArchive, fs_handle fBlock)
+	{
+		FSCacheEntry* pEntry;
+		BYTE* pData;
+		size_t dwSize;
+
+		if (gpCacheMutex == nullptr || pArchive == nullptr || fBlock == INVALID_HANDLE)
+		{
+			return nullptr;
+		}
+
+		dwSize = MPQ::FileSize(pArchive, fBlock);
+
+		SDL_LockMutex(gpCacheMutex);
+		pEntry = FindEntry(pArchive, fBlock);
+		if (pEntry != nullptr)
+		{
+			gStats.dwHits++;
+			PinEntry(pEntry);
+			SDL_UnlockMutex(gpCacheMutex);
+			return pEntry;
+		}
+
+		if (dwSize == 0 || dwSize > gStats.dwBytesBudget / FSCACHE_MAX_ENTRY_FRACTION)
+		{	// Too big; caching this would just flush everything else
+			gStats.dwUncacheable++;
+			SDL_UnlockMutex(gpCacheMutex);
+			return nullptr;
+		}
+
+		gStats.dwMisses++;
+		SDL_UnlockMutex(gpCacheMutex);
+
+		// Decompress without holding the lock, so that other threads can keep hitting the cache
+		pData = (BYTE*)malloc(dwSize);
+		Log_ErrorAssertReturn(pData != nullptr, nullptr);
+
+		dwSize = MPQ::ReadFile(pArchive, fBlock, pData, dwSize);
+		if (dwSize == 0)
+		{
+			free(pData);
+			return nullptr;
+		}
+
+		SDL_LockMutex(gpCacheMutex);
+		pEntry = FindEntry(pArchive, fBlock);
+		if (pEntry != nullptr)
+		{	// Someone else got to it first
+			PinEntry(pEntry);
+			SDL_UnlockMutex(gpCacheMutex);
+			free(pData);
+			return pEntry;
+		}
+
+		pEntry = (FSCacheEntry*)malloc(sizeof(FSCacheEntry));
+		if (pEntry == nullptr)
+		{
+			SDL_UnlockMutex(gpCacheMutex);
+			free(pData);
+			return nullptr;
+		}
+
+		EvictToBudget(dwSize);
+
+		DWORD dwHash = HashKey(pArchive, fBlock);
+		pEntry->pArchive = pArchive;
+		pEntry->fBlock = fBlock;
+		pEntry->pData = pData;
+		pEntry->dwSize = dwSize;
+		pEntry->nRefCount = 1;
+		pEntry->pPrev = pEntry->pNext = nullptr;
+		pEntry->pHashNext = gpHashTable[dwHash];
+		gpHashTable[dwHash] = pEntry;
+
+		gStats.dwBytesUsed += dwSize;
+		gStats.dwBytesPinned += dwSize;
+		gStats.dwNumEntries++;
+		SDL_UnlockMutex(gpCacheMutex);
+
+		return pEntry;
+	}
+
+	/*
+	 *	Lets go of an entry that was returned by Acquire.
+	 *	@author	eezstreet
+	 */
+	void Release(FSCacheEntry* pEntry)
+	{
+		if (pEntry == nullptr || gpCacheMutex == nullptr)
+		{
+			return;
+		}
+
+		SDL_LockMutex(gpCacheMutex);
+		if (--pEntry->nRefCount == 0)
+		{	// It counts against the budget again, which might put us over
+			gStats.dwBytesPinned -= pEntry->dwSize;
+			LinkEntryToFront(pEntry);
+			EvictToBudget(0);
+		}
+		SDL_UnlockMutex(gpCacheMutex);
+	}
+
+	/*
+	 *	Gets a snapshot of the cache counters
+	 *	@author	eezstreet
+	 */
+	void GetStats(FSCacheStats* pStats)
+	{
+		if (gpCacheMutex == nullptr)
+		{
+			memcpy(pStats, &gStats, sizeof(gStats));
+			return;
+		}
+
+		SDL_LockMutex(gpCacheMutex);
+		memcpy(pStats, &gStats, sizeof(gStats));
+		SDL_UnlockMutex(gpCacheMutex);
+	}
+
+	/*
+	 *	Writes the cache counters to the log
+	 *	@author	eezstreet
+	 */
+	void LogStats()
+	{
+		FSCacheStats stats;
+
+		GetStats(&stats);
+		Log::Print(PRIORITY_MESSAGE, "File cache: %u hits, %u misses, %u evictions, %u too big to cache",
+			stats.dwHits, stats.dwMisses, stats.dwEvictions, stats.dwUncacheable);
+		Log::Print(PRIORITY_MESSAGE, "File cache: %u files using %u of %u KB (plus %u KB pinned)",
+			stats.dwNumEntries, (DWORD)((stats.dwBytesUsed - stats.dwBytesPinned) / 1024),
+			(DWORD)(stats.dwBytesBudget / 1024), (DWORD)(stats.dwBytesPinned / 1024));
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "../Shared/D2Shared.hpp"
+
+/*
+ *	A single decompressed file, shared by everyone who has it acquired.
+ *	@author	eezstreet
+ */
+struct FSCacheEntry
+{
+	D2MPQArchive*	pArchive;
+	fs_handle		fBlock;
+	BYTE*			pData;
+	size_t			dwSize;
+	int				nRefCount;			// Entries with references are pinned: they leave the LRU list and are never evicted
+	FSCacheEntry*	pPrev;				// LRU list (head = most recently used, unpinned entries only)
+	FSCacheEntry*	pNext;
+	FSCacheEntry*	pHashNext;			// Hash bucket chain
+};
+
+/*
+ *	Counters for sizing the cache
+ *	@author	eezstreet
+ */
+struct FSCacheStats
+{
+	DWORD			dwHits;
+	DWORD			dwMisses;
+	DWORD			dwEvictions;
+	DWORD			dwUncacheable;		// Files that were too big to be cached
+	size_t			dwBytesUsed;
+	size_t			dwBytesPinned;		// Part of dwBytesUsed that's held by someone and doesn't count against the budget
+	size_t			dwBytesBudget;
+	DWORD			dwNumEntries;
+};
+
+// FileSystem_Cache.cpp
+namespace FSCache
+{
+	void Init(size_t dwBudget);
+	void Shutdown();
+	FSCacheEntry* Acquire(D2MPQArchive* pArchive, fs_handle fBlock);
+	void Release(FSCacheEntry* pEntry);
+	void GetStats(FSCacheStats* pStats);
+	void LogStats();
+}
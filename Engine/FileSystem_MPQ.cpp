@@ -1,6 +1,10 @@
 #include "FileSystem_MPQ.hpp"
+#include "FileSystem.hpp"
 #include "Logging.hpp"
 #include "MPQ.hpp"
+#include "OD2Pak.hpp"
+
+#define MAX_MPQ_SEARCH_PATHS	64
 
 /*
  *	The MPQ file system is an extension of the original filesystem.
@@ -22,11 +26,134 @@ namespace FSMPQ
 	// The first element of gpMPQSearchPaths is what gets searched for assets first (if no name is specified)
 	static MPQSearchPath* gpMPQSearchPaths;
 
+	/*
+	 *	Merged index of every file in every archive on the search path.
+	 *	Maps the two MPQ name hashes of a path straight to the archive/block that wins under the search path
+	 *	precedence, so an unnamed lookup is one hash of the filename and (usually) one probe.
+	 */
+	struct MPQIndexEntry
+	{
+		DWORD			dwName1;
+		DWORD			dwName2;
+		D2MPQArchive*	pArchive;		// nullptr if this slot is empty
+		fs_handle		fBlock;
+	};
+
+	static MPQIndexEntry* gpFileIndex = nullptr;
+	static DWORD gdwFileIndexMask = 0;
+
+	// The search path (and the index built from it) only changes while Init runs. Lookups don't take a lock, so
+	// adding an archive any later could pull the index out from under a lookup on another thread.
+	static bool gbInInit = false;
+
+	/*
+	 *	Finds the slot in the index that belongs to a pair of name hashes.
+	 *	This is either the slot that holds the file, or the empty slot where it would go.
+	 */
+	static MPQIndexEntry* FindIndexSlot(DWORD dwName1, DWORD dwName2)
+	{
+		DWORD dwIndex = dwName1 & gdwFileIndexMask;
+
+		while (gpFileIndex[dwIndex].pArchive != nullptr)
+		{
+			if (gpFileIndex[dwIndex].dwName1 == dwName1 && gpFileIndex[dwIndex].dwName2 == dwName2)
+			{
+				break;
+			}
+			dwIndex = (dwIndex + 1) & gdwFileIndexMask;
+		}
+		return &gpFileIndex[dwIndex];
+	}
+
+	/*
+	 *	Adds all of the files of an archive to the index.
+	 *	Archives have to be added from lowest to highest precedence, since later ones override earlier ones.
+	 */
+	static void IndexArchive(D2MPQArchive* pArchive)
+	{
+		DWORD dwName1, dwName2;
+		fs_handle fBlock;
+
+		for (DWORD i = 0; i < pArchive->dwNumHashEntries; i++)
+		{
+			if (!MPQ::GetHashEntry(pArchive, i, &dwName1, &dwName2, &fBlock))
+			{
+				continue;
+			}
+
+			MPQIndexEntry* pSlot = FindIndexSlot(dwName1, dwName2);
+			if (pSlot->pArchive == pArchive)
+			{	// Same name twice in one archive (different locale) - MPQ::FetchHandle would find the first one
+				continue;
+			}
+
+			pSlot->dwName1 = dwName1;
+			pSlot->dwName2 = dwName2;
+			pSlot->pArchive = pArchive;
+			pSlot->fBlock = fBlock;
+		}
+	}
+
+	/*
+	 *	Builds the merged file index from the search path, once Init has put every archive on it
+	 */
+	static void BuildFileIndex()
+	{
+		D2MPQArchive* pArchives[MAX_MPQ_SEARCH_PATHS];
+		int nNumArchives = 0;
+		DWORD dwNumEntries = 0;
+		DWORD dwIndexSize = 1;
+
+		// Collect the archives, highest precedence first
+		for (MPQSearchPath* pCurrent = gpMPQSearchPaths; pCurrent != nullptr; pCurrent = pCurrent->pNext)
+		{
+			if (pCurrent->pArchive == nullptr || !pCurrent->pArchive->bOpen)
+			{
+				continue;
+			}
+
+			if (nNumArchives >= MAX_MPQ_SEARCH_PATHS)
+			{	// Too many to index, so FindFile will have to walk the search path instead
+				nNumArchives = 0;
+				break;
+			}
+			pArchives[nNumArchives++] = pCurrent->pArchive;
+			dwNumEntries += pCurrent->pArchive->dwNumBlockEntries;
+		}
+
+		free(gpFileIndex);
+		gpFileIndex = nullptr;
+		gdwFileIndexMask = 0;
+
+		if (nNumArchives == 0)
+		{
+			return;
+		}
+
+		// Keep the load factor at or below 50%
+		while (dwIndexSize < dwNumEntries * 2)
+		{
+			dwIndexSize <<= 1;
+		}
+
+		gpFileIndex = (MPQIndexEntry*)calloc(dwIndexSize, sizeof(MPQIndexEntry));
+		Log_ErrorAssertVoidReturn(gpFileIndex != nullptr);
+		gdwFileIndexMask = dwIndexSize - 1;
+
+		// Walk the stack backwards, so that the newest archives win
+		for (int i = nNumArchives - 1; i >= 0; i--)
+		{
+			IndexArchive(pArchives[i]);
+		}
+	}
+
 	/*
 	 *	Initializes the MPQ filesystem
 	 */
 	void Init()
 	{
+		gbInInit = true;
+
 		AddSearchPath("D2DATA", "d2data.mpq");
 		AddSearchPath("D2CHAR", "d2char.mpq");
 		AddSearchPath("D2SFX", "d2sfx.mpq");
@@ -42,6 +169,9 @@ namespace FSMPQ
 		AddSearchPath("D2EXPANSION", "d2XTalk.mpq");
 		AddSearchPath("D2EXPANSION", "d2XMusic.mpq");
 		AddSearchPath("PATCH_D2", "patch_d2.mpq");
+
+		BuildFileIndex();
+		gbInInit = false;
 	}
 
 	/*
@@ -66,16 +196,47 @@ namespace FSMPQ
 			free(pPrev);
 			pPrev = nullptr;
 		}
+		gpMPQSearchPaths = nullptr;
+
+		free(gpFileIndex);
+		gpFileIndex = nullptr;
+		gdwFileIndexMask = 0;
+	}
+
+	/*
+	 *	Gets the path that the .od2pak made from an MPQ would be at (d2data.mpq -> d2data.od2pak)
+	 */
+	static void GetPakPath(const char* szMPQPath, char* szPakPath, size_t dwPakPathLen)
+	{
+		char* szExtension;
+
+		D2Lib::strncpyz(szPakPath, szMPQPath, dwPakPathLen);
+		szExtension = strrchr(szPakPath, '.');
+		if (szExtension != nullptr && strchr(szExtension, '/') == nullptr && strchr(szExtension, '\\') == nullptr)
+		{
+			*szExtension = '\0';
+		}
 
-		MPQ::Cleanup();
+		if (strlen(szPakPath) + sizeof(OD2PAK_EXTENSION) <= dwPakPathLen)
+		{
+			strcat(szPakPath, OD2PAK_EXTENSION);
+		}
 	}
 
 	/*
 	 *	Adds a single MPQ to the search path.
+	 *	If there's an .od2pak next to the MPQ, that gets used instead. It goes in the same spot on the search path,
+	 *	so it wins (and loses) against the same archives that the MPQ would have.
+	 *	Only Init can do this; the search path is fixed once files start getting looked up.
 	 *	@return	A pointer to the D2MPQArchive that got loaded
 	 */
 	D2MPQArchive* AddSearchPath(char* szMPQName, char* szMPQPath)
 	{
+		char szPakPath[MAX_D2PATH]{ 0 };
+		char szFullPath[MAX_D2PATH_ABSOLUTE]{ 0 };
+
+		Log_ErrorAssertReturn(gbInInit, nullptr);
+
 		if (szMPQName == nullptr || szMPQPath == nullptr)
 		{
 			return nullptr;
@@ -92,7 +253,22 @@ namespace FSMPQ
 
 		D2Lib::strncpyz(pNew->szName, szMPQName, MAX_D2PATH);
 		D2Lib::strncpyz(pNew->szPath, szMPQPath, MAX_D2PATH);
-		MPQ::OpenMPQ(szMPQPath, szMPQName, pNew->pArchive);
+		pNew->pArchive->bOpen = false;
+
+		GetPakPath(szMPQPath, szPakPath, MAX_D2PATH);
+		if (FS::Find(szPakPath, szFullPath, MAX_D2PATH_ABSOLUTE))
+		{
+			MPQ::OpenMPQ(szPakPath, szMPQName, pNew->pArchive);
+			if (pNew->pArchive->bOpen)
+			{
+				D2Lib::strncpyz(pNew->szPath, szPakPath, MAX_D2PATH);
+			}
+		}
+
+		if (!pNew->pArchive->bOpen)
+		{
+			MPQ::OpenMPQ(szMPQPath, szMPQName, pNew->pArchive);
+		}
 		if (pNew->pArchive == nullptr)
 		{	// couldn't open MPQ
 			free(pNew->pArchive);
@@ -103,6 +279,9 @@ namespace FSMPQ
 		pNew->pNext = gpMPQSearchPaths;
 		gpMPQSearchPaths = pNew;
 
+		// Files might resolve to the new archive now
+		FS::FlushPathCache();
+
 		return pNew->pArchive;
 	}
 
@@ -119,6 +298,26 @@ namespace FSMPQ
 		MPQSearchPath* pCurrent = gpMPQSearchPaths;
 		fs_handle f;
 
+		if (szMPQName == nullptr && gpFileIndex != nullptr)
+		{	// Any archive will do, so the merged index has the answer
+			DWORD dwName1, dwName2;
+			MPQIndexEntry* pSlot;
+
+			MPQ::HashFileName(szFileName, &dwName1, &dwName2);
+			pSlot = FindIndexSlot(dwName1, dwName2);
+			if (pSlot->pArchive == nullptr)
+			{
+				return INVALID_HANDLE;
+			}
+
+			MPQ::RegisterFileName(pSlot->pArchive, pSlot->fBlock, szFileName);
+			if (pArchiveOut != nullptr)
+			{
+				*pArchiveOut = pSlot->pArchive;
+			}
+			return pSlot->fBlock;
+		}
+
 		while (pCurrent != nullptr)
 		{
 			if (szMPQName == nullptr || !D2Lib::stricmp(szMPQName, pCurrent->szName))
@@ -137,4 +336,73 @@ namespace FSMPQ
 		}
 		return INVALID_HANDLE;	// invalid handle
 	}
-}
\ No newline at end of file
+
+	/*
+	 *	Finds an archive on the search path by the name it was added with
+	 *	@return	The archive, or nullptr if nothing by that name was added
+	 *	@author	eezstreet
+	 */
+	D2MPQArchive* FindArchive(const char* szMPQName)
+	{
+		for (MPQSearchPath* pCurrent = gpMPQSearchPaths; pCurrent != nullptr; pCurrent = pCurrent->pNext)
+		{
+			if (!D2Lib::stricmp(szMPQName, pCurrent->szName))
+			{
+				return pCurrent->pArchive;
+			}
+		}
+		return nullptr;
+	}
+
+	/*
+	 *	Finds an archive on the search path by the path that it was loaded from.
+	 *	Unlike names, these are unique (all of the expansion's archives share one name).
+	 *	@return	The archive, or nullptr if nothing was loaded from that path
+	 *	@author	eezstreet
+	 */
+	D2MPQArchive* FindArchiveByPath(const char* szMPQPath)
+	{
+		for (MPQSearchPath* pCurrent = gpMPQSearchPaths; pCurrent != nullptr; pCurrent = pCurrent->pNext)
+		{
+			if (!D2Lib::stricmp(szMPQPath, pCurrent->szPath))
+			{
+				return pCurrent->pArchive;
+			}
+		}
+		return nullptr;
+	}
+
+	/*
+	 *	Gets the path that an archive was loaded from
+	 *	@return	The path, or nullptr if the archive isn't on the search path
+	 *	@author	eezstreet
+	 */
+	const char* GetArchivePath(D2MPQArchive* pArchive)
+	{
+		for (MPQSearchPath* pCurrent = gpMPQSearchPaths; pCurrent != nullptr; pCurrent = pCurrent->pNext)
+		{
+			if (pCurrent->pArchive == pArchive)
+			{
+				return pCurrent->szPath;
+			}
+		}
+		return nullptr;
+	}
+
+	/*
+	 *	Gets the name that an archive was added to the search path with
+	 *	@return	The name, or nullptr if the archive isn't on the search path
+	 *	@author	eezstreet
+	 */
+	const char* GetArchiveName(D2MPQArchive* pArchive)
+	{
+		for (MPQSearchPath* pCurrent = gpMPQSearchPaths; pCurrent != nullptr; pCurrent = pCurrent->pNext)
+		{
+			if (pCurrent->pArchive == pArchive)
+			{
+				return pCurrent->szName;
+			}
+		}
+		return nullptr;
+	}
+}
@@ -8,4 +8,8 @@ namespace FSMPQ
 	void Shutdown();
 	D2MPQArchive* AddSearchPath(char* szMPQName, char* szMPQPath);
 	fs_handle FindFile(const char* szFileName, const char* szMPQName, D2MPQArchive** pArchiveOut);
+	D2MPQArchive* FindArchive(const char* szMPQName);
+	D2MPQArchive* FindArchiveByPath(const char* szMPQPath);
+	const char* GetArchivePath(D2MPQArchive* pArchive);
+	const char* GetArchiveName(D2MPQArchive* pArchive);
 }
\ No newline at end of file
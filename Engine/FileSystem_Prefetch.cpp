@@ -0,0 +1,411 @@
+#include "FileSystem_Prefetch.hpp"
+#include "FileSystem.hpp"
+#include "FileSystem_Cache.hpp"
+#include "FileSystem_MPQ.hpp"
+#include "Logging.hpp"
+#include "MPQ.hpp"
+#include "Platform.hpp"
+#include "Threadpool.hpp"
+#include "../Libraries/sdl/SDL_atomic.h"
+#include "../Libraries/sdl/SDL_mutex.h"
+#include "../Libraries/sdl/SDL_timer.h"
+
+/*
+ *	Cold starts spend most of their time on lots of small reads out of the MPQs, one after another.
+ *	To cut that down, we record which files get read out of the MPQs while the game starts up and the player
+ *	goes through the menus, and save that list (the manifest) into the homepath.
+ *	The next time the game starts, every file in the manifest gets read in the background, on the threadpool,
+ *	while the trademark screen is up: compressed files get decompressed into the file cache and stored files
+ *	get paged in, so by the time they're actually needed they're already in memory.
+ *	Running with -npl turns all of this off.
+ */
+
+#define FSPREFETCH_MANIFEST			"prefetch.manifest"
+#define FSPREFETCH_MAGIC			0x4D32444F	// "OD2M"
+#define FSPREFETCH_VERSION			2
+#define FSPREFETCH_MAX_ENTRIES		4096
+#define FSPREFETCH_MAX_ARCHIVES		32
+#define FSPREFETCH_MAX_JOBS			2		// Leaves the rest of the workers for async loads and DCC decodes
+#define FSPREFETCH_RECORD_MSEC		60000	// Only the first minute of a session gets recorded
+#define FSPREFETCH_HASH_SIZE		(FSPREFETCH_MAX_ENTRIES * 2)
+#define FSPREFETCH_PAGE_SIZE		4096
+
+namespace FSPrefetch
+{
+#pragma pack(push,enter_include)
+#pragma pack(1)
+	struct ManifestHeader
+	{
+		DWORD	dwMagic;
+		DWORD	dwVersion;
+		DWORD	dwNumArchives;
+		DWORD	dwNumEntries;
+	};
+
+	struct ManifestEntry
+	{
+		DWORD	dwArchive;			// Index into the archive paths that follow the header
+		DWORD	dwBlock;
+		DWORD	dwFileSize;			// So that we can tell if the archive changed since it got recorded
+	};
+#pragma pack(pop,enter_include)
+
+	struct PrefetchEntry
+	{
+		D2MPQArchive*	pArchive;
+		fs_handle		fBlock;
+	};
+
+	// Recording
+	static PrefetchEntry gRecorded[FSPREFETCH_MAX_ENTRIES];
+	static DWORD gdwNumRecorded = 0;
+	static PrefetchEntry gRecordedHash[FSPREFETCH_HASH_SIZE];
+	static SDL_atomic_t gnRecording{ 0 };
+	static SDL_mutex* gpRecordMutex = nullptr;
+	static DWORD gdwRecordStartTicks = 0;
+
+	// Prefetching
+	static PrefetchEntry* gpPrefetch = nullptr;
+	static DWORD gdwNumPrefetch = 0;
+	static SDL_atomic_t gnNextPrefetch{ 0 };
+	static SDL_atomic_t gnCancelPrefetch{ 0 };
+	static D2JobCounter gPrefetchCounter{ 0 };
+
+	/*
+	 *	Reads a single file into memory, the same way that it'll get read later
+	 */
+	static void PrefetchFile(PrefetchEntry* pEntry)
+	{
+		const BYTE* pView = MPQ::GetFileView(pEntry->pArchive, pEntry->fBlock);
+
+		if (pView != nullptr)
+		{	// Stored file; touching every page is enough to get it off of the disk
+			size_t dwSize = MPQ::FileSize(pEntry->pArchive, pEntry->fBlock);
+			volatile BYTE bTouch = 0;
+
+			for (size_t i = 0; i < dwSize; i += FSPREFETCH_PAGE_SIZE)
+			{
+				bTouch += pView[i];
+			}
+			return;
+		}
+
+		FSCache::Release(FSCache::Acquire(pEntry->pArchive, pEntry->fBlock));
+	}
+
+	/*
+	 *	Works through the manifest, in order, alongside any other prefetch jobs
+	 */
+	static void T_Prefetch(void* pData)
+	{
+		int nIndex;
+
+		while (SDL_AtomicGet(&gnCancelPrefetch) == 0)
+		{
+			nIndex = SDL_AtomicAdd(&gnNextPrefetch, 1);
+			if (nIndex >= (int)gdwNumPrefetch)
+			{
+				break;
+			}
+			PrefetchFile(&gpPrefetch[nIndex]);
+		}
+	}
+
+	/*
+	 *	Reads the manifest from the last run, and works out which of its files are still where they were.
+	 *	@return	true if there is anything to prefetch
+	 */
+	static bool LoadManifest()
+	{
+		char szPath[MAX_D2PATH_ABSOLUTE]{ 0 };
+		char szFileName[MAX_D2PATH]{ FSPREFETCH_MANIFEST };
+		D2MPQArchive* pArchives[FSPREFETCH_MAX_ARCHIVES]{ 0 };
+		const BYTE* pData;
+		const ManifestHeader* pHeader;
+		const MPQName* pArchivePaths;
+		const ManifestEntry* pEntries;
+		size_t dwSize = 0;
+		size_t dwBudget, dwBytesQueued = 0;
+		FSCacheStats stats;
+
+		if (!FS::Find(szFileName, szPath, MAX_D2PATH_ABSOLUTE))
+		{	// first run
+			return false;
+		}
+
+		pData = (const BYTE*)Sys::MapFile(szPath, &dwSize);
+		if (pData == nullptr)
+		{
+			return false;
+		}
+
+		pHeader = (const ManifestHeader*)pData;
+		if (dwSize < sizeof(ManifestHeader) || pHeader->dwMagic != FSPREFETCH_MAGIC || pHeader->dwVersion != FSPREFETCH_VERSION ||
+			pHeader->dwNumArchives > FSPREFETCH_MAX_ARCHIVES || pHeader->dwNumEntries > FSPREFETCH_MAX_ENTRIES ||
+			dwSize < sizeof(ManifestHeader) + (pHeader->dwNumArchives * sizeof(MPQName)) +
+				(pHeader->dwNumEntries * sizeof(ManifestEntry)))
+		{
+			Log::Print(PRIORITY_MESSAGE, "Ignoring bad prefetch manifest %s", szPath);
+			Sys::UnmapFile((void*)pData, dwSize);
+			return false;
+		}
+
+		pArchivePaths = (const MPQName*)(pHeader + 1);
+		pEntries = (const ManifestEntry*)(pArchivePaths + pHeader->dwNumArchives);
+
+		for (DWORD i = 0; i < pHeader->dwNumArchives; i++)
+		{
+			char szArchivePath[MAX_D2PATH];
+
+			D2Lib::strncpyz(szArchivePath, pArchivePaths[i], MAX_D2PATH);
+			pArchives[i] = FSMPQ::FindArchiveByPath(szArchivePath);
+		}
+
+		// Don't prefetch so much that the cache starts throwing out things we prefetched
+		FSCache::GetStats(&stats);
+		dwBudget = stats.dwBytesBudget - (stats.dwBytesBudget / 4);
+
+		gpPrefetch = (PrefetchEntry*)malloc(sizeof(PrefetchEntry) * (pHeader->dwNumEntries + 1));
+		Log_ErrorAssertReturn(gpPrefetch != nullptr, false);
+		gdwNumPrefetch = 0;
+
+		for (DWORD i = 0; i < pHeader->dwNumEntries; i++)
+		{
+			const ManifestEntry* pEntry = &pEntries[i];
+			D2MPQArchive* pArchive;
+
+			if (pEntry->dwArchive >= pHeader->dwNumArchives || pArchives[pEntry->dwArchive] == nullptr)
+			{
+				continue;
+			}
+
+			pArchive = pArchives[pEntry->dwArchive];
+			if (pEntry->dwBlock >= pArchive->dwNumBlockEntries ||
+				MPQ::FileSize(pArchive, pEntry->dwBlock) != pEntry->dwFileSize)
+			{	// the archive changed
+				continue;
+			}
+
+			if (MPQ::GetFileView(pArchive, pEntry->dwBlock) == nullptr)
+			{
+				if (dwBytesQueued + pEntry->dwFileSize > dwBudget)
+				{
+					continue;
+				}
+				dwBytesQueued += pEntry->dwFileSize;
+			}
+
+			gpPrefetch[gdwNumPrefetch].pArchive = pArchive;
+			gpPrefetch[gdwNumPrefetch].fBlock = pEntry->dwBlock;
+			gdwNumPrefetch++;
+		}
+
+		Sys::UnmapFile((void*)pData, dwSize);
+
+		Log::Print(PRIORITY_MESSAGE, "Prefetching %u files (%u KB to decompress)",
+			gdwNumPrefetch, (DWORD)(dwBytesQueued / 1024));
+		return gdwNumPrefetch > 0;
+	}
+
+	/*
+	 *	Writes out everything that got recorded, so that the next run can prefetch it
+	 */
+	static void SaveManifest()
+	{
+		ManifestHeader header;
+		MPQName archivePaths[FSPREFETCH_MAX_ARCHIVES];
+		D2MPQArchive* pArchives[FSPREFETCH_MAX_ARCHIVES];
+		ManifestEntry* pEntries;
+		fs_handle f;
+
+		if (gdwNumRecorded == 0)
+		{	// nothing got read out of an MPQ? don't throw out the last manifest over it
+			return;
+		}
+
+		pEntries = (ManifestEntry*)malloc(sizeof(ManifestEntry) * gdwNumRecorded);
+		Log_ErrorAssertVoidReturn(pEntries != nullptr);
+
+		header.dwMagic = FSPREFETCH_MAGIC;
+		header.dwVersion = FSPREFETCH_VERSION;
+		header.dwNumArchives = 0;
+		header.dwNumEntries = 0;
+
+		for (DWORD i = 0; i < gdwNumRecorded; i++)
+		{
+			PrefetchEntry* pRecorded = &gRecorded[i];
+			DWORD dwArchive;
+
+			for (dwArchive = 0; dwArchive < header.dwNumArchives; dwArchive++)
+			{
+				if (pArchives[dwArchive] == pRecorded->pArchive)
+				{
+					break;
+				}
+			}
+
+			if (dwArchive == header.dwNumArchives)
+			{
+				// (by path, since several archives can share a name)
+				const char* szArchivePath = FSMPQ::GetArchivePath(pRecorded->pArchive);
+
+				if (szArchivePath == nullptr || header.dwNumArchives >= FSPREFETCH_MAX_ARCHIVES)
+				{
+					continue;
+				}
+
+				memset(archivePaths[dwArchive], 0, sizeof(MPQName));
+				D2Lib::strncpyz(archivePaths[dwArchive], szArchivePath, MAX_D2PATH);
+				pArchives[dwArchive] = pRecorded->pArchive;
+				header.dwNumArchives++;
+			}
+
+			pEntries[header.dwNumEntries].dwArchive = dwArchive;
+			pEntries[header.dwNumEntries].dwBlock = pRecorded->fBlock;
+			pEntries[header.dwNumEntries].dwFileSize = MPQ::FileSize(pRecorded->pArchive, pRecorded->fBlock);
+			header.dwNumEntries++;
+		}
+
+		FS::Open(FSPREFETCH_MANIFEST, &f, FS_WRITE, true);
+		if (f != INVALID_HANDLE)
+		{
+			FS::Write(f, &header, sizeof(header));
+			FS::Write(f, archivePaths, sizeof(MPQName), header.dwNumArchives);
+			FS::Write(f, pEntries, sizeof(ManifestEntry), header.dwNumEntries);
+			FS::CloseFile(f);
+		}
+
+		free(pEntries);
+	}
+
+	/*
+	 *	Stops recording, and saves what we have
+	 */
+	static void StopRecording()
+	{
+		if (SDL_AtomicGet(&gnRecording) == 0)
+		{
+			return;
+		}
+
+		SDL_LockMutex(gpRecordMutex);
+		SDL_AtomicSet(&gnRecording, 0);
+		SaveManifest();
+		SDL_UnlockMutex(gpRecordMutex);
+	}
+
+	/*
+	 *	Starts prefetching whatever was recorded last time, and starts recording for next time.
+	 *	Needs to happen after the MPQs and the file cache are up.
+	 *	@author	eezstreet
+	 */
+	void Init(bool bEnabled)
+	{
+		int nNumJobs = D2Lib::min(Threadpool::GetNumWorkers(), FSPREFETCH_MAX_JOBS);
+
+		if (!bEnabled)
+		{
+			return;
+		}
+
+		gpRecordMutex = SDL_CreateMutex();
+		memset(gRecordedHash, 0, sizeof(gRecordedHash));
+		gdwNumRecorded = 0;
+		gdwRecordStartTicks = SDL_GetTicks();
+		SDL_AtomicSet(&gnRecording, 1);
+
+		if (nNumJobs == 0 || !LoadManifest())
+		{	// no point without something to do or something to do it with
+			return;
+		}
+
+		SDL_AtomicSet(&gnNextPrefetch, 0);
+		SDL_AtomicSet(&gnCancelPrefetch, 0);
+		memset(&gPrefetchCounter, 0, sizeof(gPrefetchCounter));
+		for (int i = 0; i < nNumJobs; i++)
+		{
+			Threadpool::SpawnJob(T_Prefetch, nullptr, &gPrefetchCounter);
+		}
+	}
+
+	/*
+	 *	Stops any prefetching that hasn't happened yet, and saves the manifest if it hasn't been already.
+	 *	Has to happen before the file cache and MPQs go away.
+	 *	@author	eezstreet
+	 */
+	void Shutdown()
+	{
+		if (gpRecordMutex == nullptr)
+		{
+			return;
+		}
+
+		SDL_AtomicSet(&gnCancelPrefetch, 1);
+		Threadpool::WaitForCounter(&gPrefetchCounter);
+
+		free(gpPrefetch);
+		gpPrefetch = nullptr;
+		gdwNumPrefetch = 0;
+
+		StopRecording();
+		SDL_DestroyMutex(gpRecordMutex);
+		gpRecordMutex = nullptr;
+	}
+
+	/*
+	 *	Closes the recording window once startup is over. Runs once per frame on the main thread.
+	 *	@author	eezstreet
+	 */
+	void Update()
+	{
+		if (SDL_AtomicGet(&gnRecording) == 0)
+		{
+			return;
+		}
+
+		if (SDL_GetTicks() - gdwRecordStartTicks >= FSPREFETCH_RECORD_MSEC || gdwNumRecorded >= FSPREFETCH_MAX_ENTRIES)
+		{
+			StopRecording();
+		}
+	}
+
+	/*
+	 *	Notes that a file got read out of an MPQ, if we're still recording
+	 *	@author	eezstreet
+	 */
+	void Record(D2MPQArchive* pArchive, fs_handle fBlock)
+	{
+		DWORD dwHash;
+
+		if (SDL_AtomicGet(&gnRecording) == 0 || pArchive == nullptr || fBlock == INVALID_HANDLE)
+		{
+			return;
+		}
+
+		dwHash = (DWORD)((((size_t)pArchive >> 4) * 31) + fBlock) % FSPREFETCH_HASH_SIZE;
+
+		SDL_LockMutex(gpRecordMutex);
+		if (SDL_AtomicGet(&gnRecording) == 0 || gdwNumRecorded >= FSPREFETCH_MAX_ENTRIES)
+		{
+			SDL_UnlockMutex(gpRecordMutex);
+			return;
+		}
+
+		while (gRecordedHash[dwHash].pArchive != nullptr)
+		{
+			if (gRecordedHash[dwHash].pArchive == pArchive && gRecordedHash[dwHash].fBlock == fBlock)
+			{	// already got this one
+				SDL_UnlockMutex(gpRecordMutex);
+				return;
+			}
+			dwHash = (dwHash + 1) % FSPREFETCH_HASH_SIZE;
+		}
+
+		gRecordedHash[dwHash].pArchive = pArchive;
+		gRecordedHash[dwHash].fBlock = fBlock;
+		gRecorded[gdwNumRecorded].pArchive = pArchive;
+		gRecorded[gdwNumRecorded].fBlock = fBlock;
+		gdwNumRecorded++;
+		SDL_UnlockMutex(gpRecordMutex);
+	}
+}
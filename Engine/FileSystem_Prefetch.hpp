@@ -0,0 +1,11 @@
+#pragma once
+#include "../Shared/D2Shared.hpp"
+
+// FileSystem_Prefetch.cpp
+namespace FSPrefetch
+{
+	void Init(bool bEnabled);
+	void Shutdown();
+	void Update();
+	void Record(D2MPQArchive* pArchive, fs_handle fBlock);
+}
@@ -5,21 +5,39 @@
 //
 //	LRU (least-recently used) queues are used on the renderer for DCCs.
 //
+//	Items are kept in a list from most to least recently used, with a hash table on the side so that finding one
+//	doesn't mean walking the list. Once a queue goes over its item count or its byte budget, items fall off of the
+//	tail. Anything that has been used during the current frame is pinned, and never falls off.
+//	Items can also hold themselves in the queue (while they're still loading, for instance) by returning false from
+//	CanEvict.
+//
 
 class LRUQueueItem
 {
 public:
-	LRUQueueItem(handle i, int d) { itemHandle = i; nDirection = d; pNext = pPrev = nullptr; }
+	LRUQueueItem(handle i, int d)
+	{
+		itemHandle = i;
+		nDirection = d;
+		dwByteSize = 0;
+		dwPinnedFrame = 0;
+		pNext = pPrev = pHashNext = nullptr;
+	}
 
 	handle GetHandle() { return itemHandle; }
 	int GetDirection() { return nDirection; }
+	size_t GetByteSize() { return dwByteSize; }
+	bool CanEvict() { return true; }	// Derived classes can hide this
 
 	LRUQueueItem* pNext;
 	LRUQueueItem* pPrev;
+	LRUQueueItem* pHashNext;	// Next item in the same hash bucket
+	DWORD dwPinnedFrame;		// Last frame that this got used on
 
 protected:
 	handle itemHandle;
 	int	nDirection;
+	size_t dwByteSize;			// How much memory this is holding onto (set by the derived class)
 };
 
 template<typename T>
@@ -29,69 +47,147 @@ private:
 	T* pHead;
 	T* pTail;
 
+	LRUQueueItem** ppBuckets;
+	DWORD dwBucketMask;
+
 	DWORD dwHitCount;
 	DWORD dwMissCount;
 	DWORD dwQueryCount;
+	DWORD dwEvictionCount;
+	DWORD dwPrefetchCount;
 	DWORD dwLRUSize;
 	DWORD dwInUseCount;
+	size_t dwByteBudget;
+	size_t dwBytesInUse;
+	DWORD dwCurrentFrame;
 
-	void MoveToFront(T* pItem)
+	DWORD GetBucket(handle itemHandle, int nDirection)
 	{
-		// If this thing is the front, we don't need to do anything
-		if (pItem == pHead)
-		{
-			return;
-		}
+		return ((itemHandle * 0x9E3779B1) ^ ((DWORD)nDirection * 0x85EBCA6B)) & dwBucketMask;
+	}
 
-		// Move this item out of its current queue slot (if it exists)
+	void Unlink(T* pItem)
+	{
 		if (pItem->pPrev)
 		{
 			pItem->pPrev->pNext = pItem->pNext;
 		}
+		else
+		{
+			pHead = (T*)pItem->pNext;
+		}
+
 		if (pItem->pNext)
 		{
 			pItem->pNext->pPrev = pItem->pPrev;
 		}
-
-		// If this thing was the tail, we need to set it to the previous thing
-		if (pItem == pTail)
+		else
 		{
 			pTail = (T*)pItem->pPrev;
 		}
 
-		// Fix the pointers on the item so it points in the correct directions
+		pItem->pPrev = pItem->pNext = nullptr;
+	}
+
+	void LinkAtFront(T* pItem)
+	{
 		pItem->pPrev = nullptr;
 		pItem->pNext = pHead;
 
-		// Make the tail fall off if we exceed the size
-		if (dwInUseCount > dwLRUSize)
-		{
-			T* pOldTail = pTail;
-			pTail = (T*)pTail->pPrev;
-			delete pOldTail;
-			dwInUseCount = dwLRUSize;
-		}
-
-		// Insert this thing as the head
 		if (pHead)
 		{
 			pHead->pPrev = pItem;
 		}
 		pHead = pItem;
 
-		// ...and possibly as the tail too if there isn't one
 		if (pTail == nullptr)
 		{
 			pTail = pHead;
 		}
 	}
 
+	void MoveToFront(T* pItem)
+	{
+		// If this thing is the front, we don't need to do anything
+		if (pItem == pHead)
+		{
+			return;
+		}
+
+		Unlink(pItem);
+		LinkAtFront(pItem);
+	}
+
+	T* Insert(handle itemHandle, int nDirection)
+	{
+		DWORD dwBucket = GetBucket(itemHandle, nDirection);
+		T* pItem = new T(itemHandle, nDirection);
+
+		pItem->pHashNext = ppBuckets[dwBucket];
+		ppBuckets[dwBucket] = pItem;
+		LinkAtFront(pItem);
+
+		dwInUseCount++;
+		dwBytesInUse += pItem->GetByteSize();
+		return pItem;
+	}
+
+	void RemoveFromIndex(T* pItem)
+	{
+		LRUQueueItem** ppLink = &ppBuckets[GetBucket(pItem->GetHandle(), pItem->GetDirection())];
+
+		while (*ppLink != nullptr)
+		{
+			if (*ppLink == pItem)
+			{
+				*ppLink = pItem->pHashNext;
+				pItem->pHashNext = nullptr;
+				return;
+			}
+			ppLink = &(*ppLink)->pHashNext;
+		}
+	}
+
+	/*
+	 *	Drops items off of the tail until we're back within our limits.
+	 *	Items get moved to the front whenever they're used, so once the tail is pinned, everything else is too.
+	 */
+	void Evict()
+	{
+		while ((dwInUseCount > dwLRUSize || dwBytesInUse > dwByteBudget) &&
+			pTail != nullptr && pTail->dwPinnedFrame != dwCurrentFrame && pTail->CanEvict())
+		{
+			T* pOldTail = pTail;
+
+			Unlink(pOldTail);
+			RemoveFromIndex(pOldTail);
+			dwInUseCount--;
+			dwBytesInUse -= pOldTail->GetByteSize();
+			dwEvictionCount++;
+			delete pOldTail;
+		}
+	}
+
 public:
-	LRUQueue(DWORD dwInitialQueueSize)
+	LRUQueue(DWORD dwInitialQueueSize, size_t dwInitialByteBudget)
 	{
-		dwHitCount = dwMissCount = dwQueryCount = dwInUseCount = 0;
+		DWORD dwNumBuckets = 1;
+
+		dwHitCount = dwMissCount = dwQueryCount = dwEvictionCount = dwPrefetchCount = dwInUseCount = 0;
 		dwLRUSize = dwInitialQueueSize;
+		dwByteBudget = dwInitialByteBudget;
+		dwBytesInUse = 0;
+		dwCurrentFrame = 1;
 		pHead = pTail = nullptr;
+
+		// Keep the buckets at most half full
+		while (dwNumBuckets < dwLRUSize * 2)
+		{
+			dwNumBuckets <<= 1;
+		}
+		dwBucketMask = dwNumBuckets - 1;
+		ppBuckets = new LRUQueueItem*[dwNumBuckets];
+		memset(ppBuckets, 0, sizeof(LRUQueueItem*) * dwNumBuckets);
 	}
 
 	~LRUQueue()
@@ -104,36 +200,94 @@ public:
 			pCurrent = (T*)pCurrent->pNext;
 			delete pPrev;
 		}
+
+		delete[] ppBuckets;
+	}
+
+	/*
+	 *	Unpins everything that got used on the last frame
+	 */
+	void BeginFrame()
+	{
+		dwCurrentFrame++;
 	}
 
+	/*
+	 *	Finds an item (making it if it isn't there), and pins it for the rest of the frame
+	 */
 	T* QueryItem(handle itemHandle, int nDirection)
 	{
-		// see if it's in the LRU first
-		T* pCurrent = pHead;
+		T* pCurrent;
 
 		dwQueryCount++;
 
+		// see if it's in the LRU first
+		pCurrent = FindItem(itemHandle, nDirection);
+		if (pCurrent != nullptr)
+		{	// Mark this as a hit
+			dwHitCount++;
+			return pCurrent;
+		}
+
+		// MISS!
+		// we need to make a new LRU item and push it to the front
+		dwMissCount++;
+
+		pCurrent = Insert(itemHandle, nDirection);
+		pCurrent->dwPinnedFrame = dwCurrentFrame;
+		Evict();
+		return pCurrent;
+	}
+
+	/*
+	 *	Finds an item without making it. If it's there, it gets moved to the front and pinned for the rest of the frame.
+	 */
+	T* FindItem(handle itemHandle, int nDirection)
+	{
+		T* pCurrent = (T*)ppBuckets[GetBucket(itemHandle, nDirection)];
+
 		while (pCurrent != nullptr)
 		{
 			if (pCurrent->GetHandle() == itemHandle && pCurrent->GetDirection() == nDirection)
 			{
-				// Mark this as a hit...
-				dwHitCount++;
-				// ...move it to the front...
 				MoveToFront(pCurrent);
-				// ... and return it
+				pCurrent->dwPinnedFrame = dwCurrentFrame;
 				return pCurrent;
 			}
-			pCurrent = (T*)pCurrent->pNext;
+			pCurrent = (T*)pCurrent->pHashNext;
 		}
+		return nullptr;
+	}
 
-		// MISS!
-		// we need to make a new LRU item and push it to the front
-		dwMissCount++;
+	/*
+	 *	Makes an item ahead of time, in case it gets used soon. Prefetched items aren't pinned.
+	 *	Returns false if the item was already there.
+	 */
+	bool PrefetchItem(handle itemHandle, int nDirection)
+	{
+		T* pCurrent = (T*)ppBuckets[GetBucket(itemHandle, nDirection)];
 
-		pCurrent = new T(itemHandle, nDirection);
-		dwInUseCount++;
-		MoveToFront(pCurrent);
-		return pCurrent;
+		while (pCurrent != nullptr)
+		{
+			if (pCurrent->GetHandle() == itemHandle && pCurrent->GetDirection() == nDirection)
+			{
+				return false;
+			}
+			pCurrent = (T*)pCurrent->pHashNext;
+		}
+
+		dwPrefetchCount++;
+		Insert(itemHandle, nDirection);
+		Evict();
+		return true;
 	}
-};
\ No newline at end of file
+
+	DWORD GetHitCount() { return dwHitCount; }
+	DWORD GetMissCount() { return dwMissCount; }
+	DWORD GetQueryCount() { return dwQueryCount; }
+	DWORD GetEvictionCount() { return dwEvictionCount; }
+	DWORD GetPrefetchCount() { return dwPrefetchCount; }
+	DWORD GetInUseCount() { return dwInUseCount; }
+	size_t GetBytesInUse() { return dwBytesInUse; }
+	size_t GetByteBudget() { return dwByteBudget; }
+};
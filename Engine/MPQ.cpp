@@ -1,11 +1,16 @@
 #include "MPQ.hpp"
+#include "MPQ_ADPCM.hpp"
+#include "MPQ_Huffman.hpp"
+#include "MPQ_PKWare.hpp"
+#include "OD2Pak.hpp"
 #include "Logging.hpp"
 #include "FileSystem.hpp"
+#include "Platform.hpp"
+#include "Threadpool.hpp"
+#include "../Libraries/sdl/SDL_atomic.h"
 #include <memory>
 #include <assert.h>
-#include "../Libraries/adpcm/adpcm.h"
 #include "../Libraries/huffman/huff.h"
-#include "../Libraries/pkware/pklib.h"
 
 #define MPQ_HASH_TABLE_INDEX    0x000
 #define MPQ_HASH_NAME_A         0x100
@@ -62,7 +67,9 @@ namespace MPQ
 		0xF0, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF
 	};
 
-	static DWORD gdwFileHeaderBuffer[0x5A000];
+	// Encryption/hashing table, shared by every archive
+	static DWORD gdwSlackSpace[0x500];
+	static bool gbSlackSpaceReady = false;
 
 	/*
 	 *	Finds the header of the MPQ file.
@@ -79,39 +86,54 @@ namespace MPQ
 	static DWORD gdwSecondHeader = 0x00000020;
 #endif
 
-	static bool ParseMPQHeader(D2MPQArchive* pMPQ)
+	/*
+	 *	Reads a range of bytes from the archive.
+	 *	Mapped archives are served straight out of the view; otherwise we do a positional read on the FS handle.
+	 *	Neither touches any shared seek position, so this is safe to call from several threads at once.
+	 *	@return	The number of bytes read
+	 */
+	static size_t ReadArchiveData(D2MPQArchive* pMPQ, DWORD dwOffset, void* pBuffer, DWORD dwLength)
 	{
-		DWORD dwFirstByte;
-		DWORD dwSecondByte;
-		WORD wVersion = 0;
+		if (pMPQ->pMappedData != nullptr)
+		{
+			if (dwOffset >= pMPQ->dwMappedSize)
+			{
+				return 0;
+			}
 
-		FS::Read(pMPQ->f, &dwFirstByte);
-		FS::Read(pMPQ->f, &dwSecondByte);
+			if (dwLength > pMPQ->dwMappedSize - dwOffset)
+			{
+				dwLength = pMPQ->dwMappedSize - dwOffset;
+			}
 
-		Log_ErrorAssertReturn(dwFirstByte == gdwFirstHeader && dwSecondByte == gdwSecondHeader, false);
+			memcpy(pBuffer, pMPQ->pMappedData + dwOffset, dwLength);
+			return dwLength;
+		}
 
-		// Read length of file data
-		FS::Read(pMPQ->f, &pMPQ->dwArchiveSize);
+		return FS::ReadAt(pMPQ->f, dwOffset, pBuffer, dwLength);
+	}
 
-		// Read the version number. This HAS to be 0.
-		FS::Read(pMPQ->f, &wVersion, sizeof(WORD));
-		Log_ErrorAssertReturn(wVersion == 0, false);
+	static bool ParseMPQHeader(D2MPQArchive* pMPQ)
+	{
+		MPQHeader header;
 
-		// Read sector size
-		FS::Read(pMPQ->f, &pMPQ->wSectorSize, sizeof(WORD));
-		pMPQ->wSectorSize = 0x1000;	// magic
+		Log_ErrorAssertReturn(ReadArchiveData(pMPQ, 0, &header, sizeof(header)) == sizeof(header), false);
+		Log_ErrorAssertReturn(header.dwID == gdwFirstHeader && header.dwHeaderSize == gdwSecondHeader, false);
 
-		// Read offset to hash table
-		FS::Read(pMPQ->f, &pMPQ->dwHashOffset);
+		// Length of file data
+		pMPQ->dwArchiveSize = header.dwArchiveSize;
 
-		// Read offset to block table
-		FS::Read(pMPQ->f, &pMPQ->dwBlockOffset);
+		// The version number HAS to be 0.
+		Log_ErrorAssertReturn(header.wFormatVersion == 0, false);
 
-		// Read length of hash table
-		FS::Read(pMPQ->f, &pMPQ->dwNumHashEntries);
+		// Sector size
+		pMPQ->wSectorSize = 0x1000;	// magic
 
-		// Read length of block table
-		FS::Read(pMPQ->f, &pMPQ->dwNumBlockEntries);
+		// Offsets to and lengths of the hash and block tables
+		pMPQ->dwHashOffset = header.dwHashTablePos;
+		pMPQ->dwBlockOffset = header.dwBlockTablePos;
+		pMPQ->dwNumHashEntries = header.dwHashTableSize;
+		pMPQ->dwNumBlockEntries = header.dwBlockTableSize;
 
 		pMPQ->dwFileCount = pMPQ->dwNumBlockEntries; // the number of files is equivalent to the number of blocks (?)
 
@@ -123,7 +145,7 @@ namespace MPQ
 	 *	Converts slashes into backslashes.
 	 *	@author	Zezula
 	 */
-	static DWORD HashString(D2MPQArchive* pMPQ, const char * szFileName, DWORD dwHashType)
+	static DWORD HashString(const char * szFileName, DWORD dwHashType)
 	{
 		DWORD  dwSeed1 = 0x7FED7FED;
 		DWORD  dwSeed2 = 0xEEEEEEEE;
@@ -135,7 +157,7 @@ namespace MPQ
 			// DON'T convert slash (0x2F) to backslash (0x5C)
 			ch = AsciiToUpperTable[*szFileName++];
 
-			dwSeed1 = pMPQ->dwSlackSpace[dwHashType + ch] ^ (dwSeed1 + dwSeed2);
+			dwSeed1 = gdwSlackSpace[dwHashType + ch] ^ (dwSeed1 + dwSeed2);
 			dwSeed2 = ch + dwSeed1 + dwSeed2 + (dwSeed2 << 5) + 3;
 		}
 
@@ -147,7 +169,7 @@ namespace MPQ
 	 *	Does NOT convert slashes to backslashes.
 	 *	@author	Zezula
 	 */
-	static DWORD HashStringSlash(D2MPQArchive* pMPQ, const char * szFileName, DWORD dwHashType)
+	static DWORD HashStringSlash(const char * szFileName, DWORD dwHashType)
 	{
 		DWORD  dwSeed1 = 0x7FED7FED;
 		DWORD  dwSeed2 = 0xEEEEEEEE;
@@ -159,7 +181,7 @@ namespace MPQ
 			// DON'T convert slash (0x2F) to backslash (0x5C)
 			ch = AsciiToUpperTable_Slash[*szFileName++];
 
-			dwSeed1 = pMPQ->dwSlackSpace[dwHashType + ch] ^ (dwSeed1 + dwSeed2);
+			dwSeed1 = gdwSlackSpace[dwHashType + ch] ^ (dwSeed1 + dwSeed2);
 			dwSeed2 = ch + dwSeed1 + dwSeed2 + (dwSeed2 << 5) + 3;
 		}
 
@@ -170,14 +192,14 @@ namespace MPQ
 	 *	Determine file key
 	 *	@author	Zezula
 	 */
-	DWORD DecryptFileKey(D2MPQArchive* pMPQ, char * szFileName, unsigned long long MpqPos, DWORD dwFileSize, DWORD dwFlags)
+	DWORD DecryptFileKey(char * szFileName, unsigned long long MpqPos, DWORD dwFileSize, DWORD dwFlags)
 	{
 		DWORD dwFileKey;
 		DWORD dwMpqPos = (DWORD)MpqPos;
 
 		// File key is calculated from plain name
 		szFileName = D2Lib::fnbld(szFileName);
-		dwFileKey = HashString(pMPQ, szFileName, MPQ_HASH_FILE_KEY);
+		dwFileKey = HashString(szFileName, MPQ_HASH_FILE_KEY);
 
 		// Fix the key, if needed
 		if (dwFlags & MPQ_FILE_FIX_KEY)
@@ -283,7 +305,7 @@ namespace MPQ
 	 *	Decrypt an MPQ block
 	 *	@author	Zezula
 	 */
-	static void DecryptMPQBlock(D2MPQArchive* pArchive, void * pvDataBlock, DWORD dwLength, DWORD dwKey1)
+	static void DecryptMPQBlock(void * pvDataBlock, DWORD dwLength, DWORD dwKey1)
 	{
 		DWORD* DataBlock = (DWORD*)pvDataBlock;
 		DWORD dwValue32;
@@ -296,7 +318,7 @@ namespace MPQ
 		for (DWORD i = 0; i < dwLength; i++)
 		{
 			// Modify the second key
-			dwKey2 += pArchive->dwSlackSpace[MPQ_HASH_KEY2_MIX + (dwKey1 & 0xFF)];
+			dwKey2 += gdwSlackSpace[MPQ_HASH_KEY2_MIX + (dwKey1 & 0xFF)];
 
 			DataBlock[i] = DataBlock[i] ^ (dwKey1 + dwKey2);
 			dwValue32 = DataBlock[i];
@@ -308,16 +330,21 @@ namespace MPQ
 
 	/*
 	 *	Initialize MPQ scratch space
+	 *	The table is the same for every archive, so it only gets built the first time an MPQ is opened.
 	 *	@author Zezula
 	 */
-	static void InitScratchSpace(D2MPQArchive* pMPQ)
+	static void InitScratchSpace()
 	{
-		// FIXME: precalculate this table and copy it to memory
 		DWORD dwSeed = 0x00100001;
 		DWORD index1 = 0;
 		DWORD index2 = 0;
 		int   i;
 
+		if (gbSlackSpaceReady)
+		{
+			return;
+		}
+
 		for (index1 = 0; index1 < 0x100; index1++)
 		{
 			for (index2 = index1, i = 0; i < 5; i++, index2 += 0x100)
@@ -330,9 +357,11 @@ namespace MPQ
 				dwSeed = (dwSeed * 125 + 3) % 0x2AAAAB;
 				temp2 = (dwSeed & 0xFFFF);
 
-				pMPQ->dwSlackSpace[index2] = (temp1 | temp2);
+				gdwSlackSpace[index2] = (temp1 | temp2);
 			}
 		}
+
+		gbSlackSpaceReady = true;
 	}
 
 	/*
@@ -375,8 +404,11 @@ namespace MPQ
 	 */
 	static bool AllocateComputeMPQBlockHash(D2MPQArchive* pMPQ)
 	{
-		// Initialize the scratch space
-		InitScratchSpace(pMPQ);
+		// Initialize the scratch space and decoding tables
+		InitScratchSpace();
+		MPQADPCM::Init();
+		MPQHuffman::Init();
+		MPQPKWare::Init();
 
 		// Allocate, read and decrypt hash table
 		pMPQ->pHashTable = (MPQHash*)malloc(sizeof(MPQHash) * pMPQ->dwNumHashEntries);
@@ -384,9 +416,8 @@ namespace MPQ
 		{
 			return false; // ran out of memory - throw error?
 		}
-		FS::Seek(pMPQ->f, pMPQ->dwHashOffset, FS_SEEK_SET);
-		FS::Read(pMPQ->f, pMPQ->pHashTable, sizeof(MPQHash), pMPQ->dwNumHashEntries);
-		DecryptMPQBlock(pMPQ, pMPQ->pHashTable, sizeof(MPQHash) * pMPQ->dwNumHashEntries, MPQ_KEY_HASH_TABLE);
+		ReadArchiveData(pMPQ, pMPQ->dwHashOffset, pMPQ->pHashTable, sizeof(MPQHash) * pMPQ->dwNumHashEntries);
+		DecryptMPQBlock(pMPQ->pHashTable, sizeof(MPQHash) * pMPQ->dwNumHashEntries, MPQ_KEY_HASH_TABLE);
 
 		// Allocate, read and decrypt block table
 		pMPQ->pBlockTable = (MPQBlock*)malloc(sizeof(MPQBlock) * pMPQ->dwNumBlockEntries);
@@ -394,9 +425,8 @@ namespace MPQ
 		{
 			return false; // ran out of memory - throw error?
 		}
-		FS::Seek(pMPQ->f, pMPQ->dwBlockOffset, FS_SEEK_SET);
-		FS::Read(pMPQ->f, pMPQ->pBlockTable, sizeof(MPQBlock), pMPQ->dwNumBlockEntries);
-		DecryptMPQBlock(pMPQ, pMPQ->pBlockTable, sizeof(MPQBlock) * pMPQ->dwNumBlockEntries, MPQ_KEY_BLOCK_TABLE);
+		ReadArchiveData(pMPQ, pMPQ->dwBlockOffset, pMPQ->pBlockTable, sizeof(MPQBlock) * pMPQ->dwNumBlockEntries);
+		DecryptMPQBlock(pMPQ->pBlockTable, sizeof(MPQBlock) * pMPQ->dwNumBlockEntries, MPQ_KEY_BLOCK_TABLE);
 
 		// Allocate name table
 		pMPQ->pNameTable = (MPQName*)calloc(pMPQ->dwNumBlockEntries, sizeof(MPQName));
@@ -406,20 +436,56 @@ namespace MPQ
 	}
 
 	/*
-	 *	Opens an MPQ at szMPQPath with name szMPQName.
+	 *	Opens an MPQ (or an .od2pak) at szMPQPath with name szMPQName.
+	 *	We try to map the whole archive into memory first, so that the tables and sectors can be read
+	 *	without going through stdio. If that fails (32-bit address space exhausted, etc) we fall back to the FS.
 	 */
 	void OpenMPQ(char* szMPQPath, const char* szMPQName, D2MPQArchive* pMPQ)
 	{
+		char szFullPath[MAX_D2PATH_ABSOLUTE]{ 0 };
+		char szRelativePath[MAX_D2PATH]{ 0 };
+		DWORD dwID;
+
 		if (!pMPQ)
 		{	// should never happen
 			return;
 		}
 
 		memset(pMPQ, 0, sizeof(D2MPQArchive));
+		pMPQ->f = INVALID_HANDLE;
+
+		D2Lib::strncpyz(szRelativePath, szMPQPath, MAX_D2PATH);
+		if (FS::Find(szRelativePath, szFullPath, MAX_D2PATH_ABSOLUTE))
+		{
+			pMPQ->pMappedData = (BYTE*)Sys::MapFile(szFullPath, &pMPQ->dwMappedSize);
+		}
+
+		if (pMPQ->pMappedData == nullptr)
+		{
+			DWORD dwMPQSize = FS::Open(szMPQPath, &pMPQ->f, FS_READ, true);
+			if (!dwMPQSize || pMPQ->f == INVALID_HANDLE)
+			{	// couldn't load MPQ - throw error?
+				return;
+			}
+		}
 
-		DWORD dwMPQSize = FS::Open(szMPQPath, &pMPQ->f, FS_READ, true);
-		if (!dwMPQSize || pMPQ->f == INVALID_HANDLE)
-		{	// couldn't load MPQ - throw error?
+		if (ReadArchiveData(pMPQ, 0, &dwID, sizeof(dwID)) == sizeof(dwID) && OD2Pak::IsPak(&dwID, sizeof(dwID)))
+		{	// One of our own paks, which has nothing to decrypt or decompress
+			InitScratchSpace();
+			pMPQ->bOpen = OD2Pak::Open(pMPQ);
+			if (!pMPQ->bOpen)
+			{	// Let go of it, so that the caller can fall back to the MPQ that it was made from
+				if (pMPQ->pMappedData != nullptr)
+				{
+					Sys::UnmapFile(pMPQ->pMappedData, pMPQ->dwMappedSize);
+					pMPQ->pMappedData = nullptr;
+				}
+				else
+				{
+					FS::CloseFile(pMPQ->f);
+					pMPQ->f = INVALID_HANDLE;
+				}
+			}
 			return;
 		}
 
@@ -447,13 +513,23 @@ namespace MPQ
 		{
 			return;
 		}
-		// Close the file handle
-		FS::CloseFile(pMPQ->f);
+
+		// Close the file handle or release the view
+		if (pMPQ->pMappedData != nullptr)
+		{
+			Sys::UnmapFile(pMPQ->pMappedData, pMPQ->dwMappedSize);
+			pMPQ->pMappedData = nullptr;
+		}
+		else
+		{
+			FS::CloseFile(pMPQ->f);
+		}
 
 		// Free the hash, name and block tables
 		free(pMPQ->pHashTable);
 		free(pMPQ->pBlockTable);
 		free(pMPQ->pNameTable);
+		free(pMPQ->pPakEntries);
 
 		// Free sector offset table (if present)
 		if (pMPQ->pSectorOffsets != nullptr)
@@ -462,6 +538,33 @@ namespace MPQ
 		}
 	}
 
+	/*
+	 *	Computes the two name hashes that identify a file in every archive's hash table.
+	 *	These don't depend on the archive, so callers that look in several archives only need to do this once.
+	 *	@author	eezstreet
+	 */
+	void HashFileName(const char* szFileName, DWORD* pdwName1, DWORD* pdwName2)
+	{
+		InitScratchSpace();
+		*pdwName1 = HashStringSlash(szFileName, MPQ_HASH_NAME_A);
+		*pdwName2 = HashStringSlash(szFileName, MPQ_HASH_NAME_B);
+	}
+
+	/*
+	 *	Remembers the name of a file, which we need for decrypting it.
+	 *	Names are only written the first time, and only under the name lock, so readers never see a half-written one.
+	 *	@author	eezstreet
+	 */
+	void RegisterFileName(D2MPQArchive* pMPQ, fs_handle fFile, const char* szFileName)
+	{
+		SDL_AtomicLock(&pMPQ->nNameLock);
+		if (pMPQ->pNameTable[fFile][0] == '\0')
+		{
+			D2Lib::strncpyz(pMPQ->pNameTable[fFile], szFileName, MAX_D2PATH);
+		}
+		SDL_AtomicUnlock(&pMPQ->nNameLock);
+	}
+
 	/*
 	 *	Retrieves a file number (file handle) from the archive
 	 *	@author	Zezula/eezstreet
@@ -469,9 +572,9 @@ namespace MPQ
 	fs_handle FetchHandle(D2MPQArchive* pMPQ, const char* szFileName)
 	{
 		DWORD dwHashIndexMask = pMPQ->dwNumHashEntries - 1;
-		DWORD dwStartIndex = HashStringSlash(pMPQ, szFileName, MPQ_HASH_TABLE_INDEX);
-		DWORD dwName1 = HashStringSlash(pMPQ, szFileName, MPQ_HASH_NAME_A);
-		DWORD dwName2 = HashStringSlash(pMPQ, szFileName, MPQ_HASH_NAME_B);
+		DWORD dwStartIndex = HashStringSlash(szFileName, MPQ_HASH_TABLE_INDEX);
+		DWORD dwName1 = HashStringSlash(szFileName, MPQ_HASH_NAME_A);
+		DWORD dwName2 = HashStringSlash(szFileName, MPQ_HASH_NAME_B);
 		DWORD dwIndex;
 
 		if (!pMPQ->bOpen)
@@ -479,6 +582,17 @@ namespace MPQ
 			return (fs_handle)-1;
 		}
 
+		if (pMPQ->pPakEntries != nullptr)
+		{	// Paks keep their entries sorted instead of hashed
+			fs_handle f = OD2Pak::FindEntry(pMPQ, dwName1, dwName2);
+
+			if (f != INVALID_HANDLE)
+			{
+				RegisterFileName(pMPQ, f, szFileName);
+			}
+			return f;
+		}
+
 		dwStartIndex = dwIndex = (dwStartIndex & dwHashIndexMask);
 
 		while (true)
@@ -495,7 +609,7 @@ namespace MPQ
 			if (pHash->dwMethodA == dwName1 && pHash->dwMethodB == dwName2 && dwBlockIndex < pMPQ->dwNumBlockEntries)
 			{
 				// Copy name to name table
-				D2Lib::strncpyz(pMPQ->pNameTable[dwBlockIndex], szFileName, MAX_D2PATH);
+				RegisterFileName(pMPQ, (fs_handle)dwBlockIndex, szFileName);
 				return (fs_handle)dwBlockIndex;
 			}
 
@@ -511,6 +625,39 @@ namespace MPQ
 		return INVALID_HANDLE;
 	}
 
+	/*
+	 *	Gets the block that a hash table entry points to.
+	 *	Used to build indices that span several archives.
+	 *	@return	false if the entry is empty, deleted or points outside of the block table
+	 */
+	bool GetHashEntry(D2MPQArchive* pMPQ, DWORD dwHashIndex, DWORD* pdwName1, DWORD* pdwName2, fs_handle* pfFile)
+	{
+		MPQHash* pHash;
+		DWORD dwBlockIndex;
+
+		if (!pMPQ->bOpen || dwHashIndex >= pMPQ->dwNumHashEntries)
+		{
+			return false;
+		}
+
+		if (pMPQ->pPakEntries != nullptr)
+		{
+			return OD2Pak::GetEntry(pMPQ, dwHashIndex, pdwName1, pdwName2, pfFile);
+		}
+
+		pHash = &pMPQ->pHashTable[dwHashIndex];
+		dwBlockIndex = GetHashBlockIndex(pHash);
+		if (pHash->dwBlockEntry >= 0xFFFFFFFE || dwBlockIndex >= pMPQ->dwNumBlockEntries)
+		{	// 0xFFFFFFFF is an empty entry, 0xFFFFFFFE is a deleted one
+			return false;
+		}
+
+		*pdwName1 = pHash->dwMethodA;
+		*pdwName2 = pHash->dwMethodB;
+		*pfFile = (fs_handle)dwBlockIndex;
+		return true;
+	}
+
 	/*
 	 *	Retrieves the (decompressed) size of a file in an archive
 	 *	@author	eezstreet
@@ -535,94 +682,30 @@ namespace MPQ
 	 *	@author Zezula / Paul Siramy / eezstreet
 	 */
 
-	typedef struct
-	{
-		unsigned char * pbInBuff;           // Pointer to input data buffer
-		unsigned char * pbInBuffEnd;        // End of the input buffer
-		unsigned char * pbOutBuff;          // Pointer to output data buffer
-		unsigned char * pbOutBuffEnd;       // Pointer to output data buffer
-	} TDataInfo;
-
-	static unsigned int ReadPKWare(char* buf, unsigned int* size, void* param)
-	{
-		TDataInfo * pInfo = (TDataInfo *)param;
-		unsigned int nMaxAvail = (unsigned int)(pInfo->pbInBuffEnd - pInfo->pbInBuff);
-		unsigned int nToRead = *size;
-
-		// Check the case when not enough data available
-		if (nToRead > nMaxAvail)
-			nToRead = nMaxAvail;
-
-		// Load data and increment offsets
-		memcpy(buf, pInfo->pbInBuff, nToRead);
-		pInfo->pbInBuff += nToRead;
-		assert(pInfo->pbInBuff <= pInfo->pbInBuffEnd);
-		return nToRead;
-	}
-
-	static void WritePKWare(char* buf, unsigned int* size, void* param)
-	{
-		TDataInfo * pInfo = (TDataInfo *)param;
-		unsigned int nMaxWrite = (unsigned int)(pInfo->pbOutBuffEnd - pInfo->pbOutBuff);
-		unsigned int nToWrite = *size;
-
-		// Check the case when not enough space in the output buffer
-		if (nToWrite > nMaxWrite)
-			nToWrite = nMaxWrite;
-
-		// Write output data and increments offsets
-		memcpy(pInfo->pbOutBuff, buf, nToWrite);
-		pInfo->pbOutBuff += nToWrite;
-		assert(pInfo->pbOutBuff <= pInfo->pbOutBuffEnd);
-	}
-
 	static void MPQDecompress_PKWare(void* pInBuffer, DWORD* dwInRead, void* pOutBuffer, DWORD* dwOutRead)
 	{
-		TDataInfo Info;                             // Data information
-		char * work_buf = (char*)malloc(EXP_BUFFER_SIZE);// Pklib's work buffer
-
-														 // Handle no-memory condition
-		if (work_buf == NULL)
-			return;
-
-		// Fill data information structure
-		memset(work_buf, 0, EXP_BUFFER_SIZE);
-		Info.pbInBuff = (unsigned char *)pInBuffer;
-		Info.pbInBuffEnd = (unsigned char *)pInBuffer + *dwInRead;
-		Info.pbOutBuff = (unsigned char *)pOutBuffer;
-		Info.pbOutBuffEnd = (unsigned char *)pOutBuffer + *dwOutRead;
-
-		// Do the decompression
-		explode(ReadPKWare, WritePKWare, work_buf, &Info);
+		DWORD dwWritten = MPQPKWare::Explode(pOutBuffer, *dwOutRead, pInBuffer, *dwInRead);
 
-		// If PKLIB is unable to decompress the data, return 0;
-		if (Info.pbOutBuff == pOutBuffer)
+		// If the data couldn't be decompressed at all, the count gets left alone (same as it always has been)
+		if (dwWritten > 0)
 		{
-			free(work_buf);
-			return;
+			*dwOutRead = dwWritten;
 		}
-
-		// Give away the number of decompressed bytes
-		*dwOutRead = (int)(Info.pbOutBuff - (unsigned char *)pOutBuffer);
-		free(work_buf);
 	}
 
 	static void MPQDecompress_Huffmann(void* pInBuffer, DWORD* dwInRead, void* pOutBuffer, DWORD* dwOutRead)
 	{
-		THuffmannTree ht(false);
-		TInputStream is(pInBuffer, *dwInRead);
-
-		*dwOutRead = ht.Decompress(pOutBuffer, *dwOutRead, &is);
+		*dwOutRead = MPQHuffman::Decompress(pOutBuffer, *dwOutRead, pInBuffer, *dwInRead);
 	}
 
 	static void MPQDecompress_PCMMono(void* pInBuffer, DWORD* dwInRead, void* pOutBuffer, DWORD* dwOutRead)
 	{
-		*dwOutRead = ::DecompressADPCM(pOutBuffer, *dwOutRead, pInBuffer, *dwInRead, 1);
+		*dwOutRead = MPQADPCM::Decompress(pOutBuffer, *dwOutRead, pInBuffer, *dwInRead, 1);
 	}
 
 	static void MPQDecompress_PCMStereo(void* pInBuffer, DWORD* dwInRead, void* pOutBuffer, DWORD* dwOutRead)
 	{
-		*dwOutRead = ::DecompressADPCM(pOutBuffer, *dwOutRead, pInBuffer, *dwInRead, 2);
+		*dwOutRead = MPQADPCM::Decompress(pOutBuffer, *dwOutRead, pInBuffer, *dwInRead, 2);
 	}
 
 	/*
@@ -641,28 +724,302 @@ namespace MPQ
 		{0, nullptr},
 	};
 
+	/*
+	 *	Runs a sector through every compression model named in nMethod.
+	 *	The output of one model is piped into the next one via pScratch, so pInput is never written to
+	 *	(which means it can point straight into a mapped archive).
+	 *	@return	The number of bytes written to pOutput
+	 */
+	static DWORD DecompressSector(BYTE nMethod, BYTE* pInput, DWORD dwInputLength, BYTE* pOutput, DWORD dwOutputLength, BYTE* pScratch)
+	{
+		DWORD dwBufferFilled = 0;
+		bool bPiped = false;
+
+		for (int j = 0; CompressionModels[j].pFunc != nullptr; j++)
+		{
+			if (nMethod & CompressionModels[j].nCompressionType)
+			{
+				if (bPiped)
+				{	// Pipe previous output into new input
+					memcpy(pScratch, pOutput, dwBufferFilled);
+					pInput = pScratch;
+					dwInputLength = dwBufferFilled;
+				}
+
+				dwBufferFilled = dwOutputLength;
+				CompressionModels[j].pFunc(pInput, &dwInputLength, pOutput, &dwBufferFilled);
+				bPiped = true;
+			}
+		}
+
+		return dwBufferFilled;
+	}
+
+#define MPQ_SECTOR_SCRATCH_SIZE		0x1000	// Must be able to hold one whole sector
+#define MPQ_LOCAL_SECTOR_TABLE_SIZE	0x100	// Files up to 1MB don't need to allocate their sector table
+#define MPQ_PARALLEL_THRESHOLD		0x40000	// Compressed files at least this big get their sectors decompressed in parallel
+#define MPQ_PARALLEL_SECTORS		16		// Number of sectors that a worker claims at once
+
+	/*
+	 *	Reads, decrypts and decompresses a single sector of a compressed file.
+	 *	pScratch must be at least MPQ_SECTOR_SCRATCH_SIZE bytes. pOutput must be able to hold one whole sector.
+	 *	@return	false if the sector table is corrupt
+	 */
+	static bool ReadSector(D2MPQArchive* pMPQ, MPQBlock* pBlock, DWORD* pSectorOffsets, DWORD dwSector, DWORD dwEncryptionKey,
+		BYTE* pOutput, BYTE* pScratch, DWORD* pdwWritten)
+	{
+		DWORD dwSectorPos = pBlock->dwFilePos + pSectorOffsets[dwSector];
+		DWORD dwBlockLengthRead = pSectorOffsets[dwSector + 1] - pSectorOffsets[dwSector];
+		DWORD dwExpectedLength = pBlock->dwFSize - (dwSector * pMPQ->wSectorSize);
+		bool bEncrypted = (pBlock->dwFlags & MPQ_FILE_ENCRYPTED) != 0;
+		BYTE* pSector;
+		BYTE nMethod = 0;
+
+		*pdwWritten = 0;
+
+		if (dwExpectedLength > pMPQ->wSectorSize)
+		{
+			dwExpectedLength = pMPQ->wSectorSize;
+		}
+
+		if (pMPQ->pMappedData != nullptr && !bEncrypted)
+		{	// Decompress straight out of the view
+			if (dwSectorPos > pMPQ->dwMappedSize || dwBlockLengthRead > pMPQ->dwMappedSize - dwSectorPos)
+			{	// corrupt sector table
+				return false;
+			}
+			pSector = pMPQ->pMappedData + dwSectorPos;
+		}
+		else
+		{
+			if (dwBlockLengthRead > MPQ_SECTOR_SCRATCH_SIZE)
+			{	// corrupt sector table
+				return false;
+			}
+
+			dwBlockLengthRead = ReadArchiveData(pMPQ, dwSectorPos, pScratch, dwBlockLengthRead);
+			pSector = pScratch;
+
+			// Decrypt it!
+			if (bEncrypted)
+			{
+				DecryptMPQBlock(pSector, dwBlockLengthRead, dwEncryptionKey + dwSector);
+			}
+		}
+
+		if (dwBlockLengthRead == dwExpectedLength)
+		{	// This sector wasn't worth compressing, so it got stored as-is
+			memcpy(pOutput, pSector, dwBlockLengthRead);
+			*pdwWritten = dwBlockLengthRead;
+			return true;
+		}
+
+		if (pBlock->dwFlags & MPQ_FILE_IMPLODE)
+		{	// Diablo 1 style compression (PKWARE)
+			nMethod = MPQ_COMPRESSION_PKWARE;
+		}
+		else if (pBlock->dwFlags & MPQ_FILE_COMPRESS)
+		{	// StarCraft and Diablo 2 style compression (mixed method)
+			nMethod = *(pSector);
+			pSector++;
+			dwBlockLengthRead--;
+		}
+
+		// A sector never decompresses to more than the sector size, which also keeps the pipe within the scratch.
+		*pdwWritten = DecompressSector(nMethod, pSector, dwBlockLengthRead, pOutput, dwExpectedLength, pScratch);
+		return true;
+	}
+
+	/*
+	 *	Shared state for decompressing the sectors of one file on several threads.
+	 *	Every sector except the last one decompresses to exactly one sector's worth of data, so each sector
+	 *	can be written straight to its final offset in the caller's buffer.
+	 */
+	struct MPQSectorJob
+	{
+		D2MPQArchive*	pMPQ;
+		MPQBlock*		pBlock;
+		DWORD*			pSectorOffsets;
+		DWORD			dwEncryptionKey;
+		BYTE*			pOutput;
+		int				nNumSectors;
+		SDL_atomic_t	nNextSector;		// Next sector that hasn't been claimed by anyone
+		SDL_atomic_t	nBytesWritten;
+	};
+
+	/*
+	 *	Keep claiming runs of sectors until there are none left
+	 */
+	static void DecompressSectorRuns(MPQSectorJob* pJob)
+	{
+		BYTE sectorScratch[MPQ_SECTOR_SCRATCH_SIZE];
+
+		while (true)
+		{
+			int nStart = SDL_AtomicAdd(&pJob->nNextSector, MPQ_PARALLEL_SECTORS);
+			int nEnd = D2Lib::min(nStart + MPQ_PARALLEL_SECTORS, pJob->nNumSectors);
+			DWORD dwRunWritten = 0;
+			DWORD dwWritten;
+
+			if (nStart >= pJob->nNumSectors)
+			{
+				return;
+			}
+
+			for (int i = nStart; i < nEnd; i++)
+			{
+				if (!ReadSector(pJob->pMPQ, pJob->pBlock, pJob->pSectorOffsets, i, pJob->dwEncryptionKey,
+					pJob->pOutput + (i * pJob->pMPQ->wSectorSize), sectorScratch, &dwWritten))
+				{
+					break;
+				}
+				dwRunWritten += dwWritten;
+			}
+
+			SDL_AtomicAdd(&pJob->nBytesWritten, dwRunWritten);
+		}
+	}
+
+	static void T_DecompressSectors(void* pData)
+	{
+		DecompressSectorRuns((MPQSectorJob*)pData);
+	}
+
+	/*
+	 *	Decompresses all of the sectors of a big file on the threadpool.
+	 *	The calling thread works on the file as well, and then helps out with whatever else is queued while the
+	 *	last runs finish, so this never takes longer than the serial path would.
+	 *	@return	The number of bytes written
+	 */
+	static size_t ReadSectorsParallel(D2MPQArchive* pMPQ, MPQBlock* pBlock, DWORD* pSectorOffsets, DWORD dwNumSectors,
+		DWORD dwEncryptionKey, BYTE* buffer)
+	{
+		int nNumRuns = (dwNumSectors + MPQ_PARALLEL_SECTORS - 1) / MPQ_PARALLEL_SECTORS;
+		int nNumHelpers = D2Lib::min(Threadpool::GetNumWorkers(), nNumRuns - 1);
+		MPQSectorJob job;
+		D2JobCounter counter{ 0 };
+
+		job.pMPQ = pMPQ;
+		job.pBlock = pBlock;
+		job.pSectorOffsets = pSectorOffsets;
+		job.dwEncryptionKey = dwEncryptionKey;
+		job.pOutput = buffer;
+		job.nNumSectors = dwNumSectors;
+		SDL_AtomicSet(&job.nNextSector, 0);
+		SDL_AtomicSet(&job.nBytesWritten, 0);
+
+		for (int i = 0; i < nNumHelpers; i++)
+		{
+			Threadpool::SpawnJob(T_DecompressSectors, &job, &counter);
+		}
+
+		// Every run gets claimed by somebody, and the helpers don't finish until the runs they claimed are done
+		DecompressSectorRuns(&job);
+		Threadpool::WaitForCounter(&counter);
+
+		return SDL_AtomicGet(&job.nBytesWritten);
+	}
+
+	/*
+	 *	Reads a file that's stored as a single unit, with no sector table.
+	 *	None of the Diablo II archives have any of these, but newer tools can make them.
+	 *	@return	The number of bytes written to buffer
+	 */
+	static size_t ReadSingleUnit(D2MPQArchive* pMPQ, MPQBlock* pBlock, DWORD dwEncryptionKey, BYTE* buffer)
+	{
+		bool bEncrypted = (pBlock->dwFlags & MPQ_FILE_ENCRYPTED) != 0;
+		DWORD dwLength = pBlock->dwCSize;
+		BYTE* pAllocated = nullptr;
+		BYTE* pScratch = nullptr;
+		BYTE* pUnit;
+		BYTE nMethod = MPQ_COMPRESSION_PKWARE;
+		size_t dwWritten;
+
+		if (!(pBlock->dwFlags & (MPQ_FILE_IMPLODE | MPQ_FILE_COMPRESS)) || dwLength >= pBlock->dwFSize)
+		{	// Stored as-is, so it can go straight into the buffer
+			dwWritten = ReadArchiveData(pMPQ, pBlock->dwFilePos, buffer, D2Lib::min(dwLength, pBlock->dwFSize));
+			if (bEncrypted)
+			{
+				DecryptMPQBlock(buffer, dwWritten, dwEncryptionKey);
+			}
+			return dwWritten;
+		}
+
+		if (pMPQ->pMappedData != nullptr && !bEncrypted)
+		{
+			pUnit = pMPQ->pMappedData + pBlock->dwFilePos;
+		}
+		else
+		{
+			pAllocated = (BYTE*)malloc(dwLength);
+			Log_ErrorAssertReturn(pAllocated != nullptr, 0);
+			dwLength = ReadArchiveData(pMPQ, pBlock->dwFilePos, pAllocated, dwLength);
+			if (bEncrypted)
+			{
+				DecryptMPQBlock(pAllocated, dwLength, dwEncryptionKey);
+			}
+			pUnit = pAllocated;
+		}
+
+		if (pBlock->dwFlags & MPQ_FILE_COMPRESS)
+		{
+			nMethod = *pUnit++;
+			dwLength--;
+		}
+
+		if (nMethod & (nMethod - 1))
+		{	// More than one method, so the pipe needs to be able to hold the whole file
+			pScratch = (BYTE*)malloc(pBlock->dwFSize);
+			if (pScratch == nullptr)
+			{
+				free(pAllocated);
+				Log_ErrorAssertReturn(!"Out of memory", 0);
+			}
+		}
+
+		dwWritten = DecompressSector(nMethod, pUnit, dwLength, buffer, pBlock->dwFSize, pScratch);
+
+		free(pScratch);
+		free(pAllocated);
+		return dwWritten;
+	}
+
+	/*
+	 *	Decrypts an uncompressed file in place. Each sector has its own key.
+	 */
+	static void DecryptSectors(D2MPQArchive* pMPQ, BYTE* buffer, size_t dwLength, DWORD dwEncryptionKey)
+	{
+		for (DWORD i = 0; i * pMPQ->wSectorSize < dwLength; i++)
+		{
+			DWORD dwSectorStart = i * pMPQ->wSectorSize;
+
+			DecryptMPQBlock(buffer + dwSectorStart, D2Lib::min<DWORD>(pMPQ->wSectorSize, dwLength - dwSectorStart),
+				dwEncryptionKey + i);
+		}
+	}
+
 	/*
 	 *	Reads a file from an archive into a memory buffer
+	 *	This is reentrant: all of the scratch space lives on the stack (or is allocated per call for huge files),
+	 *	and the archive itself is only ever read from. Any number of threads may read from the same archive at once.
 	 *	@author	Paul Siramy/eezstreet
 	 */
-	static char* gpTempBuffer = nullptr;
-	size_t gpTempBufferSize = 0;
-
 	size_t ReadFile(D2MPQArchive* pMPQ, fs_handle fFile, BYTE* buffer, DWORD dwBufferLen)
 	{
+		BYTE sectorScratch[MPQ_SECTOR_SCRATCH_SIZE];
+		DWORD dwLocalSectorTable[MPQ_LOCAL_SECTOR_TABLE_SIZE];
 		DWORD dwNumBlocks;
 		size_t dwTotalAmountRead = 0;
-		DWORD dwBufferFilled = 0;
 		DWORD dwEncryptionKey = 0;
-
-		char* pTempBuffer;
+		bool bEncrypted;
+		bool bMapped;
 
 		if (fFile == (fs_handle)-1)
 		{	// invalid file
 			return 0;
 		}
 
-		if (!pMPQ || pMPQ->f == (fs_handle)-1)
+		if (!pMPQ || (pMPQ->pMappedData == nullptr && pMPQ->f == (fs_handle)-1))
 		{	// bad MPQ pointer or MPQ is not opened
 			return 0;
 		}
@@ -679,149 +1036,141 @@ namespace MPQ
 			return 0;
 		}
 
-		// We use a global buffer to cut down on the number of memory allocations
-		// This is important if we're loading lots of files at once (ie, palettes)
-		if (gpTempBuffer == nullptr)
-		{
-			gpTempBufferSize = pBlock->dwFSize;
-			gpTempBuffer = (char*)malloc(gpTempBufferSize);
-			if (gpTempBuffer == nullptr)
-			{
-				// global buffer couldn't be allocated. die?
-				return 0;
-			}
+		Log_ErrorAssertReturn(pMPQ->wSectorSize <= MPQ_SECTOR_SCRATCH_SIZE, 0);
+
+		bEncrypted = (pBlock->dwFlags & MPQ_FILE_ENCRYPTED) != 0;
+		bMapped = pMPQ->pMappedData != nullptr;
+
+		if (bMapped && (pBlock->dwFilePos > pMPQ->dwMappedSize || pBlock->dwCSize > pMPQ->dwMappedSize - pBlock->dwFilePos))
+		{	// block runs off the end of the archive
+			return 0;
 		}
-		else if (gpTempBufferSize < pBlock->dwFSize)
+
+		if (bEncrypted || pBlock->dwFlags & MPQ_FILE_FIX_KEY)
 		{
-			gpTempBufferSize = pBlock->dwFSize;
-			char* temp = (char*)realloc(gpTempBuffer, gpTempBufferSize);
-			if (temp == nullptr)
-			{
-				free(gpTempBuffer);
-				gpTempBuffer = nullptr;
-				return 0;
-			}
-			gpTempBuffer = temp;
-		}
+			// Decrypt the key (from our own copy of the name, since another thread could be registering it)
+			char szFileName[MAX_D2PATH];
 
-		pTempBuffer = gpTempBuffer;
+			SDL_AtomicLock(&pMPQ->nNameLock);
+			memcpy(szFileName, pMPQ->pNameTable[fFile], MAX_D2PATH);
+			SDL_AtomicUnlock(&pMPQ->nNameLock);
 
-		if (pBlock->dwFlags & MPQ_FILE_ENCRYPTED || pBlock->dwFlags & MPQ_FILE_FIX_KEY)
-		{
-			// Decrypt the key 
-			dwEncryptionKey = DecryptFileKey(pMPQ, pMPQ->pNameTable[fFile], pBlock->dwFilePos, pBlock->dwFSize, pBlock->dwFlags);
+			dwEncryptionKey = DecryptFileKey(szFileName, pBlock->dwFilePos, pBlock->dwFSize, pBlock->dwFlags);
 		}
 
-		if (pBlock->dwFlags & MPQ_FILE_IMPLODE || pBlock->dwFlags & MPQ_FILE_COMPRESS)
+		if (pBlock->dwFlags & MPQ_FILE_SINGLE_UNIT)
+		{	// No sectors at all
+			dwTotalAmountRead = ReadSingleUnit(pMPQ, pBlock, dwEncryptionKey, buffer);
+		}
+		else if (pBlock->dwFlags & MPQ_FILE_IMPLODE || pBlock->dwFlags & MPQ_FILE_COMPRESS)
 		{	// Compressed file. Around 90% of the blocks are compressed in this manner.
+			DWORD* pSectorOffsets;
+			DWORD* pAllocatedSectorTable = nullptr;
+
 			dwNumBlocks = ((pBlock->dwFSize - 1) / pMPQ->wSectorSize) + 2;
+			if ((dwNumBlocks << 2) > pBlock->dwCSize)
+			{	// sector table can't even fit in the block
+				return 0;
+			}
 
 			// Read the sector header to determine what we need to read
-			FS::Seek(pMPQ->f, pBlock->dwFilePos, FS_SEEK_SET);
-			FS::Read(pMPQ->f, gdwFileHeaderBuffer, sizeof(DWORD), dwNumBlocks);
-
-			// If this is an encrypted file, we need to fix the header
-			if (pBlock->dwFlags & MPQ_FILE_ENCRYPTED)
-			{
-				// For this one, we use the encryption key - 1.
-				// Don't know why, just roll with it. Probably a bug on Blizzard's part.
-				DecryptMPQBlock(pMPQ, gdwFileHeaderBuffer, dwNumBlocks << 2, dwEncryptionKey - 1);
+			if (bMapped && !bEncrypted)
+			{	// Nothing to decrypt, so we can look at it directly
+				pSectorOffsets = (DWORD*)(pMPQ->pMappedData + pBlock->dwFilePos);
 			}
-
-			for (int i = 0; i < dwNumBlocks - 1; i++)
+			else
 			{
-				DWORD dwBlockLengthRead = gdwFileHeaderBuffer[i + 1] - gdwFileHeaderBuffer[i];
-				DWORD dwInputLength;
-				BYTE nMethod;
-				size_t dwAmountRead = FS::Read(pMPQ->f, pTempBuffer, sizeof(BYTE), dwBlockLengthRead);
-
-				// Decrypt it!
-				if (pBlock->dwFlags & MPQ_FILE_ENCRYPTED)
+				if (dwNumBlocks <= MPQ_LOCAL_SECTOR_TABLE_SIZE)
 				{
-					DecryptMPQBlock(pMPQ, pTempBuffer, dwAmountRead, dwEncryptionKey + i);
+					pSectorOffsets = dwLocalSectorTable;
 				}
-
-				if (dwAmountRead == pMPQ->wSectorSize
-					|| (i == dwNumBlocks - 2 && dwAmountRead == (pBlock->dwFSize & (pMPQ->wSectorSize - 1))))
+				else
 				{
-					memcpy(buffer + dwTotalAmountRead, pTempBuffer, dwAmountRead);
-					pTempBuffer += dwBlockLengthRead;
-					dwTotalAmountRead += dwBlockLengthRead;
-					continue;
+					pAllocatedSectorTable = (DWORD*)malloc(dwNumBlocks << 2);
+					Log_ErrorAssertReturn(pAllocatedSectorTable != nullptr, 0);
+					pSectorOffsets = pAllocatedSectorTable;
 				}
+				ReadArchiveData(pMPQ, pBlock->dwFilePos, pSectorOffsets, dwNumBlocks << 2);
+			}
+
+			// If this is an encrypted file, we need to fix the header
+			if (bEncrypted)
+			{
+				// For this one, we use the encryption key - 1.
+				// Don't know why, just roll with it. Probably a bug on Blizzard's part.
+				DecryptMPQBlock(pSectorOffsets, dwNumBlocks << 2, dwEncryptionKey - 1);
+			}
 
-				if (pBlock->dwCSize < pBlock->dwFSize)
+			if (pBlock->dwFSize >= MPQ_PARALLEL_THRESHOLD && Threadpool::GetNumWorkers() > 0)
+			{	// Big file, so spread the sectors out over the threadpool
+				dwTotalAmountRead = ReadSectorsParallel(pMPQ, pBlock, pSectorOffsets, dwNumBlocks - 1, dwEncryptionKey, buffer);
+			}
+			else
+			{	// Small file, so just do it here
+				dwTotalAmountRead = 0;
+				for (int i = 0; i < dwNumBlocks - 1; i++)
 				{
-					// Only decompress if the compress size is smaller than the real size
-					if (pBlock->dwFlags & MPQ_FILE_IMPLODE)
-					{	// Diablo 1 style compression (PKWARE)
-						nMethod = MPQ_COMPRESSION_PKWARE;
-					}
-					else if (pBlock->dwFlags & MPQ_FILE_COMPRESS)
-					{	// StarCraft and Diablo 2 style compression (mixed method)
-						nMethod = *(pTempBuffer);
-						pTempBuffer++;
-						dwBlockLengthRead--;
-					}
+					DWORD dwWritten;
 
-					dwInputLength = dwBlockLengthRead;
-					for (int j = 0; CompressionModels[j].pFunc != nullptr; j++)
-					{
-						if (nMethod & CompressionModels[j].nCompressionType)
-						{
-							dwBufferFilled = dwBufferLen;
-							CompressionModels[j].pFunc(pTempBuffer, &dwInputLength, buffer + dwTotalAmountRead, &dwBufferFilled);
-							// Pipe previous output into new input
-							memcpy(pTempBuffer, buffer + dwTotalAmountRead, dwBufferFilled);
-							dwInputLength = dwBufferFilled;
-						}
+					if (!ReadSector(pMPQ, pBlock, pSectorOffsets, i, dwEncryptionKey, buffer + dwTotalAmountRead, sectorScratch, &dwWritten))
+					{	// corrupt sector table
+						break;
 					}
+					dwTotalAmountRead += dwWritten;
 				}
+			}
 
-				pTempBuffer += dwBlockLengthRead;
-				dwTotalAmountRead += dwBufferFilled;
+			if (pAllocatedSectorTable != nullptr)
+			{
+				free(pAllocatedSectorTable);
 			}
 		}
+		else if (bMapped)
+		{	// Uncompressed file in a mapped archive - just a single copy out of the view
+			dwTotalAmountRead = pBlock->dwCSize < dwBufferLen ? pBlock->dwCSize : dwBufferLen;
+			memcpy(buffer, pMPQ->pMappedData + pBlock->dwFilePos, dwTotalAmountRead);
+		}
 		else
 		{	// Uncompressed file - Very few files are uncompressed but some (like Druid and Assassin character animations) are.
-			DWORD dwFullBlocks, dwPartialBlock;
-			DWORD dwFileSize = pBlock->dwCSize;
-			DWORD dwReadSize = 0x60000;
-
-			if (dwFileSize < dwReadSize)
-			{	// This last block is very short, we need to only read that part
-				dwReadSize = dwFileSize;
-			}
-
-			// Compute the number of blocks that we need to read
-			dwPartialBlock = dwFileSize % dwReadSize;
-			dwFullBlocks = (dwFileSize - dwPartialBlock) / dwReadSize;
+			DWORD dwFileSize = pBlock->dwCSize < dwBufferLen ? pBlock->dwCSize : dwBufferLen;
 
-			// Seek to the part of the MPQ in question
-			FS::Seek(pMPQ->f, pBlock->dwFilePos, FS_SEEK_SET);
-
-			// Read all of the full blocks
-			for (DWORD j = 0; j < dwFullBlocks; j++)
-			{
-				FS::Read(pMPQ->f, buffer + dwTotalAmountRead, dwReadSize);
-				dwTotalAmountRead += dwReadSize;
-			}
+			dwTotalAmountRead = ReadArchiveData(pMPQ, pBlock->dwFilePos, buffer, dwFileSize);
+		}
 
-			// Read the remaining partial block
-			FS::Read(pMPQ->f, buffer + dwTotalAmountRead, dwBufferLen - dwTotalAmountRead);
-			dwTotalAmountRead += dwPartialBlock;
+		if (bEncrypted && !(pBlock->dwFlags & (MPQ_FILE_SINGLE_UNIT | MPQ_FILE_COMPRESS_MASK)))
+		{	// Uncompressed sectors are still encrypted, one sector at a time
+			DecryptSectors(pMPQ, buffer, dwTotalAmountRead, dwEncryptionKey);
 		}
 
 		return dwTotalAmountRead;
 	}
 
 	/*
-	 * Frees the temporary block decompression buffer
+	 *	Gets a pointer to the contents of a file without copying it.
+	 *	Only possible for files in mapped archives which are neither compressed nor encrypted.
+	 *	The pointer stays valid until the archive is closed.
+	 *	@return	The file contents (FileSize bytes long), or nullptr if the file has to go through ReadFile
 	 */
-	void Cleanup()
+	const BYTE* GetFileView(D2MPQArchive* pMPQ, fs_handle fFile)
 	{
-		free(gpTempBuffer);
-		gpTempBuffer = nullptr;
-		gpTempBufferSize = 0;
+		MPQBlock* pBlock;
+
+		if (fFile == INVALID_HANDLE || pMPQ == nullptr || pMPQ->pMappedData == nullptr)
+		{
+			return nullptr;
+		}
+
+		pBlock = &pMPQ->pBlockTable[fFile];
+		if (pBlock->dwFlags & (MPQ_FILE_COMPRESS_MASK | MPQ_FILE_ENCRYPTED))
+		{
+			return nullptr;
+		}
+
+		if (pBlock->dwFilePos > pMPQ->dwMappedSize || pBlock->dwFSize > pMPQ->dwMappedSize - pBlock->dwFilePos)
+		{
+			return nullptr;
+		}
+
+		return pMPQ->pMappedData + pBlock->dwFilePos;
 	}
 }
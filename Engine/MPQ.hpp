@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../Shared/D2Shared.hpp"
+#include "../Libraries/sdl/SDL_atomic.h"
 
 /*
  *	EVERYTHING TO DO WITH MPQ FILES
@@ -50,6 +51,22 @@
 
 #pragma pack(push,enter_include)
 #pragma pack(1)
+/*
+ *	@author	Zezula
+ */
+struct MPQHeader
+{
+	DWORD	dwID;				// "MPQ\x1A"
+	DWORD	dwHeaderSize;		// Size of this header (always 0x20 in Diablo II)
+	DWORD	dwArchiveSize;		// Size of the whole archive
+	WORD	wFormatVersion;		// Always 0 in Diablo II
+	WORD	wSectorSize;		// Power of two exponent for the sector size
+	DWORD	dwHashTablePos;		// Offset to the hash table
+	DWORD	dwBlockTablePos;	// Offset to the block table
+	DWORD	dwHashTableSize;	// Number of entries in the hash table
+	DWORD	dwBlockTableSize;	// Number of entries in the block table
+};
+
 /*
  *	@author Zezula
  */
@@ -78,6 +95,8 @@ struct MPQBlock
 // @author eezstreet
 typedef char MPQName[MAX_D2PATH];
 
+struct OD2PakEntry;
+
 /*
  *	@author eezstreet
  */
@@ -94,12 +113,15 @@ struct D2MPQArchive
 	MPQBlock*		pBlockTable;			// Pointer to MPQ block table
 	DWORD			dwFileCount;			// Number of files in MPQ
 	WORD			wSectorSize;			// The size of MPQ sectors (always 0x200)
-	DWORD			dwSlackSpace[0x500];
 	DWORD*			pSectorOffsets;
 	DWORD			dwSectorCount;
 
 	MPQName*		pNameTable;				// Names of each file in the MPQ. Only filled as used.
-	fs_handle		f;						// FS file handle
+	SDL_SpinLock	nNameLock;				// Held while pNameTable is written to or copied out of
+	fs_handle		f;						// FS file handle (INVALID_HANDLE if the archive is mapped)
+	BYTE*			pMappedData;			// Read-only view of the whole archive (nullptr if not mapped)
+	size_t			dwMappedSize;			// Size of the mapped view
+	OD2PakEntry*	pPakEntries;			// Index of an .od2pak (nullptr if this is an MPQ) - see OD2Pak.hpp
 };
 
 // MPQ.cpp
@@ -107,8 +129,11 @@ namespace MPQ
 {
 	void OpenMPQ(char* szMPQPath, const char* szMPQName, D2MPQArchive* pMPQ);
 	void CloseMPQ(D2MPQArchive* pMPQ);
+	void HashFileName(const char* szFileName, DWORD* pdwName1, DWORD* pdwName2);
+	void RegisterFileName(D2MPQArchive* pMPQ, fs_handle fFile, const char* szFileName);
 	fs_handle FetchHandle(D2MPQArchive* pMPQ, const char* szFileName);
+	bool GetHashEntry(D2MPQArchive* pMPQ, DWORD dwHashIndex, DWORD* pdwName1, DWORD* pdwName2, fs_handle* pfFile);
 	size_t FileSize(D2MPQArchive* pMPQ, fs_handle fFile);
 	size_t ReadFile(D2MPQArchive* pMPQ, fs_handle fFile, BYTE* buffer, DWORD dwBufferLen);
-	void Cleanup();
+	const BYTE* GetFileView(D2MPQArchive* pMPQ, fs_handle fFile);
 }
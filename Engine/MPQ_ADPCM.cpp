@@ -0,0 +1,211 @@
+#include "MPQ_ADPCM.hpp"
+
+/*
+ *	IMA ADPCM decoding for WAV sectors, giving exactly the same PCM as DecompressADPCM in Libraries/adpcm.
+ *
+ *	Every sample depends on the one before it in the same channel, so there's nothing to vectorize within a channel.
+ *	What we can do is get the per-sample work down to a few table lookups:
+ *		- the six magnitude bits of a sample add up a fixed set of fractions of the step size, so the total for every
+ *		  step index and every combination of bits is worked out ahead of time
+ *		- so is the next step index (with its clamping) for every step index and code
+ *	The two channels of a stereo sector don't depend on each other, so whenever the next two codes are both plain
+ *	samples, they get decoded side by side and the CPU can work on both at once.
+ *	@author	eezstreet
+ */
+
+#define ADPCM_NUM_STEPS			89
+#define ADPCM_MAX_STEP_INDEX	(ADPCM_NUM_STEPS - 1)
+#define ADPCM_INITIAL_STEP		0x2C
+#define ADPCM_STEP_DOWN			0x80		// Repeat the last sample and lower the step index
+#define ADPCM_STEP_UP			0x81		// Raise the step index (and stay on the same channel)
+#define ADPCM_SIGN_BIT			0x40
+
+namespace MPQADPCM
+{
+	static const int gStepSizes[ADPCM_NUM_STEPS] = {
+		7, 8, 9, 10, 11, 12, 13, 14,
+		16, 17, 19, 21, 23, 25, 28, 31,
+		34, 37, 41, 45, 50, 55, 60, 66,
+		73, 80, 88, 97, 107, 118, 130, 143,
+		157, 173, 190, 209, 230, 253, 279, 307,
+		337, 371, 408, 449, 494, 544, 598, 658,
+		724, 796, 876, 963, 1060, 1166, 1282, 1411,
+		1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024,
+		3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484,
+		7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+		15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+		32767
+	};
+
+	static const int gStepAdjust[0x20] = {
+		-1, 0, -1, 4, -1, 2, -1, 6,
+		-1, 1, -1, 5, -1, 3, -1, 7,
+		-1, 1, -1, 5, -1, 3, -1, 7,
+		-1, 2, -1, 4, -1, 6, -1, 8
+	};
+
+	static WORD gMagnitudes[ADPCM_NUM_STEPS][0x40];		// Sum of the step size fractions for each set of bits
+	static BYTE gNextStep[ADPCM_NUM_STEPS][0x20];		// Next step index for each code
+	static bool gbTablesReady = false;
+
+	/*
+	 *	Builds the decoding tables. Only does anything the first time.
+	 *	@author	eezstreet
+	 */
+	void Init()
+	{
+		if (gbTablesReady)
+		{
+			return;
+		}
+
+		for (int nStep = 0; nStep < ADPCM_NUM_STEPS; nStep++)
+		{
+			for (int nBits = 0; nBits < 0x40; nBits++)
+			{
+				int nTotal = 0;
+
+				for (int i = 0; i < 6; i++)
+				{
+					if (nBits & (1 << i))
+					{
+						nTotal += gStepSizes[nStep] >> i;
+					}
+				}
+				gMagnitudes[nStep][nBits] = (WORD)nTotal;
+			}
+
+			for (int nCode = 0; nCode < 0x20; nCode++)
+			{
+				gNextStep[nStep][nCode] = (BYTE)D2Lib::max<int>(0, D2Lib::min<int>(nStep + gStepAdjust[nCode], ADPCM_MAX_STEP_INDEX));
+			}
+		}
+
+		gbTablesReady = true;
+	}
+
+	/*
+	 *	State of one channel
+	 */
+	struct ADPCMChannel
+	{
+		int		nPredicted;
+		int		nStepIndex;
+	};
+
+	static inline void WriteSample(BYTE* pOut, int nSample)
+	{
+		pOut[0] = (BYTE)(nSample & 0xFF);
+		pOut[1] = (BYTE)((nSample >> 8) & 0xFF);
+	}
+
+	/*
+	 *	Decodes a plain sample (anything that isn't a step marker)
+	 */
+	static inline int DecodeSample(ADPCMChannel* pChannel, BYTE nCode, BYTE nBitShift)
+	{
+		int nStepIndex = pChannel->nStepIndex;
+		int nDifference = (gStepSizes[nStepIndex] >> nBitShift) + gMagnitudes[nStepIndex][nCode & 0x3F];
+		int nPredicted = pChannel->nPredicted + ((nCode & ADPCM_SIGN_BIT) ? -nDifference : nDifference);
+
+		// Subtracting can only go off the bottom and adding can only go off the top
+		nPredicted = D2Lib::max<int>(-32768, D2Lib::min<int>(nPredicted, 32767));
+
+		pChannel->nPredicted = nPredicted;
+		pChannel->nStepIndex = gNextStep[nStepIndex][nCode & 0x1F];
+		return nPredicted;
+	}
+
+	/*
+	 *	Decompresses an ADPCM compressed sector with one or two channels.
+	 *	@return	The number of bytes written
+	 *	@author	eezstreet
+	 */
+	DWORD Decompress(void* pOutput, DWORD dwOutputSize, const void* pInput, DWORD dwInputSize, int nChannels)
+	{
+		const BYTE* pIn = (const BYTE*)pInput;
+		const BYTE* pInEnd = pIn + dwInputSize;
+		BYTE* pOutStart = (BYTE*)pOutput;
+		BYTE* pOut = pOutStart;
+		BYTE* pOutLast = pOutStart + (dwOutputSize & ~1);		// Samples can only go before here
+		ADPCMChannel channels[2];
+		BYTE nBitShift;
+		int nChannel = 0;										// Channel that the next sample goes to
+
+		if (nChannels != 1 && nChannels != 2)
+		{
+			return 0;
+		}
+
+		// The first byte is always zero, and the second one is the bit shift
+		if (dwInputSize < 2)
+		{
+			return 0;
+		}
+		nBitShift = pIn[1];
+		pIn += 2;
+
+		// Followed by the first sample of each channel
+		for (int i = 0; i < nChannels; i++)
+		{
+			if (pInEnd - pIn < 2 || pOut >= pOutLast)
+			{
+				return (DWORD)(pOut - pOutStart);
+			}
+
+			channels[i].nPredicted = (short)(pIn[0] | (pIn[1] << 8));
+			channels[i].nStepIndex = ADPCM_INITIAL_STEP;
+			WriteSample(pOut, channels[i].nPredicted);
+			pIn += 2;
+			pOut += 2;
+		}
+
+		while (pIn < pInEnd)
+		{
+			BYTE nCode = *pIn;
+
+			if (nChannels == 2 && pInEnd - pIn >= 2 && pOutLast - pOut >= 4 &&
+				nCode < ADPCM_STEP_DOWN && pIn[1] < ADPCM_STEP_DOWN)
+			{	// A sample for each channel, which don't depend on each other
+				int nFirst = DecodeSample(&channels[nChannel], nCode, nBitShift);
+				int nSecond = DecodeSample(&channels[nChannel ^ 1], pIn[1], nBitShift);
+
+				WriteSample(pOut, nFirst);
+				WriteSample(pOut + 2, nSecond);
+				pIn += 2;
+				pOut += 4;
+				continue;
+			}
+
+			pIn++;
+			if (nCode == ADPCM_STEP_UP)
+			{	// The next sample is still for this channel
+				channels[nChannel].nStepIndex = D2Lib::min<int>(channels[nChannel].nStepIndex + 8, ADPCM_MAX_STEP_INDEX);
+				continue;
+			}
+
+			if (pOut >= pOutLast)
+			{
+				break;
+			}
+
+			if (nCode == ADPCM_STEP_DOWN)
+			{
+				if (channels[nChannel].nStepIndex != 0)
+				{
+					channels[nChannel].nStepIndex--;
+				}
+				WriteSample(pOut, channels[nChannel].nPredicted);
+			}
+			else
+			{
+				WriteSample(pOut, DecodeSample(&channels[nChannel], nCode, nBitShift));
+			}
+
+			pOut += 2;
+			nChannel ^= nChannels - 1;
+		}
+
+		return (DWORD)(pOut - pOutStart);
+	}
+}
@@ -0,0 +1,396 @@
+#include "MPQ_Huffman.hpp"
+#include "../Libraries/huffman/huff.h"
+
+/*
+ *	Table driven Huffman decoding for MPQ sectors.
+ *
+ *	The MPQ flavor of Huffman is adaptive, but for every compression type except 0 the tree only changes when
+ *	a byte that isn't in the tree yet shows up. Types 6 through 8 are what WAV sectors use (after ADPCM), and their
+ *	trees already hold most of what ADPCM produces, so only a handful of new bytes show up per sector.
+ *	So instead of building a THuffmannTree for every sector and walking it a bit at a time, we build each type's
+ *	starting tree once, flatten it, and decode HUFF_TABLE_BITS bits per lookup.
+ *	The first time a new byte shows up, the sector carries on with a real THuffmannTree, which is in exactly the
+ *	state that BuildTree leaves it in at that point, so the output is identical either way. Once that tree settles
+ *	down again, it gets its own table too.
+ *	Type 0 changes the tree after every byte, so that always goes through THuffmannTree.
+ *	@author	eezstreet
+ */
+
+#define HUFF_NUM_TYPES		9
+#define HUFF_TABLE_BITS		10
+#define HUFF_TABLE_SIZE		(1 << HUFF_TABLE_BITS)
+#define HUFF_NODE_LEAF		0x8000			// Set on a child that's a decoded value rather than another node
+#define HUFF_END_OF_STREAM	0x100
+#define HUFF_NEW_BYTE		0x101
+#define HUFF_ERROR			0xFFFFFFFF
+#define HUFF_REBUILD_AFTER	16				// Values in a row without a new byte before the adaptive tree gets a table
+
+namespace MPQHuffman
+{
+	/*
+	 *	One lookup. Codes that are longer than HUFF_TABLE_BITS continue walking the tree from wValue.
+	 */
+	struct HuffDecodeEntry
+	{
+		WORD	wValue;			// Decoded value, or the node to keep walking from
+		BYTE	nBits;			// Number of bits that this entry uses up
+		bool	bLeaf;
+	};
+
+	struct HuffDecodeNode
+	{
+		WORD	wChild[2];		// Child for a 0 bit and for a 1 bit
+	};
+
+	struct HuffDecodeTable
+	{
+		HuffDecodeEntry	entries[HUFF_TABLE_SIZE];
+		HuffDecodeNode	nodes[HUFF_ITEM_COUNT];
+		WORD			wNumNodes;
+		bool			bValid;
+	};
+
+	static HuffDecodeTable gTables[HUFF_NUM_TYPES];
+	static bool gbTablesReady = false;
+
+	/*
+	 *	Copies a (sub)tree out of a THuffmannTree.
+	 *	A 1 bit takes the higher weight child (pChildLo->pPrev), same as THuffmannTree::DecodeOneByte.
+	 */
+	static WORD FlattenTree(HuffDecodeTable* pTable, THTreeItem* pItem)
+	{
+		WORD wNode;
+
+		if (pItem->pChildLo == nullptr)
+		{
+			return HUFF_NODE_LEAF | (WORD)pItem->DecompressedValue;
+		}
+
+		wNode = pTable->wNumNodes++;
+		pTable->nodes[wNode].wChild[0] = FlattenTree(pTable, pItem->pChildLo);
+		pTable->nodes[wNode].wChild[1] = FlattenTree(pTable, pItem->pChildLo->pPrev);
+		return wNode;
+	}
+
+	/*
+	 *	Fills in every table entry whose low nDepth bits are dwPrefix.
+	 *	Bits come out of the stream least significant first, so the first bit of a code is bit 0 of the index.
+	 */
+	static void FillTable(HuffDecodeTable* pTable, WORD wNode, int nDepth, DWORD dwPrefix)
+	{
+		if (wNode & HUFF_NODE_LEAF)
+		{
+			for (DWORD i = dwPrefix; i < HUFF_TABLE_SIZE; i += (1 << nDepth))
+			{
+				pTable->entries[i].wValue = wNode & ~HUFF_NODE_LEAF;
+				pTable->entries[i].nBits = nDepth;
+				pTable->entries[i].bLeaf = true;
+			}
+			return;
+		}
+
+		if (nDepth == HUFF_TABLE_BITS)
+		{
+			pTable->entries[dwPrefix].wValue = wNode;
+			pTable->entries[dwPrefix].nBits = nDepth;
+			pTable->entries[dwPrefix].bLeaf = false;
+			return;
+		}
+
+		FillTable(pTable, pTable->nodes[wNode].wChild[0], nDepth + 1, dwPrefix);
+		FillTable(pTable, pTable->nodes[wNode].wChild[1], nDepth + 1, dwPrefix | (1 << nDepth));
+	}
+
+	/*
+	 *	Builds the decoding tables for every compression type. Only does anything the first time.
+	 *	@author	eezstreet
+	 */
+	void Init()
+	{
+		if (gbTablesReady)
+		{
+			return;
+		}
+
+		memset(gTables, 0, sizeof(gTables));
+
+		for (int i = 1; i < HUFF_NUM_TYPES; i++)
+		{
+			THuffmannTree ht(false);
+			HuffDecodeTable* pTable = &gTables[i];
+			WORD wRoot;
+
+			if (!ht.BuildTree(i) || ht.pFirst == (THTreeItem*)&ht.pFirst)
+			{
+				continue;
+			}
+
+			wRoot = FlattenTree(pTable, ht.pFirst);
+			if (wRoot & HUFF_NODE_LEAF)
+			{	// a tree with one thing in it can't happen, since the two special values are always there
+				continue;
+			}
+
+			FillTable(pTable, wRoot, 0, 0);
+			pTable->bValid = true;
+		}
+
+		gbTablesReady = true;
+	}
+
+	/*
+	 *	Bit reader. Same bit order as TInputStream, but it keeps up to 64 bits around.
+	 */
+	struct HuffBitReader
+	{
+		const BYTE*			pIn;
+		const BYTE*			pInEnd;
+		unsigned long long	qwBits;
+		DWORD				dwNumBits;
+	};
+
+	static inline void Refill(HuffBitReader* pReader)
+	{
+		while (pReader->dwNumBits <= 56 && pReader->pIn < pReader->pInEnd)
+		{
+			pReader->qwBits |= (unsigned long long)(*pReader->pIn++) << pReader->dwNumBits;
+			pReader->dwNumBits += 8;
+		}
+	}
+
+	/*
+	 *	Pulls one more bit out, for walking the tree.
+	 *	@return	The bit, or -1 if there's nothing left
+	 */
+	static inline int GetBit(HuffBitReader* pReader)
+	{
+		int nBit;
+
+		if (pReader->dwNumBits == 0)
+		{
+			if (pReader->pIn >= pReader->pInEnd)
+			{
+				return -1;
+			}
+			pReader->qwBits = *pReader->pIn++;
+			pReader->dwNumBits = 8;
+		}
+
+		nBit = (int)(pReader->qwBits & 1);
+		pReader->qwBits >>= 1;
+		pReader->dwNumBits--;
+		return nBit;
+	}
+
+	/*
+	 *	Decodes one value using a table.
+	 *	@return	The value, or HUFF_ERROR
+	 */
+	static inline DWORD DecodeWithTable(const HuffDecodeTable* pTable, HuffBitReader* pReader)
+	{
+		const HuffDecodeEntry* pEntry;
+		WORD wNode;
+
+		Refill(pReader);
+		if (pReader->pIn >= pReader->pInEnd && pReader->dwNumBits < 7)
+		{	// THuffmannTree won't decode anything out of the last few bits either
+			return HUFF_ERROR;
+		}
+
+		pEntry = &pTable->entries[pReader->qwBits & (HUFF_TABLE_SIZE - 1)];
+		if (pEntry->nBits > pReader->dwNumBits)
+		{	// ran off the end
+			return HUFF_ERROR;
+		}
+		pReader->qwBits >>= pEntry->nBits;
+		pReader->dwNumBits -= pEntry->nBits;
+
+		if (pEntry->bLeaf)
+		{
+			return pEntry->wValue;
+		}
+
+		// long code, walk the rest of the way
+		wNode = pEntry->wValue;
+		while (!(wNode & HUFF_NODE_LEAF))
+		{
+			int nBit = GetBit(pReader);
+
+			if (nBit < 0)
+			{
+				return HUFF_ERROR;
+			}
+			wNode = pTable->nodes[wNode].wChild[nBit];
+		}
+		return wNode & ~HUFF_NODE_LEAF;
+	}
+
+	/*
+	 *	Decodes one value by walking a THuffmannTree a bit at a time
+	 *	@return	The value, or HUFF_ERROR
+	 */
+	static DWORD DecodeWithTree(THuffmannTree* pTree, HuffBitReader* pReader)
+	{
+		THTreeItem* pItem = pTree->pFirst;
+
+		Refill(pReader);
+		if (pReader->pIn >= pReader->pInEnd && pReader->dwNumBits < 7)
+		{
+			return HUFF_ERROR;
+		}
+
+		while (pItem->pChildLo != nullptr)
+		{
+			int nBit = GetBit(pReader);
+
+			if (nBit < 0)
+			{
+				return HUFF_ERROR;
+			}
+			pItem = nBit ? pItem->pChildLo->pPrev : pItem->pChildLo;
+		}
+		return pItem->DecompressedValue;
+	}
+
+	/*
+	 *	Carries on decoding a sector with a real (adaptive) tree, starting at the first new byte.
+	 *	This does the same thing as the tail end of THuffmannTree::Decompress.
+	 *	The tree changes every time a new byte shows up, and new bytes tend to come in bunches near the start of a
+	 *	sector, so the tree gets walked a bit at a time until it has gone HUFF_REBUILD_AFTER values without changing.
+	 *	Then it gets turned back into a table, which stays good until the next new byte.
+	 *	@return	The number of bytes written, or HUFF_ERROR
+	 */
+	static DWORD DecompressAdaptive(BYTE* pOutput, BYTE* pOutputEnd, unsigned int nType, HuffBitReader* pReader)
+	{
+		THuffmannTree ht(false);
+		HuffDecodeTable table;
+		BYTE* pOut = pOutput;
+		DWORD dwValue = HUFF_NEW_BYTE;
+		DWORD dwSinceChange = 0;
+		bool bTableReady = false;
+
+		// Nothing has changed the tree yet, so building it again gets us the same one
+		ht.BuildTree(nType);
+		ht.bIsCmp0 = 0;
+
+		while (true)
+		{
+			if (dwValue == HUFF_NEW_BYTE)
+			{	// The new byte is stored as-is in the next 8 bits
+				Refill(pReader);
+				if (pReader->dwNumBits < 8)
+				{
+					return HUFF_ERROR;
+				}
+				dwValue = (DWORD)(pReader->qwBits & 0xFF);
+				pReader->qwBits >>= 8;
+				pReader->dwNumBits -= 8;
+
+				ht.InsertNewBranchAndRebalance(ht.pLast->DecompressedValue, dwValue);
+				ht.IncWeightsAndRebalance(ht.ItemsByByte[dwValue]);
+				bTableReady = false;
+				dwSinceChange = 0;
+			}
+
+			*pOut++ = (BYTE)dwValue;
+			if (pOut >= pOutputEnd)
+			{
+				break;
+			}
+
+			if (bTableReady)
+			{
+				dwValue = DecodeWithTable(&table, pReader);
+			}
+			else
+			{
+				dwValue = DecodeWithTree(&ht, pReader);
+				if (++dwSinceChange == HUFF_REBUILD_AFTER)
+				{
+					table.wNumNodes = 0;
+					FillTable(&table, FlattenTree(&table, ht.pFirst), 0, 0);
+					bTableReady = true;
+				}
+			}
+
+			if (dwValue == HUFF_ERROR)
+			{
+				return HUFF_ERROR;
+			}
+			if (dwValue == HUFF_END_OF_STREAM)
+			{
+				break;
+			}
+		}
+
+		return (DWORD)(pOut - pOutput);
+	}
+
+	/*
+	 *	Decompresses a Huffman compressed sector. Same output as THuffmannTree::Decompress.
+	 *	@return	The number of bytes written, or 0 if the data was bad
+	 *	@author	eezstreet
+	 */
+	DWORD Decompress(void* pOutput, DWORD dwOutputSize, const void* pInput, DWORD dwInputSize)
+	{
+		BYTE* pOut = (BYTE*)pOutput;
+		BYTE* pOutEnd = pOut + dwOutputSize;
+		HuffDecodeTable* pTable;
+		HuffBitReader reader;
+		unsigned int nType;
+
+		if (dwOutputSize == 0 || dwInputSize == 0)
+		{
+			return 0;
+		}
+
+		nType = *(const BYTE*)pInput;
+		if (nType >= HUFF_NUM_TYPES || !gTables[nType].bValid)
+		{	// type 0 (or tables that didn't get built)
+			THuffmannTree ht(false);
+			TInputStream is((void*)pInput, dwInputSize);
+
+			return ht.Decompress(pOutput, dwOutputSize, &is);
+		}
+		pTable = &gTables[nType];
+
+		reader.pIn = (const BYTE*)pInput + 1;
+		reader.pInEnd = (const BYTE*)pInput + dwInputSize;
+		reader.qwBits = 0;
+		reader.dwNumBits = 0;
+
+		while (true)
+		{
+			DWORD dwValue = DecodeWithTable(pTable, &reader);
+
+			if (dwValue == HUFF_ERROR)
+			{
+				return 0;
+			}
+
+			if (dwValue == HUFF_END_OF_STREAM)
+			{
+				break;
+			}
+
+			if (dwValue == HUFF_NEW_BYTE)
+			{	// The tree is about to change, so this is as far as the shared tables go
+				DWORD dwWritten = DecompressAdaptive(pOut, pOutEnd, nType, &reader);
+
+				if (dwWritten == HUFF_ERROR)
+				{
+					return 0;
+				}
+				return (DWORD)(pOut - (BYTE*)pOutput) + dwWritten;
+			}
+
+			*pOut++ = (BYTE)dwValue;
+			if (pOut >= pOutEnd)
+			{
+				break;
+			}
+		}
+
+		return (DWORD)(pOut - (BYTE*)pOutput);
+	}
+}
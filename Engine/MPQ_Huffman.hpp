@@ -0,0 +1,9 @@
+#pragma once
+#include "../Shared/D2Shared.hpp"
+
+// MPQ_Huffman.cpp
+namespace MPQHuffman
+{
+	void Init();
+	DWORD Decompress(void* pOutput, DWORD dwOutputSize, const void* pInput, DWORD dwInputSize);
+}
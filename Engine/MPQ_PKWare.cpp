@@ -0,0 +1,498 @@
+#include "MPQ_PKWare.hpp"
+
+/*
+ *	PKWARE DCL "explode", straight from one buffer to another.
+ *
+ *	Libraries/pkware/explode.c works through read and write callbacks and a 0x2204 byte window that gets flushed
+ *	out 0x1000 bytes at a time, and it wants a 12KB work buffer to do it in. Sectors are never bigger than 4KB, so
+ *	none of that is needed: we decode right into the output buffer (repetitions copy out of what's already been
+ *	written there) and pull bits out of a 64 bit buffer that gets topped up once per literal.
+ *	The output is the same as explode.c's, byte for byte, including what happens with truncated or bad data:
+ *		- explode.c starts out with a window full of zeroes, so a repetition from before the start of the output
+ *		  copies zeroes.
+ *		- explode.c always keeps 8 bits loaded ahead of the ones it's using, so it gives up as soon as a code would
+ *		  leave less than 8 bits of input after it (except for the end of stream marker, which is allowed to).
+ *		- Whatever got decoded before an error is still kept.
+ *	The one difference is that repetitions get copied 8 bytes at a time when there's room for it, so the part of the
+ *	output buffer past the returned length can get scribbled on.
+ *	@author	eezstreet
+ */
+
+#define PK_CMP_BINARY			0
+#define PK_CMP_ASCII			1
+#define PK_END_OF_STREAM		0x305
+#define PK_END_MARKER			0x10E		// Length code + extra bits of the end of stream marker
+#define PK_REFILL_BELOW			32			// The longest code (a repetition) takes 30 bits
+
+namespace MPQPKWare
+{
+	/*
+	 *	Same tables as explode.c
+	 */
+	static const BYTE gDistBits[] = {
+		0x02, 0x04, 0x04, 0x05, 0x05, 0x05, 0x05, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06,
+		0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+		0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+		0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08
+	};
+
+	static const BYTE gDistCode[] = {
+		0x03, 0x0D, 0x05, 0x19, 0x09, 0x11, 0x01, 0x3E, 0x1E, 0x2E, 0x0E, 0x36, 0x16, 0x26, 0x06, 0x3A,
+		0x1A, 0x2A, 0x0A, 0x32, 0x12, 0x22, 0x42, 0x02, 0x7C, 0x3C, 0x5C, 0x1C, 0x6C, 0x2C, 0x4C, 0x0C,
+		0x74, 0x34, 0x54, 0x14, 0x64, 0x24, 0x44, 0x04, 0x78, 0x38, 0x58, 0x18, 0x68, 0x28, 0x48, 0x08,
+		0xF0, 0x70, 0xB0, 0x30, 0xD0, 0x50, 0x90, 0x10, 0xE0, 0x60, 0xA0, 0x20, 0xC0, 0x40, 0x80, 0x00
+	};
+
+	static const BYTE gExLenBits[] = {
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08
+	};
+
+	static const WORD gLenBase[] = {
+		0x0000, 0x0001, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006, 0x0007,
+		0x0008, 0x000A, 0x000E, 0x0016, 0x0026, 0x0046, 0x0086, 0x0106
+	};
+
+	static const BYTE gLenBits[] = {
+		0x03, 0x02, 0x03, 0x03, 0x04, 0x04, 0x04, 0x05, 0x05, 0x05, 0x05, 0x06, 0x06, 0x06, 0x07, 0x07
+	};
+
+	static const BYTE gLenCode[] = {
+		0x05, 0x03, 0x01, 0x06, 0x0A, 0x02, 0x0C, 0x14, 0x04, 0x18, 0x08, 0x30, 0x10, 0x20, 0x40, 0x00
+	};
+
+	static const BYTE gChBitsAsc[] = {
+		0x0B, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x08, 0x07, 0x0C, 0x0C, 0x07, 0x0C, 0x0C,
+		0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0D, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C,
+		0x04, 0x0A, 0x08, 0x0C, 0x0A, 0x0C, 0x0A, 0x08, 0x07, 0x07, 0x08, 0x09, 0x07, 0x06, 0x07, 0x08,
+		0x07, 0x06, 0x07, 0x07, 0x07, 0x07, 0x08, 0x07, 0x07, 0x08, 0x08, 0x0C, 0x0B, 0x07, 0x09, 0x0B,
+		0x0C, 0x06, 0x07, 0x06, 0x06, 0x05, 0x07, 0x08, 0x08, 0x06, 0x0B, 0x09, 0x06, 0x07, 0x06, 0x06,
+		0x07, 0x0B, 0x06, 0x06, 0x06, 0x07, 0x09, 0x08, 0x09, 0x09, 0x0B, 0x08, 0x0B, 0x09, 0x0C, 0x08,
+		0x0C, 0x05, 0x06, 0x06, 0x06, 0x05, 0x06, 0x06, 0x06, 0x05, 0x0B, 0x07, 0x05, 0x06, 0x05, 0x05,
+		0x06, 0x0A, 0x05, 0x05, 0x05, 0x05, 0x08, 0x07, 0x08, 0x08, 0x0A, 0x0B, 0x0B, 0x0C, 0x0C, 0x0C,
+		0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D,
+		0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D,
+		0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D,
+		0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C,
+		0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C,
+		0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C,
+		0x0D, 0x0C, 0x0D, 0x0D, 0x0D, 0x0C, 0x0D, 0x0D, 0x0D, 0x0C, 0x0D, 0x0D, 0x0D, 0x0D, 0x0C, 0x0D,
+		0x0D, 0x0D, 0x0C, 0x0C, 0x0C, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D
+	};
+
+	static const WORD gChCodeAsc[] = {
+		0x0490, 0x0FE0, 0x07E0, 0x0BE0, 0x03E0, 0x0DE0, 0x05E0, 0x09E0,
+		0x01E0, 0x00B8, 0x0062, 0x0EE0, 0x06E0, 0x0022, 0x0AE0, 0x02E0,
+		0x0CE0, 0x04E0, 0x08E0, 0x00E0, 0x0F60, 0x0760, 0x0B60, 0x0360,
+		0x0D60, 0x0560, 0x1240, 0x0960, 0x0160, 0x0E60, 0x0660, 0x0A60,
+		0x000F, 0x0250, 0x0038, 0x0260, 0x0050, 0x0C60, 0x0390, 0x00D8,
+		0x0042, 0x0002, 0x0058, 0x01B0, 0x007C, 0x0029, 0x003C, 0x0098,
+		0x005C, 0x0009, 0x001C, 0x006C, 0x002C, 0x004C, 0x0018, 0x000C,
+		0x0074, 0x00E8, 0x0068, 0x0460, 0x0090, 0x0034, 0x00B0, 0x0710,
+		0x0860, 0x0031, 0x0054, 0x0011, 0x0021, 0x0017, 0x0014, 0x00A8,
+		0x0028, 0x0001, 0x0310, 0x0130, 0x003E, 0x0064, 0x001E, 0x002E,
+		0x0024, 0x0510, 0x000E, 0x0036, 0x0016, 0x0044, 0x0030, 0x00C8,
+		0x01D0, 0x00D0, 0x0110, 0x0048, 0x0610, 0x0150, 0x0060, 0x0088,
+		0x0FA0, 0x0007, 0x0026, 0x0006, 0x003A, 0x001B, 0x001A, 0x002A,
+		0x000A, 0x000B, 0x0210, 0x0004, 0x0013, 0x0032, 0x0003, 0x001D,
+		0x0012, 0x0190, 0x000D, 0x0015, 0x0005, 0x0019, 0x0008, 0x0078,
+		0x00F0, 0x0070, 0x0290, 0x0410, 0x0010, 0x07A0, 0x0BA0, 0x03A0,
+		0x0240, 0x1C40, 0x0C40, 0x1440, 0x0440, 0x1840, 0x0840, 0x1040,
+		0x0040, 0x1F80, 0x0F80, 0x1780, 0x0780, 0x1B80, 0x0B80, 0x1380,
+		0x0380, 0x1D80, 0x0D80, 0x1580, 0x0580, 0x1980, 0x0980, 0x1180,
+		0x0180, 0x1E80, 0x0E80, 0x1680, 0x0680, 0x1A80, 0x0A80, 0x1280,
+		0x0280, 0x1C80, 0x0C80, 0x1480, 0x0480, 0x1880, 0x0880, 0x1080,
+		0x0080, 0x1F00, 0x0F00, 0x1700, 0x0700, 0x1B00, 0x0B00, 0x1300,
+		0x0DA0, 0x05A0, 0x09A0, 0x01A0, 0x0EA0, 0x06A0, 0x0AA0, 0x02A0,
+		0x0CA0, 0x04A0, 0x08A0, 0x00A0, 0x0F20, 0x0720, 0x0B20, 0x0320,
+		0x0D20, 0x0520, 0x0920, 0x0120, 0x0E20, 0x0620, 0x0A20, 0x0220,
+		0x0C20, 0x0420, 0x0820, 0x0020, 0x0FC0, 0x07C0, 0x0BC0, 0x03C0,
+		0x0DC0, 0x05C0, 0x09C0, 0x01C0, 0x0EC0, 0x06C0, 0x0AC0, 0x02C0,
+		0x0CC0, 0x04C0, 0x08C0, 0x00C0, 0x0F40, 0x0740, 0x0B40, 0x0340,
+		0x0300, 0x0D40, 0x1D00, 0x0D00, 0x1500, 0x0540, 0x0500, 0x1900,
+		0x0900, 0x0940, 0x1100, 0x0100, 0x1E00, 0x0E00, 0x0140, 0x1600,
+		0x0600, 0x1A00, 0x0E40, 0x0640, 0x0A40, 0x0A00, 0x1200, 0x0200,
+		0x1C00, 0x0C00, 0x1400, 0x0400, 0x1800, 0x0800, 0x1000, 0x0000
+	};
+
+	/*
+	 *	Tables that get built by Init
+	 */
+	struct PKCode
+	{
+		BYTE	nCode;
+		BYTE	nBits;
+	};
+
+	static PKCode gLengthCodes[0x100];		// Low 8 bits -> length code
+	static PKCode gDistCodes[0x100];		// Low 8 bits -> distance position code
+	static BYTE gAscBits[0x100];			// Bits left over for each literal after the lookups below
+	static BYTE gAscLookup1[0x100];			// Codes of 8 bits or less, or 0xFF if it needs gAscLookup2 or 3
+	static BYTE gAscLookup2[0x100];			// Codes that continue 4 bits in
+	static BYTE gAscLookup3[0x80];			// Codes that continue 6 bits in
+	static BYTE gAscLookup4[0x100];			// Codes whose first 8 bits are all zero
+	static bool gbTablesReady = false;
+
+	/*
+	 *	Same as explode.c's GenDecodeTabs
+	 */
+	static void BuildCodeTable(PKCode* pTable, const BYTE* pCodes, const BYTE* pBits, size_t nCount)
+	{
+		for (size_t i = 0; i < nCount; i++)
+		{
+			for (DWORD dwIndex = pCodes[i]; dwIndex < 0x100; dwIndex += (1 << pBits[i]))
+			{
+				pTable[dwIndex].nCode = (BYTE)i;
+				pTable[dwIndex].nBits = pBits[i];
+			}
+		}
+	}
+
+	/*
+	 *	Same as explode.c's GenAscTabs
+	 */
+	static void BuildAsciiTables()
+	{
+		memcpy(gAscBits, gChBitsAsc, sizeof(gAscBits));
+
+		for (int nCount = 0xFF; nCount >= 0; nCount--)
+		{
+			DWORD dwCode = gChCodeAsc[nCount];
+			BYTE nBits = gAscBits[nCount];
+			BYTE* pLookup;
+			DWORD dwLimit;
+
+			if (nBits <= 8)
+			{
+				for (DWORD dwIndex = dwCode; dwIndex < 0x100; dwIndex += (1 << nBits))
+				{
+					gAscLookup1[dwIndex] = (BYTE)nCount;
+				}
+				continue;
+			}
+
+			if ((dwCode & 0xFF) != 0)
+			{
+				gAscLookup1[dwCode & 0xFF] = 0xFF;
+				if (dwCode & 0x3F)
+				{
+					nBits -= 4;
+					dwCode >>= 4;
+					pLookup = gAscLookup2;
+					dwLimit = 0x100;
+				}
+				else
+				{
+					nBits -= 6;
+					dwCode >>= 6;
+					pLookup = gAscLookup3;
+					dwLimit = 0x80;
+				}
+			}
+			else
+			{
+				nBits -= 8;
+				dwCode >>= 8;
+				pLookup = gAscLookup4;
+				dwLimit = 0x100;
+			}
+
+			gAscBits[nCount] = nBits;
+			for (DWORD dwIndex = dwCode; dwIndex < dwLimit; dwIndex += (1 << nBits))
+			{
+				pLookup[dwIndex] = (BYTE)nCount;
+			}
+		}
+	}
+
+	/*
+	 *	Builds the decoding tables. Only does anything the first time.
+	 *	@author	eezstreet
+	 */
+	void Init()
+	{
+		if (gbTablesReady)
+		{
+			return;
+		}
+
+		BuildCodeTable(gLengthCodes, gLenCode, gLenBits, sizeof(gLenBits));
+		BuildCodeTable(gDistCodes, gDistCode, gDistBits, sizeof(gDistBits));
+		BuildAsciiTables();
+		gbTablesReady = true;
+	}
+
+	/*
+	 *	Bit reader.
+	 *	nBitsLeft counts down to the end of the input. Anything that takes it below 8 is an error, same as explode.c.
+	 */
+	struct PKBitReader
+	{
+		const BYTE*			pIn;
+		const BYTE*			pInEnd;
+		unsigned long long	qwBits;
+		DWORD				dwNumBits;
+		int					nBitsLeft;
+	};
+
+	static inline void Refill(PKBitReader* pReader)
+	{
+		if (pReader->dwNumBits >= PK_REFILL_BELOW)
+		{
+			return;
+		}
+
+		if (pReader->pInEnd - pReader->pIn >= 8)
+		{	// Load 8 bytes at once and keep however many whole ones fit
+			unsigned long long qwNext;
+
+			memcpy(&qwNext, pReader->pIn, sizeof(qwNext));
+			pReader->qwBits |= qwNext << pReader->dwNumBits;
+			pReader->pIn += (63 - pReader->dwNumBits) >> 3;
+			pReader->dwNumBits |= 56;
+			return;
+		}
+
+		while (pReader->dwNumBits <= 56 && pReader->pIn < pReader->pInEnd)
+		{
+			pReader->qwBits |= (unsigned long long)(*pReader->pIn++) << pReader->dwNumBits;
+			pReader->dwNumBits += 8;
+		}
+	}
+
+	/*
+	 *	Drops some bits.
+	 *	@return	false if that ran past the end of the input
+	 */
+	static inline bool Consume(PKBitReader* pReader, DWORD dwBits)
+	{
+		pReader->qwBits >>= dwBits;
+		pReader->dwNumBits -= dwBits;		// only wraps around when we're about to fail anyway
+		pReader->nBitsLeft -= dwBits;
+		return pReader->nBitsLeft >= 8;
+	}
+
+	/*
+	 *	Decodes an ASCII mode literal, after the flag bit
+	 *	@return	The literal, or PK_END_OF_STREAM + 1 on error
+	 */
+	static DWORD DecodeAsciiLiteral(PKBitReader* pReader)
+	{
+		DWORD dwValue;
+
+		if (pReader->qwBits & 0xFF)
+		{
+			dwValue = gAscLookup1[pReader->qwBits & 0xFF];
+			if (dwValue == 0xFF)
+			{
+				if (pReader->qwBits & 0x3F)
+				{
+					if (!Consume(pReader, 4))
+					{
+						return PK_END_OF_STREAM + 1;
+					}
+					dwValue = gAscLookup2[pReader->qwBits & 0xFF];
+				}
+				else
+				{
+					if (!Consume(pReader, 6))
+					{
+						return PK_END_OF_STREAM + 1;
+					}
+					dwValue = gAscLookup3[pReader->qwBits & 0x7F];
+				}
+			}
+		}
+		else
+		{
+			if (!Consume(pReader, 8))
+			{
+				return PK_END_OF_STREAM + 1;
+			}
+			dwValue = gAscLookup4[pReader->qwBits & 0xFF];
+		}
+
+		if (!Consume(pReader, gAscBits[dwValue]))
+		{
+			return PK_END_OF_STREAM + 1;
+		}
+		return dwValue;
+	}
+
+	/*
+	 *	Copies a repetition. Anything from before the start of the output is a zero.
+	 */
+	static inline void CopyRepetition(BYTE* pOut, const BYTE* pOutStart, DWORD dwDistance, DWORD dwLength,
+		bool bRoomToSpare)
+	{
+		const BYTE* pSource = pOut - dwDistance;
+
+		if (dwDistance > (DWORD)(pOut - pOutStart))
+		{	// Reaches back before the start of the output
+			DWORD dwZeroes = D2Lib::min<DWORD>(dwDistance - (DWORD)(pOut - pOutStart), dwLength);
+
+			memset(pOut, 0, dwZeroes);
+			pOut += dwZeroes;
+			dwLength -= dwZeroes;
+			pSource = pOutStart;
+		}
+		else if (dwDistance >= 8 && bRoomToSpare)
+		{	// 8 bytes at a time. The copies never overlap themselves, and it's fine to write a bit past the end.
+			for (DWORD i = 0; i < dwLength; i += 8)
+			{
+				memcpy(pOut + i, pSource + i, 8);
+			}
+			return;
+		}
+		else if (dwDistance == 1)
+		{	// Run of one byte
+			memset(pOut, pOut[-1], dwLength);
+			return;
+		}
+
+		while (dwLength-- > 0)
+		{
+			*pOut++ = *pSource++;
+		}
+	}
+
+	/*
+	 *	Decompresses a PKWARE DCL imploded sector.
+	 *	@return	The number of bytes written, which is 0 if the data was bad from the start
+	 *	@author	eezstreet
+	 */
+	DWORD Explode(void* pOutput, DWORD dwOutputSize, const void* pInput, DWORD dwInputSize)
+	{
+		const BYTE* pInBytes = (const BYTE*)pInput;
+		BYTE* pOutStart = (BYTE*)pOutput;
+		BYTE* pOut = pOutStart;
+		BYTE* pOutEnd = pOutStart + dwOutputSize;
+		PKBitReader reader;
+		DWORD dwType, dwDictBits, dwDictMask;
+
+		// explode.c only looks at the first 0x800 bytes for this check
+		if (dwInputSize <= 4 || dwOutputSize == 0)
+		{
+			return 0;
+		}
+
+		dwType = pInBytes[0];
+		dwDictBits = pInBytes[1];
+		if (dwDictBits < 4 || dwDictBits > 6 || (dwType != PK_CMP_BINARY && dwType != PK_CMP_ASCII))
+		{
+			return 0;
+		}
+		dwDictMask = (1 << dwDictBits) - 1;
+
+		reader.pIn = pInBytes + 2;
+		reader.pInEnd = pInBytes + dwInputSize;
+		reader.qwBits = 0;
+		reader.dwNumBits = 0;
+		reader.nBitsLeft = (int)(dwInputSize - 2) * 8;
+
+		while (pOut < pOutEnd)
+		{
+			Refill(&reader);
+
+			if (!(reader.qwBits & 1))
+			{	// Literal
+				if (dwType == PK_CMP_BINARY)
+				{
+					BYTE nLiteral = (BYTE)(reader.qwBits >> 1);
+
+					if (!Consume(&reader, 9))
+					{
+						break;
+					}
+					*pOut++ = nLiteral;
+				}
+				else
+				{
+					DWORD dwLiteral;
+
+					if (!Consume(&reader, 1))
+					{
+						break;
+					}
+					dwLiteral = DecodeAsciiLiteral(&reader);
+					if (dwLiteral > 0xFF)
+					{
+						break;
+					}
+					*pOut++ = (BYTE)dwLiteral;
+				}
+			}
+			else
+			{	// Repetition
+				const PKCode* pLength;
+				const PKCode* pDist;
+				DWORD dwLength, dwDistance;
+
+				if (!Consume(&reader, 1))
+				{
+					break;
+				}
+
+				pLength = &gLengthCodes[reader.qwBits & 0xFF];
+				if (!Consume(&reader, pLength->nBits))
+				{
+					break;
+				}
+
+				dwLength = pLength->nCode;
+				if (gExLenBits[pLength->nCode] != 0)
+				{
+					DWORD dwExtraBits = gExLenBits[pLength->nCode];
+					DWORD dwExtra = (DWORD)(reader.qwBits & ((1 << dwExtraBits) - 1));
+
+					if (pLength->nCode + dwExtra == PK_END_MARKER)
+					{	// end of stream (which is allowed to use up the last few bits)
+						break;
+					}
+					if (!Consume(&reader, dwExtraBits))
+					{
+						break;
+					}
+					dwLength = gLenBase[pLength->nCode] + dwExtra;
+				}
+				dwLength += 2;
+
+				pDist = &gDistCodes[reader.qwBits & 0xFF];
+				if (!Consume(&reader, pDist->nBits))
+				{
+					break;
+				}
+
+				if (dwLength == 2)
+				{
+					dwDistance = ((DWORD)pDist->nCode << 2) | (DWORD)(reader.qwBits & 3);
+					if (!Consume(&reader, 2))
+					{
+						break;
+					}
+				}
+				else
+				{
+					dwDistance = ((DWORD)pDist->nCode << dwDictBits) | (DWORD)(reader.qwBits & dwDictMask);
+					if (!Consume(&reader, dwDictBits))
+					{
+						break;
+					}
+				}
+				dwDistance++;
+
+				if (dwLength > (DWORD)(pOutEnd - pOut))
+				{	// explode.c carries on past the end and throws the rest away, but that doesn't change anything
+					dwLength = (DWORD)(pOutEnd - pOut);
+					CopyRepetition(pOut, pOutStart, dwDistance, dwLength, false);
+					pOut = pOutEnd;
+					break;
+				}
+
+				CopyRepetition(pOut, pOutStart, dwDistance, dwLength, (DWORD)(pOutEnd - pOut) >= dwLength + 8);
+				pOut += dwLength;
+			}
+		}
+
+		return (DWORD)(pOut - pOutStart);
+	}
+}
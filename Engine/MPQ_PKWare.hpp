@@ -0,0 +1,9 @@
+#pragma once
+#include "../Shared/D2Shared.hpp"
+
+// MPQ_PKWare.cpp
+namespace MPQPKWare
+{
+	void Init();
+	DWORD Explode(void* pOutput, DWORD dwOutputSize, const void* pInput, DWORD dwInputSize);
+}
@@ -0,0 +1,203 @@
+#include "OD2Pak.hpp"
+#include "MPQ.hpp"
+#include "Logging.hpp"
+#include "FileSystem.hpp"
+
+/*
+ *	Mounting of .od2pak files.
+ *	A pak gets opened into a D2MPQArchive just like an MPQ does. Its entries become blocks that are neither compressed
+ *	nor encrypted, so MPQ::ReadFile and MPQ::GetFileView don't need to know the difference.
+ *	@author	eezstreet
+ */
+namespace OD2Pak
+{
+	/*
+	 *	Reads a range of bytes from the pak, whether it's mapped or not
+	 *	@return	The number of bytes read
+	 */
+	static size_t ReadPakData(D2MPQArchive* pArchive, DWORD dwOffset, void* pBuffer, DWORD dwLength)
+	{
+		if (pArchive->pMappedData != nullptr)
+		{
+			if (dwOffset > pArchive->dwMappedSize || dwLength > pArchive->dwMappedSize - dwOffset)
+			{
+				return 0;
+			}
+
+			memcpy(pBuffer, pArchive->pMappedData + dwOffset, dwLength);
+			return dwLength;
+		}
+
+		return FS::ReadAt(pArchive->f, dwOffset, pBuffer, dwLength);
+	}
+
+	/*
+	 *	Whether the start of a file looks like a pak
+	 */
+	bool IsPak(const void* pHeader, size_t dwHeaderSize)
+	{
+		return dwHeaderSize >= sizeof(DWORD) && *(const DWORD*)pHeader == OD2PAK_ID;
+	}
+
+	/*
+	 *	Reads the index of a pak into pArchive.
+	 *	The archive's data must already be mapped (or its file handle open).
+	 *	@return	false if the pak is damaged, or was made by a newer version of the converter
+	 */
+	bool Open(D2MPQArchive* pArchive)
+	{
+		OD2PakHeader header;
+		OD2PakEntry* pEntries;
+		char* pNames = nullptr;
+		DWORD dwIndexSize;
+		DWORD dwCRC;
+
+		Log_ErrorAssertReturn(ReadPakData(pArchive, 0, &header, sizeof(header)) == sizeof(header), false);
+		Log_ErrorAssertReturn(header.dwID == OD2PAK_ID && header.dwHeaderSize == sizeof(header), false);
+		Log_WarnAssertReturn(header.dwVersion == OD2PAK_VERSION, false);
+
+		// The index and the names have to fit inside of the pak
+		dwIndexSize = header.dwNumEntries * sizeof(OD2PakEntry);
+		Log_ErrorAssertReturn(header.dwNumEntries <= header.dwArchiveSize / sizeof(OD2PakEntry), false);
+		Log_ErrorAssertReturn(header.dwIndexOffset <= header.dwArchiveSize &&
+			dwIndexSize <= header.dwArchiveSize - header.dwIndexOffset, false);
+		Log_ErrorAssertReturn(header.dwNamesOffset <= header.dwArchiveSize &&
+			header.dwNamesSize <= header.dwArchiveSize - header.dwNamesOffset, false);
+
+		pEntries = (OD2PakEntry*)malloc(dwIndexSize + sizeof(OD2PakEntry));
+		Log_ErrorAssertReturn(pEntries != nullptr, false);
+		if (header.dwNamesSize > 0)
+		{
+			pNames = (char*)malloc(header.dwNamesSize);
+			if (pNames == nullptr)
+			{
+				free(pEntries);
+				Log_ErrorAssertReturn(!"Out of memory", false);
+			}
+		}
+
+		if (ReadPakData(pArchive, header.dwIndexOffset, pEntries, dwIndexSize) != dwIndexSize ||
+			(pNames != nullptr && ReadPakData(pArchive, header.dwNamesOffset, pNames, header.dwNamesSize) != header.dwNamesSize))
+		{
+			free(pNames);
+			free(pEntries);
+			Log_ErrorAssertReturn(!"Couldn't read the pak index", false);
+		}
+
+		dwCRC = D2Lib::crc32(pEntries, dwIndexSize, 0);
+		dwCRC = D2Lib::crc32(pNames, header.dwNamesSize, dwCRC);
+		if (dwCRC != header.dwIndexChecksum)
+		{
+			free(pNames);
+			free(pEntries);
+			Log_ErrorAssertReturn(!"Pak index is damaged", false);
+		}
+
+		for (DWORD i = 1; i < header.dwNumEntries; i++)
+		{
+			if (pEntries[i].dwName1 < pEntries[i - 1].dwName1 ||
+				(pEntries[i].dwName1 == pEntries[i - 1].dwName1 && pEntries[i].dwName2 <= pEntries[i - 1].dwName2))
+			{	// FindEntry needs these to be in order
+				free(pNames);
+				free(pEntries);
+				Log_ErrorAssertReturn(!"Pak index is out of order", false);
+			}
+		}
+
+		pArchive->pBlockTable = (MPQBlock*)malloc(sizeof(MPQBlock) * (header.dwNumEntries + 1));
+		pArchive->pNameTable = (MPQName*)calloc(header.dwNumEntries + 1, sizeof(MPQName));
+		if (pArchive->pBlockTable == nullptr || pArchive->pNameTable == nullptr)
+		{
+			free(pArchive->pBlockTable);
+			free(pArchive->pNameTable);
+			pArchive->pBlockTable = nullptr;
+			pArchive->pNameTable = nullptr;
+			free(pNames);
+			free(pEntries);
+			Log_ErrorAssertReturn(!"Out of memory", false);
+		}
+
+		for (DWORD i = 0; i < header.dwNumEntries; i++)
+		{
+			OD2PakEntry* pEntry = &pEntries[i];
+			MPQBlock* pBlock = &pArchive->pBlockTable[i];
+
+			if (pEntry->dwOffset > header.dwArchiveSize || pEntry->dwSize > header.dwArchiveSize - pEntry->dwOffset)
+			{	// Runs off of the end of the pak, so pretend that it's empty
+				pEntry->dwSize = 0;
+			}
+
+			pBlock->dwFilePos = pEntry->dwOffset;
+			pBlock->dwCSize = pEntry->dwSize;
+			pBlock->dwFSize = pEntry->dwSize;
+			pBlock->dwFlags = MPQ_FILE_EXISTS;
+
+			if (pEntry->dwNameOffset < header.dwNamesSize)
+			{
+				DWORD dwMaxLength = D2Lib::min<DWORD>(MAX_D2PATH, header.dwNamesSize - pEntry->dwNameOffset);
+
+				D2Lib::strncpyz(pArchive->pNameTable[i], pNames + pEntry->dwNameOffset, dwMaxLength);
+			}
+		}
+		free(pNames);
+
+		pArchive->pPakEntries = pEntries;
+		pArchive->dwArchiveSize = header.dwArchiveSize;
+		pArchive->dwDataOffset = OD2PAK_ALIGNMENT;
+		pArchive->dwNumHashEntries = header.dwNumEntries;
+		pArchive->dwNumBlockEntries = header.dwNumEntries;
+		pArchive->dwFileCount = header.dwNumEntries;
+		pArchive->wSectorSize = 0x1000;
+		return true;
+	}
+
+	/*
+	 *	Looks up a file by its name hashes
+	 *	@return	The file's handle, or INVALID_HANDLE if the pak doesn't have it
+	 */
+	fs_handle FindEntry(D2MPQArchive* pArchive, DWORD dwName1, DWORD dwName2)
+	{
+		OD2PakEntry* pEntries = pArchive->pPakEntries;
+		DWORD dwLow = 0;
+		DWORD dwHigh = pArchive->dwNumBlockEntries;
+
+		while (dwLow < dwHigh)
+		{
+			DWORD dwMiddle = dwLow + ((dwHigh - dwLow) >> 1);
+			OD2PakEntry* pEntry = &pEntries[dwMiddle];
+
+			if (pEntry->dwName1 == dwName1 && pEntry->dwName2 == dwName2)
+			{
+				return (fs_handle)dwMiddle;
+			}
+
+			if (pEntry->dwName1 < dwName1 || (pEntry->dwName1 == dwName1 && pEntry->dwName2 < dwName2))
+			{
+				dwLow = dwMiddle + 1;
+			}
+			else
+			{
+				dwHigh = dwMiddle;
+			}
+		}
+
+		return INVALID_HANDLE;
+	}
+
+	/*
+	 *	Gets the name hashes of an entry. This is what MPQ::GetHashEntry does for paks.
+	 *	@return	false if there's no such entry
+	 */
+	bool GetEntry(D2MPQArchive* pArchive, DWORD dwIndex, DWORD* pdwName1, DWORD* pdwName2, fs_handle* pfFile)
+	{
+		if (dwIndex >= pArchive->dwNumBlockEntries)
+		{
+			return false;
+		}
+
+		*pdwName1 = pArchive->pPakEntries[dwIndex].dwName1;
+		*pdwName2 = pArchive->pPakEntries[dwIndex].dwName2;
+		*pfFile = (fs_handle)dwIndex;
+		return true;
+	}
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include "../Shared/D2Shared.hpp"
+
+/*
+ *	OD2PAK FILES
+ *	Our own archive format, which an installed MPQ can be repacked into (see Tools/OD2Pak).
+ *	Nothing in a pak is compressed or encrypted, and every file starts on a 4KB boundary, so once the pak is mapped
+ *	a file can be used right where it sits. Files are looked up by the same two name hashes that MPQs use, so a pak
+ *	can take the place of the MPQ it was made from without anything else noticing.
+ *
+ *	Layout:
+ *		OD2PakHeader
+ *		(padding up to the first 4KB boundary)
+ *		File data, each file padded up to the next 4KB boundary
+ *		OD2PakEntry[dwNumEntries], sorted by dwName1 and then dwName2
+ *		File names (nul terminated), if they were known when the pak was made
+ *	@author	eezstreet
+ */
+
+#define OD2PAK_ID				0x5032444F		// "OD2P"
+#define OD2PAK_VERSION			1
+#define OD2PAK_ALIGNMENT		0x1000
+#define OD2PAK_NO_NAME			0xFFFFFFFF
+#define OD2PAK_EXTENSION		".od2pak"
+
+// What's in an entry
+// There's no pre-decoded kind for DCCs. Decoding one needs the engine, so decoded DCC directions go in the DCC cache
+// instead (see DCC_Cache.cpp, and +dccwarm to fill it ahead of time).
+#define OD2PAK_KIND_RAW			0				// The file, exactly as it came out of the MPQ
+#define OD2PAK_KIND_DC6_DECODED	1				// A DC6 whose frames have already been decoded (see DC6.hpp)
+
+#pragma pack(push,enter_include)
+#pragma pack(1)
+struct OD2PakHeader
+{
+	DWORD	dwID;				// OD2PAK_ID
+	DWORD	dwVersion;			// OD2PAK_VERSION
+	DWORD	dwHeaderSize;		// sizeof(OD2PakHeader)
+	DWORD	dwArchiveSize;		// Size of the whole pak
+	DWORD	dwNumEntries;
+	DWORD	dwIndexOffset;		// Offset to the entries
+	DWORD	dwNamesOffset;		// Offset to the file names
+	DWORD	dwNamesSize;
+	DWORD	dwIndexChecksum;	// CRC-32 of the entries and the file names
+};
+
+struct OD2PakEntry
+{
+	DWORD	dwName1;			// MPQ_HASH_NAME_A hash of the file name
+	DWORD	dwName2;			// MPQ_HASH_NAME_B hash of the file name
+	DWORD	dwOffset;			// Offset to the file data (a multiple of OD2PAK_ALIGNMENT)
+	DWORD	dwSize;				// Size of the file data
+	DWORD	dwChecksum;			// CRC-32 of the file data
+	DWORD	dwNameOffset;		// Offset of the file name from dwNamesOffset, or OD2PAK_NO_NAME
+	WORD	wKind;				// OD2PAK_KIND_*
+	WORD	wReserved;
+};
+#pragma pack(pop,enter_include)
+
+struct D2MPQArchive;
+
+// OD2Pak.cpp
+namespace OD2Pak
+{
+	bool IsPak(const void* pHeader, size_t dwHeaderSize);
+	bool Open(D2MPQArchive* pArchive);
+	fs_handle FindEntry(D2MPQArchive* pArchive, DWORD dwName1, DWORD dwName2);
+	bool GetEntry(D2MPQArchive* pArchive, DWORD dwIndex, DWORD* pdwName1, DWORD* pdwName2, fs_handle* pfFile);
+}
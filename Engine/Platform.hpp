@@ -1,6 +1,7 @@
 #pragma once
 #include "../Shared/D2Shared.hpp"
 #include "Diablo2.hpp"
+#include <cstdio>
 
 // Platform_*.cpp
 namespace Sys
@@ -13,4 +14,7 @@ namespace Sys
 	D2ModuleExportStrc* OpenModule(OpenD2Modules nModule, D2ModuleImportStrc* pImports);
 	void CloseModule(OpenD2Modules nModule);
 	char16_t* GetAdapterIP();
+	void* MapFile(const char* szPath, size_t* pdwSize);
+	void UnmapFile(void* pView, size_t dwSize);
+	size_t ReadAt(FILE* pFile, size_t dwOffset, void* pBuffer, size_t dwBufferLen);
 }
\ No newline at end of file
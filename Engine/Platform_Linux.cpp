@@ -3,6 +3,9 @@
 #include <cstdio>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define D2REGISTRY_BETA_KEY	"SOFTWARE\\Blizzard Entertainment\\Diablo II Beta"
 #define D2REGISTRY_KEY		"SOFTWARE\\Blizzard Entertainment\\Diablo II"
@@ -246,6 +249,74 @@ namespace Sys
 		dlclose(gModules[nModule].dwModule);
 		memset(&gModules[nModule], 0, sizeof(D2ModuleInternal));
 	}
+
+	/*
+	*	Maps an entire file into memory as a read-only view.
+	*	@return	The base of the view, or nullptr if the file couldn't be mapped
+	*/
+	void* MapFile(const char* szPath, size_t* pdwSize)
+	{
+		struct stat fileStat;
+		void* pView;
+		int fd = open(szPath, O_RDONLY);
+
+		if (fd == -1)
+		{
+			return nullptr;
+		}
+
+		if (fstat(fd, &fileStat) != 0 || fileStat.st_size <= 0)
+		{
+			close(fd);
+			return nullptr;
+		}
+
+		pView = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);	// the mapping keeps its own reference to the file
+
+		if (pView == MAP_FAILED)
+		{
+			return nullptr;
+		}
+
+		*pdwSize = fileStat.st_size;
+		return pView;
+	}
+
+	/*
+	*	Releases a view created with MapFile
+	*/
+	void UnmapFile(void* pView, size_t dwSize)
+	{
+		if (pView == nullptr)
+		{
+			return;
+		}
+
+		munmap(pView, dwSize);
+	}
+
+	/*
+	*	Reads from an absolute offset in a file without touching its file position
+	*	@return	The number of bytes read
+	*/
+	size_t ReadAt(FILE* pFile, size_t dwOffset, void* pBuffer, size_t dwBufferLen)
+	{
+		int fd = fileno(pFile);
+		size_t dwTotalRead = 0;
+
+		while (dwTotalRead < dwBufferLen)
+		{
+			ssize_t dwRead = pread(fd, (char*)pBuffer + dwTotalRead, dwBufferLen - dwTotalRead, dwOffset + dwTotalRead);
+			if (dwRead <= 0)
+			{	// end of file, or an error
+				break;
+			}
+			dwTotalRead += dwRead;
+		}
+
+		return dwTotalRead;
+	}
 }
 
 int main(int argc, char* argv[])
@@ -8,6 +8,7 @@
 #include <cstdio>
 #include <shlobj.h>
 #include <crtdbg.h>
+#include <io.h>
 #include <winsock2.h>
 #include <iphlpapi.h>
 
@@ -331,6 +332,103 @@ namespace Sys
 		FreeLibrary(gModules[nModule].dwModule);
 		memset(&gModules[nModule], 0, sizeof(D2ModuleInternal));
 	}
+
+	/*
+	*	Maps an entire file into memory as a read-only view.
+	*	@return	The base of the view, or nullptr if the file couldn't be mapped
+	*/
+	void* MapFile(const char* szPath, size_t* pdwSize)
+	{
+		HANDLE hFile;
+		HANDLE hMapping;
+		LARGE_INTEGER fileSize;
+		void* pView;
+
+		hFile = CreateFileA(szPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+		{
+			return nullptr;
+		}
+
+		if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart <= 0)
+		{
+			CloseHandle(hFile);
+			return nullptr;
+		}
+
+		hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMapping == NULL)
+		{
+			CloseHandle(hFile);
+			return nullptr;
+		}
+
+		pView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+
+		// The view keeps the mapping (and the file) alive on its own
+		CloseHandle(hMapping);
+		CloseHandle(hFile);
+
+		if (pView == nullptr)
+		{
+			return nullptr;
+		}
+
+		*pdwSize = (size_t)fileSize.QuadPart;
+		return pView;
+	}
+
+	/*
+	*	Releases a view created with MapFile
+	*/
+	void UnmapFile(void* pView, size_t dwSize)
+	{
+		if (pView == nullptr)
+		{
+			return;
+		}
+
+		UnmapViewOfFile(pView);
+	}
+
+	/*
+	*	Reads from an absolute offset in a file.
+	*	The overlapped read still moves the handle's file pointer, so a file that gets read with this should only
+	*	ever be read with this. (Putting the pointer back afterwards wouldn't help, since another thread can be
+	*	reading the same file at once.)
+	*	@return	The number of bytes read
+	*/
+	size_t ReadAt(FILE* pFile, size_t dwOffset, void* pBuffer, size_t dwBufferLen)
+	{
+		HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(pFile));
+		size_t dwTotalRead = 0;
+
+		if (hFile == INVALID_HANDLE_VALUE)
+		{
+			return 0;
+		}
+
+		while (dwTotalRead < dwBufferLen)
+		{
+			OVERLAPPED overlapped;
+			unsigned long long qwReadOffset = (unsigned long long)dwOffset + dwTotalRead;
+			size_t dwRemaining = dwBufferLen - dwTotalRead;
+			DWORD dwToRead = dwRemaining > 0x7FFFFFFF ? 0x7FFFFFFF : (DWORD)dwRemaining;
+			DWORD dwRead = 0;
+
+			memset(&overlapped, 0, sizeof(overlapped));
+			overlapped.Offset = (DWORD)qwReadOffset;
+			overlapped.OffsetHigh = (DWORD)(qwReadOffset >> 32);
+
+			if (!::ReadFile(hFile, (char*)pBuffer + dwTotalRead, dwToRead, &dwRead, &overlapped) || dwRead == 0)
+			{	// end of file, or an error
+				break;
+			}
+			dwTotalRead += dwRead;
+		}
+
+		return dwTotalRead;
+	}
 }
 
 /*
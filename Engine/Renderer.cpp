@@ -41,7 +41,7 @@ namespace Renderer
 
 		// Load palettes
 		Pal::Init();
-		DCC::GlobalInit();
+		DCC::GlobalInit(pOpenConfig->bDCCCache != 0);
 
 		switch (DesiredRenderTarget)
 		{
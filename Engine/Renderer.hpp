@@ -9,6 +9,13 @@
 #define LRUSIZE_MISSILES				32
 #define LRUSIZE_OVERLAYS				32
 
+// How much decoded texture memory each of the LRUs can hold onto
+#define LRUBUDGET_CHARS					(64 * 1024 * 1024)
+#define LRUBUDGET_MONSTERS				(64 * 1024 * 1024)
+#define LRUBUDGET_OBJECTS				(16 * 1024 * 1024)
+#define LRUBUDGET_MISSILES				(8 * 1024 * 1024)
+#define LRUBUDGET_OVERLAYS				(8 * 1024 * 1024)
+
 // The render targets
 enum OpenD2RenderTargets
 {
@@ -2,10 +2,12 @@
 #include "LRUQueue.hpp"
 #include "COF.hpp"
 #include "DCC.hpp"
+#include "DCC_Cache.hpp"
 #include "DC6.hpp"
 #include "Logging.hpp"
 #include "Palette.hpp"
 #include "TBL_Font.hpp"
+#include "Threadpool.hpp"
 #include "Token.hpp"
 
 ///////////////////////////////////////////////////////////////////////
@@ -18,27 +20,65 @@
 //
 //	DCC Decompression
 
+/*
+ *	Where a DCC frame is in its direction's atlas, and where it goes inside of the direction's bounding box
+ */
+struct SDLDCCAtlasFrame
+{
+	int nAtlasX, nAtlasY;
+	int nWidth, nHeight;
+	int nOffsetX, nOffsetY;
+};
+
 class SDLLRUItem : public LRUQueueItem
 {
 private:
-	SDL_Texture** pTexture;
+	SDL_Texture* pAtlas;				// Every frame of the direction, packed together
+	SDLDCCAtlasFrame* pFrames;
+	DWORD dwNumFrames;
 
+	DWORD dwAtlasW;
+	DWORD dwAtlasH;
 	DWORD dwDirectionW;
 	DWORD dwDirectionH;
 
+	D2JobCounter decodeCounter;			// Done once the direction has been decoded and the atlas has been posted
+	SDL_atomic_t nUploadsRemaining;		// 1 until the atlas has been turned into a texture
+
+	bool PackAtlas();
+	void CopyFromCache(DCCCachedDirection* pCached, SDL_Surface* pAtlasSurf);
+	void CopyFromDecoder(DCCDecodedDirection* pDecoded, SDL_Surface* pAtlasSurf);
+	static void DecodeJob(void* pData);
+
 public:
 	SDLLRUItem(handle itemHandle, int d);
 	~SDLLRUItem();
 
 	DCCDirection* pDirection;
 
-	SDL_Texture* GetTextureForFrame(int nFrame)
+	// Items only get drawn (and evicted) once their atlas has been uploaded
+	bool IsReady() { return SDL_AtomicGet(&nUploadsRemaining) == 0; }
+	bool CanEvict() { return IsReady(); }
+
+	// Items that are done without an atlas couldn't be laid out, decoded or uploaded, and never will be
+	bool HasFailed() { return IsReady() && pAtlas == nullptr; }
+
+	SDL_Texture* GetAtlas()
 	{
-		if (pTexture == nullptr)
+		if (!IsReady())
 		{
 			return nullptr;
 		}
-		return pTexture[nFrame];
+		return pAtlas;
+	}
+
+	SDLDCCAtlasFrame* GetFrame(int nFrame)
+	{
+		if (pFrames == nullptr || nFrame < 0 || nFrame >= (int)dwNumFrames)
+		{
+			return nullptr;
+		}
+		return &pFrames[nFrame];
 	}
 
 	DWORD GetDirectionWidth() { return dwDirectionW; }
@@ -61,372 +101,255 @@ static SDLFontCacheItem FontCache[MAX_SDL_FONTCACHE_SIZE]{ 0 };
 static LRUQueue<SDLLRUItem>* DCCLRU[ATYPE_MAX];
 
 static SDL_Texture* gpRenderTexture = nullptr;
+static int gnMaxTextureWidth = 0;
+static int gnMaxTextureHeight = 0;
+
+// Texture uploads
+static SDLUploadItem* gpPostedUploads = nullptr;	// Pushed onto by any thread (newest first)
+static SDLUploadItem* gpUploadHead = nullptr;		// Render thread only (oldest first)
+static SDLUploadItem* gpUploadTail = nullptr;
+static Uint64 gqwUploadBudget = 0;					// In performance counter ticks
+
+// DCC decoding
+static SDL_atomic_t gnDCCDecodesInFlight{ 0 };
+static int gnDCCPrefetchesThisFrame = 0;
 
 /////////////////////////////////////////////
 //
 //	DCC Decoding
 
 /*
- *	Create a new SDL DCC LRU item by decompressing a preloaded DCC's direction, D.
- *	Special thanks to SVR, Paul Siramy, Bilian Belchev and Necrolis
+ *	Create a new SDL DCC LRU item for a preloaded DCC's direction, D.
+ *	The direction gets decoded on a worker thread, and the item can't be drawn until its atlas is uploaded.
  *	@author	eezstreet
  */
 SDLLRUItem::SDLLRUItem(handle itemHandle, int d) : LRUQueueItem(itemHandle, d)
 {
 	// at this point, it's guaranteed that the DCC exists
 	DCCFile* pFile = DCC::GetContents(itemHandle);
-	DCCDirection* pDir = &pFile->directions[d];
-	int n;
 
-	pTexture = nullptr;
+	pAtlas = nullptr;
+	pFrames = nullptr;
+	pDirection = nullptr;
+	dwNumFrames = 0;
+	dwAtlasW = dwAtlasH = 0;
+	dwDirectionW = dwDirectionH = 0;
+	memset(&decodeCounter, 0, sizeof(decodeCounter));
+	SDL_AtomicSet(&nUploadsRemaining, 0);
 
 	if (pFile == nullptr)
 	{	// FIXME: this somehow got passed in. try investigating!
 		return;
 	}
 
-	if (d >= pFile->header.nNumberDirections)
+	pDirection = DCC::GetDirection(pFile, d);
+	if (pDirection == nullptr)
 	{	// tried to enter an invalid direction! don't do this!
 		return;
 	}
 
-	pDirection = pDir;
+	if (DCC::GetDirectionArenaSize(pFile, d) == 0)
+	{	// can't be decoded
+		return;
+	}
 
-	pTexture = new SDL_Texture*[pFile->header.dwFramesPerDirection];
+	dwNumFrames = pFile->header.dwFramesPerDirection;
+	dwDirectionW = pDirection->nMaxX - pDirection->nMinX + 1;
+	dwDirectionH = pDirection->nMaxY - pDirection->nMinY + 1;
 
-	// Create a buffer containing the cells for this direction
-	int nDirectionW = pDir->nMaxX - pDir->nMinX + 1;
-	int nDirectionH = pDir->nMaxY - pDir->nMinY + 1;
-	int nDirCellW = (nDirectionW >> 2) + 10;
-	int nDirCellH = (nDirectionH >> 2) + 10;
-	DWORD dwNumCellsThisDir = nDirCellW * nDirCellH;
+	// The frame sizes are all in the header, so the atlas can be laid out before anything gets decoded
+	pFrames = new SDLDCCAtlasFrame[dwNumFrames];
+	if (!PackAtlas())
+	{
+		Log::Print(PRIORITY_MESSAGE, "DCC direction %i doesn't fit in a %ix%i texture", d, gnMaxTextureWidth, gnMaxTextureHeight);
+		delete[] pFrames;
+		pFrames = nullptr;
+		return;
+	}
 
-	// Global cell buffer
-	DCCCell** ppCellBuffer = new DCCCell*[dwNumCellsThisDir];
-	memset(ppCellBuffer, 0, dwNumCellsThisDir * sizeof(DCCCell*));
-	// Cell buffer for all frames
-	DCCCell* pFrameCells[MAX_DCC_FRAMES];
-	memset(pFrameCells, 0, sizeof(DCCCell*) * MAX_DCC_FRAMES);
+	// The atlas gets converted to 32-bit color
+	dwByteSize = (size_t)dwAtlasW * dwAtlasH * 4;
 
-	// Rewind all of the associated streams
-	pDir->RewindAllStreams();
+	SDL_AtomicSet(&nUploadsRemaining, 1);
+	SDL_AtomicAdd(&gnDCCDecodesInFlight, 1);
+	Threadpool::SpawnJob(DecodeJob, this, &decodeCounter);
+}
 
-	// First part: iterate through the frames and get the colors
-	for (int f = 0; f < pFile->header.dwFramesPerDirection; f++)
-	{
-		DCCFrame* pFrame = &pDir->frames[f];
+/*
+ *	Lays out the frames of the direction in its atlas. The frames go onto shelves, tallest first.
+ *	The atlas starts off roughly square, and gets wider if it would be too tall for the renderer.
+ *	@author	eezstreet
+ */
+bool SDLLRUItem::PackAtlas()
+{
+	int nOrder[MAX_FRAMES];
+	size_t dwArea = 0;
+	int nAtlasW = 1;
 
-		// Calculate the frame size, and number of cells in this frame
-		int nFrameW = pFrame->dwWidth;
-		int nFrameH = pFrame->dwHeight;
-		int nFrameX = pFrame->nXOffset - pDir->nMinX;
-		int nFrameY = pFrame->nYOffset - pDir->nMinY - nFrameH + 1;
-		
-		int nNumCellsW = DCC::GetCellCount(nFrameX, nFrameW);
-		int nNumCellsH = DCC::GetCellCount(nFrameY, nFrameH);
+	for (DWORD f = 0; f < dwNumFrames; f++)
+	{
+		DCCFrame* pFrame = &pDirection->frames[f];
+		SDLDCCAtlasFrame* pAtlasFrame = &pFrames[f];
+		int i;
 
-		// Allocate cells
-		DCCCell* pCell = pFrameCells[f] = new DCCCell[nNumCellsW * nNumCellsH];
+		pAtlasFrame->nWidth = pFrame->dwWidth;
+		pAtlasFrame->nHeight = pFrame->dwHeight;
+		pAtlasFrame->nOffsetX = pFrame->nXOffset - pDirection->nMinX;
+		pAtlasFrame->nOffsetY = pFrame->nYOffset - pDirection->nMinY - pAtlasFrame->nHeight + 1;
+		pAtlasFrame->nAtlasX = pAtlasFrame->nAtlasY = 0;
 
-		// Process cells left -> right / top -> bottom --SVR
-		int nStartX = nFrameX >> 2;
-		int nStartY = nFrameY >> 2;
+		dwArea += (size_t)pAtlasFrame->nWidth * pAtlasFrame->nHeight;
+		nAtlasW = D2Lib::max(nAtlasW, pAtlasFrame->nWidth);
 
-		// Grab the four pixels (clrcode) color for each cell
-		for (int y = nStartY; y < (nStartY + nNumCellsH); y++)
+		// Insert it into the order, tallest first
+		for (i = f; i > 0 && pFrames[nOrder[i - 1]].nHeight < pAtlasFrame->nHeight; i--)
 		{
-			for (int x = nStartX; x < (nStartX + nNumCellsW); x++)
-			{
-				DCCCell* pCurCell = pCell++;
-				DCCCell* pPrevCell = ppCellBuffer[(y * nDirCellW) + x];
-				DWORD dwCLRMask = 0xF;
-
-				*(DWORD*)(pCurCell->clrmap) = 0;
-
-				// If we have a previous cell, read the contents of the EqualCellBitstream and ColorMask
-				if (pPrevCell)
-				{
-					if (pDir->EqualCellStream != nullptr)
-					{
-						BYTE bit = 0;
-						pDir->EqualCellStream->ReadBits(bit, 1);
-						if (bit)
-						{	// Skip if we read a '1' bit from EqualCells
-							continue;
-						}
-					}
-					if (pDir->PixelMaskStream != nullptr)
-					{	// read the color mask
-						pDir->PixelMaskStream->ReadBits(&dwCLRMask, 4);
-					}
-				}
-
-				DWORD dwEncodingType = 0;
-				DWORD dwCLRCode = 0;
-				DWORD dwUnencoded = 0;
-				DWORD dwLastColor = 0;
-				DWORD dwTemp = 0;
-
-				// Mask off the appropriate colors
-				if (dwCLRMask != 0)
-				{
-					if (pDir->EncodingTypeStream != nullptr)
-					{	// check the encoding type
-						pDir->EncodingTypeStream->ReadBits(&dwEncodingType, 1);
-					}
-
-					for (n = 0; n < 4; n++)
-					{	// read the colors in the mask
-						if (dwCLRMask & (0x1 << n))
-						{
-							if (dwEncodingType != 0)
-							{	// if encoding is 1, read it from the raw pixel stream
-								pDir->RawPixelStream->ReadBits(&dwCLRCode, 8);
-							}
-							else
-							{
-								// read the difference from the pixel data and add it to the color
-								do
-								{
-									pDir->PixelCodeDisplacementStream->ReadBits(&dwUnencoded, 4);
-									dwCLRCode += dwUnencoded;
-								} while (dwUnencoded == 15);
-							}
-
-							// Check to see if the same color was fetched.
-							// If so, stop decoding (it's probably transparent)
-							if (dwLastColor == dwCLRCode)
-							{
-								break;
-							}
-
-							dwTemp <<= 8;
-							dwTemp |= dwCLRCode;
-							dwLastColor = dwCLRCode;
-						}
-					}
-				}
-
-				// Merge previous colors
-				for (n = 0; n < 4; n++)
-				{
-					if (dwCLRMask & (0x1 << n))
-					{	// pop the current color bit
-						pCurCell->clrmap[n] = (BYTE)(dwTemp & 0xFF);
-						dwTemp >>= 8;
-					}
-					else
-					{	// copy the previous color
-						pCurCell->clrmap[n] = pPrevCell->clrmap[n];
-					}
-				}
-
-				ppCellBuffer[(y * nDirCellW) + x] = pCurCell;
-			}
+			nOrder[i] = nOrder[i - 1];
 		}
+		nOrder[i] = f;
 	}
 
-	// Second part: build a bitmap based on the cells data
-	// FIXME: segregate this code to being renderer specific instead of this whole function being renderer-specific
-	BYTE* bitmap = new BYTE[nDirectionW * nDirectionH];
-	SDL_Surface* pFrameSurf = nullptr;
-	dwDirectionW = nDirectionW;
-	dwDirectionH = nDirectionH;
-
-	// ? clear all cells in the frame buffer list
-	memset(ppCellBuffer, 0, sizeof(DCCCell*) * dwNumCellsThisDir);
-
-	// Rewind the equal cell stream
-	if (pDir->EqualCellStream != nullptr)
+	if (nAtlasW > gnMaxTextureWidth)
 	{
-		pDir->EqualCellStream->Rewind();
+		return false;
 	}
 
-	// Render each frame's cells onto the mini surface 
-	for (int f = 0; f < pFile->header.dwFramesPerDirection; f++)
+	while ((size_t)nAtlasW * nAtlasW < dwArea)
 	{
-		DCCFrame* pFrame = &pDir->frames[f];
-
-		// Clear out the bitmap
-		memset(bitmap, 0, nDirectionW * nDirectionH);
-
-		// Calculate the frame size, and number of cells in this frame
-		int nFrameW = pFrame->dwWidth;
-		int nFrameH = pFrame->dwHeight;
-		int nFrameX = pFrame->nXOffset - pDir->nMinX;
-		int nFrameY = pFrame->nYOffset - pDir->nMinY - nFrameH + 1;
-
-		int nNumCellsW = DCC::GetCellCount(nFrameX, nFrameW);
-		int nNumCellsH = DCC::GetCellCount(nFrameY, nFrameH);
-
-		int nStartX = nFrameX >> 2;
-		int nStartY = nFrameY >> 2;
-
-		int nFirstColumnW = 4 - (nFrameX & 3);
-		int nFirstRowH = 4 - (nFrameY & 3);
+		nAtlasW++;
+	}
+	nAtlasW = D2Lib::min(nAtlasW, gnMaxTextureWidth);
 
-		int nCountI = nFirstRowH;	// height counter
-		int nCountJ;
-		int nYPos = 0;
-		int nXPos;
+	while (true)
+	{
+		int nX = 0, nY = 0, nShelfH = 0;
 
-		DCCCell* pCells = pFrameCells[f];
-		for (int y = nStartY; y < (nStartY + nNumCellsH); y++)
+		for (DWORD i = 0; i < dwNumFrames; i++)
 		{
-			nXPos = 0;
-			nCountJ = nFirstColumnW;
+			SDLDCCAtlasFrame* pAtlasFrame = &pFrames[nOrder[i]];
 
-			if (y == ((nStartY + nNumCellsH) - 1))
-			{	// If it's the last row, use the last height
-				nCountI = nFrameH;
+			if (nX + pAtlasFrame->nWidth > nAtlasW)
+			{	// start a new shelf
+				nY += nShelfH;
+				nX = 0;
+				nShelfH = 0;
 			}
 
-			for (int x = nStartX; x < (nStartX + nNumCellsW); x++)
-			{
-				bool bTransparent = false;
-				DCCCell* pCurCell = pCells++;
-				DCCCell* pPrevCell = ppCellBuffer[(y * nDirCellW) + x];
-
-				if (x == ((nStartX + nNumCellsW) - 1))
-				{	// If it's the last column, use the last width
-					nCountJ = nFrameW;
-				}
-
-				pCurCell->nH = nCountI;
-				pCurCell->nW = nCountJ;
-				pCurCell->nX = nFrameX + nXPos;
-				pCurCell->nY = nFrameY + nYPos;
-
-				// Check for equal cell
-				if (pPrevCell && pDir->EqualCellStream != nullptr)
-				{
-					DWORD dwEqualCell = 0;
-					pDir->EqualCellStream->ReadBits(&dwEqualCell, 1);
-
-					if (dwEqualCell)
-					{
-						if (pPrevCell->nH == pCurCell->nH && pPrevCell->nW == pCurCell->nW)
-						{	// same sized cell = it's definitely the same
-							// check x/y - if they are not the same then we copy it
-							if (pPrevCell->nX != pCurCell->nX || pPrevCell->nY != pCurCell->nY)
-							{
-								// source and destination rectangles
-								int dY = pCurCell->nY;
-
-								for (int i = pPrevCell->nY; i < pPrevCell->nY + pPrevCell->nH; i++)
-								{
-									int dX = pCurCell->nX;
-									for (int j = pPrevCell->nX; j < pPrevCell->nX + pPrevCell->nW; j++)
-									{
-										bitmap[(dY * nDirectionW) + dX] = bitmap[(i * nDirectionW) + j];
-										dX++;
-									}
-									dY++;
-								}
-							}
-
-							ppCellBuffer[(y * nDirCellW) + x] = pCurCell;
-							nXPos += nCountJ;
-							nCountJ = 4;
-							continue;
-						}
-						else
-						{	// incongruent cell = it's definitely transparent
-							bTransparent = true;
-						}
-					}
-				}
-
-				for (n = 0; n < 2; n++)
-				{	// try to find a zero
-					if (!pCurCell->clrmap[n])
-					{
-						break;
-					}
-				}
-
-				// fill the cell
-				if (bTransparent || !n)
-				{	// if all of them are transparent, fill with 0s
-					for (int i = nFrameY + nYPos; i < nFrameY + nYPos + nCountI; i++)
-					{
-						for (int j = nFrameX + nXPos; j < nFrameX + nXPos + nCountJ; j++)
-						{
-							bitmap[(i * nDirectionW) + j] = 0;
-						}
-					}
-				}
-				else
-				{
-					// Write the color pixels...one by one...
-					for (int i = 0; i < nCountI; i++)
-					{
-						for (int j = 0; j < nCountJ; j++)
-						{
-							DWORD dwPixelData = 0;
-							DWORD dwPixelPos = ((nFrameY + nYPos + i) * (nDirectionW)) + (nFrameX + nXPos + j);
-							int nPalettePos;
-
-							pDir->PixelCodeDisplacementStream->ReadBits(&dwPixelData, n);
-							nPalettePos = pCurCell->clrmap[dwPixelData];
-							bitmap[dwPixelPos] = pDir->nPixelValues[nPalettePos];
-						}
-					}
-				}
-
-				ppCellBuffer[(y * nDirCellW) + x] = pCurCell;
-				nXPos += nCountJ;
-				nCountJ = 4;
-			}
-
-			nYPos += nCountI;
-			nCountI = 4;
+			pAtlasFrame->nAtlasX = nX;
+			pAtlasFrame->nAtlasY = nY;
+			nX += pAtlasFrame->nWidth;
+			nShelfH = D2Lib::max(nShelfH, pAtlasFrame->nHeight);
 		}
 
-		if (pFrameSurf == nullptr)
+		if (nY + nShelfH <= gnMaxTextureHeight)
 		{
-			pFrameSurf = SDL_CreateRGBSurfaceFrom(bitmap, nDirectionW, nDirectionH, 8, nDirectionW, 0, 0, 0, 0);
-			SDL_SetSurfacePalette(pFrameSurf, PaletteCache[PAL_UNITS].pPal);
+			dwAtlasW = nAtlasW;
+			dwAtlasH = D2Lib::max(nY + nShelfH, 1);
+			return true;
 		}
-		else
+
+		if (nAtlasW >= gnMaxTextureWidth)
 		{
-			if (SDL_MUSTLOCK(pFrameSurf))
-			{
-				SDL_LockSurface(pFrameSurf);
-			}
+			return false;
+		}
+		nAtlasW = D2Lib::min(nAtlasW * 2, gnMaxTextureWidth);
+	}
+}
 
-			memcpy(pFrameSurf->pixels, bitmap, nDirectionW * nDirectionH);
+/*
+ *	Copies a direction that came out of the DCC cache into the atlas
+ *	@author	eezstreet
+ */
+void SDLLRUItem::CopyFromCache(DCCCachedDirection* pCached, SDL_Surface* pAtlasSurf)
+{
+	for (DWORD f = 0; f < pCached->dwNumFrames; f++)
+	{
+		SDLDCCAtlasFrame* pAtlasFrame = &pFrames[f];
+		BYTE* pSrc = pCached->pPixels + pCached->pFrames[f].dwPixelOffset;
+		BYTE* pDst = (BYTE*)pAtlasSurf->pixels + (pAtlasFrame->nAtlasY * pAtlasSurf->pitch) + pAtlasFrame->nAtlasX;
 
-			if (SDL_MUSTLOCK(pFrameSurf))
-			{
-				SDL_UnlockSurface(pFrameSurf);
-			}
+		for (int y = 0; y < pAtlasFrame->nHeight; y++)
+		{
+			memcpy(pDst, pSrc, pAtlasFrame->nWidth);
+			pSrc += pAtlasFrame->nWidth;
+			pDst += pAtlasSurf->pitch;
 		}
-#if 0
-		// save frame as BMP
-		char testFrameName[32];
-		snprintf(testFrameName, 32, "test%04d.bmp", f);
-		SDL_SaveBMP(pFrameSurf, testFrameName);
-#endif
-
-		// Create a new texture from this surface, for this frame		
-		pTexture[f] = SDL_CreateTextureFromSurface(gpRenderer, pFrameSurf);
 	}
+}
 
-	if (pFrameSurf != nullptr)
+/*
+ *	Copies a freshly decoded direction into the atlas
+ *	@author	eezstreet
+ */
+void SDLLRUItem::CopyFromDecoder(DCCDecodedDirection* pDecoded, SDL_Surface* pAtlasSurf)
+{
+	for (DWORD f = 0; f < pDecoded->dwNumFrames; f++)
 	{
-		// remove the surface, we don't need it anymore
-		SDL_FreeSurface(pFrameSurf);
+		SDLDCCAtlasFrame* pAtlasFrame = &pFrames[f];
+		BYTE* pSrc = pDecoded->pPixels + ((size_t)pDecoded->dwWidth * pDecoded->dwHeight * f) +
+			(pAtlasFrame->nOffsetY * pDecoded->dwWidth) + pAtlasFrame->nOffsetX;
+		BYTE* pDst = (BYTE*)pAtlasSurf->pixels + (pAtlasFrame->nAtlasY * pAtlasSurf->pitch) + pAtlasFrame->nAtlasX;
+
+		for (int y = 0; y < pAtlasFrame->nHeight; y++)
+		{
+			memcpy(pDst, pSrc, pAtlasFrame->nWidth);
+			pSrc += pDecoded->dwWidth;
+			pDst += pAtlasSurf->pitch;
+		}
 	}
+}
 
-	// Delete all of the cell data, we don't need it anymore
-	for (int f = 0; f < pFile->header.dwFramesPerDirection; f++)
+/*
+ *	Fills in an LRU item's atlas (on a worker thread), and posts it to be uploaded.
+ *	The direction comes out of the DCC cache if it's in there, and otherwise it gets decoded (and put in the cache).
+ *	Special thanks to SVR, Paul Siramy, Bilian Belchev and Necrolis
+ *	@author	eezstreet
+ */
+void SDLLRUItem::DecodeJob(void* pData)
+{
+	SDLLRUItem* pItem = (SDLLRUItem*)pData;
+	DCCFile* pFile = DCC::GetContents(pItem->itemHandle);
+	SDL_Surface* pAtlasSurf;
+	DCCCachedDirection cached;
+	bool bFilled = false;
+
+	// (new surfaces start out cleared to 0, which is transparent)
+	pAtlasSurf = SDL_CreateRGBSurface(0, pItem->dwAtlasW, pItem->dwAtlasH, 8, 0, 0, 0, 0);
+
+	if (pAtlasSurf != nullptr && DCCCache::LoadDirection(pFile, pItem->nDirection, &cached))
 	{
-		delete pFrameCells[f];
+		pItem->CopyFromCache(&cached, pAtlasSurf);
+		DCCCache::FreeDirection(&cached);
+		bFilled = true;
+	}
+	else if (pAtlasSurf != nullptr)
+	{
+		size_t dwArenaSize = DCC::GetDirectionArenaSize(pFile, pItem->nDirection);
+		BYTE* pArena = (BYTE*)malloc(dwArenaSize);
+		DCCDecodedDirection decoded;
+
+		if (pArena != nullptr && DCC::DecodeDirection(pFile, pItem->nDirection, pArena, dwArenaSize, &decoded))
+		{
+			pItem->CopyFromDecoder(&decoded, pAtlasSurf);
+			DCCCache::StoreDirection(pFile, pItem->nDirection, &decoded);
+			bFilled = true;
+		}
+		free(pArena);
 	}
 
-	delete[] bitmap;
-	delete[] ppCellBuffer;
+	if (!bFilled)
+	{	// leave the atlas empty
+		if (pAtlasSurf != nullptr)
+		{
+			SDL_FreeSurface(pAtlasSurf);
+		}
+		SDL_AtomicSet(&pItem->nUploadsRemaining, 0);
+		SDL_AtomicAdd(&gnDCCDecodesInFlight, -1);
+		return;
+	}
+
+	Renderer_SDL_QueueUpload(pAtlasSurf, PaletteCache[PAL_UNITS].pPal, &pItem->pAtlas, &pItem->nUploadsRemaining);
+	SDL_AtomicAdd(&gnDCCDecodesInFlight, -1);
 }
 
 /*
@@ -435,18 +358,24 @@ SDLLRUItem::SDLLRUItem(handle itemHandle, int d) : LRUQueueItem(itemHandle, d)
  */
 SDLLRUItem::~SDLLRUItem()
 {
-	DCCFile* pFile = DCC::GetContents(itemHandle);
-	if (pFile == nullptr)
+	if (pFrames == nullptr)
 	{
 		return;
 	}
 
-	for (int i = 0; i < pFile->header.dwFramesPerDirection; i++)
+	// Don't pull the atlas out from under the decode or the upload
+	Threadpool::WaitForCounter(&decodeCounter);
+	if (!IsReady())
+	{
+		Renderer_SDL_FinishUploads();
+	}
+
+	if (pAtlas != nullptr)
 	{
-		SDL_DestroyTexture(pTexture[i]);
+		SDL_DestroyTexture(pAtlas);
 	}
 
-	delete[] pTexture;
+	delete[] pFrames;
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -768,6 +697,187 @@ static void RB_ContinueTokenInstanceAnimation(AnimTokenInstance* pInstance, COFF
 	pInstance->currentFrame >>= 8;
 }
 
+// DCC directions aren't stored in the order that they go around the circle. These go clockwise, starting from south.
+static const int gnDirectionOrder8[8] = { 4, 0, 5, 1, 6, 2, 7, 3 };
+static const int gnDirectionOrder16[16] = { 4, 8, 0, 9, 5, 10, 1, 11, 6, 12, 2, 13, 7, 14, 3, 15 };
+static const int gnDirectionOrder32[32] = {
+	4, 16, 8, 17, 0, 18, 9, 19, 5, 20, 10, 21, 1, 22, 11, 23, 6, 24, 12, 25, 2, 26, 13, 27, 7, 28, 14, 29, 3, 30, 15, 31
+};
+
+// The modes that a token is most likely to go into next, for decoding ahead of time
+static const int gnPlayerPrefetchModes[] = { PLRMODE_TN, PLRMODE_TW, PLRMODE_NU, PLRMODE_WL, PLRMODE_RN, PLRMODE_A1 };
+static const int gnMonsterPrefetchModes[] = { MONMODE_NU, MONMODE_WL, MONMODE_A1, MONMODE_GH };
+
+/*
+ *	Gets the directions on either side of a direction
+ */
+static void RB_GetNeighbouringDirections(int nDirection, int nNumDirections, int* pLeft, int* pRight)
+{
+	const int* pOrder = nullptr;
+	int nIndex = nDirection;
+
+	switch (nNumDirections)
+	{
+		case 8:
+			pOrder = gnDirectionOrder8;
+			break;
+		case 16:
+			pOrder = gnDirectionOrder16;
+			break;
+		case 32:
+			pOrder = gnDirectionOrder32;
+			break;
+	}
+
+	if (pOrder != nullptr)
+	{
+		for (nIndex = 0; nIndex < nNumDirections; nIndex++)
+		{
+			if (pOrder[nIndex] == nDirection)
+			{
+				break;
+			}
+		}
+		*pLeft = pOrder[(nIndex + nNumDirections - 1) % nNumDirections];
+		*pRight = pOrder[(nIndex + 1) % nNumDirections];
+	}
+	else
+	{
+		*pLeft = (nIndex + nNumDirections - 1) % nNumDirections;
+		*pRight = (nIndex + 1) % nNumDirections;
+	}
+}
+
+/*
+ *	Starts decoding a direction ahead of time, unless we've already done too much of that this frame
+ */
+static void RB_PrefetchDirection(LRUQueue<SDLLRUItem>* pQueue, anim_handle anim, int nDirection)
+{
+	if (gnDCCPrefetchesThisFrame >= MAX_SDL_DCC_PREFETCHES_PER_FRAME)
+	{
+		return;
+	}
+
+	if (pQueue->PrefetchItem(anim, nDirection))
+	{
+		gnDCCPrefetchesThisFrame++;
+	}
+}
+
+/*
+ *	Decodes the directions on either side of the token's current one, and the modes that it's likely to go into next.
+ *	This only happens when nothing else is being decoded, so it never holds up something that needs to be drawn.
+ */
+static void RB_PrefetchTokenInstance(AnimTokenInstance* pInstance, LRUQueue<SDLLRUItem>* pQueue)
+{
+	const int* pModes = nullptr;
+	int nNumModes = 0;
+
+	if (SDL_AtomicGet(&gnDCCDecodesInFlight) > 0 || gnDCCPrefetchesThisFrame >= MAX_SDL_DCC_PREFETCHES_PER_FRAME)
+	{
+		return;
+	}
+
+	// Turning is the most likely thing to happen next
+	for (int i = 0; i < COMP_MAX; i++)
+	{
+		anim_handle curAnim = pInstance->componentAnims[pInstance->currentMode][i];
+		DCCFile* pFile;
+		int nLeft, nRight;
+
+		if (curAnim == INVALID_HANDLE)
+		{
+			continue;
+		}
+
+		pFile = DCC::GetContents(curAnim);
+		if (pFile == nullptr || pFile->header.nNumberDirections <= 1)
+		{
+			continue;
+		}
+
+		RB_GetNeighbouringDirections(pInstance->currentDirection, pFile->header.nNumberDirections, &nLeft, &nRight);
+		RB_PrefetchDirection(pQueue, curAnim, nLeft);
+		RB_PrefetchDirection(pQueue, curAnim, nRight);
+	}
+
+	// ...followed by starting or stopping
+	switch (pInstance->tokenType)
+	{
+		case TOKEN_CHAR:
+			pModes = gnPlayerPrefetchModes;
+			nNumModes = sizeof(gnPlayerPrefetchModes) / sizeof(gnPlayerPrefetchModes[0]);
+			break;
+		case TOKEN_MONSTER:
+			pModes = gnMonsterPrefetchModes;
+			nNumModes = sizeof(gnMonsterPrefetchModes) / sizeof(gnMonsterPrefetchModes[0]);
+			break;
+	}
+
+	for (int m = 0; m < nNumModes; m++)
+	{
+		if (pModes[m] == pInstance->currentMode)
+		{
+			continue;
+		}
+
+		for (int i = 0; i < COMP_MAX; i++)
+		{
+			anim_handle curAnim = pInstance->componentAnims[pModes[m]][i];
+
+			if (curAnim != INVALID_HANDLE)
+			{
+				RB_PrefetchDirection(pQueue, curAnim, pInstance->currentDirection);
+			}
+		}
+	}
+}
+
+/*
+ *	Gets the LRU items for each component of a token in a mode/direction, and whether they're all ready to be drawn.
+ *	If bDecode is set, anything that's missing starts decoding. Otherwise missing items are left out.
+ *	Components that failed don't count as ready. pbSettled is set if none of the components are still on their way.
+ */
+static bool RB_GetTokenComponents(AnimTokenInstance* pInstance, LRUQueue<SDLLRUItem>* pQueue,
+	int nMode, int nDirection, bool bDecode, SDLLRUItem** ppItems, bool* pbSettled)
+{
+	bool bReady = true;
+
+	*pbSettled = true;
+
+	for (int i = 0; i < COMP_MAX; i++)
+	{
+		anim_handle curAnim = pInstance->componentAnims[nMode][i];
+		SDLLRUItem* pItem = nullptr;
+
+		if (curAnim != INVALID_HANDLE)
+		{
+			if (bDecode)
+			{
+				pItem = pQueue->QueryItem(curAnim, nDirection);
+			}
+			else
+			{
+				pItem = pQueue->FindItem(curAnim, nDirection);
+			}
+
+			if (pItem == nullptr || !pItem->IsReady())
+			{
+				bReady = false;
+				*pbSettled = false;
+			}
+			else if (pItem->HasFailed())
+			{
+				bReady = false;
+			}
+		}
+
+		ppItems[i] = pItem;
+	}
+
+	return bReady;
+}
+
 /*
  *	Backend - Draw an anim token instance
  */
@@ -778,6 +888,11 @@ static void RB_DrawTokenInstance(SDLCommand* pCmd)
 	cof_handle currentCOF;
 	COFFile* pCOFFile;
 	LRUQueue<SDLLRUItem>* pQueue;
+	SDLLRUItem* pItems[COMP_MAX];
+	SDLLRUItem* pLastReadyItems[COMP_MAX];
+	SDLLRUItem** ppDrawItems = pItems;
+	bool bSettled, bLastReadySettled;
+	int nFrame;
 
 	if (pInstance == nullptr || !pInstance->bInUse || !pInstance->bActive)
 	{
@@ -798,7 +913,6 @@ static void RB_DrawTokenInstance(SDLCommand* pCmd)
 
 	RB_ContinueTokenInstanceAnimation(pInstance, pCOFFile);
 
-	// iterate through all components
 	switch (pInstance->tokenType)
 	{
 		case TOKEN_CHAR:
@@ -811,51 +925,86 @@ static void RB_DrawTokenInstance(SDLCommand* pCmd)
 			pQueue = DCCLRU[ATYPE_MONSTER];
 			break;
 	}
+
+	// Anything that isn't decoded yet gets decoded in the background. Until then, the token gets drawn the way it was
+	// the last time that it was ready (or not at all, if it has never been ready).
+	// Components that failed are left out, but the token is only drawn without them once nothing better is coming.
+	nFrame = pInstance->currentFrame;
+	if (RB_GetTokenComponents(pInstance, pQueue, pInstance->currentMode, pInstance->currentDirection, true,
+		pItems, &bSettled))
+	{
+		pInstance->bLastReadyValid = true;
+		pInstance->lastReadyMode = pInstance->currentMode;
+		pInstance->lastReadyDirection = pInstance->currentDirection;
+		pInstance->lastReadyFrame = pInstance->currentFrame;
+
+		RB_PrefetchTokenInstance(pInstance, pQueue);
+	}
+	else if (pInstance->bLastReadyValid && RB_GetTokenComponents(pInstance, pQueue,
+		pInstance->lastReadyMode, pInstance->lastReadyDirection, false, pLastReadyItems, &bLastReadySettled))
+	{
+		ppDrawItems = pLastReadyItems;
+		if (pInstance->lastReadyMode != pInstance->currentMode)
+		{	// the frames of the new mode don't line up with the old one, so hold the last frame that got drawn
+			nFrame = pInstance->lastReadyFrame;
+		}
+	}
+	else if (!bSettled)
+	{
+		return;
+	}
+
+	// iterate through all components
 	for (int i = COMP_MAX-1; i >= 0; i--)
 	{
-		anim_handle curAnim = pInstance->componentAnims[pInstance->currentMode][i];
-		SDLLRUItem* pItem;
+		SDLLRUItem* pItem = ppDrawItems[i];
 
-		if (curAnim == INVALID_HANDLE)
+		if (pItem == nullptr)
 		{
 			continue; // nothing in this component
 		}
-
-		pItem = pQueue->QueryItem(curAnim, pInstance->currentDirection);
-		Log_ErrorAssert(pItem != nullptr);
 		
 		// render it!!
-		SDL_Texture* pTexture = pItem->GetTextureForFrame((int)pInstance->currentFrame);
-		DWORD dwWidth = pItem->GetDirectionWidth();
-		DWORD dwHeight = pItem->GetDirectionHeight();
+		SDL_Texture* pAtlas = pItem->GetAtlas();
+		SDLDCCAtlasFrame* pFrame = pItem->GetFrame(nFrame);
 
-		if (pTexture == nullptr)
-		{	// or uh...don't actually. that's a bad idea.
-			return;
+		if (pAtlas == nullptr || pFrame == nullptr)
+		{	// this component couldn't be decoded, but the rest of the token still can be drawn
+			continue;
+		}
+
+		if (pFrame->nWidth <= 0 || pFrame->nHeight <= 0)
+		{	// nothing in this frame
+			continue;
 		}
 
 		// The destination rectangle is oriented from the upper left corner, but whenever we do a draw call,
 		// we are orienting from the "base point" of the token's DCC files. So we need to correct that.
+		// (This puts it at the corner of the direction's bounding box, and the frame goes somewhere inside of that)
+		SDL_Rect s{
+			pFrame->nAtlasX,
+			pFrame->nAtlasY,
+			pFrame->nWidth,
+			pFrame->nHeight,
+		};
 		SDL_Rect d{
 			pTCmd->x,
 			pTCmd->y,
-			(int)dwWidth,
-			(int)dwHeight,
+			pFrame->nWidth,
+			pFrame->nHeight,
 		};
-		d.x -= (pItem->pDirection->frames[pInstance->currentFrame].nMinX - pItem->pDirection->nMinX);
-		d.x += pItem->pDirection->frames[pInstance->currentFrame].nXOffset;
-		d.y -= (pItem->pDirection->frames[pInstance->currentFrame].nMinY - pItem->pDirection->nMinY);
-		d.y += pItem->pDirection->frames[pInstance->currentFrame].nYOffset;
-		d.y -= pItem->pDirection->frames[pInstance->currentFrame].dwHeight - 1;
-		SDL_SetTextureBlendMode(pTexture, SDL_BLENDMODE_BLEND);
-		SDL_RenderCopy(gpRenderer, pTexture, nullptr, &d);
+		d.x -= (pItem->pDirection->frames[nFrame].nMinX - pItem->pDirection->nMinX);
+		d.x += pItem->pDirection->frames[nFrame].nXOffset;
+		d.y -= (pItem->pDirection->frames[nFrame].nMinY - pItem->pDirection->nMinY);
+		d.y += pItem->pDirection->frames[nFrame].nYOffset;
+		d.y -= pItem->pDirection->frames[nFrame].dwHeight - 1;
+		d.x += pFrame->nOffsetX;
+		d.y += pFrame->nOffsetY;
+		SDL_SetTextureBlendMode(pAtlas, SDL_BLENDMODE_BLEND);
+		SDL_RenderCopy(gpRenderer, pAtlas, &s, &d);
 
 #if 0
 		// debug: draw a rectangle around where the frames are
-		d.x += (pItem->pDirection->frames[pInstance->currentFrame].nMinX - pItem->pDirection->nMinX);
-		d.y += (pItem->pDirection->frames[pInstance->currentFrame].nMinY - pItem->pDirection->nMinY);
-		d.w = pItem->pDirection->frames[pInstance->currentFrame].dwWidth;
-		d.h = pItem->pDirection->frames[pInstance->currentFrame].dwHeight;
 		SDL_SetRenderDrawColor(gpRenderer, 128, 128, 255, 255);
 		SDL_RenderDrawRect(gpRenderer, &d);
 
@@ -951,11 +1100,30 @@ void Renderer_SDL_ClearTextureCache()
  *	@author	eezstreet
  */
 static DWORD LRUSizes[ATYPE_MAX] = { LRUSIZE_CHARS, LRUSIZE_MONSTERS, LRUSIZE_OBJECTS, LRUSIZE_MISSILES, LRUSIZE_OVERLAYS };
+static size_t LRUBudgets[ATYPE_MAX] = { LRUBUDGET_CHARS, LRUBUDGET_MONSTERS, LRUBUDGET_OBJECTS, LRUBUDGET_MISSILES, LRUBUDGET_OVERLAYS };
+static const char* LRUNames[ATYPE_MAX] = { "chars", "monsters", "objects", "missiles", "overlays" };
 void Renderer_SDL_InitLRUs()
 {
 	for (int i = 0; i < ATYPE_MAX; i++)
 	{
-		DCCLRU[i] = new LRUQueue<SDLLRUItem>(LRUSizes[i]);
+		DCCLRU[i] = new LRUQueue<SDLLRUItem>(LRUSizes[i], LRUBudgets[i]);
+	}
+}
+
+/*
+ *	Logs how well each of the LRUs has been doing
+ *	@author	eezstreet
+ */
+void Renderer_SDL_PrintLRUStats()
+{
+	for (int i = 0; i < ATYPE_MAX; i++)
+	{
+		LRUQueue<SDLLRUItem>* pQueue = DCCLRU[i];
+
+		Log::Print(PRIORITY_DEBUG, "DCC LRU (%s): %u queries, %u hits, %u misses, %u prefetches, %u evictions, %u items, %u/%u KB",
+			LRUNames[i], pQueue->GetQueryCount(), pQueue->GetHitCount(), pQueue->GetMissCount(),
+			pQueue->GetPrefetchCount(), pQueue->GetEvictionCount(), pQueue->GetInUseCount(),
+			(DWORD)(pQueue->GetBytesInUse() / 1024), (DWORD)(pQueue->GetByteBudget() / 1024));
 	}
 }
 
@@ -965,12 +1133,128 @@ void Renderer_SDL_InitLRUs()
  */
 void Renderer_SDL_ClearLRUs()
 {
+	Renderer_SDL_PrintLRUStats();
+
 	for (int i = 0; i < ATYPE_MAX; i++)
 	{
 		delete DCCLRU[i];
 	}
 }
 
+/////////////////////////////////////////////
+//
+//	Texture Uploads
+//
+//	Textures can only be created on the render thread, but the surfaces that they're made from don't have to be.
+//	Any thread can post a surface here, and Present turns as many of them into textures as it can within the
+//	upload budget. Whatever doesn't fit gets done on the next frame.
+
+/*
+ *	Posts a surface to be uploaded into a texture cache slot. Safe to call from any thread.
+ *	The slot (and the counter, if there is one) has to stay around until the upload is done, which can be
+ *	waited on with Renderer_SDL_FinishUploads.
+ *	@author	eezstreet
+ */
+void Renderer_SDL_QueueUpload(SDL_Surface* pSurface, SDL_Palette* pPalette, SDL_Texture** ppTexture, SDL_atomic_t* pRemaining)
+{
+	SDLUploadItem* pItem = (SDLUploadItem*)malloc(sizeof(SDLUploadItem));
+	Log_ErrorAssertVoidReturn(pItem != nullptr);
+
+	pItem->pSurface = pSurface;
+	pItem->pPalette = pPalette;
+	pItem->ppTexture = ppTexture;
+	pItem->pRemaining = pRemaining;
+
+	do
+	{
+		pItem->pNext = (SDLUploadItem*)SDL_AtomicGetPtr((void**)&gpPostedUploads);
+	} while (!SDL_AtomicCASPtr((void**)&gpPostedUploads, pItem->pNext, pItem));
+}
+
+/*
+ *	Takes everything that has been posted since the last time, and puts it on the end of the upload queue
+ */
+static void Renderer_SDL_CollectUploads()
+{
+	SDLUploadItem* pPosted = (SDLUploadItem*)SDL_AtomicSetPtr((void**)&gpPostedUploads, nullptr);
+	SDLUploadItem* pOldest = nullptr;
+	SDLUploadItem* pNewest = pPosted;
+
+	if (pPosted == nullptr)
+	{
+		return;
+	}
+
+	// They got posted newest first, so flip them around
+	while (pPosted != nullptr)
+	{
+		SDLUploadItem* pNext = pPosted->pNext;
+
+		pPosted->pNext = pOldest;
+		pOldest = pPosted;
+		pPosted = pNext;
+	}
+
+	if (gpUploadTail != nullptr)
+	{
+		gpUploadTail->pNext = pOldest;
+	}
+	else
+	{
+		gpUploadHead = pOldest;
+	}
+	gpUploadTail = pNewest;
+}
+
+/*
+ *	Uploads queued surfaces, oldest first, until the budget runs out.
+ *	At least one gets uploaded, so that the queue always moves.
+ */
+static void Renderer_SDL_ProcessUploads(Uint64 qwBudget)
+{
+	Uint64 qwStart = SDL_GetPerformanceCounter();
+
+	Renderer_SDL_CollectUploads();
+
+	while (gpUploadHead != nullptr)
+	{
+		SDLUploadItem* pItem = gpUploadHead;
+
+		gpUploadHead = pItem->pNext;
+		if (gpUploadHead == nullptr)
+		{
+			gpUploadTail = nullptr;
+		}
+
+		if (pItem->pPalette != nullptr)
+		{
+			SDL_SetSurfacePalette(pItem->pSurface, pItem->pPalette);
+		}
+		*pItem->ppTexture = SDL_CreateTextureFromSurface(gpRenderer, pItem->pSurface);
+		SDL_FreeSurface(pItem->pSurface);
+
+		if (pItem->pRemaining != nullptr)
+		{
+			SDL_AtomicAdd(pItem->pRemaining, -1);
+		}
+		free(pItem);
+
+		if (SDL_GetPerformanceCounter() - qwStart >= qwBudget)
+		{
+			return;
+		}
+	}
+}
+
+/*
+ *	Uploads everything that has been posted so far, regardless of the budget. Render thread only.
+ *	@author	eezstreet
+ */
+void Renderer_SDL_FinishUploads()
+{
+	Renderer_SDL_ProcessUploads((Uint64)-1);
+}
+
 ///////////////////////////////////////////////////////////////////////
 //
 //	FRONTEND FUNCTIONS
@@ -1075,6 +1359,10 @@ Renderer_SDL::Renderer_SDL(D2GameConfigStrc * pConfig, OpenD2ConfigStrc * pOpenC
 
 	Log_ErrorAssert(gpRenderer);
 
+	// DCC atlases have to fit inside of whatever the renderer can handle
+	gnMaxTextureWidth = ri.max_texture_width > 0 ? ri.max_texture_width : 2048;
+	gnMaxTextureHeight = ri.max_texture_height > 0 ? ri.max_texture_height : 2048;
+
 	// Build palettes
 	for (int i = 0; i < PAL_MAX_PALETTES; i++)
 	{
@@ -1110,27 +1398,51 @@ Renderer_SDL::Renderer_SDL(D2GameConfigStrc * pConfig, OpenD2ConfigStrc * pOpenC
 
 	gpRenderTexture = SDL_CreateTexture(gpRenderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, 800, 600);
 
+	// No budget means that everything gets uploaded as soon as it can be
+	if (pOpenConfig->dwUploadBudgetMS > 0)
+	{
+		gqwUploadBudget = (SDL_GetPerformanceFrequency() * pOpenConfig->dwUploadBudgetMS) / 1000;
+	}
+	else
+	{
+		gqwUploadBudget = (Uint64)-1;
+	}
+
 	// Create LRUs
 	Renderer_SDL_InitLRUs();
 }
 
 Renderer_SDL::~Renderer_SDL()
 {
-	// Free palettes
-	for (int i = 0; i < PAL_MAX_PALETTES; i++)
-	{
-		SDL_FreePalette(PaletteCache[i].pPal);
-	}
+	// Anything still waiting to be uploaded has a slot to go into, which is about to go away
+	Renderer_SDL_FinishUploads();
 
 	SDL_DestroyTexture(gpRenderTexture);
 	Renderer_SDL_ClearTextureCache();
 	Renderer_SDL_DeregisterAllFonts();
 	Renderer_SDL_ClearLRUs();
+
+	// Free palettes (only once the LRUs are gone, since DCC frames that are still decoding need them for uploading)
+	for (int i = 0; i < PAL_MAX_PALETTES; i++)
+	{
+		SDL_FreePalette(PaletteCache[i].pPal);
+	}
+
 	SDL_DestroyRenderer(gpRenderer);
 }
 
 void Renderer_SDL::Present()
 {
+	// Turn whatever got decoded since last frame into textures, so that it can be drawn this frame
+	Renderer_SDL_ProcessUploads(gqwUploadBudget);
+
+	// Anything that got drawn last frame can be evicted again
+	for (int i = 0; i < ATYPE_MAX; i++)
+	{
+		DCCLRU[i]->BeginFrame();
+	}
+	gnDCCPrefetchesThisFrame = 0;
+
 	// Clear backbuffer
 	SDL_RenderClear(gpRenderer);
 
@@ -1180,6 +1492,11 @@ tex_handle Renderer_SDL::TextureFromStitchedDC6(const char * dc6Path, const char
 	DC6::LoadImage(dc6Path, &pCache->dc6);
 	pCache->bHasDC6 = true;
 
+	if (pCache->dc6.pFrames == nullptr || end >= pCache->dc6.header.dwFrames)
+	{	// couldn't be loaded
+		return tex;
+	}
+
 	// Calculate how wide it should be
 	DWORD dwStitchRows = 0;
 	DWORD dwStitchCols = 0;
@@ -8,6 +8,7 @@
 #define MAX_SDL_ANIMCACHE_SIZE			0x100
 #define MAX_SDL_ANIM_FRAMES				0x80
 #define MAX_SDL_FONTCACHE_SIZE			0x20
+#define MAX_SDL_DCC_PREFETCHES_PER_FRAME	4
 
 #define MAX_TEXT_DRAW_LINE				128
 
@@ -174,6 +175,18 @@ struct SDLFontCacheItem
 	DC6Image dc6[2];
 };
 
+/*
+ *	A surface that got built on another thread, waiting to be turned into a texture on the render thread
+ */
+struct SDLUploadItem
+{
+	SDL_Surface*	pSurface;		// Freed once it has been uploaded
+	SDL_Palette*	pPalette;		// Optional - applied to the surface right before the upload
+	SDL_Texture**	ppTexture;		// Cache slot that the new texture goes into
+	SDL_atomic_t*	pRemaining;		// Optional - taken down by one once the texture is in its slot
+	SDLUploadItem*	pNext;
+};
+
 class Renderer_SDL : public IRenderer
 {
 public:
@@ -222,4 +235,8 @@ public:
 	virtual void DrawTokenInstance(anim_handle instance, int x, int y, int translvl, int palette);
 
 	virtual void Clear();
-};
\ No newline at end of file
+};
+
+// Renderer_SDL.cpp
+void Renderer_SDL_QueueUpload(SDL_Surface* pSurface, SDL_Palette* pPalette, SDL_Texture** ppTexture, SDL_atomic_t* pRemaining);
+void Renderer_SDL_FinishUploads();
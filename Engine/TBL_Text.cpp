@@ -32,8 +32,8 @@ namespace TBL
 	{
 		char szPathStr[MAX_D2PATH]{ 0 };
 		TBLFile* pTBL = &TBLFiles[gnLastUsedTBL];
-		BYTE* pFileBuffer;
-		BYTE* pReadHead;
+		const BYTE* pFileBuffer;
+		const BYTE* pReadHead;
 		DWORD dwTableSize = 0;
 		size_t strTableRead = 0;
 
@@ -53,23 +53,17 @@ namespace TBL
 		// TODO: make this use something other than english
 		snprintf(szPathStr, MAX_D2PATH, "data\\local\\LNG\\%s\\%s.tbl", GAME_LANGUAGE, szTblFile);
 
-		pTBL->dwFileSize = FS::Open(szPathStr, &pTBL->archiveHandle, FS_READ, true);
-		if (pTBL->archiveHandle == INVALID_HANDLE)
+		pFileBuffer = (const BYTE*)FS::Map(szPathStr, &pTBL->dwFileSize);
+		if (pFileBuffer == nullptr)
 		{	// couldn't find this TBL file
 			return INVALID_HANDLE;
 		}
 		if (pTBL->dwFileSize < sizeof(TBLHeader))
 		{
-			FS::CloseFile(pTBL->archiveHandle);
+			FS::Unmap(pFileBuffer);
 			return INVALID_HANDLE;
 		}
-
-		// Allocate file buffer and read
-		pFileBuffer = (BYTE*)malloc(pTBL->dwFileSize);
-		Log_ErrorAssertReturn(pFileBuffer, INVALID_HANDLE);
 		pReadHead = pFileBuffer;
-		FS::Read(pTBL->archiveHandle, pFileBuffer, pTBL->dwFileSize);
-		FS::CloseFile(pTBL->archiveHandle);
 
 		// Copy contents from buffer into the file
 		memcpy(&pTBL->header, pReadHead, sizeof(TBLHeader));
@@ -80,7 +74,7 @@ namespace TBL
 		{
 			Log::Print(PRIORITY_MESSAGE, "Couldn't load TBL %s: wrong version (got %i, expected %i)",
 				szPathStr, pTBL->header.Version, TBL_VERSION);
-			free(pFileBuffer);
+			FS::Unmap(pFileBuffer);
 			return INVALID_HANDLE;
 		}
 
@@ -151,7 +145,7 @@ namespace TBL
 			}
 		}
 
-		free(pFileBuffer);
+		FS::Unmap(pFileBuffer);
 		return gnLastUsedTBL++;
 	}
 
@@ -1,176 +1,559 @@
 #include "Diablo2.hpp"
 #include "Threadpool.hpp"
+#include "Logging.hpp"
 
-#define	THREADPOOL_SIZE	10
-#define MAX_THREAD_JOBS	100
+/*
+ *	The job system.
+ *	Every worker has its own queue of jobs. Jobs spawned by a worker go on its own queue, which it works through
+ *	newest first; when it runs out, it steals the oldest jobs from everyone else. Threads that aren't workers (the
+ *	main thread, mostly) share one more queue, which the workers steal from as well.
+ *	Jobs are stored in the queues themselves, so spawning one doesn't allocate anything.
+ *	Waiting on a counter runs jobs on the waiting thread until the counter reaches zero, instead of sleeping.
+ *	@author	eezstreet
+ */
 
-#define THREADPOOL_SLEEP_MIN	2
-#define THREADPOOL_SLEEP_MAX	10
+#define THREADPOOL_MAX_WORKERS	31
+#define THREADPOOL_QUEUE_SIZE	1024		// Must be a power of two
+#define THREADPOOL_MAX_PENDING	1024		// Jobs that can be waiting on counters at once
+#define THREADPOOL_SHARED_QUEUE	0			// The queue that threads which aren't workers push to
 
-namespace Threadpool
+/*
+ *	A job that's ready to go
+ */
+struct D2Job
+{
+	D2AsyncTask		task;
+	void*			pData;
+	D2JobCounter*	pCounter;
+};
+
+/*
+ *	A job that's waiting on a counter to reach zero
+ */
+struct D2PendingJob
 {
+	D2Job			job;
+	D2PendingJob*	pNext;
+};
 
-	struct D2ThreadTask
+namespace Threadpool
+{
+	/*
+	 *	A worker's queue. The worker pushes and pops at the bottom; everyone else steals from the top.
+	 *	Each queue has its own lock, so the only time two threads fight over one is when somebody is stealing.
+	 */
+	struct D2JobQueue
 	{
-		D2AsyncTask task;
-		void* pData;
-		D2ThreadTask* pBehind;	// the element that is "behind" this one in line
+		SDL_SpinLock	lock;
+		DWORD			dwTop;
+		DWORD			dwBottom;
+		D2Job			jobs[THREADPOOL_QUEUE_SIZE];
 	};
 
-	static SDL_Thread* gpaThreadPool[THREADPOOL_SIZE]{ 0 };
-	static bool gbKillThreads = false;
+	static D2JobQueue gQueues[THREADPOOL_MAX_WORKERS + 1];
+	static SDL_Thread* gpaWorkers[THREADPOOL_MAX_WORKERS]{ 0 };
+	static int gnNumWorkers = 0;
+	static int gnNumQueues = 1;
+	static SDL_atomic_t gnKillThreads;
+	static SDL_atomic_t gnNumSleeping;
+	static SDL_atomic_t gnNumOutstanding;		// Jobs that have been spawned but haven't finished
+	static SDL_sem* gpWakeSemaphore = nullptr;
+	static SDL_TLSID gWorkerQueueTLS = 0;		// Which queue belongs to the current thread (plus one)
+
+	static D2PendingJob gPendingJobs[THREADPOOL_MAX_PENDING];
+	static D2PendingJob* gpFreePendingJobs = nullptr;
+	static SDL_SpinLock gPendingLock = 0;
 
-	static D2ThreadTask* gpJobQueueHead = nullptr;
-	static D2ThreadTask* gpJobQueueTail = nullptr;
-	static SDL_mutex* gpJobQueueMutex = nullptr;
-	static SDL_semaphore* gpQueueSizeSemaphore = nullptr;
+	static void RunJob(D2Job* pJob);
 
 	/*
-	 *	Waits until all of the jobs in the queue have been completed.
-	 *	@author	eezstreet
+	 *	Counters are declared in D2Shared.hpp (so that modcode can use them), which can't see SDL
 	 */
-	void WaitUntilCompletion()
+	static SDL_atomic_t* CounterValue(D2JobCounter* pCounter)
 	{
-		while (SDL_SemValue(gpQueueSizeSemaphore) != 0)
+		return (SDL_atomic_t*)&pCounter->nValue;
+	}
+
+	/*
+	 *	Gets the queue that the current thread pushes to
+	 */
+	static int GetQueueIndex()
+	{
+		if (gWorkerQueueTLS == 0)
 		{
-			SDL_Delay(2);
+			return THREADPOOL_SHARED_QUEUE;
 		}
+		return (int)(intptr_t)SDL_TLSGet(gWorkerQueueTLS);
 	}
 
 	/*
-	 *	Wait until a single job on the queue has been completed
+	 *	Puts a job on the bottom of a queue
+	 *	@return	false if the queue is full
+	 */
+	static bool PushJob(D2JobQueue* pQueue, D2Job* pJob)
+	{
+		SDL_AtomicLock(&pQueue->lock);
+		if (pQueue->dwBottom - pQueue->dwTop >= THREADPOOL_QUEUE_SIZE)
+		{
+			SDL_AtomicUnlock(&pQueue->lock);
+			return false;
+		}
+
+		pQueue->jobs[pQueue->dwBottom & (THREADPOOL_QUEUE_SIZE - 1)] = *pJob;
+		pQueue->dwBottom++;
+		SDL_AtomicUnlock(&pQueue->lock);
+		return true;
+	}
 
 	/*
-	 *	Pop a job off of the job queue.
-	 *	@author	eezstreet
+	 *	Takes the newest job off of the bottom of a queue
+	 */
+	static bool PopJob(D2JobQueue* pQueue, D2Job* pJob)
+	{
+		SDL_AtomicLock(&pQueue->lock);
+		if (pQueue->dwBottom == pQueue->dwTop)
+		{
+			SDL_AtomicUnlock(&pQueue->lock);
+			return false;
+		}
+
+		pQueue->dwBottom--;
+		*pJob = pQueue->jobs[pQueue->dwBottom & (THREADPOOL_QUEUE_SIZE - 1)];
+		SDL_AtomicUnlock(&pQueue->lock);
+		return true;
+	}
+
+	/*
+	 *	Takes the oldest job off of the top of a queue
+	 */
+	static bool StealJob(D2JobQueue* pQueue, D2Job* pJob)
+	{
+		SDL_AtomicLock(&pQueue->lock);
+		if (pQueue->dwBottom == pQueue->dwTop)
+		{
+			SDL_AtomicUnlock(&pQueue->lock);
+			return false;
+		}
+
+		*pJob = pQueue->jobs[pQueue->dwTop & (THREADPOOL_QUEUE_SIZE - 1)];
+		pQueue->dwTop++;
+		SDL_AtomicUnlock(&pQueue->lock);
+		return true;
+	}
+
+	/*
+	 *	Finds something for a thread to do: its own newest job, or else somebody else's oldest one
 	 */
-	static void PopJob()
+	static bool FindJob(int nQueueIndex, D2Job* pJob)
 	{
-		if (gpJobQueueHead == nullptr)
-		{	// no jobs?
+		if (PopJob(&gQueues[nQueueIndex], pJob))
+		{
+			return true;
+		}
+
+		for (int i = 1; i < gnNumQueues; i++)
+		{
+			if (StealJob(&gQueues[(nQueueIndex + i) % gnNumQueues], pJob))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/*
+	 *	Whether any queue has a job on it
+	 */
+	static bool HasJobs()
+	{
+		for (int i = 0; i < gnNumQueues; i++)
+		{
+			bool bEmpty;
+
+			SDL_AtomicLock(&gQueues[i].lock);
+			bEmpty = gQueues[i].dwBottom == gQueues[i].dwTop;
+			SDL_AtomicUnlock(&gQueues[i].lock);
+
+			if (!bEmpty)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/*
+	 *	Hands a job that's ready to go to the current thread's queue, and wakes up a worker for it
+	 */
+	static void StartJob(D2Job* pJob)
+	{
+		if (gnNumWorkers == 0 || !PushJob(&gQueues[GetQueueIndex()], pJob))
+		{	// Nobody to run it (or no room for it), so it gets done right here
+			RunJob(pJob);
 			return;
 		}
 
-		// Lock the head
-		SDL_LockMutex(gpJobQueueMutex);
+		if (SDL_AtomicGet(&gnNumSleeping) > 0)
+		{
+			SDL_SemPost(gpWakeSemaphore);
+		}
+	}
+
+	/*
+	 *	Takes one off of a counter, starting anything that was waiting on it if that was the last one.
+	 *	The counter's lock is held until we're done with it, which WaitForCounter relies on.
+	 */
+	static void DecrementCounter(D2JobCounter* pCounter)
+	{
+		D2PendingJob* pWaiting = nullptr;
 
-		// Pop the head off
-		D2ThreadTask* pCurrent = gpJobQueueHead;
-		if (gpJobQueueTail == gpJobQueueHead)
+		SDL_AtomicLock(&pCounter->nLock);
+		if (SDL_AtomicAdd(CounterValue(pCounter), -1) == 1)
 		{
-			gpJobQueueTail = nullptr;
+			pWaiting = pCounter->pWaiting;
+			pCounter->pWaiting = nullptr;
 		}
-		gpJobQueueHead = gpJobQueueHead->pBehind;
+		SDL_AtomicUnlock(&pCounter->nLock);
+
+		while (pWaiting != nullptr)
+		{
+			D2PendingJob* pNext = pWaiting->pNext;
+			D2Job job = pWaiting->job;
 
+			SDL_AtomicLock(&gPendingLock);
+			pWaiting->pNext = gpFreePendingJobs;
+			gpFreePendingJobs = pWaiting;
+			SDL_AtomicUnlock(&gPendingLock);
 
-		// Unlock the head (and the tail too, if we need to)
-		SDL_UnlockMutex(gpJobQueueMutex);
+			StartJob(&job);
+			pWaiting = pNext;
+		}
+	}
 
-		// Actually do the job
-		pCurrent->task(pCurrent->pData);
+	/*
+	 *	Runs a job and marks it as done
+	 */
+	static void RunJob(D2Job* pJob)
+	{
+		pJob->task(pJob->pData);
 
-		// Free it
-		free(pCurrent);
+		if (pJob->pCounter != nullptr)
+		{
+			DecrementCounter(pJob->pCounter);
+		}
+		SDL_AtomicAdd(&gnNumOutstanding, -1);
 	}
 
 	/*
-	 *	Push a job onto the job queue.
+	 *	Starts a job.
+	 *	If pCounter isn't null, it goes up by one now and back down once the job is done.
+	 *	Without any workers (or with the queue full), the job gets run before this returns.
 	 *	@author	eezstreet
 	 */
-	void SpawnJob(D2AsyncTask job, void* pData)
+	void SpawnJob(D2AsyncTask job, void* pData, D2JobCounter* pCounter)
 	{
-		// Allocate a thread task
-		D2ThreadTask* pCurrent = (D2ThreadTask*)malloc(sizeof(D2ThreadTask));
-		pCurrent->task = job;
-		pCurrent->pData = pData;
-		pCurrent->pBehind = nullptr;
+		D2Job newJob = { job, pData, pCounter };
+
+		if (pCounter != nullptr)
+		{
+			SDL_AtomicIncRef(CounterValue(pCounter));
+		}
+		SDL_AtomicIncRef(&gnNumOutstanding);
 
-		// Lock the queue mutex
-		SDL_LockMutex(gpJobQueueMutex);
+		StartJob(&newJob);
+	}
 
-		// If there's nothing on the queue, we set the element to be the current.
-		// Otherwise, we adjust the tail.
-		if (gpJobQueueTail == nullptr)
+	/*
+	 *	Starts a job once pDependency reaches zero (or right away, if it's already there).
+	 *	pCounter goes up by one now, the same as with SpawnJob, so waiting on it waits on this job too.
+	 *	@author	eezstreet
+	 */
+	void SpawnJobAfter(D2JobCounter* pDependency, D2AsyncTask job, void* pData, D2JobCounter* pCounter)
+	{
+		D2Job newJob = { job, pData, pCounter };
+		D2PendingJob* pPending;
+
+		if (pDependency == nullptr)
+		{
+			SpawnJob(job, pData, pCounter);
+			return;
+		}
+
+		if (pCounter != nullptr)
+		{
+			SDL_AtomicIncRef(CounterValue(pCounter));
+		}
+		SDL_AtomicIncRef(&gnNumOutstanding);
+
+		SDL_AtomicLock(&pDependency->nLock);
+		if (SDL_AtomicGet(CounterValue(pDependency)) == 0)
+		{	// nothing to wait for
+			SDL_AtomicUnlock(&pDependency->nLock);
+			StartJob(&newJob);
+			return;
+		}
+
+		SDL_AtomicLock(&gPendingLock);
+		pPending = gpFreePendingJobs;
+		if (pPending != nullptr)
+		{
+			gpFreePendingJobs = pPending->pNext;
+		}
+		SDL_AtomicUnlock(&gPendingLock);
+
+		if (pPending == nullptr)
+		{	// Too many jobs waiting already, so wait for this one's dependency here instead
+			SDL_AtomicUnlock(&pDependency->nLock);
+			WaitForCounter(pDependency);
+			StartJob(&newJob);
+			return;
+		}
+
+		pPending->job = newJob;
+		pPending->pNext = pDependency->pWaiting;
+		pDependency->pWaiting = pPending;
+		SDL_AtomicUnlock(&pDependency->nLock);
+	}
+
+	/*
+	 *	Waits for a counter to reach zero, running jobs on this thread in the meantime.
+	 *	Once this returns, nothing touches the counter anymore, so it can go out of scope.
+	 *	@author	eezstreet
+	 */
+	void WaitForCounter(D2JobCounter* pCounter)
+	{
+		int nQueueIndex = GetQueueIndex();
+		D2Job job;
+
+		while (SDL_AtomicGet(CounterValue(pCounter)) > 0)
 		{
-			gpJobQueueHead = gpJobQueueTail = pCurrent;
+			if (FindJob(nQueueIndex, &job))
+			{
+				RunJob(&job);
+			}
+			else
+			{	// Whatever's left is running on other threads
+				SDL_Delay(0);
+			}
 		}
-		else
+
+		// Whoever took it down to zero might still be holding the lock
+		SDL_AtomicLock(&pCounter->nLock);
+		SDL_AtomicUnlock(&pCounter->nLock);
+	}
+
+	/*
+	 *	Waits until every job that has been spawned has finished, running jobs on this thread in the meantime.
+	 *	Jobs waiting on counters that never reach zero will keep this from returning.
+	 *	@author	eezstreet
+	 */
+	void WaitUntilCompletion()
+	{
+		int nQueueIndex = GetQueueIndex();
+		D2Job job;
+
+		while (SDL_AtomicGet(&gnNumOutstanding) > 0)
 		{
-			gpJobQueueTail->pBehind = pCurrent;
-			gpJobQueueTail = pCurrent;
+			if (FindJob(nQueueIndex, &job))
+			{
+				RunJob(&job);
+			}
+			else
+			{
+				SDL_Delay(0);
+			}
 		}
+	}
+
+	/*
+	 *	Shared state for a parallel for. Chunks get handed out in order to whoever asks for one next.
+	 */
+	struct D2ParallelFor
+	{
+		D2ParallelForTask	task;
+		void*				pData;
+		int					nEnd;
+		int					nGrainSize;
+		SDL_atomic_t		nNext;			// Start of the next chunk that hasn't been claimed by anyone
+	};
+
+	static void RunParallelForChunks(D2ParallelFor* pFor)
+	{
+		while (true)
+		{
+			int nStart = SDL_AtomicAdd(&pFor->nNext, pFor->nGrainSize);
 
-		// Unlock the queue mutex (so something else can modify it)
-		SDL_UnlockMutex(gpJobQueueMutex);
+			if (nStart >= pFor->nEnd)
+			{
+				return;
+			}
+			pFor->task(nStart, D2Lib::min(nStart + pFor->nGrainSize, pFor->nEnd), pFor->pData);
+		}
+	}
 
-		// Lastly, increment the queue size semaphore
-		SDL_SemPost(gpQueueSizeSemaphore);
+	static void T_ParallelFor(void* pData)
+	{
+		RunParallelForChunks((D2ParallelFor*)pData);
 	}
 
 	/*
-	 *	Spawn one of these jobs to kill a worker thread.
+	 *	Runs task over every index from nStart up to nEnd, split into chunks of nGrainSize indices that are spread
+	 *	out over the workers. The calling thread works on the chunks too, and this doesn't return until all of them
+	 *	are done, so the data can live on the stack.
+	 *	A grain size of zero (or less) picks one that gives every thread a few chunks.
+	 *	Chunks may be run in any order, on any thread, so they shouldn't write anywhere that another chunk does.
 	 *	@author	eezstreet
 	 */
-	static void WorkerDie(void* pData)
+	void ParallelFor(int nStart, int nEnd, int nGrainSize, D2ParallelForTask task, void* pData)
 	{
-		exit(0);
+		int nCount = nEnd - nStart;
+		int nNumChunks, nNumHelpers;
+		D2ParallelFor parallelFor;
+		D2JobCounter counter{ 0 };
+
+		if (nCount <= 0)
+		{
+			return;
+		}
+
+		if (nGrainSize <= 0)
+		{
+			nGrainSize = D2Lib::max(1, nCount / (gnNumQueues * 4));
+		}
+
+		nNumChunks = (nCount + nGrainSize - 1) / nGrainSize;
+		nNumHelpers = D2Lib::min(gnNumWorkers, nNumChunks - 1);
+		if (nNumHelpers <= 0)
+		{	// Not worth splitting up (or nobody to split it with)
+			task(nStart, nEnd, pData);
+			return;
+		}
+
+		parallelFor.task = task;
+		parallelFor.pData = pData;
+		parallelFor.nEnd = nEnd;
+		parallelFor.nGrainSize = nGrainSize;
+		SDL_AtomicSet(&parallelFor.nNext, nStart);
+
+		for (int i = 0; i < nNumHelpers; i++)
+		{
+			SpawnJob(T_ParallelFor, &parallelFor, &counter);
+		}
+
+		RunParallelForChunks(&parallelFor);
+		WaitForCounter(&counter);
 	}
 
 	/*
-	 *	Every tick, the threads in the threadpool will run this function.
+	 *	Every worker thread runs this until the threadpool shuts down.
 	 *	@author	eezstreet
 	 */
-	static int T_Worker(void* notUsed)
+	static int T_Worker(void* pQueueIndex)
 	{
-		while (!gbKillThreads)
+		int nQueueIndex = (int)(intptr_t)pQueueIndex;
+		D2Job job;
+
+		SDL_TLSSet(gWorkerQueueTLS, pQueueIndex, nullptr);
+
+		while (!SDL_AtomicGet(&gnKillThreads))
 		{
-			// wait until the queue length semaphore is greater than 0
-			SDL_SemWait(gpQueueSizeSemaphore);
+			if (FindJob(nQueueIndex, &job))
+			{
+				RunJob(&job);
+				continue;
+			}
 
-			// take the most recent task and do it
-			PopJob();
+			// Nothing to do, so go to sleep. Anyone who pushes a job after we say that we're sleeping wakes us up,
+			// and anything pushed before then gets noticed by HasJobs.
+			SDL_AtomicIncRef(&gnNumSleeping);
+			if (!HasJobs() && !SDL_AtomicGet(&gnKillThreads))
+			{
+				SDL_SemWait(gpWakeSemaphore);
+			}
+			SDL_AtomicAdd(&gnNumSleeping, -1);
 		}
 
 		return 0; // we don't really care about what is returned
 	}
 
 	/*
-	 *	Initiate the threadpools
+	 *	Starts up one worker for every core, except for the one that the main thread is on.
 	 *	@author	eezstreet
 	 */
 	void Init()
 	{
 		char threadName[32];
+		int nNumWorkers = D2Lib::max(1, D2Lib::min(SDL_GetCPUCount() - 1, THREADPOOL_MAX_WORKERS));
+
+		memset(gQueues, 0, sizeof(gQueues));
+		SDL_AtomicSet(&gnKillThreads, 0);
+		SDL_AtomicSet(&gnNumSleeping, 0);
+		SDL_AtomicSet(&gnNumOutstanding, 0);
+
+		gpFreePendingJobs = nullptr;
+		for (int i = 0; i < THREADPOOL_MAX_PENDING; i++)
+		{
+			gPendingJobs[i].pNext = gpFreePendingJobs;
+			gpFreePendingJobs = &gPendingJobs[i];
+		}
 
-		// Create the two mutexes and semaphore associated with the job queue.
-		gpJobQueueMutex = SDL_CreateMutex();
-		gpQueueSizeSemaphore = SDL_CreateSemaphore(0);
+		gWorkerQueueTLS = SDL_TLSCreate();
+		gpWakeSemaphore = SDL_CreateSemaphore(0);
+		Log_ErrorAssertVoidReturn(gWorkerQueueTLS != 0 && gpWakeSemaphore != nullptr);
 
-		for (int i = 0; i < THREADPOOL_SIZE; i++)
+		// Queue 0 is the shared one, so worker i gets queue i + 1
+		gnNumQueues = nNumWorkers + 1;
+		for (int i = 0; i < nNumWorkers; i++)
 		{
 			snprintf(threadName, 32, "_worker%d", i);
-			gpaThreadPool[i] = SDL_CreateThread(T_Worker, threadName, nullptr);
+			gpaWorkers[i] = SDL_CreateThread(T_Worker, threadName, (void*)(intptr_t)(i + 1));
 		}
+
+		gnNumWorkers = nNumWorkers;
+	}
+
+	/*
+	 *	Gets the number of worker threads that are running.
+	 *	This is zero if the threadpool hasn't been started, in which case jobs get run as soon as they're spawned.
+	 *	@author	eezstreet
+	 */
+	int GetNumWorkers()
+	{
+		return gnNumWorkers;
 	}
 
 	/*
-	 *	Delete the threadpools
+	 *	Stops all of the workers.
+	 *	Jobs that haven't been started by now never will be.
 	 *	@author	eezstreet
 	 */
 	void Shutdown()
 	{
-		// In global memory, signify that the threads need to die
-		gbKillThreads = true;
+		int nNumWorkers = gnNumWorkers;
+
+		if (nNumWorkers == 0)
+		{
+			return;
+		}
 
-		// Detach them and watch the magic happen
-		for (int i = 0; i < THREADPOOL_SIZE; i++)
+		// Wake all of them up so they notice, and wait for them to finish what they were doing
+		SDL_AtomicSet(&gnKillThreads, 1);
+		for (int i = 0; i < nNumWorkers; i++)
 		{
-			SpawnJob(WorkerDie, 0);
-			SDL_DetachThread(gpaThreadPool[i]);
+			SDL_SemPost(gpWakeSemaphore);
 		}
+		for (int i = 0; i < nNumWorkers; i++)
+		{
+			SDL_WaitThread(gpaWorkers[i], nullptr);
+			gpaWorkers[i] = nullptr;
+		}
+
+		gnNumWorkers = 0;
+		gnNumQueues = 1;
+		memset(gQueues, 0, sizeof(gQueues));
+		SDL_AtomicSet(&gnNumOutstanding, 0);
 
-		// Delete the mutexes and the semaphore
-		SDL_DestroySemaphore(gpQueueSizeSemaphore);
-		SDL_DestroyMutex(gpJobQueueMutex);
+		SDL_DestroySemaphore(gpWakeSemaphore);
+		gpWakeSemaphore = nullptr;
 	}
-}
\ No newline at end of file
+}
@@ -1,11 +1,16 @@
 #pragma once
 #include "../Shared/D2Shared.hpp"
+#include "../Libraries/sdl/SDL_atomic.h"
 
 // Threadpool.cpp
 namespace Threadpool
 {
-	void WaitUntilCompletion();
-	void SpawnJob(D2AsyncTask job, void* pData);
 	void Init();
 	void Shutdown();
-}
\ No newline at end of file
+	int GetNumWorkers();
+	void SpawnJob(D2AsyncTask job, void* pData, D2JobCounter* pCounter = nullptr);
+	void SpawnJobAfter(D2JobCounter* pDependency, D2AsyncTask job, void* pData, D2JobCounter* pCounter = nullptr);
+	void WaitForCounter(D2JobCounter* pCounter);
+	void WaitUntilCompletion();
+	void ParallelFor(int nStart, int nEnd, int nGrainSize, D2ParallelForTask task, void* pData);
+}
@@ -38,6 +38,13 @@ struct AnimTokenInstance
 	bool			bActive;
 
 	anim_handle		componentAnims[XXXMODE_MAX][COMP_MAX];
+
+	// The last mode/direction that had all of its components ready to draw (used by the renderer while the
+	// current one is still being decoded)
+	bool			bLastReadyValid;
+	int				lastReadyMode;
+	int				lastReadyDirection;
+	int				lastReadyFrame;
 };
 
 // Token.cpp - Should maybe move this to gamecode?
@@ -58,8 +58,9 @@ namespace Window
 	 */
 	void ShutdownSDL()
 	{
-		DCC::GlobalShutdown();
+		// The renderer goes first, since it waits for any DCC directions that are still being decoded
 		delete RenderTarget;
+		DCC::GlobalShutdown();
 		SDL_DestroyWindow(gpWindow);
 		SDL_Quit();
 	}
@@ -1,7 +1,12 @@
 #include "Diablo2.hpp"
 #include "Audio.hpp"
 #include "COF.hpp"
+#include "DCC.hpp"
+#include "DCC_Cache.hpp"
 #include "FileSystem.hpp"
+#include "FileSystem_Async.hpp"
+#include "FileSystem_Cache.hpp"
+#include "FileSystem_Prefetch.hpp"
 #include "INI.hpp"
 #include "Input.hpp"
 #include "Logging.hpp"
@@ -10,6 +15,7 @@
 #include "Renderer.hpp"
 #include "TBL_Font.hpp"
 #include "TBL_Text.hpp"
+#include "Threadpool.hpp"
 #include "Token.hpp"
 #include "Window.hpp"
 
@@ -90,6 +96,9 @@ D2CmdArgStrc OpenD2CommandArguments[] = {
 	{"FILEIO",		"LOGFLAGS",		"logflags",		CMD_DWORD,		co(dwLogFlags),		PRIORITY_ALL},
 	{"AUDIO",		"AUDIODEVICE",	"audiodevice",	CMD_DWORD,		co(dwAudioDevice),	0},
 	{"AUDIO",		"AUDIOCHANNELS","audiochannels",CMD_DWORD,		co(dwAudioChannels),2},
+	{"FILEIO",		"FILECACHEKB",	"filecachekb",	CMD_DWORD,		co(dwFileCacheKB),	16384},
+	{"VIDEO",		"UPLOADBUDGET",	"uploadms",		CMD_DWORD,		co(dwUploadBudgetMS),2},
+	{"FILEIO",		"DCCCACHE",		"dcccache",		CMD_BOOLEAN,	co(bDCCCache),		0x00},
 	{"",			"",				"",				0,				0x0000,				0x00},
 };
 #undef co
@@ -157,7 +166,18 @@ static D2ModuleImportStrc exports = {
 	Audio::ResumeAudio,
 	Audio::SetMasterVolume,
 	Audio::SetMusicVolume,
-	Audio::SetSoundVolume
+	Audio::SetSoundVolume,
+
+	FS::Map,
+	FS::Unmap,
+	FSAsync::LoadBatch,
+	FSAsync::GetNumPending,
+
+	Threadpool::GetNumWorkers,
+	Threadpool::SpawnJob,
+	Threadpool::SpawnJobAfter,
+	Threadpool::WaitForCounter,
+	Threadpool::ParallelFor,
 };
 
 static D2ModuleExportStrc* imports[MODULE_MAX]{ 0 };
@@ -313,6 +333,24 @@ void ParseCommandline(int argc, char** argv, D2GameConfigStrc* pConfig, OpenD2Co
 	}
 }
 
+/*
+ *	Looks for +dccwarm (or +dccwarm=<listfile>) on the commandline.
+ *	It isn't a setting, so it doesn't go in the argument tables (and never gets saved to the INI).
+ *	@return	true if the DCC cache should be prewarmed instead of running the game
+ */
+static bool FindDCCPrewarmArgument(int argc, char** argv, char* szListFile, size_t dwListFileLen)
+{
+	for (int i = 1; i < argc && argv[i][0] != '\0'; i++)
+	{
+		if (!D2Lib::stricmpn(argv[i], "+dccwarm", 8) && (argv[i][8] == '\0' || argv[i][8] == '='))
+		{
+			D2Lib::strncpyz(szListFile, argv[i][8] == '=' ? argv[i] + 9 : "", dwListFileLen);
+			return true;
+		}
+	}
+	return false;
+}
+
 /*
  *	Pull default values from a D2CmdArgStrc array
  */
@@ -437,12 +475,20 @@ int InitGame(int argc, char** argv)
 	D2GameConfigStrc config{ 0 };
 	OpenD2ConfigStrc openD2Config{ 0 };
 	DWORD dwDesiredFrameMsec;
+	char szPrewarmList[MAX_D2PATH]{ 0 };
+	bool bPrewarmDCCs;
 
 	PopulateConfiguration(&config, &openD2Config);
 	ParseCommandline(argc, argv, &config, &openD2Config);
 
+	bPrewarmDCCs = FindDCCPrewarmArgument(argc, argv, szPrewarmList, MAX_D2PATH);
+	if (bPrewarmDCCs)
+	{	// the prewarm touches every DCC once, which shouldn't end up in the prefetch manifest
+		config.bNoPreload = 1;
+	}
+
 	Network::Init();
-//	Threadpool::Init();
+	Threadpool::Init();
 	FS::Init(&config, &openD2Config);
 	Log::InitSystem(GAME_LOG_HEADER, GAME_NAME, &openD2Config);
 	FS::LogSearchPaths();
@@ -452,6 +498,20 @@ int InitGame(int argc, char** argv)
 	if (openD2Config.szBasePath[0] == 0x0) {
 		Log::Error(__FILE__, __LINE__, "Basepath is not set. Run with the +basepath=\"...\" parameter.");
 	}
+
+	if (bPrewarmDCCs)
+	{	// Fill up the DCC cache and quit, without ever opening a window
+		DCC::GlobalInit(true);
+		DCCCache::Prewarm(szPrewarmList);
+		DCC::GlobalShutdown();
+
+		Network::Shutdown();
+		TBL::Cleanup();
+		Log::Shutdown();
+		FS::Shutdown();
+		Threadpool::Shutdown();
+		return 0;
+	}
 	
 	Window::InitSDL(&config, &openD2Config); // renderer also gets initialized here
 	Renderer::MapRenderTargetExports(&exports);
@@ -484,6 +544,10 @@ int InitGame(int argc, char** argv)
 			}
 		}
 
+		// Hand back any files that finished loading in the background
+		FSAsync::Deliver();
+		FSPrefetch::Update();
+
 		// Run the module frame
 		currentModule = imports[currentModule]->RunModuleFrame(&config, &openD2Config);
 
@@ -547,9 +611,10 @@ int InitGame(int argc, char** argv)
 	WriteGameConfig(&config, &openD2Config);
 	TBL::Cleanup();
 	COF::DeregisterAll();
+	FSCache::LogStats();
 	Log::Shutdown();
 	FS::Shutdown();
-	//Threadpool::Shutdown();
+	Threadpool::Shutdown();
 
 	return 0;
 }
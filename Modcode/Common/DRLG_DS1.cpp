@@ -14,28 +14,14 @@ DS1File* DS1_Load(char* szFilePath)
 	DWORD dwHash = D2Lib::strhash(szFileStripped, MAX_D2PATH_ABSOLUTE, MAX_DS1_LOADED);
 
 	// Find the file itself
-	fs_handle fileHandle;
-	DWORD dwFileSize = engine->FS_Open(szFilePath, &fileHandle, FS_READ, true);
+	size_t dwFileSize = 0;
+	const BYTE* fileData = (const BYTE*)engine->FS_Map(szFilePath, &dwFileSize);
 
-	if (fileHandle == INVALID_HANDLE)
-	{
-		return nullptr;
-	}
-	if (dwFileSize == 0)
-	{
-		engine->FS_CloseFile(fileHandle);
-		return nullptr;
-	}
-
-	// Allocate that many bytes to read and then read it
-	BYTE* fileData = (BYTE*)malloc(dwFileSize);
 	if (fileData == nullptr)
 	{
-		return nullptr; // TODO: proper memory allocation
+		return nullptr;
 	}
 
-	engine->FS_Read(fileHandle, fileData, dwFileSize, 1);
-	engine->FS_CloseFile(fileHandle);
-
-	free(fileData); // FIXME
+	engine->FS_Unmap(fileData); // FIXME
+	return nullptr;
 }
\ No newline at end of file
@@ -24,27 +24,29 @@ void BIN_Compile(const char* szTextName, D2TxtColumnStrc* pColumns, int* nNumber
 */
 bool BIN_Read(char* szBinName, void** pDestinationData, size_t* pFileSize)
 {
-	D2MPQArchive* pArchive = nullptr;
-	fs_handle f;
-	*pFileSize = engine->FS_Open(szBinName, &f, FS_READ, true);
+	const BYTE* pFileData = (const BYTE*)engine->FS_Map(szBinName, pFileSize);
 	DWORD dwNumRecords = 0; // FIXME: use this
 
-	if (f == INVALID_HANDLE)
+	if (pFileData == nullptr)
 	{
 		return false;	// couldn't find it...this is probably a bad thing
 	}
 
-	Log_ErrorAssertReturn(*pFileSize != 0, false);
-
-	*pDestinationData = malloc(*pFileSize);
-	engine->FS_Read(f, *pDestinationData, *pFileSize, 1);
+	bool bValidSize = *pFileSize >= sizeof(DWORD);
+	if (!bValidSize)
+	{	// not even a record count; give the file back before complaining about it
+		engine->FS_Unmap(pFileData);
+		Log_ErrorAssertReturn(bValidSize, false);
+	}
 
 	//	Somewhat of a hack here, but the first field in the BIN actually seems to be a DWORD
 	//	that specifies how many records in the file.
 	//	Needless to say, this will screw everything up if we don't account for it correctly.
-	void* offset = (void*)(((BYTE*)*pDestinationData) + 4);
+	//	The records get copied out of the mapped file since the game is free to change them.
 	*pFileSize -= sizeof(DWORD);
-	memmove(*pDestinationData, offset, *pFileSize);
+	*pDestinationData = malloc(*pFileSize);
+	memcpy(*pDestinationData, pFileData + sizeof(DWORD), *pFileSize);
+	engine->FS_Unmap(pFileData);
 
 	return true;
 }
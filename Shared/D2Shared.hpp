@@ -121,6 +121,13 @@ typedef pixel D2Palette[256];
 
 typedef void	(*D2AsyncTask)(void* pData);
 
+// Runs one chunk of a parallel for: every index from nStart up to (but not including) nEnd.
+typedef void	(*D2ParallelForTask)(int nStart, int nEnd, void* pData);
+
+// Called on the main thread once a file from an async batch has been loaded.
+// pData is nullptr if the file couldn't be found. Otherwise it belongs to the callback and must be given back with FS_Unmap.
+typedef void	(*D2AsyncLoadCallback)(const char* szFileName, const void* pData, size_t dwSize, void* pUserData);
+
 struct D2MPQArchive;
 struct D2Packet;
 
@@ -588,6 +595,9 @@ struct OpenD2ConfigStrc
 	DWORD			dwNumPendingCommands;
 	DWORD			dwAudioDevice;
 	DWORD			dwAudioChannels;
+	DWORD			dwFileCacheKB;
+	DWORD			dwUploadBudgetMS;
+	BYTE			bDCCCache;
 };
 
 class IRenderer
@@ -641,8 +651,8 @@ public:
 //
 //	Module Exports
 
-#define D2CLIENTAPI_VERSION	1
-#define D2SERVERAPI_VERSION	1
+#define D2CLIENTAPI_VERSION	2
+#define D2SERVERAPI_VERSION	2
 
 enum OpenD2Modules
 {
@@ -653,6 +663,31 @@ enum OpenD2Modules
 	MODULE_CLEAN,
 };
 
+/*
+ *	A single file in an async load batch
+ *	@author	eezstreet
+ */
+struct D2AsyncLoadRequest
+{
+	char				szFileName[MAX_D2PATH];
+	D2AsyncLoadCallback	pCallback;
+	void*				pUserData;
+};
+
+/*
+ *	Counts the jobs of some piece of work that haven't finished yet.
+ *	Zero it before use. Jobs spawned with a counter add one to it, and take that one back off once they've run.
+ *	Giving several jobs the same counter and then spawning a job after it is how work gets fanned back in.
+ *	The members only ever get touched by the engine (atomically), so leave them alone.
+ *	@author	eezstreet
+ */
+struct D2JobCounter
+{
+	int						nValue;
+	int						nLock;			// Protects pWaiting
+	struct D2PendingJob*	pWaiting;		// Jobs to start once nValue reaches zero
+};
+
 struct D2ModuleImportStrc
 {	// These get imported from the engine
 	int nApiVersion;
@@ -724,6 +759,20 @@ struct D2ModuleImportStrc
 	void			(*S_SetMasterVolume)(float volume);
 	void			(*S_SetMusicVolume)(float volume);
 	void			(*S_SetSoundVolume)(float volume);
+
+	// Added in version 2 (new calls only ever go on the end, so that older modules get turned away by the version)
+	// Filesystem calls
+	const void*		(*FS_Map)(const char* szFileName, size_t* pdwSize);
+	void			(*FS_Unmap)(const void* pView);
+	void			(*FS_LoadAsync)(D2AsyncLoadRequest* pRequests, int nNumRequests);
+	DWORD			(*FS_PendingAsyncLoads)();
+
+	// Job system calls
+	int				(*JOB_GetNumWorkers)();
+	void			(*JOB_Spawn)(D2AsyncTask job, void* pData, D2JobCounter* pCounter);
+	void			(*JOB_SpawnAfter)(D2JobCounter* pDependency, D2AsyncTask job, void* pData, D2JobCounter* pCounter);
+	void			(*JOB_WaitForCounter)(D2JobCounter* pCounter);
+	void			(*JOB_ParallelFor)(int nStart, int nEnd, int nGrainSize, D2ParallelForTask task, void* pData);
 };
 
 struct D2ModuleExportStrc
@@ -782,6 +831,9 @@ namespace D2Lib
 	void seedcopy(D2Seed* pDest, D2Seed* pSrc);
 	bool sbrand(D2Seed* pSeed);
 
+	// Checksums
+	DWORD crc32(const void* pData, size_t dwLength, DWORD dwCRC);
+
 	// Math
 	template <typename T>
 	T min(T a, T b)
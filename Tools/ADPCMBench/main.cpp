@@ -0,0 +1,272 @@
+#include "../../Engine/MPQ_ADPCM.hpp"
+#include "../../Libraries/adpcm/adpcm.h"
+#include <stdio.h>
+#include <time.h>
+
+/*
+ *	adpcmbench: compares the table driven ADPCM decoder (MPQADPCM) against DecompressADPCM.
+ *	The corpus is made up of generated WAV data (tones, noise, silence, sudden loud bits and clipping) in mono and
+ *	stereo at every compression level, so that all of the step markers get used.
+ *	Every sector is checked to make sure both decoders give back exactly the same thing before anything gets timed,
+ *	and so is a batch of random (mostly invalid) input.
+ *	@author	eezstreet
+ */
+
+#define BENCH_SECTOR_SIZE		0x1000
+#define BENCH_NUM_SECTORS		32
+#define BENCH_NUM_LEVELS		6
+#define BENCH_NUM_SIGNALS		4
+#define BENCH_NUM_RANDOM		20000
+#define BENCH_DEFAULT_PASSES	200
+
+/*
+ *	One compressed sector
+ */
+struct BenchSector
+{
+	BYTE	pCompressed[BENCH_SECTOR_SIZE * 2];
+	DWORD	dwCompressedSize;
+};
+
+/*
+ *	A set of sectors with the same number of channels
+ */
+struct BenchSet
+{
+	const char*	szName;
+	int			nChannels;
+	DWORD		dwNumSectors;
+	BenchSector	sectors[BENCH_NUM_SECTORS * BENCH_NUM_LEVELS];
+};
+
+static DWORD NextRandom(DWORD* pdwState)
+{	// xorshift32
+	DWORD x = *pdwState;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*pdwState = x;
+	return x;
+}
+
+/*
+ *	Generates one sector of audio
+ */
+static void GenerateAudio(short* pSamples, DWORD dwNumSamples, DWORD dwSector, int nChannels)
+{
+	DWORD dwState = 0x9E3779B9 ^ (dwSector * 40503u);
+	DWORD dwSignal = dwSector % BENCH_NUM_SIGNALS;
+
+	for (DWORD i = 0; i < dwNumSamples; i++)
+	{
+		DWORD t = (dwSector * dwNumSamples + i) / nChannels;
+		int nChannel = i % nChannels;
+		float fValue = 0.0f;
+
+		switch (dwSignal)
+		{
+			case 0:	// a couple of tones, with some noise on top
+				fValue = sinf(t * 0.031f) * 9000.0f + sinf(t * 0.0077f + nChannel) * 6000.0f;
+				fValue += (float)((int)(NextRandom(&dwState) & 0x3FF) - 0x200);
+				break;
+			case 1:	// quiet, with the odd click
+				fValue = (NextRandom(&dwState) & 0x1FF) == 0 ? 20000.0f : (float)((int)(NextRandom(&dwState) & 7) - 4);
+				break;
+			case 2:	// loud enough to clip
+				fValue = sinf(t * 0.05f) * 60000.0f;
+				fValue = fValue > 32767.0f ? 32767.0f : (fValue < -32768.0f ? -32768.0f : fValue);
+				break;
+			case 3:	// noise
+				fValue = (float)(short)NextRandom(&dwState);
+				break;
+		}
+
+		pSamples[i] = (short)fValue;
+	}
+}
+
+static void BuildSet(BenchSet* pSet, const char* szName, int nChannels)
+{
+	short samples[BENCH_SECTOR_SIZE / sizeof(short)];
+
+	pSet->szName = szName;
+	pSet->nChannels = nChannels;
+	pSet->dwNumSectors = 0;
+
+	for (int nLevel = 1; nLevel <= BENCH_NUM_LEVELS; nLevel++)
+	{
+		for (DWORD i = 0; i < BENCH_NUM_SECTORS; i++)
+		{
+			BenchSector* pSector = &pSet->sectors[pSet->dwNumSectors++];
+
+			GenerateAudio(samples, BENCH_SECTOR_SIZE / sizeof(short), i, nChannels);
+			pSector->dwCompressedSize = CompressADPCM(pSector->pCompressed, sizeof(pSector->pCompressed),
+				samples, BENCH_SECTOR_SIZE, nChannels, nLevel);
+		}
+	}
+}
+
+/*
+ *	Decodes something with both decoders and makes sure they agree
+ */
+static bool Compare(const BYTE* pInput, DWORD dwInputSize, DWORD dwOutputSize, int nChannels)
+{
+	BYTE pExpected[BENCH_SECTOR_SIZE * 2];
+	BYTE pActual[BENCH_SECTOR_SIZE * 2];
+	DWORD dwExpected, dwActual;
+
+	memset(pExpected, 0xCD, sizeof(pExpected));
+	memset(pActual, 0xCD, sizeof(pActual));
+	dwExpected = DecompressADPCM(pExpected, dwOutputSize, (void*)pInput, dwInputSize, nChannels);
+	dwActual = MPQADPCM::Decompress(pActual, dwOutputSize, pInput, dwInputSize, nChannels);
+
+	return dwExpected == dwActual && !memcmp(pExpected, pActual, sizeof(pExpected));
+}
+
+static bool VerifySet(BenchSet* pSet)
+{
+	for (DWORD i = 0; i < pSet->dwNumSectors; i++)
+	{
+		BenchSector* pSector = &pSet->sectors[i];
+
+		// Try it with room to spare and with short (and odd sized) buffers, since they stop in different places
+		if (!Compare(pSector->pCompressed, pSector->dwCompressedSize, BENCH_SECTOR_SIZE, pSet->nChannels) ||
+			!Compare(pSector->pCompressed, pSector->dwCompressedSize, BENCH_SECTOR_SIZE / 2 + 1, pSet->nChannels) ||
+			!Compare(pSector->pCompressed, pSector->dwCompressedSize / 3, BENCH_SECTOR_SIZE, pSet->nChannels))
+		{
+			printf("%s: sector %u doesn't match\n", pSet->szName, i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool VerifyRandom()
+{
+	BYTE pInput[BENCH_SECTOR_SIZE];
+	DWORD dwState = 12345;
+
+	for (DWORD i = 0; i < BENCH_NUM_RANDOM; i++)
+	{
+		DWORD dwInputSize = NextRandom(&dwState) % sizeof(pInput);
+		DWORD dwOutputSize = NextRandom(&dwState) % (BENCH_SECTOR_SIZE * 2);
+		int nChannels = 1 + (NextRandom(&dwState) & 1);
+
+		for (DWORD j = 0; j < dwInputSize; j++)
+		{	// lots of step markers
+			DWORD dwRandom = NextRandom(&dwState);
+			pInput[j] = (dwRandom & 0x300) == 0 ? (BYTE)(0x80 + ((dwRandom >> 10) & 1)) : (BYTE)dwRandom;
+		}
+		if (dwInputSize > 1)
+		{	// with a sensible bit shift
+			pInput[1] &= 7;
+		}
+
+		if (!Compare(pInput, dwInputSize, dwOutputSize, nChannels))
+		{
+			printf("random input %u doesn't match\n", i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static double TimeOriginal(BenchSet* pSet, int nPasses, DWORD* pdwTotal)
+{
+	BYTE pOutput[BENCH_SECTOR_SIZE];
+	clock_t start = clock();
+
+	*pdwTotal = 0;
+	for (int nPass = 0; nPass < nPasses; nPass++)
+	{
+		for (DWORD i = 0; i < pSet->dwNumSectors; i++)
+		{
+			BenchSector* pSector = &pSet->sectors[i];
+
+			*pdwTotal += DecompressADPCM(pOutput, sizeof(pOutput), pSector->pCompressed,
+				pSector->dwCompressedSize, pSet->nChannels);
+		}
+	}
+
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static double TimeTables(BenchSet* pSet, int nPasses, DWORD* pdwTotal)
+{
+	BYTE pOutput[BENCH_SECTOR_SIZE];
+	clock_t start = clock();
+
+	*pdwTotal = 0;
+	for (int nPass = 0; nPass < nPasses; nPass++)
+	{
+		for (DWORD i = 0; i < pSet->dwNumSectors; i++)
+		{
+			BenchSector* pSector = &pSet->sectors[i];
+
+			*pdwTotal += MPQADPCM::Decompress(pOutput, sizeof(pOutput), pSector->pCompressed,
+				pSector->dwCompressedSize, pSet->nChannels);
+		}
+	}
+
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char** argv)
+{
+	static BenchSet sets[2];
+	int nPasses = BENCH_DEFAULT_PASSES;
+	bool bOK = true;
+
+	if (argc > 1)
+	{
+		nPasses = atoi(argv[1]);
+		if (nPasses <= 0)
+		{
+			printf("usage: adpcmbench [passes]\n");
+			return 1;
+		}
+	}
+
+	MPQADPCM::Init();
+
+	BuildSet(&sets[0], "mono", 1);
+	BuildSet(&sets[1], "stereo", 2);
+
+	for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++)
+	{
+		if (!VerifySet(&sets[i]))
+		{
+			bOK = false;
+		}
+	}
+
+	if (!bOK || !VerifyRandom())
+	{
+		return 1;
+	}
+	printf("all sectors match\n\n");
+	printf("%-10s %16s %14s %8s\n", "", "DecompressADPCM", "MPQADPCM", "");
+
+	for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++)
+	{
+		DWORD dwOriginalTotal, dwTablesTotal;
+		double fOriginal = TimeOriginal(&sets[i], nPasses, &dwOriginalTotal);
+		double fTables = TimeTables(&sets[i], nPasses, &dwTablesTotal);
+		double fMegabytes = (double)dwOriginalTotal / (1024.0 * 1024.0);
+
+		printf("%-10s %11.1f MB/s %9.1f MB/s %7.2fx\n", sets[i].szName,
+			fOriginal > 0.0 ? fMegabytes / fOriginal : 0.0,
+			fTables > 0.0 ? fMegabytes / fTables : 0.0,
+			fTables > 0.0 ? fOriginal / fTables : 0.0);
+
+		if (dwOriginalTotal != dwTablesTotal)
+		{
+			printf("  decoded sizes don't match!\n");
+			bOK = false;
+		}
+	}
+
+	return bOK ? 0 : 1;
+}
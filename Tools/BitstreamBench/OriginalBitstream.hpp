@@ -0,0 +1,56 @@
+#pragma once
+#include "../../Shared/D2Shared.hpp"
+
+/*
+ *	The original Bitstream, from before it read out of a 64-bit bit buffer.
+ *	Kept as-is (apart from the name) so that bitstreambench has something to check the current one against.
+ *	@author	eezstreet
+ */
+class OriginalBitstream
+{
+public:
+	OriginalBitstream();
+	~OriginalBitstream();
+
+	void LoadStream(BYTE* pNewStream, size_t dwStreamSizeBytes);
+	void SplitFrom(OriginalBitstream* pSplitStream, size_t dwSplitStreamSizeBits);
+
+	void SetCurrentPosition(DWORD dwPosition, DWORD dwBitOffset = 0);
+
+	void ReadByte(BYTE& outByte);
+	void ReadWord(WORD& outWord);
+	void ReadDWord(DWORD& outWord);
+	void ReadBits(BYTE& outBits, int bitCount);
+	void ReadBits(WORD& outBits, int bitCount);
+	void ReadBits(DWORD& outBits, int bitCount);
+	void ReadByte(BYTE* outByte);
+	void ReadWord(WORD* outWord);
+	void ReadDWord(DWORD* outWord);
+	void ReadBits(BYTE* outBits, int bitCount);
+	void ReadBits(WORD* outBits, int bitCount);
+	void ReadBits(DWORD* outBits, int bitCount);
+	void ReadBits(void* outBits, size_t outSize, int bitCount);
+	void ReadData(void* data, size_t outSize);
+
+	// Helper function - convert from unsigned to 2C
+	void ConvertFormat(long* dwOutBits, int bitCount);
+
+	void Rewind();
+
+	size_t GetRemainingReadBits();
+
+	BYTE* GetHeldData(size_t& outSize);
+
+private:
+	int ReadBits(int bitsCount);
+	void FreeInternalStreamSource();
+
+	bool bExternalStorage;
+	BYTE* pStream;
+	size_t dwStreamStartByte;
+	size_t dwStreamStartBit;
+	size_t dwTotalStreamSizeBytes;
+	size_t dwTotalStreamSizeBits;
+	size_t dwCurrentByte;
+	size_t dwReadBit;
+};
\ No newline at end of file
@@ -0,0 +1,367 @@
+#include "OriginalBitstream.hpp"
+#include "../../Engine/Bitstream.hpp"
+#include <stdio.h>
+#include <time.h>
+
+/*
+ *	bitstreambench: compares Bitstream (which reads out of a 64-bit bit buffer) against the original one, which
+ *	read a byte at a time.
+ *	Before anything gets timed, both are run over the same random streams, with the same random mix of reads (of
+ *	every size, signed and unsigned), ReadBitsN, splits, rewinds and repositioning, and every value that comes back
+ *	has to be the same. Reads near the end of a stream are left out, since that's the one place where the two are
+ *	meant to differ.
+ *	The timed reads are the kinds that DCC decoding does.
+ *	@author	eezstreet
+ */
+
+#define BENCH_STREAM_SIZE			(96 * 1024)
+#define BENCH_NUM_WIDTHS			0x10000
+#define BENCH_DEFAULT_PASSES		400
+#define BENCH_DEFAULT_STREAMS		20000
+#define BENCH_MAX_VERIFY_SIZE		2048
+#define BENCH_OPS_PER_STREAM		200
+#define BENCH_MAX_SPLITS			4
+#define BENCH_END_MARGIN			80		// Bits at the end of a stream where the two are allowed to differ
+
+namespace Log
+{	// Both bitstreams assert on bad reads. The bench has no log to send them to, and the results get compared anyway.
+	void Error(const char* szFile, const int nLine, const char* szCondition)
+	{
+	}
+}
+
+static DWORD NextRandom(DWORD* pdwState)
+{	// xorshift32
+	DWORD x = *pdwState;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*pdwState = x;
+	return x;
+}
+
+/*
+ *	Runs both bitstreams over one random stream.
+ *	pqwReads gets the number of reads that were compared added to it.
+ */
+static bool VerifyStream(DWORD dwStream, QWORD* pqwReads)
+{
+	static BYTE pData[BENCH_MAX_VERIFY_SIZE + 64];
+	OriginalBitstream original[BENCH_MAX_SPLITS];
+	Bitstream current[BENCH_MAX_SPLITS];
+	DWORD dwState = (dwStream * 2654435761u) ^ 0x9E3779B9;
+	size_t dwSize;
+	int nNumStreams = 1;
+
+	if (dwState == 0)
+	{	// xorshift never gets anywhere from 0
+		dwState = 1;
+	}
+
+	dwSize = 64 + (NextRandom(&dwState) % (BENCH_MAX_VERIFY_SIZE - 64));
+	for (size_t i = 0; i < dwSize; i++)
+	{
+		pData[i] = (BYTE)NextRandom(&dwState);
+	}
+
+	original[0].LoadStream(pData, dwSize);
+	current[0].LoadStream(pData, dwSize);
+
+	for (int nOp = 0; nOp < BENCH_OPS_PER_STREAM; nOp++)
+	{
+		int s = NextRandom(&dwState) % nNumStreams;
+		DWORD dwOp = NextRandom(&dwState) % 10;
+		size_t dwRemaining = original[s].GetRemainingReadBits();
+
+		if ((dwRemaining < BENCH_END_MARGIN || dwRemaining > dwSize * 8) && dwOp <= 7)
+		{	// too close to the end (or repositioned past it), so go back to the start instead
+			dwOp = 8;
+		}
+
+		if (dwOp < 5)
+		{	// a single read of any size, one in eight of them signed
+			int nBits = NextRandom(&dwState) % 33;
+			DWORD dwExpected = 0, dwActual = 0;
+
+			if ((NextRandom(&dwState) & 7) == 0)
+			{
+				nBits = -(int)(1 + (NextRandom(&dwState) % 31));
+			}
+
+			original[s].ReadBits(&dwExpected, nBits);
+			current[s].ReadBits(&dwActual, nBits);
+			(*pqwReads)++;
+			if (dwExpected != dwActual)
+			{
+				printf("stream %u, step %d: reading %d bits gave %08X instead of %08X\n",
+					dwStream, nOp, nBits, dwActual, dwExpected);
+				return false;
+			}
+		}
+		else if (dwOp == 5)
+		{	// a run of same-sized reads, which ReadBitsN has to do the same as separate reads
+			DWORD dwExpected[8], dwActual[8];
+			int nBits = 1 + (NextRandom(&dwState) % 12);
+			int nCount = 1 + (NextRandom(&dwState) % 8);
+
+			if (dwRemaining < (size_t)((nBits * nCount) + 16))
+			{
+				continue;
+			}
+
+			for (int i = 0; i < nCount; i++)
+			{
+				original[s].ReadBits(&dwExpected[i], nBits);
+			}
+			current[s].ReadBitsN(dwActual, nCount, nBits);
+			*pqwReads += nCount;
+			if (memcmp(dwExpected, dwActual, sizeof(DWORD) * nCount))
+			{
+				printf("stream %u, step %d: ReadBitsN of %d x %d bits doesn't match\n", dwStream, nOp, nCount, nBits);
+				return false;
+			}
+		}
+		else if (dwOp == 6 && s == 0 && nNumStreams < BENCH_MAX_SPLITS && dwRemaining + 16 < dwSize * 8)
+		{	// split a stream off of the first one, the way DCC direction decoding does
+			size_t dwSplitBits = NextRandom(&dwState) % 300;
+
+			original[nNumStreams].SplitFrom(&original[0], dwSplitBits);
+			current[nNumStreams].SplitFrom(&current[0], dwSplitBits);
+			nNumStreams++;
+		}
+		else if (dwOp == 7)
+		{
+			WORD wExpected, wActual;
+
+			original[s].ReadWord(&wExpected);
+			current[s].ReadWord(&wActual);
+			(*pqwReads)++;
+			if (wExpected != wActual)
+			{
+				printf("stream %u, step %d: ReadWord gave %04X instead of %04X\n", dwStream, nOp, wActual, wExpected);
+				return false;
+			}
+		}
+		else if (dwOp == 8)
+		{
+			original[s].Rewind();
+			current[s].Rewind();
+		}
+		else if (s == 0)
+		{	// Split streams share their data, so only the first one gets moved around
+			DWORD dwPosition = NextRandom(&dwState) % (dwSize / 2);
+			DWORD dwBit = dwPosition == 0 ? 0 : NextRandom(&dwState) % 8;
+
+			original[0].SetCurrentPosition(dwPosition, dwBit);
+			current[0].SetCurrentPosition(dwPosition, dwBit);
+		}
+	}
+
+	// Read whatever is left of every stream a bit at a time, right up to the end
+	for (int s = 0; s < nNumStreams; s++)
+	{
+		size_t dwRemaining = original[s].GetRemainingReadBits();
+
+		while (dwRemaining > 0 && dwRemaining <= dwSize * 8)
+		{
+			BYTE nExpected, nActual;
+
+			original[s].ReadBits(&nExpected, 1);
+			current[s].ReadBits(&nActual, 1);
+			(*pqwReads)++;
+			if (nExpected != nActual)
+			{
+				printf("stream %u: split %d doesn't match at the end\n", dwStream, s);
+				return false;
+			}
+			dwRemaining = original[s].GetRemainingReadBits();
+		}
+	}
+
+	return true;
+}
+
+/*
+ *	Field widths in the same sort of mix as a DCC direction: 1 bit flags, 2 bit pixel codes, 4 bit masks and
+ *	codes, and 8 bit raw colors
+ */
+static void BuildWidths(int* pWidths, DWORD* pdwState)
+{
+	static const int nMix[] = { 1, 1, 4, 4, 4, 2, 2, 8, 1, 2 };
+
+	for (DWORD i = 0; i < BENCH_NUM_WIDTHS; i++)
+	{
+		pWidths[i] = nMix[NextRandom(pdwState) % (sizeof(nMix) / sizeof(nMix[0]))];
+	}
+}
+
+static double TimeOriginalMixed(BYTE* pData, int* pWidths, size_t dwNumReads, int nPasses, DWORD* pdwTotal)
+{
+	OriginalBitstream stream;
+	clock_t start = clock();
+
+	*pdwTotal = 0;
+	stream.LoadStream(pData, BENCH_STREAM_SIZE);
+	for (int nPass = 0; nPass < nPasses; nPass++)
+	{
+		stream.Rewind();
+		for (size_t i = 0; i < dwNumReads; i++)
+		{
+			DWORD dwValue;
+
+			stream.ReadBits(&dwValue, pWidths[i % BENCH_NUM_WIDTHS]);
+			*pdwTotal += dwValue;
+		}
+	}
+
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static double TimeCurrentMixed(BYTE* pData, int* pWidths, size_t dwNumReads, int nPasses, DWORD* pdwTotal)
+{
+	Bitstream stream;
+	clock_t start = clock();
+
+	*pdwTotal = 0;
+	stream.LoadStream(pData, BENCH_STREAM_SIZE);
+	for (int nPass = 0; nPass < nPasses; nPass++)
+	{
+		stream.Rewind();
+		for (size_t i = 0; i < dwNumReads; i++)
+		{
+			DWORD dwValue;
+
+			stream.ReadBits(&dwValue, pWidths[i % BENCH_NUM_WIDTHS]);
+			*pdwTotal += dwValue;
+		}
+	}
+
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+/*
+ *	Rows of four 2 bit pixel codes, which the original could only read one at a time
+ */
+static double TimeOriginalRows(BYTE* pData, size_t dwNumRows, int nPasses, DWORD* pdwTotal)
+{
+	OriginalBitstream stream;
+	clock_t start = clock();
+
+	*pdwTotal = 0;
+	stream.LoadStream(pData, BENCH_STREAM_SIZE);
+	for (int nPass = 0; nPass < nPasses; nPass++)
+	{
+		stream.Rewind();
+		for (size_t i = 0; i < dwNumRows; i++)
+		{
+			for (int j = 0; j < 4; j++)
+			{
+				DWORD dwCode;
+
+				stream.ReadBits(&dwCode, 2);
+				*pdwTotal += dwCode;
+			}
+		}
+	}
+
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static double TimeCurrentRows(BYTE* pData, size_t dwNumRows, int nPasses, DWORD* pdwTotal)
+{
+	Bitstream stream;
+	clock_t start = clock();
+
+	*pdwTotal = 0;
+	stream.LoadStream(pData, BENCH_STREAM_SIZE);
+	for (int nPass = 0; nPass < nPasses; nPass++)
+	{
+		stream.Rewind();
+		for (size_t i = 0; i < dwNumRows; i++)
+		{
+			DWORD dwCodes[4];
+
+			stream.ReadBitsN(dwCodes, 4, 2);
+			*pdwTotal += dwCodes[0] + dwCodes[1] + dwCodes[2] + dwCodes[3];
+		}
+	}
+
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void PrintResult(const char* szName, double fOriginal, double fCurrent, double fMillions, bool bSame)
+{
+	printf("%-16s %10.1f Mreads/s %10.1f Mreads/s %7.2fx\n", szName,
+		fOriginal > 0.0 ? fMillions / fOriginal : 0.0,
+		fCurrent > 0.0 ? fMillions / fCurrent : 0.0,
+		fCurrent > 0.0 ? fOriginal / fCurrent : 0.0);
+
+	if (!bSame)
+	{
+		printf("  results don't match!\n");
+	}
+}
+
+int main(int argc, char** argv)
+{
+	static BYTE pData[BENCH_STREAM_SIZE];
+	static int nWidths[BENCH_NUM_WIDTHS];
+	int nPasses = BENCH_DEFAULT_PASSES;
+	DWORD dwNumStreams = BENCH_DEFAULT_STREAMS;
+	DWORD dwState = 12345;
+	QWORD qwReads = 0;
+	size_t dwNumReads, dwNumRows;
+	DWORD dwOriginalTotal, dwCurrentTotal;
+	double fOriginal, fCurrent;
+	bool bOK = true;
+
+	if (argc > 1)
+	{
+		nPasses = atoi(argv[1]);
+	}
+	if (argc > 2)
+	{
+		dwNumStreams = strtoul(argv[2], nullptr, 0);
+	}
+	if (nPasses <= 0 || dwNumStreams == 0)
+	{
+		printf("usage: bitstreambench [passes] [random streams to check]\n");
+		return 1;
+	}
+
+	for (DWORD i = 0; i < dwNumStreams; i++)
+	{
+		if (!VerifyStream(i, &qwReads))
+		{
+			return 1;
+		}
+	}
+	printf("all %llu reads over %u random streams match\n\n", (unsigned long long)qwReads, dwNumStreams);
+
+	for (size_t i = 0; i < BENCH_STREAM_SIZE; i++)
+	{
+		pData[i] = (BYTE)NextRandom(&dwState);
+	}
+	BuildWidths(nWidths, &dwState);
+
+	// None of the widths are more than 8 bits, so this never runs off of the end
+	dwNumReads = ((BENCH_STREAM_SIZE * 8) - 64) / 8;
+	dwNumRows = dwNumReads;
+
+	printf("%-16s %19s %19s %8s\n", "", "OriginalBitstream", "Bitstream", "");
+
+	fOriginal = TimeOriginalMixed(pData, nWidths, dwNumReads, nPasses, &dwOriginalTotal);
+	fCurrent = TimeCurrentMixed(pData, nWidths, dwNumReads, nPasses, &dwCurrentTotal);
+	PrintResult("mixed reads", fOriginal, fCurrent, (double)dwNumReads * nPasses / 1000000.0,
+		dwOriginalTotal == dwCurrentTotal);
+	bOK = bOK && dwOriginalTotal == dwCurrentTotal;
+
+	// ReadBitsN reads a whole row at once, but rows get counted as four reads for both
+	fOriginal = TimeOriginalRows(pData, dwNumRows, nPasses, &dwOriginalTotal);
+	fCurrent = TimeCurrentRows(pData, dwNumRows, nPasses, &dwCurrentTotal);
+	PrintResult("2 bit rows of 4", fOriginal, fCurrent, (double)dwNumRows * 4 * nPasses / 1000000.0,
+		dwOriginalTotal == dwCurrentTotal);
+	bOK = bOK && dwOriginalTotal == dwCurrentTotal;
+
+	return bOK ? 0 : 1;
+}
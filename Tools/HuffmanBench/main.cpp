@@ -0,0 +1,262 @@
+#include "../../Engine/MPQ_Huffman.hpp"
+#include "../../Libraries/adpcm/adpcm.h"
+#include "../../Libraries/huffman/huff.h"
+#include <stdio.h>
+#include <time.h>
+
+/*
+ *	huffbench: compares the table driven Huffman decoder (MPQHuffman) against THuffmannTree.
+ *	Sectors get built the same way that WAV files in the archives are: ADPCM first, then Huffman on top of that.
+ *	Every sector is checked to make sure both decoders give back exactly the same thing before anything gets timed.
+ *	@author	eezstreet
+ */
+
+#define BENCH_SECTOR_SIZE		0x1000
+#define BENCH_NUM_SECTORS		64
+#define BENCH_ADPCM_LEVEL		4			// Same as mpqwriter
+#define BENCH_DEFAULT_PASSES	200
+
+/*
+ *	One compressed sector
+ */
+struct BenchSector
+{
+	BYTE	pCompressed[BENCH_SECTOR_SIZE * 2];
+	DWORD	dwCompressedSize;
+	DWORD	dwDecompressedSize;
+};
+
+/*
+ *	A set of sectors that all get compressed the same way
+ */
+struct BenchSet
+{
+	const char*	szName;
+	BenchSector	sectors[BENCH_NUM_SECTORS];
+};
+
+static DWORD NextRandom(DWORD* pdwState)
+{	// xorshift32
+	DWORD x = *pdwState;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*pdwState = x;
+	return x;
+}
+
+/*
+ *	A couple of detuned tones with some noise on top, roughly what a sound effect looks like
+ */
+static void GenerateAudio(BYTE* pData, DWORD dwSize, DWORD dwSector, int nChannels)
+{
+	short* pSamples = (short*)pData;
+	DWORD dwNumSamples = dwSize / sizeof(short);
+	DWORD dwState = 0x9E3779B9 ^ (dwSector * 40503u);
+
+	for (DWORD i = 0; i < dwNumSamples; i++)
+	{
+		DWORD t = (dwSector * dwNumSamples + i) / nChannels;
+		float fValue = sinf(t * 0.031f) * 9000.0f + sinf(t * 0.0077f + (i % nChannels)) * 6000.0f;
+
+		fValue += (float)((int)(NextRandom(&dwState) & 0x3FF) - 0x200);
+		pSamples[i] = (short)fValue;
+	}
+}
+
+/*
+ *	Plain text, which has bytes that the ADPCM trees don't start out with
+ */
+static void GenerateText(BYTE* pData, DWORD dwSize, DWORD dwSector)
+{
+	static const char* szWords[] = {
+		"the ", "horadric ", "cube ", "transmutes ", "items ", "into ", "something ", "better. ",
+		"Stay ", "a ", "while ", "and ", "listen! ", "\r\n"
+	};
+	DWORD dwState = 0x12345678 ^ (dwSector * 2654435761u);
+	DWORD dwPos = 0;
+
+	while (dwPos < dwSize)
+	{
+		const char* szWord = szWords[NextRandom(&dwState) % (sizeof(szWords) / sizeof(szWords[0]))];
+
+		while (*szWord && dwPos < dwSize)
+		{
+			pData[dwPos++] = *szWord++;
+		}
+	}
+}
+
+/*
+ *	Builds a set of sectors.
+ *	nChannels is 0 for text, otherwise the sectors are ADPCM compressed with that many channels first.
+ *	nType is the Huffman compression type.
+ */
+static void BuildSet(BenchSet* pSet, const char* szName, int nChannels, int nType)
+{
+	BYTE pRaw[BENCH_SECTOR_SIZE];
+	BYTE pADPCM[BENCH_SECTOR_SIZE * 2];
+
+	pSet->szName = szName;
+
+	for (DWORD i = 0; i < BENCH_NUM_SECTORS; i++)
+	{
+		BenchSector* pSector = &pSet->sectors[i];
+		THuffmannTree ht(true);
+		TOutputStream os(pSector->pCompressed, sizeof(pSector->pCompressed));
+		BYTE* pInput = pRaw;
+		DWORD dwInputSize = BENCH_SECTOR_SIZE;
+
+		if (nChannels == 0)
+		{
+			GenerateText(pRaw, BENCH_SECTOR_SIZE, i);
+		}
+		else
+		{
+			GenerateAudio(pRaw, BENCH_SECTOR_SIZE, i, nChannels);
+			dwInputSize = CompressADPCM(pADPCM, sizeof(pADPCM), pRaw, BENCH_SECTOR_SIZE, nChannels, BENCH_ADPCM_LEVEL);
+			pInput = pADPCM;
+		}
+
+		pSector->dwDecompressedSize = dwInputSize;
+		pSector->dwCompressedSize = ht.Compress(&os, pInput, dwInputSize, nType);
+	}
+}
+
+/*
+ *	Makes sure that both decoders agree on every sector
+ */
+static bool VerifySet(BenchSet* pSet)
+{
+	BYTE pExpected[BENCH_SECTOR_SIZE * 2];
+	BYTE pActual[BENCH_SECTOR_SIZE * 2];
+
+	for (DWORD i = 0; i < BENCH_NUM_SECTORS; i++)
+	{
+		BenchSector* pSector = &pSet->sectors[i];
+
+		// Try it with room to spare and with a short buffer, since they stop in different places
+		for (int nPass = 0; nPass < 2; nPass++)
+		{
+			DWORD dwOutSize = nPass == 0 ? sizeof(pExpected) : pSector->dwDecompressedSize / 2;
+			THuffmannTree ht(false);
+			TInputStream is(pSector->pCompressed, pSector->dwCompressedSize);
+			DWORD dwExpected, dwActual;
+
+			memset(pExpected, 0xCD, sizeof(pExpected));
+			memset(pActual, 0xCD, sizeof(pActual));
+			dwExpected = ht.Decompress(pExpected, dwOutSize, &is);
+			dwActual = MPQHuffman::Decompress(pActual, dwOutSize, pSector->pCompressed, pSector->dwCompressedSize);
+
+			if (dwExpected != dwActual || memcmp(pExpected, pActual, sizeof(pExpected)))
+			{
+				printf("%s: sector %u doesn't match (%u bytes vs %u bytes)\n", pSet->szName, i, dwExpected, dwActual);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static double TimeOriginal(BenchSet* pSet, int nPasses, DWORD* pdwTotal)
+{
+	BYTE pOutput[BENCH_SECTOR_SIZE * 2];
+	clock_t start = clock();
+
+	*pdwTotal = 0;
+	for (int nPass = 0; nPass < nPasses; nPass++)
+	{
+		for (DWORD i = 0; i < BENCH_NUM_SECTORS; i++)
+		{
+			BenchSector* pSector = &pSet->sectors[i];
+			THuffmannTree ht(false);
+			TInputStream is(pSector->pCompressed, pSector->dwCompressedSize);
+
+			*pdwTotal += ht.Decompress(pOutput, sizeof(pOutput), &is);
+		}
+	}
+
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static double TimeTables(BenchSet* pSet, int nPasses, DWORD* pdwTotal)
+{
+	BYTE pOutput[BENCH_SECTOR_SIZE * 2];
+	clock_t start = clock();
+
+	*pdwTotal = 0;
+	for (int nPass = 0; nPass < nPasses; nPass++)
+	{
+		for (DWORD i = 0; i < BENCH_NUM_SECTORS; i++)
+		{
+			BenchSector* pSector = &pSet->sectors[i];
+
+			*pdwTotal += MPQHuffman::Decompress(pOutput, sizeof(pOutput),
+				pSector->pCompressed, pSector->dwCompressedSize);
+		}
+	}
+
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char** argv)
+{
+	static BenchSet sets[5];
+	int nPasses = BENCH_DEFAULT_PASSES;
+	bool bOK = true;
+
+	if (argc > 1)
+	{
+		nPasses = atoi(argv[1]);
+		if (nPasses <= 0)
+		{
+			printf("usage: huffbench [passes]\n");
+			return 1;
+		}
+	}
+
+	MPQHuffman::Init();
+
+	BuildSet(&sets[0], "adpcm mono, type 6", 1, BENCH_ADPCM_LEVEL + 2);
+	BuildSet(&sets[1], "adpcm stereo, type 6", 2, BENCH_ADPCM_LEVEL + 2);
+	BuildSet(&sets[2], "adpcm mono, type 8", 1, 8);
+	BuildSet(&sets[3], "text, type 6", 0, BENCH_ADPCM_LEVEL + 2);
+	BuildSet(&sets[4], "text, type 0", 0, 0);
+
+	for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++)
+	{
+		if (!VerifySet(&sets[i]))
+		{
+			bOK = false;
+		}
+	}
+
+	if (!bOK)
+	{
+		return 1;
+	}
+	printf("all sectors match\n\n");
+	printf("%-24s %14s %14s %8s\n", "", "THuffmannTree", "MPQHuffman", "");
+
+	for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++)
+	{
+		DWORD dwOriginalTotal, dwTablesTotal;
+		double fOriginal = TimeOriginal(&sets[i], nPasses, &dwOriginalTotal);
+		double fTables = TimeTables(&sets[i], nPasses, &dwTablesTotal);
+		double fMegabytes = (double)dwOriginalTotal / (1024.0 * 1024.0);
+
+		printf("%-24s %9.1f MB/s %9.1f MB/s %7.2fx\n", sets[i].szName,
+			fOriginal > 0.0 ? fMegabytes / fOriginal : 0.0,
+			fTables > 0.0 ? fMegabytes / fTables : 0.0,
+			fTables > 0.0 ? fOriginal / fTables : 0.0);
+
+		if (dwOriginalTotal != dwTablesTotal)
+		{
+			printf("  decoded sizes don't match!\n");
+			bOK = false;
+		}
+	}
+
+	return bOK ? 0 : 1;
+}
@@ -0,0 +1,484 @@
+#include "MPQReader.hpp"
+#include "../../Engine/MPQ_ADPCM.hpp"
+#include "../../Engine/MPQ_Huffman.hpp"
+#include "../../Engine/MPQ_PKWare.hpp"
+
+#define MPQ_READER_ID			0x1A51504D	// "MPQ\x1A"
+#define MPQ_HASH_ENTRY_EMPTY	0xFFFFFFFF
+#define MPQ_HASH_ENTRY_DELETED	0xFFFFFFFE
+
+namespace MPQReader
+{
+	/*
+	 *	Prints out why something went wrong.
+	 */
+	static bool Error(const char* szFormat, const char* szFileName)
+	{
+		fprintf(stderr, "MPQReader: ");
+		fprintf(stderr, szFormat, szFileName);
+		fprintf(stderr, "\n");
+		return false;
+	}
+
+	/*
+	 *	Reads a range of bytes from the archive
+	 */
+	static bool ReadArchiveData(D2MPQReader* pReader, DWORD dwOffset, void* pBuffer, DWORD dwLength)
+	{
+		if (dwOffset > pReader->dwArchiveSize || dwLength > pReader->dwArchiveSize - dwOffset)
+		{
+			return false;
+		}
+
+		if (dwLength == 0)
+		{
+			return true;
+		}
+
+		return fseek(pReader->pFile, dwOffset, SEEK_SET) == 0 && fread(pBuffer, dwLength, 1, pReader->pFile) == 1;
+	}
+
+	/*
+	 *	Opens an archive for reading, and reads its hash and block tables.
+	 *	Only archives with the header right at the start (like all of the Diablo II ones) are supported.
+	 *	@author	eezstreet
+	 */
+	bool Open(const char* szPath, D2MPQReader* pReader)
+	{
+		MPQHeader header;
+		long lSize;
+
+		memset(pReader, 0, sizeof(D2MPQReader));
+
+		pReader->pFile = fopen(szPath, "rb");
+		if (pReader->pFile == nullptr)
+		{
+			return Error("couldn't open %s", szPath);
+		}
+
+		fseek(pReader->pFile, 0, SEEK_END);
+		lSize = ftell(pReader->pFile);
+		pReader->dwArchiveSize = lSize > 0 ? (DWORD)lSize : 0;
+
+		if (!ReadArchiveData(pReader, 0, &header, sizeof(header)) || header.dwID != MPQ_READER_ID ||
+			header.dwHeaderSize != sizeof(header) || header.wFormatVersion != 0)
+		{
+			Close(pReader);
+			return Error("%s isn't a Diablo II MPQ", szPath);
+		}
+
+		if (header.dwHashTableSize == 0 || (header.dwHashTableSize & (header.dwHashTableSize - 1)) != 0 ||
+			header.dwHashTableSize > pReader->dwArchiveSize / sizeof(MPQHash) ||
+			header.dwBlockTableSize > pReader->dwArchiveSize / sizeof(MPQBlock))
+		{
+			Close(pReader);
+			return Error("%s has a damaged header", szPath);
+		}
+
+		MPQWriter::InitCryptTable();
+		MPQADPCM::Init();
+		MPQHuffman::Init();
+		MPQPKWare::Init();
+
+		pReader->dwSectorSize = 0x200 << header.wSectorSize;
+		pReader->dwNumHashEntries = header.dwHashTableSize;
+		pReader->dwNumBlockEntries = header.dwBlockTableSize;
+		pReader->pHashTable = (MPQHash*)malloc(sizeof(MPQHash) * pReader->dwNumHashEntries);
+		pReader->pBlockTable = (MPQBlock*)malloc(sizeof(MPQBlock) * (pReader->dwNumBlockEntries + 1));
+		pReader->pszHashNames = (char**)calloc(pReader->dwNumHashEntries, sizeof(char*));
+		if (pReader->pHashTable == nullptr || pReader->pBlockTable == nullptr || pReader->pszHashNames == nullptr)
+		{
+			Close(pReader);
+			return Error("%s: out of memory", szPath);
+		}
+
+		if (!ReadArchiveData(pReader, header.dwHashTablePos, pReader->pHashTable, sizeof(MPQHash) * pReader->dwNumHashEntries) ||
+			!ReadArchiveData(pReader, header.dwBlockTablePos, pReader->pBlockTable, sizeof(MPQBlock) * pReader->dwNumBlockEntries))
+		{
+			Close(pReader);
+			return Error("couldn't read the hash and block tables of %s", szPath);
+		}
+
+		MPQWriter::DecryptMPQBlock(pReader->pHashTable, sizeof(MPQHash) * pReader->dwNumHashEntries, MPQ_KEY_HASH_TABLE);
+		MPQWriter::DecryptMPQBlock(pReader->pBlockTable, sizeof(MPQBlock) * pReader->dwNumBlockEntries, MPQ_KEY_BLOCK_TABLE);
+		return true;
+	}
+
+	/*
+	 *	Closes an archive
+	 *	@author	eezstreet
+	 */
+	void Close(D2MPQReader* pReader)
+	{
+		if (pReader->pszHashNames != nullptr)
+		{
+			for (DWORD i = 0; i < pReader->dwNumHashEntries; i++)
+			{
+				free(pReader->pszHashNames[i]);
+			}
+		}
+
+		if (pReader->pFile != nullptr)
+		{
+			fclose(pReader->pFile);
+		}
+
+		free(pReader->pszHashNames);
+		free(pReader->pHashTable);
+		free(pReader->pBlockTable);
+		memset(pReader, 0, sizeof(D2MPQReader));
+	}
+
+	/*
+	 *	Turns a file name into the form that the archive hashes (backslashes only)
+	 */
+	static bool GetArchivedName(const char* szFileName, size_t dwLength, MPQName szName)
+	{
+		if (dwLength == 0 || dwLength >= MAX_D2PATH)
+		{
+			return false;
+		}
+
+		for (size_t i = 0; i < dwLength; i++)
+		{
+			szName[i] = szFileName[i] == '/' ? '\\' : szFileName[i];
+		}
+		szName[dwLength] = '\0';
+		return true;
+	}
+
+	/*
+	 *	Walks the collision chain of a name, calling back for every hash table entry that holds it
+	 *	@return	The number of entries that hold the name
+	 */
+	static DWORD WalkHashChain(D2MPQReader* pReader, const char* szName, bool (*pCallback)(D2MPQReader*, DWORD, const char*, DWORD*),
+		DWORD* pdwResult)
+	{
+		DWORD dwMask = pReader->dwNumHashEntries - 1;
+		DWORD dwStartIndex = MPQWriter::HashString(szName, MPQ_HASH_TABLE_INDEX) & dwMask;
+		DWORD dwName1 = MPQWriter::HashString(szName, MPQ_HASH_NAME_A);
+		DWORD dwName2 = MPQWriter::HashString(szName, MPQ_HASH_NAME_B);
+		DWORD dwIndex = dwStartIndex;
+		DWORD dwFound = 0;
+
+		do
+		{
+			MPQHash* pHash = &pReader->pHashTable[dwIndex];
+
+			if (pHash->dwBlockEntry == MPQ_HASH_ENTRY_EMPTY)
+			{
+				break;
+			}
+
+			if (pHash->dwBlockEntry != MPQ_HASH_ENTRY_DELETED && pHash->dwMethodA == dwName1 && pHash->dwMethodB == dwName2)
+			{
+				dwFound++;
+				if (!pCallback(pReader, dwIndex, szName, pdwResult))
+				{
+					break;
+				}
+			}
+
+			dwIndex = (dwIndex + 1) & dwMask;
+		} while (dwIndex != dwStartIndex);
+
+		return dwFound;
+	}
+
+	static bool StopAtFirst(D2MPQReader* pReader, DWORD dwIndex, const char* szName, DWORD* pdwResult)
+	{
+		*pdwResult = dwIndex;
+		return false;
+	}
+
+	static bool NameEntry(D2MPQReader* pReader, DWORD dwIndex, const char* szName, DWORD* pdwResult)
+	{
+		if (pReader->pszHashNames[dwIndex] == nullptr)
+		{
+			pReader->pszHashNames[dwIndex] = (char*)malloc(strlen(szName) + 1);
+			if (pReader->pszHashNames[dwIndex] != nullptr)
+			{
+				strcpy(pReader->pszHashNames[dwIndex], szName);
+				(*pdwResult)++;
+			}
+		}
+		return true;
+	}
+
+	/*
+	 *	Finds the hash table entry of a file, the same way that MPQ::FetchHandle does
+	 *	@return	The index of the hash table entry, or 0xFFFFFFFF if the file isn't in the archive
+	 */
+	DWORD FindHashEntry(D2MPQReader* pReader, const char* szFileName)
+	{
+		MPQName szName;
+		DWORD dwIndex = MPQ_HASH_ENTRY_EMPTY;
+
+		if (!GetArchivedName(szFileName, strlen(szFileName), szName))
+		{
+			return MPQ_HASH_ENTRY_EMPTY;
+		}
+
+		WalkHashChain(pReader, szName, StopAtFirst, &dwIndex);
+		if (dwIndex != MPQ_HASH_ENTRY_EMPTY && pReader->pszHashNames[dwIndex] == nullptr)
+		{	// might as well remember it
+			DWORD dwNamed = 0;
+
+			NameEntry(pReader, dwIndex, szName, &dwNamed);
+		}
+		return dwIndex;
+	}
+
+	/*
+	 *	Learns the names of files from a list of them, one per line (the same as a (listfile)).
+	 *	Names that aren't in the archive are ignored.
+	 *	@return	The number of hash table entries that got a name
+	 */
+	DWORD AddListfile(D2MPQReader* pReader, const char* pListfile, DWORD dwListfileSize)
+	{
+		DWORD dwNamed = 0;
+		DWORD dwStart = 0;
+
+		while (dwStart < dwListfileSize)
+		{
+			DWORD dwEnd = dwStart;
+			MPQName szName;
+
+			while (dwEnd < dwListfileSize && pListfile[dwEnd] != '\r' && pListfile[dwEnd] != '\n' && pListfile[dwEnd] != ';')
+			{
+				dwEnd++;
+			}
+
+			if (GetArchivedName(pListfile + dwStart, dwEnd - dwStart, szName))
+			{
+				WalkHashChain(pReader, szName, NameEntry, &dwNamed);
+			}
+			dwStart = dwEnd + 1;
+		}
+
+		return dwNamed;
+	}
+
+	/*
+	 *	Runs data through every compression method named in nMethod, in the same order that the engine does
+	 *	@return	The number of bytes written to pOutput
+	 */
+	static DWORD DecompressUnit(BYTE nMethod, const BYTE* pInput, DWORD dwInputSize, BYTE* pOutput, DWORD dwOutputSize,
+		BYTE* pScratch)
+	{
+		static const BYTE nOrder[] = {
+			MPQ_COMPRESSION_PKWARE, MPQ_COMPRESSION_HUFFMANN, MPQ_COMPRESSION_ADPCM_MONO, MPQ_COMPRESSION_ADPCM_STEREO
+		};
+		DWORD dwWritten = 0;
+		bool bPiped = false;
+
+		for (size_t i = 0; i < sizeof(nOrder); i++)
+		{
+			if (!(nMethod & nOrder[i]))
+			{
+				continue;
+			}
+
+			if (bPiped)
+			{
+				memcpy(pScratch, pOutput, dwWritten);
+				pInput = pScratch;
+				dwInputSize = dwWritten;
+			}
+
+			switch (nOrder[i])
+			{
+				case MPQ_COMPRESSION_PKWARE:
+					dwWritten = MPQPKWare::Explode(pOutput, dwOutputSize, pInput, dwInputSize);
+					break;
+				case MPQ_COMPRESSION_HUFFMANN:
+					dwWritten = MPQHuffman::Decompress(pOutput, dwOutputSize, pInput, dwInputSize);
+					break;
+				case MPQ_COMPRESSION_ADPCM_MONO:
+					dwWritten = MPQADPCM::Decompress(pOutput, dwOutputSize, pInput, dwInputSize, 1);
+					break;
+				case MPQ_COMPRESSION_ADPCM_STEREO:
+					dwWritten = MPQADPCM::Decompress(pOutput, dwOutputSize, pInput, dwInputSize, 2);
+					break;
+			}
+			bPiped = true;
+		}
+
+		return dwWritten;
+	}
+
+	/*
+	 *	Decompresses a unit (a whole file, or one sector) that's been read into pUnit
+	 *	@return	false if it didn't decompress to exactly dwExpectedSize bytes
+	 */
+	static bool ReadUnit(MPQBlock* pBlock, BYTE* pUnit, DWORD dwUnitSize, BYTE* pOutput, DWORD dwExpectedSize, BYTE* pScratch)
+	{
+		BYTE nMethod = MPQ_COMPRESSION_PKWARE;
+
+		if (dwUnitSize >= dwExpectedSize || !(pBlock->dwFlags & (MPQ_FILE_IMPLODE | MPQ_FILE_COMPRESS)))
+		{	// wasn't worth compressing
+			if (dwUnitSize < dwExpectedSize)
+			{
+				return false;
+			}
+			memcpy(pOutput, pUnit, dwExpectedSize);
+			return true;
+		}
+
+		if (pBlock->dwFlags & MPQ_FILE_COMPRESS)
+		{
+			if (dwUnitSize == 0)
+			{
+				return false;
+			}
+			nMethod = *pUnit++;
+			dwUnitSize--;
+		}
+
+		return DecompressUnit(nMethod, pUnit, dwUnitSize, pOutput, dwExpectedSize, pScratch) == dwExpectedSize;
+	}
+
+	/*
+	 *	Reads a whole file out of the archive.
+	 *	Encrypted files need a name for the hash table entry (see AddListfile and FindHashEntry).
+	 *	@return	The file contents (free them when done), or nullptr if the file couldn't be read
+	 *	@author	eezstreet
+	 */
+	BYTE* ReadFile(D2MPQReader* pReader, DWORD dwHashIndex, DWORD* pdwSize)
+	{
+		MPQHash* pHash;
+		MPQBlock* pBlock;
+		const char* szName;
+		BYTE* pOutput = nullptr;
+		BYTE* pRaw = nullptr;
+		BYTE* pScratch = nullptr;
+		DWORD* pSectorTable = nullptr;
+		DWORD dwEncryptionKey = 0;
+		DWORD dwBlockIndex;
+		bool bEncrypted;
+		bool bOK = true;
+
+		if (dwHashIndex >= pReader->dwNumHashEntries)
+		{
+			return nullptr;
+		}
+
+		pHash = &pReader->pHashTable[dwHashIndex];
+		dwBlockIndex = pHash->dwBlockEntry & 0x0FFFFFFF;
+		if (pHash->dwBlockEntry >= MPQ_HASH_ENTRY_DELETED || dwBlockIndex >= pReader->dwNumBlockEntries)
+		{
+			return nullptr;
+		}
+
+		pBlock = &pReader->pBlockTable[dwBlockIndex];
+		szName = pReader->pszHashNames[dwHashIndex];
+		bEncrypted = (pBlock->dwFlags & MPQ_FILE_ENCRYPTED) != 0;
+		if (!(pBlock->dwFlags & MPQ_FILE_EXISTS) || (pBlock->dwFlags & MPQ_FILE_DELETE_MARKER))
+		{
+			return nullptr;
+		}
+
+		if (bEncrypted)
+		{
+			if (szName == nullptr)
+			{
+				Error("%s", "can't decrypt a file without knowing its name");
+				return nullptr;
+			}
+			dwEncryptionKey = MPQWriter::GetFileKey(szName, pBlock->dwFilePos, pBlock->dwFSize, pBlock->dwFlags);
+		}
+
+		// Room for an extra DWORD, so that encrypted data can always be decrypted in place
+		pOutput = (BYTE*)malloc(pBlock->dwFSize + sizeof(DWORD));
+		pScratch = (BYTE*)malloc(D2Lib::max(pBlock->dwFSize, pReader->dwSectorSize) + sizeof(DWORD));
+		if (pOutput == nullptr || pScratch == nullptr)
+		{
+			free(pOutput);
+			free(pScratch);
+			Error("%s", "out of memory");
+			return nullptr;
+		}
+
+		if (pBlock->dwFSize == 0)
+		{	// nothing to read
+		}
+		else if ((pBlock->dwFlags & MPQ_FILE_SINGLE_UNIT) || !(pBlock->dwFlags & (MPQ_FILE_IMPLODE | MPQ_FILE_COMPRESS)))
+		{	// One big unit, or sectors that aren't compressed (which can be read as one)
+			pRaw = (BYTE*)malloc(pBlock->dwCSize + sizeof(DWORD));
+			bOK = pRaw != nullptr && ReadArchiveData(pReader, pBlock->dwFilePos, pRaw, pBlock->dwCSize);
+
+			if (bOK && bEncrypted && (pBlock->dwFlags & MPQ_FILE_SINGLE_UNIT))
+			{
+				MPQWriter::DecryptMPQBlock(pRaw, pBlock->dwCSize, dwEncryptionKey);
+			}
+			else if (bOK && bEncrypted)
+			{
+				for (DWORD i = 0; i * pReader->dwSectorSize < pBlock->dwCSize; i++)
+				{
+					DWORD dwStart = i * pReader->dwSectorSize;
+
+					MPQWriter::DecryptMPQBlock(pRaw + dwStart, D2Lib::min(pReader->dwSectorSize, pBlock->dwCSize - dwStart),
+						dwEncryptionKey + i);
+				}
+			}
+
+			if (bOK && (pBlock->dwFlags & MPQ_FILE_SINGLE_UNIT))
+			{
+				bOK = ReadUnit(pBlock, pRaw, pBlock->dwCSize, pOutput, pBlock->dwFSize, pScratch);
+			}
+			else if (bOK)
+			{
+				bOK = pBlock->dwCSize >= pBlock->dwFSize;
+				if (bOK)
+				{
+					memcpy(pOutput, pRaw, pBlock->dwFSize);
+				}
+			}
+		}
+		else
+		{	// Compressed sectors
+			DWORD dwNumSectors = ((pBlock->dwFSize - 1) / pReader->dwSectorSize) + 1;
+			DWORD dwTableSize = (dwNumSectors + 1) * sizeof(DWORD);
+
+			pSectorTable = (DWORD*)malloc(dwTableSize);
+			pRaw = (BYTE*)malloc(pReader->dwSectorSize + sizeof(DWORD));
+			bOK = pSectorTable != nullptr && pRaw != nullptr && dwTableSize <= pBlock->dwCSize &&
+				ReadArchiveData(pReader, pBlock->dwFilePos, pSectorTable, dwTableSize);
+
+			if (bOK && bEncrypted)
+			{
+				MPQWriter::DecryptMPQBlock(pSectorTable, dwTableSize, dwEncryptionKey - 1);
+			}
+
+			for (DWORD i = 0; bOK && i < dwNumSectors; i++)
+			{
+				DWORD dwSectorSize = pSectorTable[i + 1] - pSectorTable[i];
+				DWORD dwExpectedSize = D2Lib::min(pReader->dwSectorSize, pBlock->dwFSize - (i * pReader->dwSectorSize));
+
+				bOK = pSectorTable[i + 1] >= pSectorTable[i] && pSectorTable[i + 1] <= pBlock->dwCSize &&
+					dwSectorSize <= pReader->dwSectorSize &&
+					ReadArchiveData(pReader, pBlock->dwFilePos + pSectorTable[i], pRaw, dwSectorSize);
+
+				if (bOK && bEncrypted)
+				{
+					MPQWriter::DecryptMPQBlock(pRaw, dwSectorSize, dwEncryptionKey + i);
+				}
+
+				bOK = bOK && ReadUnit(pBlock, pRaw, dwSectorSize, pOutput + (i * pReader->dwSectorSize), dwExpectedSize, pScratch);
+			}
+		}
+
+		free(pSectorTable);
+		free(pRaw);
+		free(pScratch);
+
+		if (!bOK)
+		{
+			free(pOutput);
+			return nullptr;
+		}
+
+		*pdwSize = pBlock->dwFSize;
+		return pOutput;
+	}
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "MPQWriter.hpp"
+
+/*
+ *	MPQ ARCHIVE READER
+ *	A simple, single threaded reader for the tools, so that they don't need the engine's filesystem to look inside of
+ *	an archive. Files get decompressed with the same decoders that the engine uses.
+ *	Encrypted files can only be read once their name is known, which is what the (listfile) is for.
+ *	@author	eezstreet
+ */
+
+/*
+ *	@author	eezstreet
+ */
+struct D2MPQReader
+{
+	FILE*		pFile;
+	DWORD		dwArchiveSize;
+	DWORD		dwSectorSize;
+	DWORD		dwNumHashEntries;
+	DWORD		dwNumBlockEntries;
+	MPQHash*	pHashTable;
+	MPQBlock*	pBlockTable;
+	char**		pszHashNames;			// Name of each hash table entry, if it's known (nullptr otherwise)
+};
+
+// MPQReader.cpp
+namespace MPQReader
+{
+	bool Open(const char* szPath, D2MPQReader* pReader);
+	void Close(D2MPQReader* pReader);
+	DWORD FindHashEntry(D2MPQReader* pReader, const char* szFileName);
+	DWORD AddListfile(D2MPQReader* pReader, const char* pListfile, DWORD dwListfileSize);
+	BYTE* ReadFile(D2MPQReader* pReader, DWORD dwHashIndex, DWORD* pdwSize);
+}
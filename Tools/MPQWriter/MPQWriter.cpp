@@ -0,0 +1,952 @@
+#include "MPQWriter.hpp"
+#include "../../Libraries/adpcm/adpcm.h"
+#include "../../Libraries/huffman/huff.h"
+#include "../../Libraries/pkware/pklib.h"
+
+#define MPQ_WRITER_ADPCM_LEVEL		4		// Same as the "high quality" setting in most MPQ editors
+#define MPQ_WRITER_MIN_HASH_SIZE	16
+#define MPQ_WRITER_MIN_NAME_INDEX	512
+#define MPQ_WRITER_NO_NAME			0xFFFFFFFF
+
+#define IMPLODE_DICT_BITS		6			// 0x1000 byte dictionary
+#define IMPLODE_DICT_SIZE		(0x40 << IMPLODE_DICT_BITS)
+#define IMPLODE_MIN_REP			3			// We never bother with two byte repetitions
+#define IMPLODE_MAX_REP			0x206
+#define IMPLODE_HASH_SIZE		0x1000
+#define IMPLODE_MAX_CHAIN		64			// How far back we look for a better repetition
+#define IMPLODE_NO_POS			0xFFFFFFFF
+
+namespace MPQWriter
+{
+	// Encryption/hashing table
+	static DWORD gdwCryptTable[0x500];
+	static bool gbCryptTableReady = false;
+
+	/*
+	 *	Tables for the PKWARE DCL bit stream. These have to match the ones in explode.c.
+	 *	@author	Zezula
+	 */
+	static const BYTE DistBits[] =
+	{
+		0x02, 0x04, 0x04, 0x05, 0x05, 0x05, 0x05, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06,
+		0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+		0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+		0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08
+	};
+
+	static const BYTE DistCode[] =
+	{
+		0x03, 0x0D, 0x05, 0x19, 0x09, 0x11, 0x01, 0x3E, 0x1E, 0x2E, 0x0E, 0x36, 0x16, 0x26, 0x06, 0x3A,
+		0x1A, 0x2A, 0x0A, 0x32, 0x12, 0x22, 0x42, 0x02, 0x7C, 0x3C, 0x5C, 0x1C, 0x6C, 0x2C, 0x4C, 0x0C,
+		0x74, 0x34, 0x54, 0x14, 0x64, 0x24, 0x44, 0x04, 0x78, 0x38, 0x58, 0x18, 0x68, 0x28, 0x48, 0x08,
+		0xF0, 0x70, 0xB0, 0x30, 0xD0, 0x50, 0x90, 0x10, 0xE0, 0x60, 0xA0, 0x20, 0xC0, 0x40, 0x80, 0x00
+	};
+
+	static const BYTE ExLenBits[] =
+	{
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08
+	};
+
+	static const WORD LenBase[] =
+	{
+		0x0000, 0x0001, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006, 0x0007,
+		0x0008, 0x000A, 0x000E, 0x0016, 0x0026, 0x0046, 0x0086, 0x0106
+	};
+
+	static const BYTE LenBits[] =
+	{
+		0x03, 0x02, 0x03, 0x03, 0x04, 0x04, 0x04, 0x05, 0x05, 0x05, 0x05, 0x06, 0x06, 0x06, 0x07, 0x07
+	};
+
+	static const BYTE LenCode[] =
+	{
+		0x05, 0x03, 0x01, 0x06, 0x0A, 0x02, 0x0C, 0x14, 0x04, 0x18, 0x08, 0x30, 0x10, 0x20, 0x40, 0x00
+	};
+
+	/*
+	 *	Prints out why something went wrong.
+	 */
+	static bool Error(const char* szFormat, const char* szFileName)
+	{
+		fprintf(stderr, "MPQWriter: ");
+		fprintf(stderr, szFormat, szFileName);
+		fprintf(stderr, "\n");
+		return false;
+	}
+
+	/*
+	 *	Builds the encryption/hashing table. Identical to the one in MPQ.cpp.
+	 *	@author	Zezula
+	 */
+	void InitCryptTable()
+	{
+		DWORD dwSeed = 0x00100001;
+		DWORD index1 = 0;
+		DWORD index2 = 0;
+		int   i;
+
+		if (gbCryptTableReady)
+		{
+			return;
+		}
+
+		for (index1 = 0; index1 < 0x100; index1++)
+		{
+			for (index2 = index1, i = 0; i < 5; i++, index2 += 0x100)
+			{
+				DWORD temp1, temp2;
+
+				dwSeed = (dwSeed * 125 + 3) % 0x2AAAAB;
+				temp1 = (dwSeed & 0xFFFF) << 0x10;
+
+				dwSeed = (dwSeed * 125 + 3) % 0x2AAAAB;
+				temp2 = (dwSeed & 0xFFFF);
+
+				gdwCryptTable[index2] = (temp1 | temp2);
+			}
+		}
+
+		gbCryptTableReady = true;
+	}
+
+	/*
+	 *	Hashes a file name. Names have already had their slashes turned into backslashes by now.
+	 *	@author	Zezula
+	 */
+	DWORD HashString(const char* szFileName, DWORD dwHashType)
+	{
+		DWORD  dwSeed1 = 0x7FED7FED;
+		DWORD  dwSeed2 = 0xEEEEEEEE;
+		DWORD  ch;
+
+		while (*szFileName != 0)
+		{
+			ch = (BYTE)*szFileName++;
+			if (ch >= 'a' && ch <= 'z')
+			{
+				ch -= 'a' - 'A';
+			}
+
+			dwSeed1 = gdwCryptTable[dwHashType + ch] ^ (dwSeed1 + dwSeed2);
+			dwSeed2 = ch + dwSeed1 + dwSeed2 + (dwSeed2 << 5) + 3;
+		}
+
+		return dwSeed1;
+	}
+
+	/*
+	 *	Encrypts a block of data. Anything past the last whole DWORD is left alone, same as the decryption.
+	 *	@author	Zezula
+	 */
+	static void EncryptMPQBlock(void* pvDataBlock, DWORD dwLength, DWORD dwKey1)
+	{
+		DWORD* DataBlock = (DWORD*)pvDataBlock;
+		DWORD dwValue32;
+		DWORD dwKey2 = 0xEEEEEEEE;
+
+		// Round to DWORDs
+		dwLength >>= 2;
+
+		for (DWORD i = 0; i < dwLength; i++)
+		{
+			// Modify the second key
+			dwKey2 += gdwCryptTable[MPQ_HASH_KEY2_MIX + (dwKey1 & 0xFF)];
+
+			dwValue32 = DataBlock[i];
+			DataBlock[i] = dwValue32 ^ (dwKey1 + dwKey2);
+
+			dwKey1 = ((~dwKey1 << 0x15) + 0x11111111) | (dwKey1 >> 0x0B);
+			dwKey2 = dwValue32 + dwKey2 + (dwKey2 << 5) + 3;
+		}
+	}
+
+	/*
+	 *	Decrypts a block of data. Used by MPQReader.cpp.
+	 *	@author	Zezula
+	 */
+	void DecryptMPQBlock(void* pvDataBlock, DWORD dwLength, DWORD dwKey1)
+	{
+		DWORD* DataBlock = (DWORD*)pvDataBlock;
+		DWORD dwValue32;
+		DWORD dwKey2 = 0xEEEEEEEE;
+
+		// Round to DWORDs
+		dwLength >>= 2;
+
+		for (DWORD i = 0; i < dwLength; i++)
+		{
+			// Modify the second key
+			dwKey2 += gdwCryptTable[MPQ_HASH_KEY2_MIX + (dwKey1 & 0xFF)];
+
+			dwValue32 = DataBlock[i] ^ (dwKey1 + dwKey2);
+			DataBlock[i] = dwValue32;
+
+			dwKey1 = ((~dwKey1 << 0x15) + 0x11111111) | (dwKey1 >> 0x0B);
+			dwKey2 = dwValue32 + dwKey2 + (dwKey2 << 5) + 3;
+		}
+	}
+
+	/*
+	 *	Works out the encryption key for a file, the same way that MPQ::DecryptFileKey does.
+	 */
+	DWORD GetFileKey(const char* szFileName, DWORD dwFilePos, DWORD dwFileSize, DWORD dwFlags)
+	{
+		const char* szPlainName = strrchr(szFileName, '\\');
+		DWORD dwFileKey;
+
+		dwFileKey = HashString(szPlainName != nullptr ? szPlainName + 1 : szFileName, MPQ_HASH_FILE_KEY);
+		if (dwFlags & MPQ_FILE_FIX_KEY)
+		{
+			dwFileKey = (dwFileKey + dwFilePos) ^ dwFileSize;
+		}
+		return dwFileKey;
+	}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// PKWARE IMPLODE
+
+	/*
+	 *	Bit output for the DCL stream. Bits go out least significant first.
+	 */
+	struct ImplodeStream
+	{
+		BYTE*	pOut;
+		BYTE*	pOutEnd;
+		DWORD	dwBitBuffer;
+		DWORD	dwBitCount;
+		bool	bOverflow;
+	};
+
+	static void PutBits(ImplodeStream* pStream, DWORD dwValue, DWORD dwNumBits)
+	{
+		pStream->dwBitBuffer |= dwValue << pStream->dwBitCount;
+		pStream->dwBitCount += dwNumBits;
+
+		while (pStream->dwBitCount >= 8)
+		{
+			if (pStream->pOut >= pStream->pOutEnd)
+			{
+				pStream->bOverflow = true;
+			}
+			else
+			{
+				*pStream->pOut++ = (BYTE)pStream->dwBitBuffer;
+			}
+			pStream->dwBitBuffer >>= 8;
+			pStream->dwBitCount -= 8;
+		}
+	}
+
+	/*
+	 *	Writes a repetition of dwLength bytes, starting dwDistance bytes back.
+	 *	A length of IMPLODE_MAX_REP + 1 is the end of stream marker.
+	 */
+	static void PutRepetition(ImplodeStream* pStream, DWORD dwLength, DWORD dwDistance)
+	{
+		DWORD dwLengthValue = dwLength - 2;
+		int nLengthCode = 15;
+
+		while (LenBase[nLengthCode] > dwLengthValue)
+		{
+			nLengthCode--;
+		}
+
+		PutBits(pStream, 1, 1);
+		PutBits(pStream, LenCode[nLengthCode], LenBits[nLengthCode]);
+		if (ExLenBits[nLengthCode] != 0)
+		{
+			PutBits(pStream, dwLengthValue - LenBase[nLengthCode], ExLenBits[nLengthCode]);
+		}
+
+		if (dwLength > IMPLODE_MAX_REP)
+		{	// end of stream - no distance
+			return;
+		}
+
+		dwDistance--;
+		if (dwLength == 2)
+		{
+			PutBits(pStream, DistCode[dwDistance >> 2], DistBits[dwDistance >> 2]);
+			PutBits(pStream, dwDistance & 0x03, 2);
+		}
+		else
+		{
+			PutBits(pStream, DistCode[dwDistance >> IMPLODE_DICT_BITS], DistBits[dwDistance >> IMPLODE_DICT_BITS]);
+			PutBits(pStream, dwDistance & ((1 << IMPLODE_DICT_BITS) - 1), IMPLODE_DICT_BITS);
+		}
+	}
+
+	static inline DWORD ImplodeHash(const BYTE* pData)
+	{
+		return ((pData[0] << 4) ^ (pData[1] << 2) ^ pData[2]) & (IMPLODE_HASH_SIZE - 1);
+	}
+
+	/*
+	 *	Compresses a buffer with PKWARE DCL (binary mode, 4KB dictionary), which is what explode() reads.
+	 *	Greedy matching over hash chains; nowhere near as thorough as the real implode, but it's compatible.
+	 *	@return	The size of the compressed data, or 0 if it didn't fit in pOutput
+	 *	@author	eezstreet
+	 */
+	DWORD Implode(const BYTE* pInput, DWORD dwInputSize, BYTE* pOutput, DWORD dwOutputSize)
+	{
+		DWORD dwHashHead[IMPLODE_HASH_SIZE];
+		DWORD dwHashPrev[IMPLODE_DICT_SIZE];
+		ImplodeStream stream;
+		DWORD dwPos = 0;
+
+		if (dwOutputSize < 2)
+		{
+			return 0;
+		}
+
+		pOutput[0] = CMP_BINARY;
+		pOutput[1] = IMPLODE_DICT_BITS;
+
+		stream.pOut = pOutput + 2;
+		stream.pOutEnd = pOutput + dwOutputSize;
+		stream.dwBitBuffer = 0;
+		stream.dwBitCount = 0;
+		stream.bOverflow = false;
+
+		memset(dwHashHead, 0xFF, sizeof(dwHashHead));
+
+		while (dwPos < dwInputSize && !stream.bOverflow)
+		{
+			DWORD dwBestLength = 0;
+			DWORD dwBestDistance = 0;
+			DWORD dwAdvance;
+
+			if (dwPos + IMPLODE_MIN_REP <= dwInputSize)
+			{
+				DWORD dwMaxLength = D2Lib::min<DWORD>(dwInputSize - dwPos, IMPLODE_MAX_REP);
+				DWORD dwCandidate = dwHashHead[ImplodeHash(pInput + dwPos)];
+				int nChain = IMPLODE_MAX_CHAIN;
+
+				while (dwCandidate != IMPLODE_NO_POS && dwPos - dwCandidate <= IMPLODE_DICT_SIZE && nChain-- > 0)
+				{
+					DWORD dwLength = 0;
+					DWORD dwNext;
+
+					while (dwLength < dwMaxLength && pInput[dwCandidate + dwLength] == pInput[dwPos + dwLength])
+					{
+						dwLength++;
+					}
+
+					if (dwLength > dwBestLength)
+					{
+						dwBestLength = dwLength;
+						dwBestDistance = dwPos - dwCandidate;
+						if (dwLength == dwMaxLength)
+						{
+							break;
+						}
+					}
+
+					dwNext = dwHashPrev[dwCandidate & (IMPLODE_DICT_SIZE - 1)];
+					if (dwNext == IMPLODE_NO_POS || dwNext >= dwCandidate)
+					{	// the chain got overwritten
+						break;
+					}
+					dwCandidate = dwNext;
+				}
+			}
+
+			if (dwBestLength >= IMPLODE_MIN_REP)
+			{
+				PutRepetition(&stream, dwBestLength, dwBestDistance);
+				dwAdvance = dwBestLength;
+			}
+			else
+			{
+				PutBits(&stream, 0, 1);
+				PutBits(&stream, pInput[dwPos], 8);
+				dwAdvance = 1;
+			}
+
+			// Every position we step over goes into the hash chains
+			while (dwAdvance-- > 0)
+			{
+				if (dwPos + IMPLODE_MIN_REP <= dwInputSize)
+				{
+					DWORD dwHash = ImplodeHash(pInput + dwPos);
+
+					dwHashPrev[dwPos & (IMPLODE_DICT_SIZE - 1)] = dwHashHead[dwHash];
+					dwHashHead[dwHash] = dwPos;
+				}
+				dwPos++;
+			}
+		}
+
+		// End of stream marker, then whatever is left in the bit buffer
+		PutRepetition(&stream, IMPLODE_MAX_REP + 1, 0);
+		if (stream.dwBitCount > 0)
+		{
+			PutBits(&stream, 0, 8 - stream.dwBitCount);
+		}
+
+		if (stream.bOverflow)
+		{
+			return 0;
+		}
+		return (DWORD)(stream.pOut - pOutput);
+	}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// COMPRESSION
+
+	/*
+	 *	Runs a unit (sector or single unit file) through each of the methods in nMethod, in the opposite order
+	 *	that MPQ::DecompressSector undoes them. Methods that don't make the data any smaller are dropped.
+	 *	pOutput gets the method byte followed by the compressed data.
+	 *	@return	The size of what was written to pOutput, or 0 if the unit should be stored as-is
+	 */
+	static DWORD CompressUnit(BYTE nMethod, const BYTE* pInput, DWORD dwInputSize, BYTE* pOutput,
+		BYTE* pScratch1, BYTE* pScratch2, DWORD dwScratchSize)
+	{
+		const BYTE* pCurrent = pInput;
+		DWORD dwCurrentSize = dwInputSize;
+		BYTE nApplied = 0;
+
+		static const BYTE nOrder[] = {
+			MPQ_COMPRESSION_ADPCM_MONO, MPQ_COMPRESSION_ADPCM_STEREO, MPQ_COMPRESSION_HUFFMANN, MPQ_COMPRESSION_PKWARE
+		};
+
+		for (size_t i = 0; i < sizeof(nOrder) / sizeof(nOrder[0]); i++)
+		{
+			BYTE* pTarget = (pCurrent == pScratch1) ? pScratch2 : pScratch1;
+			DWORD dwWritten = 0;
+
+			if (!(nMethod & nOrder[i]))
+			{
+				continue;
+			}
+
+			switch (nOrder[i])
+			{
+				case MPQ_COMPRESSION_ADPCM_MONO:
+					dwWritten = CompressADPCM(pTarget, dwScratchSize, (void*)pCurrent, dwCurrentSize, 1, MPQ_WRITER_ADPCM_LEVEL);
+					break;
+				case MPQ_COMPRESSION_ADPCM_STEREO:
+					dwWritten = CompressADPCM(pTarget, dwScratchSize, (void*)pCurrent, dwCurrentSize, 2, MPQ_WRITER_ADPCM_LEVEL);
+					break;
+				case MPQ_COMPRESSION_HUFFMANN:
+				{
+					THuffmannTree ht(true);
+					TOutputStream os(pTarget, dwScratchSize);
+					int nType = 0;
+
+					if (nApplied & (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO))
+					{	// Storm pairs each ADPCM level with the tree that was built for it
+						nType = MPQ_WRITER_ADPCM_LEVEL + 2;
+					}
+
+					dwWritten = ht.Compress(&os, (void*)pCurrent, dwCurrentSize, nType);
+					break;
+				}
+				case MPQ_COMPRESSION_PKWARE:
+					dwWritten = Implode(pCurrent, dwCurrentSize, pTarget, dwScratchSize);
+					break;
+			}
+
+			if (dwWritten > 0 && dwWritten < dwCurrentSize)
+			{
+				pCurrent = pTarget;
+				dwCurrentSize = dwWritten;
+				nApplied |= nOrder[i];
+			}
+		}
+
+		if (nApplied == 0 || dwCurrentSize + 1 >= dwInputSize)
+		{	// not worth it
+			return 0;
+		}
+
+		pOutput[0] = nApplied;
+		memcpy(pOutput + 1, pCurrent, dwCurrentSize);
+		return dwCurrentSize + 1;
+	}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// ARCHIVE
+
+	/*
+	 *	Puts a file's name into the name index. There has to be room for it.
+	 */
+	static void IndexName(D2MPQWriter* pWriter, DWORD dwFile)
+	{
+		DWORD dwMask = pWriter->dwNameIndexSize - 1;
+		DWORD dwIndex = HashString(pWriter->pNameTable[dwFile], MPQ_HASH_TABLE_INDEX) & dwMask;
+
+		while (pWriter->pNameIndex[dwIndex] != MPQ_WRITER_NO_NAME)
+		{
+			dwIndex = (dwIndex + 1) & dwMask;
+		}
+		pWriter->pNameIndex[dwIndex] = dwFile;
+	}
+
+	/*
+	 *	Doubles the size of the name index and puts every name back into it
+	 */
+	static bool GrowNameIndex(D2MPQWriter* pWriter)
+	{
+		DWORD dwNewSize = pWriter->dwNameIndexSize ? pWriter->dwNameIndexSize * 2 : MPQ_WRITER_MIN_NAME_INDEX;
+		DWORD* pNewIndex = (DWORD*)malloc(sizeof(DWORD) * dwNewSize);
+
+		if (pNewIndex == nullptr)
+		{
+			return false;
+		}
+
+		memset(pNewIndex, 0xFF, sizeof(DWORD) * dwNewSize);
+		free(pWriter->pNameIndex);
+		pWriter->pNameIndex = pNewIndex;
+		pWriter->dwNameIndexSize = dwNewSize;
+
+		for (DWORD i = 0; i < pWriter->dwNumFiles; i++)
+		{
+			IndexName(pWriter, i);
+		}
+		return true;
+	}
+
+	/*
+	 *	Checks whether a file with this name has already been added.
+	 *	Names are compared without case, the same as the archive's own hash table does.
+	 */
+	static bool HasName(D2MPQWriter* pWriter, const char* szName)
+	{
+		DWORD dwMask = pWriter->dwNameIndexSize - 1;
+		DWORD dwIndex;
+
+		if (pWriter->dwNameIndexSize == 0)
+		{
+			return false;
+		}
+
+		dwIndex = HashString(szName, MPQ_HASH_TABLE_INDEX) & dwMask;
+		while (pWriter->pNameIndex[dwIndex] != MPQ_WRITER_NO_NAME)
+		{
+			if (!D2Lib::stricmp(pWriter->pNameTable[pWriter->pNameIndex[dwIndex]], szName))
+			{
+				return true;
+			}
+			dwIndex = (dwIndex + 1) & dwMask;
+		}
+		return false;
+	}
+
+	/*
+	 *	Starts writing a new archive at szPath. Any existing file there gets overwritten.
+	 *	dwHashTableSize must be a power of two, or 0 to size the hash table to fit.
+	 *	@author	eezstreet
+	 */
+	bool Create(const char* szPath, DWORD dwHashTableSize, bool bListfile, D2MPQWriter* pWriter)
+	{
+		MPQHeader header;
+
+		memset(pWriter, 0, sizeof(D2MPQWriter));
+
+		if (dwHashTableSize != 0 && (dwHashTableSize & (dwHashTableSize - 1)) != 0)
+		{
+			return Error("%s: hash table size must be a power of two", szPath);
+		}
+
+		pWriter->pFile = fopen(szPath, "wb");
+		if (pWriter->pFile == nullptr)
+		{
+			return Error("couldn't open %s for writing", szPath);
+		}
+
+		// The real header gets written once we know where everything is
+		memset(&header, 0, sizeof(header));
+		if (fwrite(&header, sizeof(header), 1, pWriter->pFile) != 1)
+		{
+			Abort(pWriter);
+			return Error("couldn't write to %s", szPath);
+		}
+
+		InitCryptTable();
+
+		pWriter->dwWritePos = sizeof(MPQHeader);
+		pWriter->dwHashTableSize = dwHashTableSize;
+		pWriter->bListfile = bListfile;
+		return true;
+	}
+
+	/*
+	 *	Compresses, encrypts and writes out a file.
+	 *	dwFlags is any combination of MPQ_FILE_IMPLODE / MPQ_FILE_COMPRESS, MPQ_FILE_ENCRYPTED, MPQ_FILE_FIX_KEY and
+	 *	MPQ_FILE_SINGLE_UNIT. nCompression is the set of MPQ_COMPRESSION_* methods to use with MPQ_FILE_COMPRESS.
+	 *	Every name can only be added once (ignoring case, and with / and \ being the same).
+	 *	@author	eezstreet
+	 */
+	bool AddFile(D2MPQWriter* pWriter, const char* szArchivedName, const BYTE* pData, DWORD dwSize,
+		DWORD dwFlags, BYTE nCompression)
+	{
+		MPQName szName;
+		MPQBlock* pBlock;
+		DWORD dwUnitSize, dwNumUnits, dwTableSize, dwScratchSize, dwEncryptionKey = 0;
+		DWORD* pSectorTable = nullptr;
+		BYTE* pBlob;
+		BYTE* pUnit;
+		BYTE* pScratch1;
+		BYTE* pScratch2;
+		DWORD dwBlobSize;
+		bool bCompressed;
+		size_t i;
+
+		if (pWriter->pFile == nullptr)
+		{
+			return Error("%s: archive isn't open", szArchivedName);
+		}
+
+		if (strlen(szArchivedName) >= MAX_D2PATH)
+		{
+			return Error("%s: name is too long", szArchivedName);
+		}
+
+		// Archives always use backslashes
+		for (i = 0; szArchivedName[i] != '\0'; i++)
+		{
+			szName[i] = szArchivedName[i] == '/' ? '\\' : szArchivedName[i];
+		}
+		szName[i] = '\0';
+
+		if (HasName(pWriter, szName))
+		{
+			return Error("%s: is already in the archive", szName);
+		}
+
+		dwFlags &= (MPQ_FILE_IMPLODE | MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED | MPQ_FILE_FIX_KEY | MPQ_FILE_SINGLE_UNIT);
+		if ((dwFlags & MPQ_FILE_IMPLODE) && (dwFlags & MPQ_FILE_COMPRESS))
+		{
+			return Error("%s: can't be both imploded and compressed", szName);
+		}
+		if ((dwFlags & MPQ_FILE_COMPRESS) && nCompression == 0)
+		{
+			return Error("%s: compressed, but no compression method was given", szName);
+		}
+		if (dwFlags & MPQ_FILE_FIX_KEY)
+		{	// doesn't mean anything without encryption
+			dwFlags |= MPQ_FILE_ENCRYPTED;
+		}
+		if (dwSize == 0)
+		{	// Nothing to compress (or encrypt)
+			dwFlags = 0;
+		}
+		dwFlags |= MPQ_FILE_EXISTS;
+
+		// Grow the tables if needed
+		if (pWriter->dwNumFiles >= pWriter->dwMaxFiles)
+		{
+			DWORD dwNewMax = pWriter->dwMaxFiles ? pWriter->dwMaxFiles * 2 : 256;
+			MPQBlock* pNewBlocks = (MPQBlock*)realloc(pWriter->pBlockTable, sizeof(MPQBlock) * dwNewMax);
+			MPQName* pNewNames;
+
+			if (pNewBlocks == nullptr)
+			{
+				return Error("%s: out of memory", szName);
+			}
+			pWriter->pBlockTable = pNewBlocks;
+
+			pNewNames = (MPQName*)realloc(pWriter->pNameTable, sizeof(MPQName) * dwNewMax);
+			if (pNewNames == nullptr)
+			{
+				return Error("%s: out of memory", szName);
+			}
+			pWriter->pNameTable = pNewNames;
+			pWriter->dwMaxFiles = dwNewMax;
+		}
+
+		// Keep the name index at most half full
+		if ((pWriter->dwNumFiles + 1) * 2 > pWriter->dwNameIndexSize && !GrowNameIndex(pWriter))
+		{
+			return Error("%s: out of memory", szName);
+		}
+
+		bCompressed = (dwFlags & (MPQ_FILE_IMPLODE | MPQ_FILE_COMPRESS)) != 0;
+		if (dwFlags & MPQ_FILE_SINGLE_UNIT)
+		{
+			dwUnitSize = dwSize;
+			dwNumUnits = 1;
+		}
+		else
+		{
+			dwUnitSize = MPQ_WRITER_SECTOR_SIZE;
+			dwNumUnits = (dwSize + dwUnitSize - 1) / dwUnitSize;
+		}
+		dwTableSize = (bCompressed && !(dwFlags & MPQ_FILE_SINGLE_UNIT)) ? (dwNumUnits + 1) * sizeof(DWORD) : 0;
+
+		// Compression can make a unit bigger than it started (which we throw away), so leave plenty of room
+		dwScratchSize = (dwUnitSize * 2) + 0x100;
+		pBlob = (BYTE*)malloc(dwTableSize + dwSize + dwNumUnits);
+		pUnit = (BYTE*)malloc(dwScratchSize * 3);
+		if (dwTableSize > 0)
+		{
+			pSectorTable = (DWORD*)malloc(dwTableSize);
+		}
+		if (pBlob == nullptr || pUnit == nullptr || (dwTableSize > 0 && pSectorTable == nullptr))
+		{
+			free(pBlob);
+			free(pUnit);
+			free(pSectorTable);
+			return Error("%s: out of memory", szName);
+		}
+		pScratch1 = pUnit + dwScratchSize;
+		pScratch2 = pScratch1 + dwScratchSize;
+
+		if (dwFlags & MPQ_FILE_ENCRYPTED)
+		{
+			dwEncryptionKey = GetFileKey(szName, pWriter->dwWritePos, dwSize, dwFlags);
+		}
+
+		dwBlobSize = dwTableSize;
+		for (DWORD dwUnit = 0; dwUnit < dwNumUnits; dwUnit++)
+		{
+			const BYTE* pIn = pData + (dwUnit * dwUnitSize);
+			DWORD dwInSize = D2Lib::min<DWORD>(dwUnitSize, dwSize - (dwUnit * dwUnitSize));
+			DWORD dwOutSize = 0;
+
+			if (dwFlags & MPQ_FILE_IMPLODE)
+			{
+				dwOutSize = Implode(pIn, dwInSize, pUnit, dwScratchSize);
+				if (dwOutSize >= dwInSize)
+				{
+					dwOutSize = 0;
+				}
+			}
+			else if (dwFlags & MPQ_FILE_COMPRESS)
+			{
+				BYTE nMethod = nCompression;
+
+				if (dwUnit == 0 && !(dwFlags & MPQ_FILE_SINGLE_UNIT) && (nMethod & (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO)))
+				{	// The first sector of a WAV holds the header, which ADPCM would mangle
+					nMethod = MPQ_COMPRESSION_PKWARE;
+				}
+				dwOutSize = CompressUnit(nMethod, pIn, dwInSize, pUnit, pScratch1, pScratch2, dwScratchSize);
+			}
+
+			if (dwOutSize == 0)
+			{	// stored as-is
+				memcpy(pUnit, pIn, dwInSize);
+				dwOutSize = dwInSize;
+			}
+
+			if (dwFlags & MPQ_FILE_ENCRYPTED)
+			{
+				EncryptMPQBlock(pUnit, dwOutSize, dwEncryptionKey + dwUnit);
+			}
+
+			if (pSectorTable != nullptr)
+			{
+				pSectorTable[dwUnit] = dwBlobSize;
+			}
+			memcpy(pBlob + dwBlobSize, pUnit, dwOutSize);
+			dwBlobSize += dwOutSize;
+		}
+
+		if (pSectorTable != nullptr)
+		{
+			pSectorTable[dwNumUnits] = dwBlobSize;
+			if (dwFlags & MPQ_FILE_ENCRYPTED)
+			{	// see MPQ::ReadFile
+				EncryptMPQBlock(pSectorTable, dwTableSize, dwEncryptionKey - 1);
+			}
+			memcpy(pBlob, pSectorTable, dwTableSize);
+		}
+
+		free(pUnit);
+		free(pSectorTable);
+
+		if ((DWORD)(pWriter->dwWritePos + dwBlobSize) < pWriter->dwWritePos)
+		{
+			free(pBlob);
+			return Error("%s: archive would be larger than 4GB", szName);
+		}
+
+		if (dwBlobSize > 0 && fwrite(pBlob, dwBlobSize, 1, pWriter->pFile) != 1)
+		{
+			free(pBlob);
+			return Error("%s: couldn't write to the archive", szName);
+		}
+		free(pBlob);
+
+		pBlock = &pWriter->pBlockTable[pWriter->dwNumFiles];
+		pBlock->dwFilePos = pWriter->dwWritePos;
+		pBlock->dwCSize = dwBlobSize;
+		pBlock->dwFSize = dwSize;
+		pBlock->dwFlags = dwFlags;
+		memcpy(pWriter->pNameTable[pWriter->dwNumFiles], szName, sizeof(MPQName));
+		IndexName(pWriter, pWriter->dwNumFiles);
+
+		pWriter->dwWritePos += dwBlobSize;
+		pWriter->dwNumFiles++;
+		return true;
+	}
+
+	/*
+	 *	Adds a (listfile) naming everything in the archive
+	 */
+	static bool AddListfile(D2MPQWriter* pWriter)
+	{
+		DWORD dwNumFiles = pWriter->dwNumFiles;
+		DWORD dwSize = 0;
+		char* szListfile;
+		bool bResult;
+
+		szListfile = (char*)malloc((dwNumFiles * (MAX_D2PATH + 2)) + 1);
+		if (szListfile == nullptr)
+		{
+			return Error("%s: out of memory", "(listfile)");
+		}
+
+		for (DWORD i = 0; i < dwNumFiles; i++)
+		{
+			size_t dwLength = strlen(pWriter->pNameTable[i]);
+
+			memcpy(szListfile + dwSize, pWriter->pNameTable[i], dwLength);
+			dwSize += dwLength;
+			szListfile[dwSize++] = '\r';
+			szListfile[dwSize++] = '\n';
+		}
+
+		bResult = AddFile(pWriter, "(listfile)", (BYTE*)szListfile, dwSize, MPQ_FILE_COMPRESS, MPQ_COMPRESSION_PKWARE);
+		free(szListfile);
+		return bResult;
+	}
+
+	/*
+	 *	Writes out the hash table, block table and header, and closes the archive.
+	 *	@author	eezstreet
+	 */
+	bool Finish(D2MPQWriter* pWriter)
+	{
+		MPQHash* pHashTable;
+		MPQBlock* pBlockTable;
+		MPQHeader header;
+		DWORD dwHashTableSize = pWriter->dwHashTableSize;
+		DWORD dwHashPos, dwBlockPos;
+		bool bResult = true;
+
+		if (pWriter->pFile == nullptr)
+		{
+			return Error("%s: archive isn't open", "Finish");
+		}
+
+		if (pWriter->bListfile && !AddListfile(pWriter))
+		{
+			Abort(pWriter);
+			return false;
+		}
+
+		if (dwHashTableSize == 0)
+		{	// Keep it at most 3/4 full, so that the collision chains stay short
+			dwHashTableSize = MPQ_WRITER_MIN_HASH_SIZE;
+			while (dwHashTableSize < pWriter->dwNumFiles + (pWriter->dwNumFiles / 3) + 1)
+			{
+				dwHashTableSize <<= 1;
+			}
+		}
+		else if (dwHashTableSize < pWriter->dwNumFiles)
+		{
+			Abort(pWriter);
+			return Error("%s: hash table is too small for all of the files", "Finish");
+		}
+
+		pHashTable = (MPQHash*)malloc(sizeof(MPQHash) * dwHashTableSize);
+		pBlockTable = (MPQBlock*)malloc(sizeof(MPQBlock) * (pWriter->dwNumFiles + 1));
+		if (pHashTable == nullptr || pBlockTable == nullptr)
+		{
+			free(pHashTable);
+			free(pBlockTable);
+			Abort(pWriter);
+			return Error("%s: out of memory", "Finish");
+		}
+
+		// Empty hash entries are all 0xFF
+		memset(pHashTable, 0xFF, sizeof(MPQHash) * dwHashTableSize);
+		for (DWORD i = 0; i < pWriter->dwNumFiles; i++)
+		{
+			const char* szName = pWriter->pNameTable[i];
+			DWORD dwIndex = HashString(szName, MPQ_HASH_TABLE_INDEX) & (dwHashTableSize - 1);
+			DWORD dwName1 = HashString(szName, MPQ_HASH_NAME_A);
+			DWORD dwName2 = HashString(szName, MPQ_HASH_NAME_B);
+
+			while (pHashTable[dwIndex].dwBlockEntry != 0xFFFFFFFF)
+			{
+				if (pHashTable[dwIndex].dwMethodA == dwName1 && pHashTable[dwIndex].dwMethodB == dwName2)
+				{	// two different names that hash the same; readers could only ever find one of them
+					Error("%s: has the same hashes as another file in the archive", szName);
+					free(pHashTable);
+					free(pBlockTable);
+					Abort(pWriter);
+					return false;
+				}
+				dwIndex = (dwIndex + 1) & (dwHashTableSize - 1);
+			}
+
+			pHashTable[dwIndex].dwMethodA = dwName1;
+			pHashTable[dwIndex].dwMethodB = dwName2;
+			pHashTable[dwIndex].wLocale = 0;
+			pHashTable[dwIndex].nPlatform = 0;
+			pHashTable[dwIndex].nReserved = 0;
+			pHashTable[dwIndex].dwBlockEntry = i;
+		}
+
+		memcpy(pBlockTable, pWriter->pBlockTable, sizeof(MPQBlock) * pWriter->dwNumFiles);
+		EncryptMPQBlock(pHashTable, sizeof(MPQHash) * dwHashTableSize, MPQ_KEY_HASH_TABLE);
+		EncryptMPQBlock(pBlockTable, sizeof(MPQBlock) * pWriter->dwNumFiles, MPQ_KEY_BLOCK_TABLE);
+
+		dwHashPos = pWriter->dwWritePos;
+		dwBlockPos = dwHashPos + (sizeof(MPQHash) * dwHashTableSize);
+
+		header.dwID = 0x1A51504D;	// "MPQ\x1A"
+		header.dwHeaderSize = sizeof(MPQHeader);
+		header.dwArchiveSize = dwBlockPos + (sizeof(MPQBlock) * pWriter->dwNumFiles);
+		header.wFormatVersion = 0;
+		header.wSectorSize = MPQ_WRITER_SECTOR_SHIFT;
+		header.dwHashTablePos = dwHashPos;
+		header.dwBlockTablePos = dwBlockPos;
+		header.dwHashTableSize = dwHashTableSize;
+		header.dwBlockTableSize = pWriter->dwNumFiles;
+
+		if (fwrite(pHashTable, sizeof(MPQHash), dwHashTableSize, pWriter->pFile) != dwHashTableSize ||
+			fwrite(pBlockTable, sizeof(MPQBlock), pWriter->dwNumFiles, pWriter->pFile) != pWriter->dwNumFiles ||
+			fseek(pWriter->pFile, 0, SEEK_SET) != 0 ||
+			fwrite(&header, sizeof(header), 1, pWriter->pFile) != 1)
+		{
+			bResult = Error("%s: couldn't write the archive tables", "Finish");
+		}
+
+		free(pHashTable);
+		free(pBlockTable);
+
+		if (fclose(pWriter->pFile) != 0)
+		{
+			bResult = Error("%s: couldn't close the archive", "Finish");
+		}
+		pWriter->pFile = nullptr;
+
+		Abort(pWriter);
+		return bResult;
+	}
+
+	/*
+	 *	Throws away an archive without finishing it (and frees everything once it has been finished)
+	 *	@author	eezstreet
+	 */
+	void Abort(D2MPQWriter* pWriter)
+	{
+		if (pWriter->pFile != nullptr)
+		{
+			fclose(pWriter->pFile);
+		}
+		free(pWriter->pBlockTable);
+		free(pWriter->pNameTable);
+		free(pWriter->pNameIndex);
+		memset(pWriter, 0, sizeof(D2MPQWriter));
+	}
+}
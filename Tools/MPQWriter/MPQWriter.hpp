@@ -0,0 +1,54 @@
+#pragma once
+#include "../../Engine/MPQ.hpp"
+#include <stdio.h>
+
+/*
+ *	MPQ ARCHIVE WRITER
+ *	Builds Diablo II style (format version 0) archives from scratch, so that the archive code can be exercised
+ *	without any of the original game data.
+ *	Files are written out as they get added; the hash and block tables (and the header) are written by Finish.
+ *	@author	eezstreet
+ */
+
+#define MPQ_HASH_TABLE_INDEX		0x000
+#define MPQ_HASH_NAME_A				0x100
+#define MPQ_HASH_NAME_B				0x200
+#define MPQ_HASH_FILE_KEY			0x300
+#define MPQ_HASH_KEY2_MIX			0x400
+
+#define MPQ_WRITER_SECTOR_SHIFT		3			// 0x200 << 3 = 0x1000, same as every Diablo II archive
+#define MPQ_WRITER_SECTOR_SIZE		(0x200 << MPQ_WRITER_SECTOR_SHIFT)
+
+/*
+ *	@author	eezstreet
+ */
+struct D2MPQWriter
+{
+	FILE*		pFile;
+	DWORD		dwWritePos;				// Where the next file goes
+	DWORD		dwHashTableSize;		// 0 = pick one when the archive is finished
+	DWORD		dwNumFiles;
+	DWORD		dwMaxFiles;				// Size of the block and name tables
+	MPQBlock*	pBlockTable;
+	MPQName*	pNameTable;
+	DWORD*		pNameIndex;				// Open addressed table of block numbers, to find duplicate names
+	DWORD		dwNameIndexSize;
+	bool		bListfile;				// Write a (listfile) when the archive is finished
+};
+
+// MPQWriter.cpp
+namespace MPQWriter
+{
+	bool Create(const char* szPath, DWORD dwHashTableSize, bool bListfile, D2MPQWriter* pWriter);
+	bool AddFile(D2MPQWriter* pWriter, const char* szArchivedName, const BYTE* pData, DWORD dwSize,
+		DWORD dwFlags, BYTE nCompression);
+	bool Finish(D2MPQWriter* pWriter);
+	void Abort(D2MPQWriter* pWriter);
+	DWORD Implode(const BYTE* pInput, DWORD dwInputSize, BYTE* pOutput, DWORD dwOutputSize);
+
+	// Hashing and encryption, shared with MPQReader.cpp
+	void InitCryptTable();
+	DWORD HashString(const char* szFileName, DWORD dwHashType);
+	DWORD GetFileKey(const char* szFileName, DWORD dwFilePos, DWORD dwFileSize, DWORD dwFlags);
+	void DecryptMPQBlock(void* pvDataBlock, DWORD dwLength, DWORD dwKey1);
+}
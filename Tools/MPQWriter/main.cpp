@@ -0,0 +1,360 @@
+#include "MPQWriter.hpp"
+
+/*
+ *	mpqwriter: builds MPQ archives from files on disk, or from generated data.
+ *	Generated files are the same every time for a given seed, so archives of any size can be rebuilt anywhere
+ *	(for benchmarking the archive code, say) without needing any of the original game data.
+ *	@author	eezstreet
+ */
+
+#define SYNTHETIC_NAME		"data\\synthetic\\%06u.bin"
+
+/*
+ *	Options that apply to every file added after them
+ */
+struct MPQWriterOptions
+{
+	DWORD	dwFlags;
+	BYTE	nCompression;
+	DWORD	dwSeed;
+	DWORD	dwNextSynthetic;		// Carries on across every -synthetic, so that generated names never repeat
+	char	szNextName[MAX_D2PATH];
+};
+
+static void PrintUsage()
+{
+	printf("usage: mpqwriter <archive.mpq> [options] [files...]\n");
+	printf("Options apply to every file that comes after them.\n");
+	printf("  -hashsize <n>                   hash table size (a power of two; default fits the files)\n");
+	printf("  -nolistfile                     don't add a (listfile)\n");
+	printf("  -store                          don't compress\n");
+	printf("  -implode                        PKWARE implode, Diablo I style\n");
+	printf("  -compress <pkware+huffman+...>  multiple compression: any of pkware, huffman, adpcm1, adpcm2\n");
+	printf("  -encrypt / -noencrypt\n");
+	printf("  -fixkey / -nofixkey             adjust the encryption key by the file's position (implies -encrypt)\n");
+	printf("  -single / -sectors              store files as a single unit, or in 4KB sectors\n");
+	printf("  -as <name>                      name of the next file inside the archive (default: its path)\n");
+	printf("  -seed <n>                       seed for -synthetic\n");
+	printf("  -synthetic <count> <size>       add <count> generated files of <size> bytes each\n");
+}
+
+/*
+ *	Reads a whole file into memory
+ */
+static BYTE* ReadWholeFile(const char* szPath, DWORD* pdwSize)
+{
+	FILE* pFile = fopen(szPath, "rb");
+	BYTE* pData;
+	long lSize;
+
+	if (pFile == nullptr)
+	{
+		return nullptr;
+	}
+
+	fseek(pFile, 0, SEEK_END);
+	lSize = ftell(pFile);
+	fseek(pFile, 0, SEEK_SET);
+	if (lSize < 0)
+	{
+		fclose(pFile);
+		return nullptr;
+	}
+
+	pData = (BYTE*)malloc(lSize > 0 ? lSize : 1);
+	if (pData != nullptr && lSize > 0 && fread(pData, lSize, 1, pFile) != 1)
+	{
+		free(pData);
+		pData = nullptr;
+	}
+
+	fclose(pFile);
+	*pdwSize = (DWORD)lSize;
+	return pData;
+}
+
+static DWORD NextRandom(DWORD* pdwState)
+{	// xorshift32
+	DWORD x = *pdwState;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*pdwState = x;
+	return x;
+}
+
+/*
+ *	Fills a buffer with something that compresses about as well as game data does:
+ *	a mix of noise, runs of a single byte, gradients and repeats of earlier data.
+ */
+static void GenerateSynthetic(BYTE* pData, DWORD dwSize, DWORD dwSeed, DWORD dwIndex)
+{
+	DWORD dwState = (dwSeed * 2654435761u) ^ (dwIndex * 40503u) ^ 0x9E3779B9;
+	DWORD dwPos = 0;
+
+	if (dwState == 0)
+	{
+		dwState = 1;
+	}
+
+	while (dwPos < dwSize)
+	{
+		DWORD dwKind = NextRandom(&dwState) & 3;
+		DWORD dwLength = D2Lib::min<DWORD>(1 + (NextRandom(&dwState) & 63), dwSize - dwPos);
+		BYTE nValue = (BYTE)NextRandom(&dwState);
+
+		switch (dwKind)
+		{
+			case 0:	// noise
+				for (DWORD i = 0; i < dwLength; i++)
+				{
+					pData[dwPos + i] = (BYTE)NextRandom(&dwState);
+				}
+				break;
+			case 1:	// run
+				memset(pData + dwPos, nValue, dwLength);
+				break;
+			case 2:	// gradient
+				for (DWORD i = 0; i < dwLength; i++)
+				{
+					pData[dwPos + i] = (BYTE)(nValue + i);
+				}
+				break;
+			case 3:	// repeat something from earlier on
+				if (dwPos == 0)
+				{
+					memset(pData, nValue, dwLength);
+				}
+				else
+				{
+					DWORD dwDistance = 1 + (NextRandom(&dwState) % D2Lib::min<DWORD>(dwPos, 0x1000));
+					for (DWORD i = 0; i < dwLength; i++)
+					{
+						pData[dwPos + i] = pData[dwPos + i - dwDistance];
+					}
+				}
+				break;
+		}
+
+		dwPos += dwLength;
+	}
+}
+
+/*
+ *	Parses a list of compression methods, ie "adpcm1+huffman"
+ */
+static bool ParseCompression(const char* szList, BYTE* pnCompression)
+{
+	char szMethods[MAX_D2PATH];
+	char* szMethod;
+
+	D2Lib::strncpyz(szMethods, szList, MAX_D2PATH);
+	*pnCompression = 0;
+
+	for (szMethod = strtok(szMethods, "+"); szMethod != nullptr; szMethod = strtok(nullptr, "+"))
+	{
+		if (!D2Lib::stricmp(szMethod, "pkware"))
+		{
+			*pnCompression |= MPQ_COMPRESSION_PKWARE;
+		}
+		else if (!D2Lib::stricmp(szMethod, "huffman"))
+		{
+			*pnCompression |= MPQ_COMPRESSION_HUFFMANN;
+		}
+		else if (!D2Lib::stricmp(szMethod, "adpcm1"))
+		{
+			*pnCompression |= MPQ_COMPRESSION_ADPCM_MONO;
+		}
+		else if (!D2Lib::stricmp(szMethod, "adpcm2"))
+		{
+			*pnCompression |= MPQ_COMPRESSION_ADPCM_STEREO;
+		}
+		else
+		{
+			fprintf(stderr, "unknown compression method '%s'\n", szMethod);
+			return false;
+		}
+	}
+
+	return *pnCompression != 0;
+}
+
+static bool AddSynthetic(D2MPQWriter* pWriter, MPQWriterOptions* pOptions, DWORD dwCount, DWORD dwSize)
+{
+	BYTE* pData = (BYTE*)malloc(dwSize > 0 ? dwSize : 1);
+	char szName[MAX_D2PATH];
+
+	if (pData == nullptr)
+	{
+		fprintf(stderr, "out of memory\n");
+		return false;
+	}
+
+	for (DWORD i = 0; i < dwCount; i++)
+	{
+		DWORD dwIndex = pOptions->dwNextSynthetic++;
+
+		snprintf(szName, MAX_D2PATH, SYNTHETIC_NAME, dwIndex);
+		GenerateSynthetic(pData, dwSize, pOptions->dwSeed, dwIndex);
+		if (!MPQWriter::AddFile(pWriter, szName, pData, dwSize, pOptions->dwFlags, pOptions->nCompression))
+		{
+			free(pData);
+			return false;
+		}
+	}
+
+	free(pData);
+	return true;
+}
+
+static bool AddDiskFile(D2MPQWriter* pWriter, MPQWriterOptions* pOptions, const char* szPath)
+{
+	const char* szName = pOptions->szNextName[0] != '\0' ? pOptions->szNextName : szPath;
+	DWORD dwSize = 0;
+	BYTE* pData = ReadWholeFile(szPath, &dwSize);
+	bool bResult;
+
+	if (pData == nullptr)
+	{
+		fprintf(stderr, "couldn't read %s\n", szPath);
+		return false;
+	}
+
+	bResult = MPQWriter::AddFile(pWriter, szName, pData, dwSize, pOptions->dwFlags, pOptions->nCompression);
+	pOptions->szNextName[0] = '\0';
+	free(pData);
+	return bResult;
+}
+
+int main(int argc, char** argv)
+{
+	D2MPQWriter writer;
+	MPQWriterOptions options;
+	DWORD dwHashTableSize = 0;
+	bool bListfile = true;
+	bool bOK = true;
+	int i;
+
+	if (argc < 2)
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	// Archive wide options have to be known before the archive gets created
+	for (i = 2; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-hashsize") && i + 1 < argc)
+		{
+			dwHashTableSize = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (!strcmp(argv[i], "-nolistfile"))
+		{
+			bListfile = false;
+		}
+	}
+
+	if (!MPQWriter::Create(argv[1], dwHashTableSize, bListfile, &writer))
+	{
+		return 1;
+	}
+
+	memset(&options, 0, sizeof(options));
+	options.dwFlags = MPQ_FILE_COMPRESS;
+	options.nCompression = MPQ_COMPRESSION_PKWARE;
+
+	for (i = 2; i < argc && bOK; i++)
+	{
+		const char* szArg = argv[i];
+		bool bHasValue = i + 1 < argc;
+
+		if (!strcmp(szArg, "-hashsize") && bHasValue)
+		{
+			i++;
+		}
+		else if (!strcmp(szArg, "-nolistfile"))
+		{
+			continue;
+		}
+		else if (!strcmp(szArg, "-store"))
+		{
+			options.dwFlags &= ~(MPQ_FILE_COMPRESS | MPQ_FILE_IMPLODE);
+		}
+		else if (!strcmp(szArg, "-implode"))
+		{
+			options.dwFlags &= ~MPQ_FILE_COMPRESS;
+			options.dwFlags |= MPQ_FILE_IMPLODE;
+		}
+		else if (!strcmp(szArg, "-compress") && bHasValue)
+		{
+			options.dwFlags &= ~MPQ_FILE_IMPLODE;
+			options.dwFlags |= MPQ_FILE_COMPRESS;
+			bOK = ParseCompression(argv[++i], &options.nCompression);
+		}
+		else if (!strcmp(szArg, "-encrypt"))
+		{
+			options.dwFlags |= MPQ_FILE_ENCRYPTED;
+		}
+		else if (!strcmp(szArg, "-noencrypt"))
+		{
+			options.dwFlags &= ~(MPQ_FILE_ENCRYPTED | MPQ_FILE_FIX_KEY);
+		}
+		else if (!strcmp(szArg, "-fixkey"))
+		{
+			options.dwFlags |= MPQ_FILE_ENCRYPTED | MPQ_FILE_FIX_KEY;
+		}
+		else if (!strcmp(szArg, "-nofixkey"))
+		{
+			options.dwFlags &= ~MPQ_FILE_FIX_KEY;
+		}
+		else if (!strcmp(szArg, "-single"))
+		{
+			options.dwFlags |= MPQ_FILE_SINGLE_UNIT;
+		}
+		else if (!strcmp(szArg, "-sectors"))
+		{
+			options.dwFlags &= ~MPQ_FILE_SINGLE_UNIT;
+		}
+		else if (!strcmp(szArg, "-as") && bHasValue)
+		{
+			D2Lib::strncpyz(options.szNextName, argv[++i], MAX_D2PATH);
+		}
+		else if (!strcmp(szArg, "-seed") && bHasValue)
+		{
+			options.dwSeed = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (!strcmp(szArg, "-synthetic") && i + 2 < argc)
+		{
+			DWORD dwCount = strtoul(argv[i + 1], nullptr, 0);
+			DWORD dwSize = strtoul(argv[i + 2], nullptr, 0);
+
+			i += 2;
+			bOK = AddSynthetic(&writer, &options, dwCount, dwSize);
+		}
+		else if (szArg[0] == '-')
+		{
+			fprintf(stderr, "unknown option %s\n", szArg);
+			PrintUsage();
+			bOK = false;
+		}
+		else
+		{
+			bOK = AddDiskFile(&writer, &options, szArg);
+		}
+	}
+
+	if (!bOK)
+	{
+		MPQWriter::Abort(&writer);
+		remove(argv[1]);
+		return 1;
+	}
+
+	if (!MPQWriter::Finish(&writer))
+	{
+		remove(argv[1]);
+		return 1;
+	}
+
+	return 0;
+}
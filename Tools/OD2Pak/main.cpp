@@ -0,0 +1,736 @@
+#include "../MPQWriter/MPQReader.hpp"
+#include "../../Engine/OD2Pak.hpp"
+#include "../../Engine/DC6.hpp"
+
+/*
+ *	od2pak: repacks an installed MPQ into an .od2pak (see Engine/OD2Pak.hpp), which the game picks up instead of the
+ *	MPQ when it's sitting next to it. It can also check or list an existing pak.
+ *	Files are keyed by their name hashes, so files whose names aren't known still make it into the pak. Names are
+ *	only needed for encrypted files (and to make -list and -predecode useful); they come from the archive's
+ *	(listfile) and from any -listfile given.
+ *	@author	eezstreet
+ */
+
+#define OD2PAK_MAX_DC6_SIZE		(2048 * 2048)	// Same as the read buffer in DC6.cpp, which the whole file has to fit in
+
+/*
+ *	A file that's going into the pak
+ */
+struct PakSource
+{
+	DWORD	dwHashIndex;
+	DWORD	dwFilePos;				// Where it is in the MPQ, so that it gets read in order
+	OD2PakEntry	entry;
+};
+
+static void PrintUsage()
+{
+	printf("usage: od2pak <archive.mpq> [options]\n");
+	printf("       od2pak -verify <archive.od2pak>\n");
+	printf("       od2pak -list <archive.od2pak>\n");
+	printf("  -o <archive.od2pak>     where to write the pak (default: next to the MPQ)\n");
+	printf("  -listfile <file>        names of files in the MPQ, one per line (can be given more than once)\n");
+	printf("  -predecode              store DC6s already decoded, so that loading them is a copy\n");
+	printf("                          (DCCs are never pre-decoded; the game's +dccwarm fills the DCC cache instead)\n");
+}
+
+/*
+ *	Reads a whole file into memory
+ */
+static BYTE* ReadWholeFile(const char* szPath, DWORD* pdwSize)
+{
+	FILE* pFile = fopen(szPath, "rb");
+	BYTE* pData;
+	long lSize;
+
+	if (pFile == nullptr)
+	{
+		return nullptr;
+	}
+
+	fseek(pFile, 0, SEEK_END);
+	lSize = ftell(pFile);
+	fseek(pFile, 0, SEEK_SET);
+	if (lSize < 0)
+	{
+		fclose(pFile);
+		return nullptr;
+	}
+
+	pData = (BYTE*)malloc(lSize > 0 ? lSize : 1);
+	if (pData != nullptr && lSize > 0 && fread(pData, lSize, 1, pFile) != 1)
+	{
+		free(pData);
+		pData = nullptr;
+	}
+
+	fclose(pFile);
+	*pdwSize = (DWORD)lSize;
+	return pData;
+}
+
+/*
+ *	Orders entries the way that OD2Pak::FindEntry wants them
+ */
+static int CompareEntries(const void* pA, const void* pB)
+{
+	const OD2PakEntry* pEntryA = &((const PakSource*)pA)->entry;
+	const OD2PakEntry* pEntryB = &((const PakSource*)pB)->entry;
+
+	if (pEntryA->dwName1 != pEntryB->dwName1)
+	{
+		return pEntryA->dwName1 < pEntryB->dwName1 ? -1 : 1;
+	}
+	if (pEntryA->dwName2 != pEntryB->dwName2)
+	{
+		return pEntryA->dwName2 < pEntryB->dwName2 ? -1 : 1;
+	}
+	if (((const PakSource*)pA)->dwHashIndex != ((const PakSource*)pB)->dwHashIndex)
+	{
+		return ((const PakSource*)pA)->dwHashIndex < ((const PakSource*)pB)->dwHashIndex ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ *	Orders files by where they are in the MPQ
+ */
+static int CompareFilePos(const void* pA, const void* pB)
+{
+	DWORD dwA = ((const PakSource*)pA)->dwFilePos;
+	DWORD dwB = ((const PakSource*)pB)->dwFilePos;
+
+	return dwA < dwB ? -1 : (dwA > dwB ? 1 : 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// DC6 PRE-DECODING
+
+/*
+ *	Decodes one DC6 frame, the same way that DC6.cpp does, except that it gives up instead of writing outside of
+ *	the frame or reading past the end of the file.
+ */
+static bool DecodeDC6Frame(const BYTE* pPixels, DWORD dwAvailable, BYTE* pOutPixels, DC6Frame::DC6FrameHeader* pHeader)
+{
+	DWORD x = 0, y;
+	DWORD dwNumPixels = pHeader->dwWidth * pHeader->dwHeight;
+
+	y = pHeader->dwFlip > 0 ? 0 : pHeader->dwHeight - 1;
+
+	for (DWORD i = 0; i < pHeader->dwLength; i++)
+	{
+		BYTE pixel;
+
+		if (i >= dwAvailable)
+		{
+			return false;
+		}
+
+		pixel = pPixels[i];
+		if (pixel == 0x80)
+		{	// pixel row termination
+			x = 0;
+			y += pHeader->dwFlip > 0 ? 1 : -1;
+		}
+		else if (pixel & 0x80)
+		{	// transparent pixels
+			x += pixel & 0x7F;
+		}
+		else
+		{
+			while (pixel--)
+			{
+				unsigned long long qwPos = (unsigned long long)y * pHeader->dwWidth + x++;
+
+				if (++i >= dwAvailable || qwPos >= dwNumPixels)
+				{
+					return false;
+				}
+				pOutPixels[qwPos] = pPixels[i];
+			}
+		}
+	}
+
+	return true;
+}
+
+/*
+ *	Turns a DC6 into a DC6_DECODED_VERSION one.
+ *	@return	The decoded DC6 (free it when done), or nullptr if it's not something that DC6.cpp would load exactly
+ */
+static BYTE* PredecodeDC6(const BYTE* pData, DWORD dwSize, DWORD* pdwOutSize)
+{
+	const DC6ImageHeader* pHeader = (const DC6ImageHeader*)pData;
+	const DWORD* pFramePointers = (const DWORD*)(pData + sizeof(DC6ImageHeader));
+	unsigned long long qwOutSize;
+	DWORD dwNumFrames, dwWritePos;
+	DC6ImageHeader* pOutHeader;
+	DWORD* pOutPointers;
+	BYTE* pOut;
+
+	if (dwSize < sizeof(DC6ImageHeader) || pHeader->dwVersion != DC6_HEADER_VERSION ||
+		pHeader->dwDirections > 32 || pHeader->dwFrames > (dwSize - sizeof(DC6ImageHeader)) / sizeof(DWORD))
+	{
+		return nullptr;
+	}
+
+	dwNumFrames = pHeader->dwDirections * pHeader->dwFrames;
+	if (dwNumFrames > (dwSize - sizeof(DC6ImageHeader)) / sizeof(DWORD))
+	{
+		return nullptr;
+	}
+
+	// Work out how big it's going to be
+	qwOutSize = sizeof(DC6ImageHeader) + dwNumFrames * sizeof(DWORD);
+	for (DWORD i = 0; i < dwNumFrames; i++)
+	{
+		const DC6Frame::DC6FrameHeader* pFrame;
+
+		if (pFramePointers[i] > dwSize || sizeof(DC6Frame::DC6FrameHeader) > dwSize - pFramePointers[i])
+		{
+			return nullptr;
+		}
+
+		pFrame = (const DC6Frame::DC6FrameHeader*)(pData + pFramePointers[i]);
+		if (pFrame->dwWidth > OD2PAK_MAX_DC6_SIZE || pFrame->dwHeight > OD2PAK_MAX_DC6_SIZE)
+		{
+			return nullptr;
+		}
+
+		qwOutSize += sizeof(DC6Frame::DC6FrameHeader) + (unsigned long long)pFrame->dwWidth * pFrame->dwHeight;
+		if (qwOutSize >= OD2PAK_MAX_DC6_SIZE)
+		{	// the decoded file (headers and all) wouldn't fit in DC6.cpp's read buffer
+			return nullptr;
+		}
+	}
+
+	pOut = (BYTE*)calloc(1, (size_t)qwOutSize);
+	if (pOut == nullptr)
+	{
+		return nullptr;
+	}
+
+	pOutHeader = (DC6ImageHeader*)pOut;
+	pOutPointers = (DWORD*)(pOut + sizeof(DC6ImageHeader));
+	memcpy(pOutHeader, pHeader, sizeof(DC6ImageHeader));
+	pOutHeader->dwVersion = DC6_DECODED_VERSION;
+	dwWritePos = sizeof(DC6ImageHeader) + dwNumFrames * sizeof(DWORD);
+
+	for (DWORD i = 0; i < dwNumFrames; i++)
+	{
+		DC6Frame::DC6FrameHeader* pFrame = (DC6Frame::DC6FrameHeader*)(pOut + dwWritePos);
+		DWORD dwFrameData = pFramePointers[i] + sizeof(DC6Frame::DC6FrameHeader);
+
+		memcpy(pFrame, pData + pFramePointers[i], sizeof(DC6Frame::DC6FrameHeader));
+		if (!DecodeDC6Frame(pData + dwFrameData, dwSize - dwFrameData, pOut + dwWritePos + sizeof(DC6Frame::DC6FrameHeader), pFrame))
+		{
+			free(pOut);
+			return nullptr;
+		}
+
+		pFrame->dwLength = pFrame->dwWidth * pFrame->dwHeight;
+		pOutPointers[i] = dwWritePos;
+		dwWritePos += sizeof(DC6Frame::DC6FrameHeader) + pFrame->dwLength;
+	}
+
+	*pdwOutSize = dwWritePos;
+	return pOut;
+}
+
+static bool IsDC6(const char* szName)
+{
+	size_t dwLength = szName != nullptr ? strlen(szName) : 0;
+
+	return dwLength > 4 && !D2Lib::stricmp(szName + dwLength - 4, ".dc6");
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// WRITING
+
+/*
+ *	Pads the file out with zeroes to the next OD2PAK_ALIGNMENT boundary
+ */
+static bool PadFile(FILE* pFile, DWORD* pdwWritePos)
+{
+	static const BYTE zeroes[OD2PAK_ALIGNMENT] = { 0 };
+	DWORD dwPadding = (OD2PAK_ALIGNMENT - (*pdwWritePos & (OD2PAK_ALIGNMENT - 1))) & (OD2PAK_ALIGNMENT - 1);
+
+	if (dwPadding > 0 && fwrite(zeroes, dwPadding, 1, pFile) != 1)
+	{
+		return false;
+	}
+
+	*pdwWritePos += dwPadding;
+	return true;
+}
+
+static bool WriteData(FILE* pFile, const void* pData, DWORD dwSize, DWORD* pdwWritePos)
+{
+	if (dwSize > 0xFFFFFFFF - *pdwWritePos - OD2PAK_ALIGNMENT)
+	{	// offsets are only 32 bits
+		return false;
+	}
+
+	if (dwSize > 0 && fwrite(pData, dwSize, 1, pFile) != 1)
+	{
+		return false;
+	}
+
+	*pdwWritePos += dwSize;
+	return true;
+}
+
+/*
+ *	Finds every file in the MPQ. If a name is in the hash table more than once (different locales), the first one
+ *	wins, same as in the engine's file index.
+ *	@return	The files (free them when done)
+ */
+static PakSource* CollectFiles(D2MPQReader* pReader, DWORD* pdwNumFiles)
+{
+	PakSource* pSources = (PakSource*)calloc(pReader->dwNumHashEntries + 1, sizeof(PakSource));
+	DWORD dwNumSources = 0;
+	DWORD dwNumUnique = 0;
+
+	if (pSources == nullptr)
+	{
+		return nullptr;
+	}
+
+	for (DWORD i = 0; i < pReader->dwNumHashEntries; i++)
+	{
+		MPQHash* pHash = &pReader->pHashTable[i];
+		DWORD dwBlockIndex = pHash->dwBlockEntry & 0x0FFFFFFF;
+		MPQBlock* pBlock;
+
+		if (pHash->dwBlockEntry >= 0xFFFFFFFE || dwBlockIndex >= pReader->dwNumBlockEntries)
+		{
+			continue;
+		}
+
+		pBlock = &pReader->pBlockTable[dwBlockIndex];
+		if (!(pBlock->dwFlags & MPQ_FILE_EXISTS) || (pBlock->dwFlags & MPQ_FILE_DELETE_MARKER))
+		{
+			continue;
+		}
+
+		pSources[dwNumSources].dwHashIndex = i;
+		pSources[dwNumSources].dwFilePos = pBlock->dwFilePos;
+		pSources[dwNumSources].entry.dwName1 = pHash->dwMethodA;
+		pSources[dwNumSources].entry.dwName2 = pHash->dwMethodB;
+		pSources[dwNumSources].entry.dwNameOffset = OD2PAK_NO_NAME;
+		dwNumSources++;
+	}
+
+	// Sort by name hash (ties go to the earlier hash table entry) and drop the duplicates
+	qsort(pSources, dwNumSources, sizeof(PakSource), CompareEntries);
+	for (DWORD i = 0; i < dwNumSources; i++)
+	{
+		if (dwNumUnique > 0 && pSources[dwNumUnique - 1].entry.dwName1 == pSources[i].entry.dwName1 &&
+			pSources[dwNumUnique - 1].entry.dwName2 == pSources[i].entry.dwName2)
+		{
+			continue;
+		}
+		pSources[dwNumUnique++] = pSources[i];
+	}
+
+	*pdwNumFiles = dwNumUnique;
+	return pSources;
+}
+
+/*
+ *	Repacks an MPQ into a pak
+ *	@author	eezstreet
+ */
+static bool Convert(D2MPQReader* pReader, const char* szPakPath, bool bPredecode)
+{
+	OD2PakHeader header;
+	PakSource* pSources;
+	OD2PakEntry* pEntries;
+	DWORD dwNumFiles, dwNumSkipped = 0, dwNumPredecoded = 0;
+	DWORD dwWritePos = 0;
+	DWORD dwNamesSize = 0;
+	FILE* pFile;
+	bool bOK = true;
+
+	pSources = CollectFiles(pReader, &dwNumFiles);
+	if (pSources == nullptr)
+	{
+		printf("out of memory\n");
+		return false;
+	}
+
+	pFile = fopen(szPakPath, "wb");
+	if (pFile == nullptr)
+	{
+		printf("couldn't open %s for writing\n", szPakPath);
+		free(pSources);
+		return false;
+	}
+
+	// The real header gets written once everything else is
+	memset(&header, 0, sizeof(header));
+	bOK = WriteData(pFile, &header, sizeof(header), &dwWritePos) && PadFile(pFile, &dwWritePos);
+
+	// Copy the files over in the same order that they're in the MPQ
+	qsort(pSources, dwNumFiles, sizeof(PakSource), CompareFilePos);
+	for (DWORD i = 0; bOK && i < dwNumFiles; i++)
+	{
+		PakSource* pSource = &pSources[i];
+		const char* szName = pReader->pszHashNames[pSource->dwHashIndex];
+		DWORD dwSize = 0;
+		BYTE* pData = MPQReader::ReadFile(pReader, pSource->dwHashIndex, &dwSize);
+
+		if (pData == nullptr)
+		{
+			if (szName != nullptr)
+			{
+				printf("skipping %s: couldn't read it\n", szName);
+			}
+			else
+			{
+				printf("skipping %08X%08X: couldn't read it\n", pSource->entry.dwName1, pSource->entry.dwName2);
+			}
+			pSource->dwHashIndex = 0xFFFFFFFF;
+			dwNumSkipped++;
+			continue;
+		}
+
+		if (bPredecode && IsDC6(szName))
+		{
+			DWORD dwDecodedSize;
+			BYTE* pDecoded = PredecodeDC6(pData, dwSize, &dwDecodedSize);
+
+			if (pDecoded != nullptr)
+			{
+				free(pData);
+				pData = pDecoded;
+				dwSize = dwDecodedSize;
+				pSource->entry.wKind = OD2PAK_KIND_DC6_DECODED;
+				dwNumPredecoded++;
+			}
+		}
+
+		pSource->entry.dwOffset = dwWritePos;
+		pSource->entry.dwSize = dwSize;
+		pSource->entry.dwChecksum = D2Lib::crc32(pData, dwSize, 0);
+		if (szName != nullptr)
+		{
+			pSource->entry.dwNameOffset = dwNamesSize;
+			dwNamesSize += strlen(szName) + 1;
+		}
+
+		bOK = WriteData(pFile, pData, dwSize, &dwWritePos) && PadFile(pFile, &dwWritePos);
+		free(pData);
+	}
+
+	// Write out the index, without the files that got skipped
+	qsort(pSources, dwNumFiles, sizeof(PakSource), CompareEntries);
+	pEntries = (OD2PakEntry*)malloc(sizeof(OD2PakEntry) * (dwNumFiles + 1));
+	bOK = bOK && pEntries != nullptr;
+
+	header.dwID = OD2PAK_ID;
+	header.dwVersion = OD2PAK_VERSION;
+	header.dwHeaderSize = sizeof(header);
+	header.dwIndexOffset = dwWritePos;
+	header.dwNumEntries = 0;
+	for (DWORD i = 0; bOK && i < dwNumFiles; i++)
+	{
+		if (pSources[i].dwHashIndex != 0xFFFFFFFF)
+		{
+			pEntries[header.dwNumEntries++] = pSources[i].entry;
+		}
+	}
+	bOK = bOK && WriteData(pFile, pEntries, sizeof(OD2PakEntry) * header.dwNumEntries, &dwWritePos);
+	header.dwIndexChecksum = bOK ? D2Lib::crc32(pEntries, sizeof(OD2PakEntry) * header.dwNumEntries, 0) : 0;
+
+	// ...and the names, in the order that they were handed out above
+	qsort(pSources, dwNumFiles, sizeof(PakSource), CompareFilePos);
+	header.dwNamesOffset = dwWritePos;
+	for (DWORD i = 0; bOK && i < dwNumFiles; i++)
+	{
+		const char* szName;
+
+		if (pSources[i].dwHashIndex == 0xFFFFFFFF || pSources[i].entry.dwNameOffset == OD2PAK_NO_NAME)
+		{
+			continue;
+		}
+
+		szName = pReader->pszHashNames[pSources[i].dwHashIndex];
+		bOK = WriteData(pFile, szName, strlen(szName) + 1, &dwWritePos);
+		header.dwIndexChecksum = D2Lib::crc32(szName, strlen(szName) + 1, header.dwIndexChecksum);
+	}
+	header.dwNamesSize = dwWritePos - header.dwNamesOffset;
+	header.dwArchiveSize = dwWritePos;
+
+	bOK = bOK && fseek(pFile, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, pFile) == 1;
+	bOK = (fclose(pFile) == 0) && bOK;
+
+	free(pEntries);
+	free(pSources);
+
+	if (!bOK)
+	{
+		printf("couldn't write %s\n", szPakPath);
+		remove(szPakPath);
+		return false;
+	}
+
+	printf("%s: %u files (%u pre-decoded), %u bytes\n", szPakPath, header.dwNumEntries, dwNumPredecoded, header.dwArchiveSize);
+	if (dwNumSkipped > 0)
+	{
+		printf("%u files couldn't be read and were left out\n", dwNumSkipped);
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// CHECKING
+
+/*
+ *	Reads the header and index of a pak
+ *	@return	The entries (free them when done), or nullptr if the pak is damaged
+ */
+static OD2PakEntry* ReadIndex(FILE* pFile, OD2PakHeader* pHeader, char** ppNames)
+{
+	OD2PakEntry* pEntries;
+	DWORD dwCRC;
+
+	*ppNames = nullptr;
+	if (fread(pHeader, sizeof(OD2PakHeader), 1, pFile) != 1 || pHeader->dwID != OD2PAK_ID ||
+		pHeader->dwHeaderSize != sizeof(OD2PakHeader))
+	{
+		printf("not an od2pak\n");
+		return nullptr;
+	}
+
+	if (pHeader->dwVersion != OD2PAK_VERSION)
+	{
+		printf("version %u, expected %u\n", pHeader->dwVersion, OD2PAK_VERSION);
+		return nullptr;
+	}
+
+	pEntries = (OD2PakEntry*)malloc(sizeof(OD2PakEntry) * (pHeader->dwNumEntries + 1));
+	*ppNames = (char*)malloc(pHeader->dwNamesSize + 1);
+	if (pEntries == nullptr || *ppNames == nullptr ||
+		fseek(pFile, pHeader->dwIndexOffset, SEEK_SET) != 0 ||
+		(pHeader->dwNumEntries > 0 && fread(pEntries, sizeof(OD2PakEntry) * pHeader->dwNumEntries, 1, pFile) != 1) ||
+		fseek(pFile, pHeader->dwNamesOffset, SEEK_SET) != 0 ||
+		(pHeader->dwNamesSize > 0 && fread(*ppNames, pHeader->dwNamesSize, 1, pFile) != 1))
+	{
+		printf("couldn't read the index\n");
+		free(pEntries);
+		free(*ppNames);
+		*ppNames = nullptr;
+		return nullptr;
+	}
+	(*ppNames)[pHeader->dwNamesSize] = '\0';
+
+	dwCRC = D2Lib::crc32(pEntries, sizeof(OD2PakEntry) * pHeader->dwNumEntries, 0);
+	dwCRC = D2Lib::crc32(*ppNames, pHeader->dwNamesSize, dwCRC);
+	if (dwCRC != pHeader->dwIndexChecksum)
+	{
+		printf("index checksum is %08X, expected %08X\n", dwCRC, pHeader->dwIndexChecksum);
+		free(pEntries);
+		free(*ppNames);
+		*ppNames = nullptr;
+		return nullptr;
+	}
+
+	return pEntries;
+}
+
+static const char* GetEntryName(OD2PakHeader* pHeader, OD2PakEntry* pEntry, char* pNames, char* szBuffer)
+{
+	if (pEntry->dwNameOffset < pHeader->dwNamesSize)
+	{
+		return pNames + pEntry->dwNameOffset;
+	}
+
+	snprintf(szBuffer, MAX_D2PATH, "%08X%08X", pEntry->dwName1, pEntry->dwName2);
+	return szBuffer;
+}
+
+/*
+ *	Checks the index and every file in a pak against their checksums
+ *	@author	eezstreet
+ */
+static bool Verify(const char* szPakPath, bool bList)
+{
+	FILE* pFile = fopen(szPakPath, "rb");
+	OD2PakHeader header;
+	OD2PakEntry* pEntries;
+	char* pNames;
+	BYTE* pData = nullptr;
+	DWORD dwDataSize = 0;
+	DWORD dwNumBad = 0;
+
+	if (pFile == nullptr)
+	{
+		printf("couldn't open %s\n", szPakPath);
+		return false;
+	}
+
+	pEntries = ReadIndex(pFile, &header, &pNames);
+	if (pEntries == nullptr)
+	{
+		fclose(pFile);
+		return false;
+	}
+
+	for (DWORD i = 0; i < header.dwNumEntries; i++)
+	{
+		OD2PakEntry* pEntry = &pEntries[i];
+		char szBuffer[MAX_D2PATH];
+		const char* szName = GetEntryName(&header, pEntry, pNames, szBuffer);
+		bool bOK = true;
+
+		if (bList)
+		{
+			printf("%10u  %s%s\n", pEntry->dwSize, szName, pEntry->wKind == OD2PAK_KIND_DC6_DECODED ? "  (pre-decoded)" : "");
+			continue;
+		}
+
+		if (i > 0 && (pEntries[i - 1].dwName1 > pEntry->dwName1 ||
+			(pEntries[i - 1].dwName1 == pEntry->dwName1 && pEntries[i - 1].dwName2 >= pEntry->dwName2)))
+		{
+			printf("%s: out of order\n", szName);
+			dwNumBad++;
+			continue;
+		}
+
+		if (pEntry->dwOffset & (OD2PAK_ALIGNMENT - 1))
+		{
+			printf("%s: isn't aligned\n", szName);
+			dwNumBad++;
+			continue;
+		}
+
+		if (pEntry->dwSize > dwDataSize)
+		{
+			free(pData);
+			dwDataSize = pEntry->dwSize;
+			pData = (BYTE*)malloc(dwDataSize);
+		}
+
+		if (pEntry->dwSize > 0)
+		{
+			bOK = pData != nullptr && fseek(pFile, pEntry->dwOffset, SEEK_SET) == 0 && fread(pData, pEntry->dwSize, 1, pFile) == 1;
+		}
+
+		if (!bOK || D2Lib::crc32(pData, pEntry->dwSize, 0) != pEntry->dwChecksum)
+		{
+			printf("%s: %s\n", szName, bOK ? "checksum doesn't match" : "couldn't read it");
+			dwNumBad++;
+		}
+	}
+
+	if (!bList)
+	{
+		printf("%s: %u files, %u bad\n", szPakPath, header.dwNumEntries, dwNumBad);
+	}
+
+	free(pData);
+	free(pNames);
+	free(pEntries);
+	fclose(pFile);
+	return dwNumBad == 0;
+}
+
+int main(int argc, char** argv)
+{
+	D2MPQReader reader;
+	char szPakPath[MAX_D2PATH_ABSOLUTE];
+	const char* szMPQPath = nullptr;
+	bool bPredecode = false;
+	bool bOK;
+	DWORD dwListfileIndex;
+
+	if (argc < 2)
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	if (!strcmp(argv[1], "-verify") || !strcmp(argv[1], "-list"))
+	{
+		if (argc != 3)
+		{
+			PrintUsage();
+			return 1;
+		}
+		return Verify(argv[2], !strcmp(argv[1], "-list")) ? 0 : 1;
+	}
+
+	szMPQPath = argv[1];
+	szPakPath[0] = '\0';
+	if (!MPQReader::Open(szMPQPath, &reader))
+	{
+		return 1;
+	}
+
+	// The archive's own (listfile) names most of the files, if it has one
+	dwListfileIndex = MPQReader::FindHashEntry(&reader, "(listfile)");
+	if (dwListfileIndex != 0xFFFFFFFF)
+	{
+		DWORD dwSize;
+		BYTE* pListfile = MPQReader::ReadFile(&reader, dwListfileIndex, &dwSize);
+
+		if (pListfile != nullptr)
+		{
+			MPQReader::AddListfile(&reader, (const char*)pListfile, dwSize);
+			free(pListfile);
+		}
+	}
+
+	for (int i = 2; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-o") && i + 1 < argc)
+		{
+			D2Lib::strncpyz(szPakPath, argv[++i], MAX_D2PATH_ABSOLUTE);
+		}
+		else if (!strcmp(argv[i], "-listfile") && i + 1 < argc)
+		{
+			DWORD dwSize;
+			BYTE* pListfile = ReadWholeFile(argv[++i], &dwSize);
+
+			if (pListfile == nullptr)
+			{
+				printf("couldn't read %s\n", argv[i]);
+				MPQReader::Close(&reader);
+				return 1;
+			}
+			printf("%s: %u names\n", argv[i], MPQReader::AddListfile(&reader, (const char*)pListfile, dwSize));
+			free(pListfile);
+		}
+		else if (!strcmp(argv[i], "-predecode"))
+		{
+			bPredecode = true;
+		}
+		else
+		{
+			PrintUsage();
+			MPQReader::Close(&reader);
+			return 1;
+		}
+	}
+
+	if (szPakPath[0] == '\0')
+	{	// d2data.mpq -> d2data.od2pak
+		char* szExtension;
+
+		D2Lib::strncpyz(szPakPath, szMPQPath, MAX_D2PATH_ABSOLUTE - sizeof(OD2PAK_EXTENSION));
+		szExtension = strrchr(szPakPath, '.');
+		if (szExtension != nullptr && strchr(szExtension, '/') == nullptr && strchr(szExtension, '\\') == nullptr)
+		{
+			*szExtension = '\0';
+		}
+		strcat(szPakPath, OD2PAK_EXTENSION);
+	}
+
+	bOK = Convert(&reader, szPakPath, bPredecode);
+	MPQReader::Close(&reader);
+	return bOK ? 0 : 1;
+}